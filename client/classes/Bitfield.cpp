@@ -0,0 +1,113 @@
+#include "../headers.h"
+
+/**
+* @brief Constructs a bitfield with all bits cleared.
+* @param numBits The number of bits, i.e. pieces of the file.
+*/
+Bitfield::Bitfield(size_t numBits)
+: m_numBits(numBits)
+, m_numWords((numBits + 63) / 64)
+, m_words(new atomic<uint64_t>[m_numWords])
+{
+    for (size_t i = 0; i < m_numWords; i++) m_words[i].store(0, memory_order_relaxed);
+}
+
+/**
+* @brief Sets a bit.
+* @param bit The bit to set.
+* @return True if the bit was not set before, false if it was set or is out of range.
+*/
+bool Bitfield::setBit(size_t bit) {
+    if (bit >= m_numBits) return false;
+    uint64_t mask = 1ULL << (bit % 64);
+    return (m_words[bit / 64].fetch_or(mask, memory_order_release) & mask) == 0;
+}
+
+/**
+* @brief Clears a bit.
+* @param bit The bit to clear.
+*/
+void Bitfield::clearBit(size_t bit) {
+    if (bit >= m_numBits) return;
+    m_words[bit / 64].fetch_and(~(1ULL << (bit % 64)), memory_order_release);
+}
+
+/**
+* @brief Sets all bits.
+*/
+void Bitfield::setAll() {
+    for (size_t i = 0; i < m_numWords; i++) {
+        size_t bitsInWord = min((size_t)64, m_numBits - i * 64);
+        m_words[i].store(bitsInWord == 64 ? ~0ULL : (1ULL << bitsInWord) - 1, memory_order_release);
+    }
+}
+
+/**
+* @brief Checks whether a bit is set.
+* @param bit The bit to check.
+* @return True if the bit is set, false if it is not set or out of range.
+*/
+bool Bitfield::testBit(size_t bit) const {
+    if (bit >= m_numBits) return false;
+    return (m_words[bit / 64].load(memory_order_acquire) >> (bit % 64)) & 1;
+}
+
+/**
+* @brief Gives the number of bits.
+* @return The number of bits.
+*/
+size_t Bitfield::size() const {
+    return m_numBits;
+}
+
+/**
+* @brief Counts the set bits.
+* @return The number of set bits.
+*/
+size_t Bitfield::count() const {
+    size_t setBits = 0;
+    for (size_t i = 0; i < m_numWords; i++) setBits += __builtin_popcountll(m_words[i].load(memory_order_acquire));
+    return setBits;
+}
+
+/**
+* @brief Packs the bitfield into bytes, bit 0 is the most significant bit of the first byte.
+* @return ceil(size() / 8) bytes.
+*/
+string Bitfield::toBytes() const {
+    string bytes((m_numBits + 7) / 8, '\0');
+    for (size_t i = 0; i < m_numWords; i++) {
+        uint64_t word = m_words[i].load(memory_order_acquire);
+        for (size_t j = 0; j < 8 && i * 8 + j < bytes.size(); j++) {
+            uint8_t byte = (word >> (j * 8)) & 0xFF;
+
+            //: Words hold bit 0 in their least significant bit, bytes on the wire in their most significant bit
+            byte = (byte & 0xF0) >> 4 | (byte & 0x0F) << 4;
+            byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
+            byte = (byte & 0xAA) >> 1 | (byte & 0x55) << 1;
+            bytes[i * 8 + j] = (char)byte;
+        }
+    }
+    return bytes;
+}
+
+/**
+* @brief Unpacks bytes produced by toBytes() into the indices of the set bits.
+* @param bytes The packed bitfield.
+* @param numBits The number of bits, bits beyond it are ignored.
+* @return The set bits in increasing order.
+*/
+vector<int> Bitfield::giveSetBits(const string& bytes, size_t numBits) {
+    vector<int> setBits;
+    size_t numBytes = min(bytes.size(), (numBits + 7) / 8);
+    for (size_t i = 0; i < numBytes; i++) {
+        uint8_t byte = (uint8_t)bytes[i];
+        while (byte) {
+            int bitInByte = __builtin_clz(byte) - 24;
+            size_t bit = i * 8 + bitInByte;
+            if (bit < numBits) setBits.push_back((int)bit);
+            byte &= ~(0x80 >> bitInByte);
+        }
+    }
+    return setBits;
+}
@@ -33,14 +33,15 @@ void ClientSocket::connectSocket(string serverIp, int serverPort){
 
     // Convert server IP address from string to binary form
     if (inet_pton(AF_INET, serverIp.c_str(), &serverAddr.sin_addr) <= 0) {
-        throw string("Converting IP address " + serverIp + "!!\nError:" + string(strerror(errno)));
         closeSocket();
+        throw string("Converting IP address " + serverIp + "!!\nError:" + string(strerror(errno)));
     }
 
     // Connect to the server
     if (connect(m_socketFd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        throw string("Connecting to " + serverIp + ":" + to_string(serverPort) + "!!\nError: " + string(strerror(errno)));
+        string error = string(strerror(errno));
         closeSocket();
+        throw string("Connecting to " + serverIp + ":" + to_string(serverPort) + "!!\nError: " + error);
     }
     m_serverIp = serverIp;
     m_serverPort = serverPort;
@@ -68,76 +69,145 @@ void ClientSocket::setOptions(){
 }
 
 /**
-* @brief Sends a message to the connected server.
+* @brief Sends a message to the connected server as a single frame.
 * @param message The message to be sent to the server.
+* @param opcode The kind of message, one of the OPCODE_* values.
 * @throws string If the socket is not created or if sending the message fails.
 */
-void ClientSocket::sendSocket(string message){
+void ClientSocket::sendSocket(string message, uint8_t opcode){
     if(m_socketFd == -1) {
         throw string("Socket not exist!! Create socket first using createSocket()!!");
     }
     if(m_serverIp == "" || m_serverPort == -1){
         throw string("Socket is not connected with server!! Connect it first using connectSocket(string serverIp, int serverPort)!!");
     }
-    string messageLength = to_string(message.size());
-    message = messageLength + " " + message;
 
-    // Send the message to the server
-    if(send(m_socketFd, message.c_str(), message.size(), 0) < 0){
+    FrameHeader header;
+    header.m_length = htonl(message.size());
+    header.m_opcode = opcode;
+    header.m_status = STATUS_SUCCESS;
+    header.m_reserved = 0;
+
+    //: Header and payload are gathered by the kernel, no need to concatenate them
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)message.data();
+    iov[1].iov_len = message.size();
+
+    struct msghdr socketMessage;
+    memset(&socketMessage, 0, sizeof(socketMessage));
+    socketMessage.msg_iov = iov;
+    socketMessage.msg_iovlen = 2;
+
+    //: sendmsg() may send less than asked for, continue from where it stopped
+    while(socketMessage.msg_iovlen > 0){
+        ssize_t bytesSent = sendmsg(m_socketFd, &socketMessage, MSG_NOSIGNAL);
+        if(bytesSent < 0){
+            if(errno == EINTR) continue;
+            string error = string(strerror(errno));
+            close(m_socketFd);
+            m_socketFd = -1;
+            throw string("Sending message\nError: " + error);
+        }
+        while(socketMessage.msg_iovlen > 0 && (size_t)bytesSent >= socketMessage.msg_iov->iov_len){
+            bytesSent -= socketMessage.msg_iov->iov_len;
+            socketMessage.msg_iov++;
+            socketMessage.msg_iovlen--;
+        }
+        if(socketMessage.msg_iovlen > 0){
+            socketMessage.msg_iov->iov_base = (char*)socketMessage.msg_iov->iov_base + bytesSent;
+            socketMessage.msg_iov->iov_len -= bytesSent;
+        }
+    }
+}
+
+/**
+* @brief Receives the header of the next frame from the connected server.
+* @return The frame header in host byte order.
+* @throws string If the socket is not connected, if receiving fails, if the connection
+*                 is closed or if the header announces a payload that is too large.
+*/
+FrameHeader ClientSocket::recvHeader(){
+    FrameHeader header;
+    recvPayload((char*)&header, sizeof(header));
+
+    header.m_length = ntohl(header.m_length);
+    header.m_reserved = ntohs(header.m_reserved);
+    if(header.m_length > MAX_FRAME_LENGTH) {
         close(m_socketFd);
-        throw string("Sending message\nError: " + string(strerror(errno)));
+        m_socketFd = -1;
+        throw string("Receiving data from server!!\nError: Frame of " + to_string(header.m_length) + " bytes is too large!!");
     }
+    return header;
 }
 
 /**
-* @brief Receives a message from the connected server.
-* @return The received message as a string.
+* @brief Receives exactly length bytes from the connected server into a caller-supplied buffer.
+* @param buffer The buffer to receive into, at least length bytes long.
+* @param length The number of bytes to receive.
 * @throws string If the socket is not created, if the socket is not connected to a server, 
 *                 or if receiving the message fails.
 */
-string ClientSocket::recvSocket(){
+void ClientSocket::recvPayload(char* buffer, size_t length){
     if(m_socketFd == -1) {
         throw string("Socket not exist!! Create socket first using createSocket()!!");
     }
     if(m_serverIp == "" || m_serverPort == -1){
         throw string("Socket is not connected with server!! Connect it first using connectSocket(string serverIp, int serverPort)!!");
     }
-    int totalDataLength = -1;
-    string receivedData = "";
 
-    while(true){
-        char buffer[524288];
-        int bytesRead = recv(m_socketFd, buffer, sizeof(buffer), 0);
+    size_t bytesReceived = 0;
+    while(bytesReceived < length){
+        ssize_t bytesRead = recv(m_socketFd, buffer + bytesReceived, length - bytesReceived, 0);
         if(bytesRead == 0) {
+            close(m_socketFd);
+            m_socketFd = -1;
             throw string("Error: Server closed the connection!!");
         }
         if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            int error = errno;
             close(m_socketFd);
-            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            m_socketFd = -1;
+            if (error == EWOULDBLOCK || error == EAGAIN) {
                 throw string("Receive timeout occurred!! No data received within 15 seconds!!");
             }
-            throw string("Receiving data from server!!\nError: " + string(strerror(errno)));
-        }
-
-        receivedData += string(buffer, bytesRead);
-        
-        if(totalDataLength == -1) {
-            vector<string> temp = Utils::tokenize(receivedData, ' ');
-            totalDataLength = stoi(temp[0]) - (bytesRead - (temp[0].size() + 1));
-            receivedData = receivedData.substr(temp[0].size() + 1);
-        }
-        else {
-            totalDataLength -= bytesRead;
-        }
-
-        if(totalDataLength == 0) {
-            break;
+            throw string("Receiving data from server!!\nError: " + string(strerror(error)));
         }
+        bytesReceived += bytesRead;
     }
+}
 
+/**
+* @brief Receives a whole frame from the connected server.
+* @param header Set to the header of the received frame.
+* @return The payload of the frame as a string.
+* @throws string If the socket is not created, if the socket is not connected to a server, 
+*                 or if receiving the message fails.
+*/
+string ClientSocket::recvSocket(FrameHeader& header){
+    header = recvHeader();
+
+    string receivedData(header.m_length, '\0');
+    recvPayload(&receivedData[0], header.m_length);
     return receivedData;
 }
 
+/**
+* @brief Closes the socket if it is still open.
+*/
+ClientSocket::~ClientSocket(){
+    if(m_socketFd != -1) close(m_socketFd);
+}
+
+/**
+* @brief Shuts the connection down, a thread blocked receiving on it returns with an error.
+*/
+void ClientSocket::shutdownSocket(){
+    if(m_socketFd != -1) shutdown(m_socketFd, SHUT_RDWR);
+}
+
 /**
 * @brief Closes the client socket and resets internal state.
 * @throws string If the socket is not created before attempting to close.
@@ -151,3 +221,16 @@ void ClientSocket::closeSocket(){
     m_serverIp = "";
     m_serverPort = -1;
 }
+
+/**
+* @brief Checks without blocking whether the socket is still connected and has no unread data.
+* @return True if the socket can be used for a new request, false otherwise.
+*/
+bool ClientSocket::isIdleConnected() const {
+    if(m_socketFd == -1) return false;
+
+    //: A closed peer reads as end of file, a reply left unread would be taken for the next one
+    char byte;
+    ssize_t bytesRead = recv(m_socketFd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,115 @@
+#include "../headers.h"
+
+/**
+* @brief Registers a new download.
+* @param weight Priority weight of the download, one of the DOWNLOAD_PRIORITY_* values.
+* @return Id of the download.
+*/
+int DownloadScheduler::addDownload(int weight) {
+    lock_guard<mutex> guard(m_schedulerMutex);
+    int downloadId = m_nextDownloadId++;
+    m_downloads[downloadId].m_weight = max(1, weight);
+    return downloadId;
+}
+
+/**
+* @brief Forgets a download once all of its workers are done.
+* @param downloadId Id of the download.
+*/
+void DownloadScheduler::removeDownload(int downloadId) {
+    {
+        lock_guard<mutex> guard(m_schedulerMutex);
+        m_downloads.erase(downloadId);
+    }
+    //: Shares of the other downloads grow
+    m_requestReleased.notify_all();
+}
+
+/**
+* @brief Gives the share of the global limit a download is entitled to.
+* @param download The download.
+* @param totalWeight Sum of the weights of all active downloads.
+* @return At least one request.
+* @note Expects m_schedulerMutex to be held.
+*/
+int DownloadScheduler::giveShareLocked(const Download& download, int totalWeight) const {
+    return max(1, MAX_INFLIGHT_REQUESTS * download.m_weight / max(1, totalWeight));
+}
+
+/**
+* @brief Checks whether a download can send one more request to a seeder now.
+* @param downloadId Id of the download.
+* @param seederIpPort IP:Port of the seeder.
+* @return True if a request slot can be granted, false otherwise.
+* @note Expects m_schedulerMutex to be held.
+*/
+bool DownloadScheduler::canGrantLocked(int downloadId, const string& seederIpPort) const {
+    if (m_inFlight >= MAX_INFLIGHT_REQUESTS) return false;
+
+    auto peer = m_peerInFlight.find(seederIpPort);
+    if (peer != m_peerInFlight.end() && peer->second >= MAX_INFLIGHT_PER_PEER) return false;
+
+    //: Only downloads with requests in flight or waiting compete for the limit
+    int totalWeight = 0;
+    for (const auto& it : m_downloads) {
+        if (it.second.m_inFlight > 0 || it.second.m_waiting > 0) totalWeight += it.second.m_weight;
+    }
+
+    const Download& download = m_downloads.at(downloadId);
+    if (download.m_inFlight < giveShareLocked(download, totalWeight)) return true;
+
+    //: Beyond its share only while no waiting download is below its own
+    for (const auto& it : m_downloads) {
+        if (it.first != downloadId && it.second.m_waiting > 0 && it.second.m_inFlight < giveShareLocked(it.second, totalWeight)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+* @brief Takes a slot for one request of a download to a seeder.
+* @param downloadId Id of the download.
+* @param seederIpPort IP:Port of the seeder.
+* @param shouldWait Whether to wait for a slot, only allowed without any slot held by the caller.
+* @return True if a slot was taken, false if none is free and the caller should not wait.
+* @details A worker with requests in flight must not wait: the slots it holds are only
+*          given back once it reads their replies.
+*/
+bool DownloadScheduler::acquireRequest(int downloadId, const string& seederIpPort, bool shouldWait) {
+    unique_lock<mutex> guard(m_schedulerMutex);
+    auto it = m_downloads.find(downloadId);
+    if (it == m_downloads.end()) return false;
+    Download& download = it->second;
+
+    if (!canGrantLocked(downloadId, seederIpPort)) {
+        if (!shouldWait) return false;
+
+        download.m_waiting++;
+        m_requestReleased.wait(guard, [&] { return canGrantLocked(downloadId, seederIpPort); });
+        download.m_waiting--;
+    }
+
+    download.m_inFlight++;
+    m_peerInFlight[seederIpPort]++;
+    m_inFlight++;
+    return true;
+}
+
+/**
+* @brief Gives back the slot of a request once its reply is received or the request is lost.
+* @param downloadId Id of the download.
+* @param seederIpPort IP:Port of the seeder.
+*/
+void DownloadScheduler::releaseRequest(int downloadId, const string& seederIpPort) {
+    {
+        lock_guard<mutex> guard(m_schedulerMutex);
+        auto it = m_downloads.find(downloadId);
+        if (it != m_downloads.end()) it->second.m_inFlight--;
+
+        auto peer = m_peerInFlight.find(seederIpPort);
+        if (peer != m_peerInFlight.end() && --peer->second == 0) m_peerInFlight.erase(peer);
+        m_inFlight--;
+    }
+    m_requestReleased.notify_all();
+}
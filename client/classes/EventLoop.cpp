@@ -0,0 +1,472 @@
+#include "../headers.h"
+
+/**
+* @brief Queues a frame to be sent to the peer.
+* @param payload The payload of the frame.
+* @param opcode The kind of message, one of the OPCODE_* values.
+* @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
+*/
+void Connection::queueFrame(const string& payload, uint8_t opcode, uint8_t status){
+    FrameHeader header;
+    header.m_length = htonl(payload.size());
+    header.m_opcode = opcode;
+    header.m_status = status;
+    header.m_reserved = 0;
+
+    OutputChunk chunk;
+    chunk.m_data.reserve(sizeof(header) + payload.size());
+    chunk.m_data.append((char*)&header, sizeof(header));
+    chunk.m_data.append(payload);
+    m_outQueue.push_back(move(chunk));
+}
+
+/**
+* @brief Queues a frame whose payload is a prefix followed by a range of a file, sent later with sendfile().
+* @param prefix Bytes of the payload sent before the file data.
+* @param file Open handle of the file, kept open until the range is sent.
+* @param offset The offset in the file to start sending from.
+* @param length The number of bytes to send.
+* @param opcode The kind of message, one of the OPCODE_* values.
+*/
+void Connection::queueFile(const string& prefix, shared_ptr<FileHandle> file, off_t offset, size_t length, uint8_t opcode){
+    FrameHeader header;
+    header.m_length = htonl(prefix.size() + length);
+    header.m_opcode = opcode;
+    header.m_status = STATUS_SUCCESS;
+    header.m_reserved = 0;
+
+    OutputChunk chunk;
+    chunk.m_data.assign((char*)&header, sizeof(header));
+    chunk.m_data.append(prefix);
+    chunk.m_file = move(file);
+    chunk.m_offset = offset;
+    chunk.m_length = length;
+    m_outQueue.push_back(move(chunk));
+}
+
+/**
+* @brief Queues a frame whose payload is a prefix followed by a shared buffer, which is sent without being copied.
+* @param prefix Bytes of the payload sent before the buffer.
+* @param buffer The buffer, kept alive until it is sent.
+* @param opcode The kind of message, one of the OPCODE_* values.
+*/
+void Connection::queueBuffer(const string& prefix, shared_ptr<const string> buffer, uint8_t opcode){
+    FrameHeader header;
+    header.m_length = htonl(prefix.size() + buffer->size());
+    header.m_opcode = opcode;
+    header.m_status = STATUS_SUCCESS;
+    header.m_reserved = 0;
+
+    OutputChunk chunk;
+    chunk.m_data.assign((char*)&header, sizeof(header));
+    chunk.m_data.append(prefix);
+    chunk.m_length = buffer->size();
+    chunk.m_buffer = move(buffer);
+    m_outQueue.push_back(move(chunk));
+}
+
+/**
+* @brief Creates the epoll instance and the worker threads.
+* @param numWorkers Number of worker threads running the frame handler.
+* @throws string If the epoll instance can not be created.
+*/
+EventLoop::EventLoop(size_t numWorkers)
+: m_workers(numWorkers, "seeder")
+{
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(m_epollFd == -1){
+        throw string("Creating epoll instance!!\nError: " + string(strerror(errno)));
+    }
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_wakeFd == -1){
+        close(m_epollFd);
+        throw string("Creating eventfd!!\nError: " + string(strerror(errno)));
+    }
+}
+
+/**
+* @brief Stops the loop and releases all connections.
+*/
+EventLoop::~EventLoop(){
+    stop();
+    close(m_wakeFd);
+    close(m_epollFd);
+}
+
+/**
+* @brief Starts watching the listening socket on a reactor thread.
+* @param listenFd The listening socket, switched to non-blocking mode.
+* @param frameHandler Called on a worker thread for every complete frame received.
+* @param uploadLimiter Limiter of the piece data sent, null for no limits.
+* @throws string If the listening socket can not be watched.
+*/
+void EventLoop::start(int listenFd, function<void(Connection&, const FrameHeader&, string&)> frameHandler, UploadLimiter* uploadLimiter){
+    m_listenFd = listenFd;
+    m_frameHandler = move(frameHandler);
+    m_uploadLimiter = uploadLimiter;
+
+    int flags = fcntl(m_listenFd, F_GETFL, 0);
+    if(flags == -1 || fcntl(m_listenFd, F_SETFL, flags | O_NONBLOCK) == -1){
+        throw string("Setting listening socket non-blocking!!\nError: " + string(strerror(errno)));
+    }
+
+    //: Listening socket and eventfd are told apart from connections by pointers to their members
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &m_listenFd;
+    if(epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &event) == -1){
+        throw string("Watching listening socket!!\nError: " + string(strerror(errno)));
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &m_wakeFd;
+    if(epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &event) == -1){
+        throw string("Watching eventfd!!\nError: " + string(strerror(errno)));
+    }
+
+    m_stop = false;
+    m_reactor = thread(&EventLoop::run, this);
+}
+
+/**
+* @brief Stops the reactor thread, waits for running handlers and closes all connections.
+*/
+void EventLoop::stop(){
+    if(!m_reactor.joinable()) return;
+
+    m_stop = true;
+    uint64_t one = 1;
+    if(write(m_wakeFd, &one, sizeof(one)) == -1){
+        generalLogger.log("ERROR", "Waking event loop!! Error: " + string(strerror(errno)));
+    }
+    m_reactor.join();
+    m_workers.wait();
+
+    {
+        lock_guard<mutex> guard(m_parkedMutex);
+        m_parked.clear();
+    }
+
+    lock_guard<mutex> guard(m_connectionsMutex);
+    for(Connection* connection : m_connections){
+        if(m_uploadLimiter) m_uploadLimiter->removeConnection(connection->m_peerIp);
+        Metrics::getInstance().removeConnection();
+        close(connection->m_fd);
+        delete connection;
+    }
+    m_connections.clear();
+}
+
+/**
+* @brief Waits for readiness events and hands ready connections to the workers.
+* @details Connections are registered with EPOLLONESHOT, so a connection is reported
+*          again only after the worker handling it re-arms it. This way frames of one
+*          connection are always handled in order by a single worker at a time.
+*          Connections parked by the upload limiter are not watched, the wait for
+*          events ends when the first of them goes on.
+*/
+void EventLoop::run(){
+    vector<struct epoll_event> events(MAX_EPOLL_EVENTS);
+    while(!m_stop){
+        int numEvents = epoll_wait(m_epollFd, events.data(), events.size(), giveParkedTimeout());
+        if(numEvents == -1){
+            if(errno == EINTR) continue;
+            generalLogger.log("ERROR", "Waiting for events!! Error: " + string(strerror(errno)));
+            break;
+        }
+
+        for(int i = 0; i < numEvents; i++){
+            if(events[i].data.ptr == &m_wakeFd){
+                uint64_t value;
+                if(read(m_wakeFd, &value, sizeof(value)) == -1 && errno != EAGAIN){
+                    generalLogger.log("ERROR", "Reading eventfd!! Error: " + string(strerror(errno)));
+                }
+                continue;
+            }
+            if(events[i].data.ptr == &m_listenFd){
+                acceptConnections();
+                continue;
+            }
+
+            Connection* connection = (Connection*)events[i].data.ptr;
+            uint32_t readyEvents = events[i].events;
+            m_workers.enqueueTask([this, connection, readyEvents] {
+                handleConnection(connection, readyEvents);
+            });
+        }
+        resumeParked();
+    }
+}
+
+/**
+* @brief Gives the milliseconds until the first parked connection goes on.
+* @return The timeout for epoll_wait(), -1 if no connection is parked.
+*/
+int EventLoop::giveParkedTimeout(){
+    lock_guard<mutex> guard(m_parkedMutex);
+    if(m_parked.empty()) return -1;
+
+    //: Rounded up, a timeout rounded down would wake the reactor just before the time and spin
+    auto wait = m_parked.begin()->first - chrono::steady_clock::now();
+    if(wait <= chrono::steady_clock::duration::zero()) return 0;
+    return (int)chrono::ceil<chrono::milliseconds>(wait).count();
+}
+
+/**
+* @brief Hands the parked connections whose time came to the workers.
+*/
+void EventLoop::resumeParked(){
+    auto now = chrono::steady_clock::now();
+    lock_guard<mutex> guard(m_parkedMutex);
+    while(!m_parked.empty() && m_parked.begin()->first <= now){
+        Connection* connection = m_parked.begin()->second;
+        m_parked.erase(m_parked.begin());
+        m_workers.enqueueTask([this, connection] {
+            handleConnection(connection, EPOLLOUT);
+        });
+    }
+}
+
+/**
+* @brief Accepts all pending connections and registers them as non-blocking sockets.
+*/
+void EventLoop::acceptConnections(){
+    while(true){
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrSize = sizeof(clientAddr);
+        int clientFd = accept4(m_listenFd, (struct sockaddr*)&clientAddr, &clientAddrSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(clientFd == -1){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                generalLogger.log("ERROR", "Accepting connection!! Error: " + string(strerror(errno)));
+            }
+            return;
+        }
+
+        char peerIp[INET_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET, &clientAddr.sin_addr, peerIp, sizeof(peerIp));
+        Connection* connection = new Connection(clientFd, peerIp);
+        connection->m_bytesServed = &Metrics::getInstance().giveBytesServed(connection->m_peerIp);
+        Metrics::getInstance().addConnection();
+        {
+            lock_guard<mutex> guard(m_connectionsMutex);
+            m_connections.insert(connection);
+        }
+        if(m_uploadLimiter) m_uploadLimiter->addConnection(connection->m_peerIp);
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = connection;
+        if(epoll_ctl(m_epollFd, EPOLL_CTL_ADD, clientFd, &event) == -1){
+            generalLogger.log("ERROR", "Watching connection!! Error: " + string(strerror(errno)));
+            closeConnection(connection);
+        }
+    }
+}
+
+/**
+* @brief Runs on a worker: flushes pending output, reads and handles frames, then re-arms the connection.
+* @param connection The ready connection, owned by this worker until it is re-armed.
+* @param readyEvents The events reported by epoll.
+*/
+void EventLoop::handleConnection(Connection* connection, uint32_t readyEvents){
+    try{
+        if(readyEvents & EPOLLERR){
+            throw string("Socket error!!");
+        }
+
+        //: Nothing new is read while earlier responses are still queued, the peer is slowed down instead
+        if(!flushOutput(*connection)){
+            waitForOutput(connection);
+            return;
+        }
+
+        readInput(*connection);
+
+        //: Every complete frame in the buffer is handled, a partial one waits for more bytes
+        size_t consumed = 0;
+        while(connection->m_inBuffer.size() - consumed >= sizeof(FrameHeader)){
+            FrameHeader header;
+            memcpy(&header, connection->m_inBuffer.data() + consumed, sizeof(header));
+            header.m_length = ntohl(header.m_length);
+            header.m_reserved = ntohs(header.m_reserved);
+            if(header.m_length > MAX_FRAME_LENGTH){
+                throw string("Frame of " + to_string(header.m_length) + " bytes is too large!!");
+            }
+            if(connection->m_inBuffer.size() - consumed - sizeof(header) < header.m_length) break;
+
+            string payload = connection->m_inBuffer.substr(consumed + sizeof(header), header.m_length);
+            consumed += sizeof(header) + header.m_length;
+            m_frameHandler(*connection, header, payload);
+        }
+        connection->m_inBuffer.erase(0, consumed);
+
+        if(!flushOutput(*connection)){
+            waitForOutput(connection);
+            return;
+        }
+        if(connection->m_peerClosed){
+            closeConnection(connection);
+            return;
+        }
+        rearm(connection, EPOLLIN | EPOLLRDHUP);
+    }
+    catch(const string& e){
+        //: Stream can not be resynchronized after a broken frame, so drop the connection
+        generalLogger.log("ERROR", "Connection at fd " + to_string(connection->m_fd) + " dropped!! Error: " + e);
+        closeConnection(connection);
+    }
+    catch(const exception& e){
+        //: e.g. stoi() on a malformed argument, the connection must not be left un-armed
+        generalLogger.log("ERROR", "Connection at fd " + to_string(connection->m_fd) + " dropped!! Error: " + string(e.what()));
+        closeConnection(connection);
+    }
+}
+
+/**
+* @brief Reads everything the socket has buffered, up to MAX_READ_PER_EVENT bytes.
+* @param connection The connection to read from.
+* @throws string If receiving fails.
+*/
+void EventLoop::readInput(Connection& connection){
+    char buffer[READ_CHUNK_SIZE];
+    size_t totalRead = 0;
+    while(totalRead < MAX_READ_PER_EVENT){
+        ssize_t bytesRead = recv(connection.m_fd, buffer, sizeof(buffer), 0);
+        if(bytesRead == 0){
+            connection.m_peerClosed = true;
+            return;
+        }
+        if(bytesRead < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            throw string("Receiving from socket!!\nError: " + string(strerror(errno)));
+        }
+        connection.m_inBuffer.append(buffer, bytesRead);
+        totalRead += bytesRead;
+    }
+}
+
+/**
+* @brief Sends as much of the queued output as the socket accepts.
+* @param connection The connection to send on.
+* @return True if the queue is empty, false if the socket is full.
+* @throws string If sending fails.
+*/
+bool EventLoop::flushOutput(Connection& connection){
+    while(!connection.m_outQueue.empty()){
+        OutputChunk& chunk = connection.m_outQueue.front();
+
+        //: Slot is checked before the header is sent, a choked leecher never waits in the middle of a piece
+        bool isPiece = chunk.m_file || chunk.m_buffer;
+        if(isPiece && !chunk.m_isAdmitted && m_uploadLimiter){
+            if(!m_uploadLimiter->admit(connection.m_peerIp, connection.m_resumeAt)) return false;
+            chunk.m_isAdmitted = true;
+        }
+
+        //: Frame header (or the whole frame) first, file or buffer data of the chunk after it
+        if(connection.m_outSent < chunk.m_data.size()){
+            int flags = MSG_NOSIGNAL | (isPiece ? MSG_MORE : 0);
+            ssize_t bytesSent = send(connection.m_fd, chunk.m_data.data() + connection.m_outSent, chunk.m_data.size() - connection.m_outSent, flags);
+            if(bytesSent < 0){
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                throw string("Sending to socket!!\nError: " + string(strerror(errno)));
+            }
+            connection.m_outSent += bytesSent;
+            if(connection.m_bytesServed) connection.m_bytesServed->fetch_add(bytesSent, memory_order_relaxed);
+            continue;
+        }
+
+        if(isPiece && chunk.m_length > 0){
+            size_t allowed = chunk.m_length;
+            if(m_uploadLimiter){
+                allowed = m_uploadLimiter->giveAllowance(connection.m_peerIp, chunk.m_length, connection.m_resumeAt);
+                if(allowed == 0) return false;
+            }
+
+            //: sendfile() advances the offset by the number of bytes it sent, a buffer is advanced here
+            ssize_t bytesSent;
+            if(chunk.m_file){
+                bytesSent = sendfile(connection.m_fd, chunk.m_file->m_fd, &chunk.m_offset, allowed);
+            } else {
+                bytesSent = send(connection.m_fd, chunk.m_buffer->data() + chunk.m_offset, allowed, MSG_NOSIGNAL);
+                if(bytesSent > 0) chunk.m_offset += bytesSent;
+            }
+            if(bytesSent < 0){
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                throw string("Sending piece to socket!!\nError: " + string(strerror(errno)));
+            }
+            if(bytesSent == 0){
+                throw string("File ended while sending to socket!!");
+            }
+            if(m_uploadLimiter) m_uploadLimiter->consume(connection.m_peerIp, bytesSent);
+            if(connection.m_bytesServed) connection.m_bytesServed->fetch_add(bytesSent, memory_order_relaxed);
+            chunk.m_length -= bytesSent;
+            continue;
+        }
+
+        connection.m_outQueue.pop_front();
+        connection.m_outSent = 0;
+    }
+    return true;
+}
+
+/**
+* @brief Hands a connection back to epoll, it will be reported once for the given events.
+* @param connection The connection to re-arm.
+* @param events The events to wait for.
+* @throws string If the connection can not be re-armed.
+*/
+void EventLoop::rearm(Connection* connection, uint32_t events){
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = connection;
+    if(epoll_ctl(m_epollFd, EPOLL_CTL_MOD, connection->m_fd, &event) == -1){
+        throw string("Re-arming connection!!\nError: " + string(strerror(errno)));
+    }
+}
+
+/**
+* @brief Waits until the output of a connection can go on, whether held back by the socket or by the upload limiter.
+* @param connection The connection with output left.
+* @throws string If the connection can not be re-armed.
+*/
+void EventLoop::waitForOutput(Connection* connection){
+    if(connection->m_resumeAt == chrono::steady_clock::time_point()){
+        rearm(connection, EPOLLOUT);
+        return;
+    }
+
+    //: Parked connection is not watched by epoll, so no worker touches it until it goes on
+    auto resumeAt = connection->m_resumeAt;
+    connection->m_resumeAt = chrono::steady_clock::time_point();
+    bool isFirst;
+    {
+        lock_guard<mutex> guard(m_parkedMutex);
+        isFirst = m_parked.empty() || resumeAt < m_parked.begin()->first;
+        m_parked.insert({resumeAt, connection});
+    }
+
+    //: Reactor may be waiting for a later time or for no time at all
+    uint64_t one = 1;
+    if(isFirst && write(m_wakeFd, &one, sizeof(one)) == -1){
+        generalLogger.log("ERROR", "Waking event loop!! Error: " + string(strerror(errno)));
+    }
+}
+
+/**
+* @brief Closes a connection and frees it.
+* @param connection The connection to close, not watched by epoll anymore after this call.
+*/
+void EventLoop::closeConnection(Connection* connection){
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, connection->m_fd, nullptr);
+    close(connection->m_fd);
+    {
+        lock_guard<mutex> guard(m_connectionsMutex);
+        m_connections.erase(connection);
+    }
+    if(m_uploadLimiter) m_uploadLimiter->removeConnection(connection->m_peerIp);
+    Metrics::getInstance().removeConnection();
+    delete connection;
+}
@@ -1,29 +1,110 @@
 #include "../headers.h"
 
-mutex Files::m_fileNameToFilePathMutex;
-mutex Files::m_filePathToAvailablePiecesMutex;
-map<pair<string, string>, string> Files::m_fileNameToFilePath;
-map<string, vector<int>> Files::m_filePathToAvailablePieces;
+Files::Shard Files::m_shards[REGISTRY_SHARDS];
+mutex Files::m_namesMutex;
+
+/**
+* @brief Gives the shard holding a file path.
+* @param filePath The path to the file.
+* @return The shard of the file path.
+*/
+Files::Shard& Files::giveShard(const string& filePath) {
+    return m_shards[hash<string>{}(filePath) % REGISTRY_SHARDS];
+}
+
+/**
+* @brief Gives the shard holding a file name of a group.
+* @param fileName The name of the file.
+* @param groupName The name of the group.
+* @return The shard of the file name.
+*/
+Files::Shard& Files::giveShard(const string& fileName, const string& groupName) {
+    return m_shards[hash<string>{}(groupName + "/" + fileName) % REGISTRY_SHARDS];
+}
 
 /**
 * @brief Adds a file path to the map with synchronization.
 * @param fileName The name of the file.
 * @param groupName The name of the group.
 * @param filePath The path to the file.
+* @param pieceSize The piece size the file is split into.
+* @param merkleTree The Merkle tree of the file, one leaf per piece.
 */
-void Files::addFilepath(string fileName, string groupName, string filePath) {
-    lock_guard<mutex> guard(Files::m_fileNameToFilePathMutex);
-    m_fileNameToFilePath[{fileName, groupName}] = filePath;
+void Files::addFilepath(string fileName, string groupName, string filePath, int pieceSize, shared_ptr<MerkleTree> merkleTree) {
+    lock_guard<mutex> namesGuard(m_namesMutex);
+
+    //: Pieces are registered before the name, so a name that can be looked up always has its pieces
+    {
+        Shard& shard = giveShard(filePath);
+        unique_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+
+        //: A path shared in several groups keeps its bitfield unless the file was split differently or changed
+        auto it = shard.m_filePathToAvailablePieces.find(filePath);
+        auto treeIt = shard.m_filePathToMerkleTree.find(filePath);
+        bool isSameFile = it != shard.m_filePathToAvailablePieces.end() && treeIt != shard.m_filePathToMerkleTree.end()
+            && it->second->size() == merkleTree->numLeaves() && shard.m_filePathToPieceSize[filePath] == pieceSize
+            && treeIt->second->root() == merkleTree->root();
+        if (!isSameFile) {
+            shard.m_filePathToAvailablePieces[filePath] = make_shared<Bitfield>(merkleTree->numLeaves());
+        }
+
+        //: Proofs of the pieces kept are in the old tree, unless the new one proves every piece anyway
+        if (!isSameFile || merkleTree->isComplete()) {
+            shard.m_filePathToMerkleTree[filePath] = merkleTree;
+        }
+        shard.m_filePathToPieceSize[filePath] = pieceSize;
+    }
+
+    Shard& shard = giveShard(fileName, groupName);
+    unique_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+    shard.m_fileNameToFilePath[{fileName, groupName}] = filePath;
 }
 
 /**
-* @brief Adds a piece number to the list of available pieces for a given file path.
+* @brief Gives the bitfield of available pieces of a file path.
+* @param filePath The path to the file.
+* @return The bitfield, null if the file path is not added.
+*/
+shared_ptr<Bitfield> Files::giveBitfield(string filePath) {
+    Shard& shard = giveShard(filePath);
+    shared_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+    auto it = shard.m_filePathToAvailablePieces.find(filePath);
+    return (it != shard.m_filePathToAvailablePieces.end()) ? it->second : nullptr;
+}
+
+/**
+* @brief Gives the Merkle tree of a file path.
+* @param filePath The path to the file.
+* @return The Merkle tree, null if the file path is not added.
+*/
+shared_ptr<MerkleTree> Files::giveMerkleTree(string filePath) {
+    Shard& shard = giveShard(filePath);
+    shared_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+    auto it = shard.m_filePathToMerkleTree.find(filePath);
+    return (it != shard.m_filePathToMerkleTree.end()) ? it->second : nullptr;
+}
+
+/**
+* @brief Gives the piece size of a file path.
+* @param filePath The path to the file.
+* @return The piece size, -1 if the file path is not added.
+*/
+int Files::givePieceSize(string filePath) {
+    Shard& shard = giveShard(filePath);
+    shared_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+    auto it = shard.m_filePathToPieceSize.find(filePath);
+    return (it != shard.m_filePathToPieceSize.end()) ? it->second : -1;
+}
+
+/**
+* @brief Marks a piece as available for a given file path.
 * @param filePath The path to the file.
 * @param pieceNumber The piece number to add.
 */
 void Files::addPieceToFilepath(string filePath, int pieceNumber) {
-    lock_guard<mutex> guard(Files::m_filePathToAvailablePiecesMutex);
-    m_filePathToAvailablePieces[filePath].push_back(pieceNumber);
+    //: Bits are atomic, the lock is only needed to find the bitfield
+    shared_ptr<Bitfield> bitfield = giveBitfield(filePath);
+    if (bitfield) bitfield->setBit(pieceNumber);
 }
 
 /**
@@ -33,28 +114,20 @@ void Files::addPieceToFilepath(string filePath, int pieceNumber) {
 * @return The file path, or an empty string if not found.
 */
 string Files::giveFilePath(string fileName, string groupName) {
-    lock_guard<mutex> guard(Files::m_fileNameToFilePathMutex);
-    auto it = m_fileNameToFilePath.find({fileName, groupName});
-    return (it != m_fileNameToFilePath.end()) ? it->second : "";
+    Shard& shard = giveShard(fileName, groupName);
+    shared_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+    auto it = shard.m_fileNameToFilePath.find({fileName, groupName});
+    return (it != shard.m_fileNameToFilePath.end()) ? it->second : "";
 }
 
 /**
-* @brief Retrieves a string of available pieces for a given file path.
+* @brief Retrieves the packed bitfield of available pieces for a given file path.
 * @param filePath The path to the file.
-* @return A string of available piece numbers separated by spaces, or an empty string if none.
+* @return The bitfield packed into bytes, or an empty string if the file path is not added.
 */
 string Files::giveAvailablePieces(string filePath) {
-    lock_guard<mutex> guard(Files::m_filePathToAvailablePiecesMutex);
-    auto it = m_filePathToAvailablePieces.find(filePath);
-    if (it == m_filePathToAvailablePieces.end()) {
-        return "";
-    }
-
-    string temp;
-    for (const auto& pieceNumber : it->second) {
-        temp.append(" " + to_string(pieceNumber));
-    }
-    return temp;
+    shared_ptr<Bitfield> bitfield = giveBitfield(filePath);
+    return bitfield ? bitfield->toBytes() : "";
 }
 
 /**
@@ -64,12 +137,113 @@ string Files::giveAvailablePieces(string filePath) {
 * @return True if the piece is available, false otherwise.
 */
 bool Files::isPieceAvailable(string filePath, int pieceNumber) {
-    lock_guard<mutex> guard(Files::m_filePathToAvailablePiecesMutex);
-    auto it = m_filePathToAvailablePieces.find(filePath);
-    if (it == m_filePathToAvailablePieces.end()) {
-        return false;
+    shared_ptr<Bitfield> bitfield = giveBitfield(filePath);
+    return bitfield && pieceNumber >= 0 && bitfield->testBit(pieceNumber);
+}
+
+/**
+* @brief Removes a file name from the map, then forgets its file and closes it if no other name refers to it.
+* @param fileName The name of the file.
+* @param groupName The name of the group.
+*/
+void Files::removeFilepath(string fileName, string groupName) {
+    lock_guard<mutex> namesGuard(m_namesMutex);
+    string filePath;
+    {
+        Shard& shard = giveShard(fileName, groupName);
+        unique_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+        auto it = shard.m_fileNameToFilePath.find({fileName, groupName});
+        if (it == shard.m_fileNameToFilePath.end()) {
+            return;
+        }
+        filePath = it->second;
+        shard.m_fileNameToFilePath.erase(it);
+    }
+
+    //: The same file may still be shared in another group, names of a path may be in any shard
+    for (Shard& shard : m_shards) {
+        shared_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+        for (const auto& entry : shard.m_fileNameToFilePath) {
+            if (entry.second == filePath) return;
+        }
+    }
+
+    //: Nothing refers to the path any more, sharing it again registers it anew
+    {
+        Shard& shard = giveShard(filePath);
+        unique_lock<TimedMutex<shared_mutex>> guard(shard.m_registryMutex);
+        shard.m_filePathToAvailablePieces.erase(filePath);
+        shard.m_filePathToPieceSize.erase(filePath);
+        shard.m_filePathToMerkleTree.erase(filePath);
+    }
+    closeFileHandle(filePath);
+}
+
+/**
+* @brief Gives an open handle for a file path, opening it on a cache miss.
+* @param filePath The path to the file.
+* @return Shared handle of the file, it stays open while held even if evicted.
+* @throw string If the file can not be opened.
+*/
+shared_ptr<FileHandle> Files::giveFileHandle(string filePath) {
+    Shard& shard = giveShard(filePath);
+    {
+        lock_guard<TimedMutex<mutex>> guard(shard.m_openFilesMutex);
+        auto it = shard.m_openFiles.find(filePath);
+        if (it != shard.m_openFiles.end()) {
+            shard.m_openFilesLru.splice(shard.m_openFilesLru.begin(), shard.m_openFilesLru, it->second.second);
+            return it->second.first;
+        }
+    }
+
+    //: File is opened without the lock, a slow disk must not stall other files of the shard
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw string("Failed to open file at Seeder!!");
+    }
+    shared_ptr<FileHandle> handle = make_shared<FileHandle>(fd);
+
+    lock_guard<TimedMutex<mutex>> guard(shard.m_openFilesMutex);
+
+    //: Another worker may have opened it meanwhile, keep the cached one and close ours
+    auto it = shard.m_openFiles.find(filePath);
+    if (it != shard.m_openFiles.end()) {
+        return it->second.first;
+    }
+
+    shard.m_openFilesLru.push_front(filePath);
+    shard.m_openFiles[filePath] = {handle, shard.m_openFilesLru.begin()};
+
+    //: Evicted handles are closed once the last piece being served from them is sent
+    if (shard.m_openFiles.size() > (size_t)max(1, MAX_OPEN_FILES / REGISTRY_SHARDS)) {
+        shard.m_openFiles.erase(shard.m_openFilesLru.back());
+        shard.m_openFilesLru.pop_back();
+    }
+    return handle;
+}
+
+/**
+* @brief Drops the cached handle of a file path.
+* @param filePath The path to the file.
+*/
+void Files::closeFileHandle(string filePath) {
+    Shard& shard = giveShard(filePath);
+    lock_guard<TimedMutex<mutex>> guard(shard.m_openFilesMutex);
+    auto it = shard.m_openFiles.find(filePath);
+    if (it == shard.m_openFiles.end()) {
+        return;
+    }
+    shard.m_openFilesLru.erase(it->second.second);
+    shard.m_openFiles.erase(it);
+}
+
+/**
+* @brief Drops all cached handles.
+*/
+void Files::closeAllFileHandles() {
+    for (Shard& shard : m_shards) {
+        lock_guard<TimedMutex<mutex>> guard(shard.m_openFilesMutex);
+        shard.m_openFiles.clear();
+        shard.m_openFilesLru.clear();
     }
-    
-    const auto& pieces = it->second;
-    return find(pieces.begin(), pieces.end(), pieceNumber) != pieces.end();
 }
@@ -0,0 +1,278 @@
+#include "../headers.h"
+
+/**
+* @brief Writes a new journal, replacing any journal at the same path.
+* @param journalPath Path of the journal.
+* @param info The file the journal is of.
+* @param merkleTree Merkle tree of the file.
+* @param pieceBytes Packed bitfield of the pieces already written, empty if there are none.
+* @throw string If the journal can not be written.
+*/
+Journal::Journal(string journalPath, FileInfo info, shared_ptr<MerkleTree> merkleTree, const string& pieceBytes)
+: m_journalPath(journalPath)
+, m_info(info)
+, m_merkleTree(merkleTree)
+, m_pieces(merkleTree->numLeaves())
+, m_lastSync(chrono::steady_clock::now())
+{
+    for (int pieceNumber : Bitfield::giveSetBits(pieceBytes, m_pieces.size())) m_pieces.setBit(pieceNumber);
+
+    string root = m_merkleTree->root();
+    string header = "P2P_JOURNAL " + m_info.m_groupName + " " + m_info.m_fileName + " " + m_info.m_filePath + " "
+        + to_string(m_info.m_fileSize) + " " + to_string(m_info.m_pieceSize) + " " + m_info.m_fileSHA + " "
+        + Utils::toHex((const unsigned char*)root.data(), root.size()) + "\n";
+    m_piecesOffset = header.size();
+    m_nodesOffset = m_piecesOffset + (m_pieces.size() + 7) / 8;
+
+    //: Written aside and renamed over the old journal, so a crash leaves either the old or the new one
+    string content = header + m_pieces.toBytes() + m_merkleTree->nodeBytes();
+    string tempPath = m_journalPath + ".tmp";
+    int tempFd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tempFd < 0) {
+        throw string("Creating journal " + m_journalPath + "!!\nError: " + string(strerror(errno)));
+    }
+    if (write(tempFd, content.data(), content.size()) != (ssize_t)content.size() || fdatasync(tempFd) < 0) {
+        close(tempFd);
+        unlink(tempPath.c_str());
+        throw string("Writing journal " + m_journalPath + "!!\nError: " + string(strerror(errno)));
+    }
+    close(tempFd);
+
+    if (rename(tempPath.c_str(), m_journalPath.c_str()) < 0 || (m_fd = open(m_journalPath.c_str(), O_WRONLY)) < 0) {
+        throw string("Creating journal " + m_journalPath + "!!\nError: " + string(strerror(errno)));
+    }
+}
+
+/**
+* @brief Syncs pieces not synced yet and closes the journal.
+*/
+Journal::~Journal() {
+    lock_guard<mutex> guard(m_journalMutex);
+    if (m_fd == -1) return;
+    try {
+        if (m_unsyncedPieces > 0) syncLocked();
+    } catch (const string& e) {
+        //: Pieces not synced are fetched again on resume, nothing else is lost
+    }
+    close(m_fd);
+}
+
+/**
+* @brief Reads a journal.
+* @param journalPath Path of the journal.
+* @return The journal, with the pieces and tree saved in it.
+* @throw string If the journal can not be read or is damaged.
+*/
+shared_ptr<Journal> Journal::load(string journalPath) {
+    int fd = open(journalPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw string("Opening journal " + journalPath + "!!\nError: " + string(strerror(errno)));
+    }
+
+    string content;
+    char buffer[65536];
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0) content.append(buffer, bytesRead);
+    close(fd);
+    if (bytesRead < 0) {
+        throw string("Reading journal " + journalPath + "!!\nError: " + string(strerror(errno)));
+    }
+
+    size_t headerEnd = content.find('\n');
+    vector<string> tokens = Utils::tokenize(content.substr(0, headerEnd), ' ');
+    //: Sizes are checked before they are converted, a damaged header must not throw anything but the error below
+    if (headerEnd == string::npos || tokens.size() != 8 || tokens[0] != "P2P_JOURNAL"
+        || tokens[4].empty() || tokens[4].size() > 18 || tokens[4].find_first_not_of("0123456789") != string::npos
+        || tokens[5].empty() || tokens[5].size() > 9 || tokens[5].find_first_not_of("0123456789") != string::npos) {
+        throw string("Journal " + journalPath + " is damaged!!");
+    }
+
+    FileInfo info;
+    info.m_groupName = tokens[1];
+    info.m_fileName = tokens[2];
+    info.m_filePath = tokens[3];
+    info.m_fileSize = stoll(tokens[4]);
+    info.m_pieceSize = stoi(tokens[5]);
+    info.m_fileSHA = tokens[6];
+    string root = Utils::fromHex(tokens[7]);
+    if (info.m_fileSize < 0 || info.m_pieceSize <= 0 || root.size() != SHA256_DIGEST_LENGTH) {
+        throw string("Journal " + journalPath + " is damaged!!");
+    }
+
+    //: The tree checks that the saved nodes are of its size and root
+    size_t numPieces = (info.m_fileSize + info.m_pieceSize - 1) / info.m_pieceSize;
+    size_t piecesLength = (numPieces + 7) / 8;
+    size_t piecesOffset = headerEnd + 1;
+    if (content.size() < piecesOffset + piecesLength) {
+        throw string("Journal " + journalPath + " is damaged!!");
+    }
+    shared_ptr<MerkleTree> merkleTree = make_shared<MerkleTree>(numPieces, root, content.substr(piecesOffset + piecesLength));
+
+    return make_shared<Journal>(journalPath, info, merkleTree, content.substr(piecesOffset, piecesLength));
+}
+
+/**
+* @brief Gives the directory of the journals of a user, creating it if needed.
+* @param seederIp The IP address of the seeder of this client.
+* @param seederPort The port number of the seeder of this client.
+* @param userName The name of the user.
+* @return The directory path.
+* @throw string If the directory can not be created.
+*/
+string Journal::giveJournalDir(string seederIp, int seederPort, string userName) {
+    string journalDir = "./journals";
+    for (string part : {seederIp + ":" + to_string(seederPort), userName, string("")}) {
+        if (mkdir(journalDir.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw string("Making directory " + journalDir + " for journals!!");
+        }
+        if (part != "") journalDir += "/" + part;
+    }
+    return journalDir;
+}
+
+/**
+* @brief Gives the path of the journal of a file in a group.
+* @param journalDir The directory of the journals.
+* @param groupName The name of the group.
+* @param fileName The name of the file.
+* @return The journal path.
+*/
+string Journal::giveJournalPath(string journalDir, string groupName, string fileName) {
+    //: Names may hold any character allowed in a command, hexadecimal keeps the path valid and unique
+    string key = groupName + " " + fileName;
+    return journalDir + "/" + Utils::toHex((const unsigned char*)key.data(), key.size()) + ".journal";
+}
+
+/**
+* @brief Lists the journals in a directory.
+* @param journalDir The directory of the journals.
+* @return Paths of the journals.
+*/
+vector<string> Journal::listJournals(string journalDir) {
+    vector<string> journalPaths;
+    DIR* dir = opendir(journalDir.c_str());
+    if (!dir) return journalPaths;
+
+    const string extension = ".journal";
+    while (struct dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name.size() > extension.size() && name.compare(name.size() - extension.size(), extension.size(), extension) == 0) {
+            journalPaths.push_back(journalDir + "/" + name);
+        }
+    }
+    closedir(dir);
+    return journalPaths;
+}
+
+/**
+* @brief Writes the bitfield and the tree to the journal and syncs it.
+* @note Expects m_journalMutex to be held.
+*/
+void Journal::syncLocked() {
+    string pieceBytes = m_pieces.toBytes();
+    string nodeBytes = m_merkleTree->nodeBytes();
+    if (pwrite(m_fd, pieceBytes.data(), pieceBytes.size(), m_piecesOffset) != (ssize_t)pieceBytes.size()
+        || pwrite(m_fd, nodeBytes.data(), nodeBytes.size(), m_nodesOffset) != (ssize_t)nodeBytes.size()
+        || fdatasync(m_fd) < 0) {
+        throw string("Writing journal " + m_journalPath + "!!\nError: " + string(strerror(errno)));
+    }
+    m_unsyncedPieces = 0;
+    m_lastSync = chrono::steady_clock::now();
+}
+
+/**
+* @brief Marks a piece as written, syncing the journal once enough pieces or time piled up.
+* @param pieceNumber The piece written.
+*/
+void Journal::markPiece(int pieceNumber) {
+    if (!m_pieces.setBit(pieceNumber)) return;
+
+    lock_guard<mutex> guard(m_journalMutex);
+    if (m_fd == -1) return;
+
+    //: One sync covers a batch of pieces, an fdatasync() per piece would cost more than the piece
+    m_unsyncedPieces++;
+    if (m_unsyncedPieces >= JOURNAL_SYNC_PIECES || chrono::steady_clock::now() - m_lastSync >= chrono::milliseconds(JOURNAL_SYNC_INTERVAL)) {
+        syncLocked();
+    }
+}
+
+/**
+* @brief Marks a piece as missing, e.g. when it did not match its leaf anymore.
+* @param pieceNumber The piece missing.
+*/
+void Journal::unmarkPiece(int pieceNumber) {
+    m_pieces.clearBit(pieceNumber);
+
+    lock_guard<mutex> guard(m_journalMutex);
+    m_unsyncedPieces++;
+}
+
+/**
+* @brief Marks all pieces as written and syncs the journal.
+*/
+void Journal::markAllPieces() {
+    m_pieces.setAll();
+
+    lock_guard<mutex> guard(m_journalMutex);
+    if (m_fd != -1) syncLocked();
+}
+
+/**
+* @brief Syncs pieces not synced yet.
+*/
+void Journal::sync() {
+    lock_guard<mutex> guard(m_journalMutex);
+    if (m_fd != -1 && m_unsyncedPieces > 0) syncLocked();
+}
+
+/**
+* @brief Deletes the journal, nothing is written to it afterwards.
+*/
+void Journal::remove() {
+    lock_guard<mutex> guard(m_journalMutex);
+    if (m_fd == -1) return;
+    close(m_fd);
+    m_fd = -1;
+    unlink(m_journalPath.c_str());
+}
+
+/**
+* @brief Gives the pieces marked as written.
+* @return The piece numbers in increasing order.
+*/
+vector<int> Journal::giveJournaledPieces() const {
+    return Bitfield::giveSetBits(m_pieces.toBytes(), m_pieces.size());
+}
+
+/**
+* @brief Gives the packed bitfield of the pieces marked as written.
+* @return The bitfield packed into bytes.
+*/
+string Journal::givePieceBytes() const {
+    return m_pieces.toBytes();
+}
+
+/**
+* @brief Checks whether all pieces are marked as written.
+* @return True if the file is complete, false otherwise.
+*/
+bool Journal::isComplete() const {
+    return m_pieces.count() == m_pieces.size();
+}
+
+/**
+* @brief Gives the file the journal is of.
+* @return The file info.
+*/
+const FileInfo& Journal::info() const {
+    return m_info;
+}
+
+/**
+* @brief Gives the Merkle tree saved in the journal.
+* @return The Merkle tree.
+*/
+shared_ptr<MerkleTree> Journal::merkleTree() const {
+    return m_merkleTree;
+}
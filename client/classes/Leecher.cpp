@@ -1,24 +1,56 @@
 #include "../headers.h"
 
 /**
- * @brief Initializes the Leecher instance by creating a client socket.
+ * @brief Connects to the first reachable tracker, the others are connected to when used.
+ * 
+ * @param trackers IP address and port number of every tracker, the one to try first at the front.
+ * 
+ * @return void
+ * 
+ * @throws string If no tracker can be reached.
  */
-void Leecher::init() {
-    m_clientSocket.createSocket();
+void Leecher::connectTracker(vector<pair<string, int>> trackers) {
+    for (auto& it : trackers) {
+        m_trackers.push_back(make_unique<TrackerLink>());
+        m_trackers.back()->m_trackerIp = it.first;
+        m_trackers.back()->m_trackerPort = it.second;
+    }
+
+    string lastError = "No tracker is given!!";
+    for (size_t i = 0; i < m_trackers.size(); i++) {
+        TrackerLink& link = *m_trackers[i];
+        lock_guard<mutex> guard(link.m_linkMutex);
+        try {
+            link.m_socket = openTrackerSocket(link.m_trackerIp, link.m_trackerPort);
+        } catch (const string& e) {
+            link.m_isDown = true;
+            link.m_downSince = chrono::steady_clock::now();
+            lastError = e;
+            continue;
+        }
+        m_homeTracker = i;
+        m_logger.log("SUCCESS", "Leecher connected to tracker at " + link.m_trackerIp + ":" + to_string(link.m_trackerPort) + ".");
+        return;
+    }
+    throw lastError;
 }
 
 /**
- * @brief Connects to the tracker server.
+ * @brief Opens a connection to a tracker.
  * 
- * @param trackerIp IP address of the tracker server.
- * @param trackerPort Port number of the tracker server.
+ * @param trackerIp IP address of the tracker.
+ * @param trackerPort Port number of the tracker.
  * 
- * @return void
+ * @return unique_ptr<ClientSocket> The connected socket.
+ * 
+ * @throws string If the tracker can not be reached.
  */
-void Leecher::connectTracker(string trackerIp, int trackerPort) {
-    m_clientSocket.connectSocket(trackerIp, trackerPort);
-    m_clientSocket.setOptions();
-    m_logger.log("SUCCESS", "Leecher connected to tracker at " + trackerIp + ":" + to_string(trackerPort) + ".");
+unique_ptr<ClientSocket> Leecher::openTrackerSocket(string trackerIp, int trackerPort) {
+    unique_ptr<ClientSocket> socket = make_unique<ClientSocket>();
+    socket->createSocket();
+    socket->connectSocket(trackerIp, trackerPort);
+    socket->setOptions();
+    return socket;
 }
 
 /**
@@ -32,12 +64,15 @@ void Leecher::start() {
 }
 
 /**
- * @brief Stops the Leecher instance by closing the client socket.
+ * @brief Stops the Leecher instance by closing the connections to the trackers.
  * 
  * @return void
  */
 void Leecher::stop() {
-    m_clientSocket.closeSocket();
+    for (auto& link : m_trackers) {
+        lock_guard<mutex> guard(link->m_linkMutex);
+        link->m_socket = nullptr;
+    }
 }
 
 /**
@@ -71,6 +106,28 @@ void Leecher::processUserRequests(string inputFromClient) {
     
     if (tokens.empty()) return;
 
+    //: Failed commands are timed too, their error goes on to the prompt
+    auto startTime = chrono::steady_clock::now();
+    try {
+        dispatchUserRequest(tokens, inputFromClient);
+    } catch (const string&) {
+        Metrics::getInstance().recordCommand(tokens[0], chrono::steady_clock::now() - startTime);
+        throw;
+    }
+    Metrics::getInstance().recordCommand(tokens[0], chrono::steady_clock::now() - startTime);
+}
+
+/**
+ * @brief Calls the function handling a user command.
+ * 
+ * @param tokens Command tokens, not empty.
+ * @param inputFromClient The input command string from the user.
+ * 
+ * @return void
+ * 
+ * @throws string If the command is unknown or fails.
+ */
+void Leecher::dispatchUserRequest(vector<string> tokens, string inputFromClient) {
     if (tokens[0] == "quit" || tokens[0] == "exit") quit(tokens, inputFromClient);
     else if (tokens[0] == "create_user") createUser(tokens, inputFromClient);
     else if (tokens[0] == "login") login(tokens, inputFromClient);
@@ -86,6 +143,9 @@ void Leecher::processUserRequests(string inputFromClient) {
     else if (tokens[0] == "show_downloads") showDownloads(tokens, inputFromClient);
     else if (tokens[0] == "logout") logout(tokens, inputFromClient);
     else if (tokens[0] == "stop_share") stopShare(tokens, inputFromClient);
+    else if (tokens[0] == "subscribe" || tokens[0] == "unsubscribe") subscribe(tokens, inputFromClient);
+    else if (tokens[0] == "batch") batch(tokens, inputFromClient);
+    else if (tokens[0] == "stats") stats(tokens, inputFromClient);
     else throw string("Invalid command!!");
 }
 
@@ -102,78 +162,208 @@ void Leecher::printResponse(vector<string> tokens, string response) {
         vector<string> responseTokens = Utils::tokenize(response, ' ');
         response = "";
         for (int i = 0; i < (int)responseTokens.size(); i++) {
-            if (i != 1) response.append(responseTokens[i] + " ");
+            if (i != 0) response.append(responseTokens[i] + " ");
         }
     }
 
     if (tokens[0] == "list_groups") {
-        vector<string> responseTokens = Utils::tokenize(response, ' ');
-        if (responseTokens.size() == 1) {
+        if (Utils::tokenize(response, '\n').empty()) {
             cout << string(YELLOW) + "There is no group in the system!!\n" + string(RESET) << flush;
             return;
         }
-        response = "List of groups is as follows : " + responseTokens[1];
+        response = "List of groups is as follows : " + response;
         cout << response + "\n" << flush;
         return;
     }
 
     if (tokens[0] == "list_requests") {
-        vector<string> responseTokens = Utils::tokenize(response, ' ');
-        if (responseTokens.size() == 1) {
+        if (Utils::tokenize(response, '\n').empty()) {
             cout << string(YELLOW) + "There is no pending joinee in the group!!\n" + string(RESET) << flush;
             return;
         }
-        response = "List of pending requests in the group is as follows : " + responseTokens[1];
+        response = "List of pending requests in the group is as follows : " + response;
         cout << response + "\n" << flush;
         return;
     }
 
     if (tokens[0] == "list_files") {
-        vector<string> responseTokens = Utils::tokenize(response, ' ');
-        if (responseTokens.size() == 1) {
+        if (Utils::tokenize(response, '\n').empty()) {
             cout << string(YELLOW) + "There are no files in the group!!\n" + string(RESET) << flush;
             return;
         }
-        response = "List of files in the group is as follows : " + responseTokens[1];
+        response = "List of files in the group is as follows : " + response;
         cout << response + "\n" << flush;
         return;
     }
 
-    cout << string(GREEN) + response + "\n" + string(RESET) << flush;
+    cout << string(GREEN) + "Success: " + response + "\n" + string(RESET) << flush;
 }
 
 /**
  * @brief Checks for errors in the response and throws an exception if an error is found.
  * 
- * @param response The response string from the tracker server.
+ * @param header The frame header of the response.
+ * @param response The response string from the tracker server or a seeder.
+ * @param expectedOpcode The opcode a successful response must carry.
  * 
  * @return void
  * 
  * @throws string Exception if error is found in the response.
  */
-void Leecher::checkForError(string response) {
-    if (response.substr(0, 5) == "Error") {
-        throw response.substr(7);
+void Leecher::checkForError(const FrameHeader& header, string response, uint8_t expectedOpcode) {
+    if (header.m_status == STATUS_ERROR) {
+        throw response;
+    }
+    if (header.m_opcode != expectedOpcode) {
+        throw string("Unexpected frame with opcode " + to_string(header.m_opcode) + " in response!!");
     }
 }
 
 /**
- * @brief Sends a message to the tracker server and receives the response.
+ * @brief Sends a message to a tracker and receives the response.
+ * 
+ * See exchangeTracker().
  * 
  * @param messageForTracker The message to be sent to the tracker server.
  * 
  * @return string The response received from the tracker server.
+ * 
+ * @throws string If the tracker responds with an error or no tracker can be reached.
  */
 string Leecher::sendTracker(string messageForTracker) {
-    m_logger.log("COMMAND", "Sending to tracker : " + messageForTracker);
-    
-    m_clientSocket.sendSocket(messageForTracker);
-    
-    string response = m_clientSocket.recvSocket();
-    m_logger.log("COMMAND", "Received from tracker : " + response);
-    
-    checkForError(response);
-    
+    string commandName = messageForTracker.substr(0, messageForTracker.find(' '));
+    bool isRead = commandName == "list_groups" || commandName == "list_requests" || commandName == "list_files" || commandName == "download_file";
+
+    pair<FrameHeader, string> reply = exchangeTracker(giveRequest(messageForTracker), OPCODE_COMMAND, isRead);
+    checkForError(reply.first, reply.second);
+    return reply.second;
+}
+
+/**
+ * @brief Gives a message with a request id in front if it changes the state of the trackers.
+ * 
+ * The id stays the same when exchangeTracker() sends the message again after a lost
+ * response, so the primary answers a write it applied already without applying it twice.
+ * 
+ * @param messageForTracker The message.
+ * 
+ * @return string "request <id> <message>" for a write, the message as it is otherwise.
+ */
+string Leecher::giveRequest(string messageForTracker) {
+    static const set<string> writes = {
+        "create_user", "login", "logout", "create_group", "join_group", "accept_request",
+        "upload_file", "stop_share", "have", "leave_group"
+    };
+    if (!writes.count(messageForTracker.substr(0, messageForTracker.find(' ')))) return messageForTracker;
+    return m_requestPrefix + to_string(++m_nextRequestNumber) + " " + messageForTracker;
+}
+
+/**
+ * @brief Sends commands to the tracker in one frame and receives their responses.
+ * 
+ * The tracker runs the commands in order, so a command sees the changes of the ones
+ * before it, and answers all of them in a single round trip.
+ * 
+ * @param messagesForTracker The messages to be sent, at most MAX_BATCH_COMMANDS.
+ * 
+ * @return vector<pair<uint8_t, string>> Status and response of every message, in order.
+ * 
+ * @throws string If the tracker refuses the whole batch or no tracker can be reached.
+ */
+vector<pair<uint8_t, string>> Leecher::sendTrackerBatch(vector<string> messagesForTracker) {
+    bool isRead = true;
+    string payload = "";
+    for (string& it : messagesForTracker) {
+        string commandName = it.substr(0, it.find(' '));
+        if (commandName != "list_groups" && commandName != "list_requests" && commandName != "list_files") isRead = false;
+        payload += giveRequest(it) + "\n";
+    }
+
+    pair<FrameHeader, string> reply = exchangeTracker(payload, OPCODE_BATCH, isRead);
+    checkForError(reply.first, reply.second, OPCODE_BATCH);
+    vector<pair<uint8_t, string>> replies = Utils::unpackReplies(reply.second);
+    if (replies.size() != messagesForTracker.size()) throw string("Invalid responses of batch!!");
+    return replies;
+}
+
+/**
+ * @brief Sends a frame to a tracker and receives the response.
+ * 
+ * Reads go round all trackers, changes go to the tracker that took the last change,
+ * every tracker passes changes on to the primary tracker. A tracker that can not be
+ * reached is left for the next one, and only tried again after the others for
+ * TRACKER_RETRY_INTERVAL.
+ * 
+ * @param payload The payload of the frame.
+ * @param opcode The kind of message, OPCODE_COMMAND or OPCODE_BATCH.
+ * @param isRead Whether the frame only reads.
+ * 
+ * @return pair<FrameHeader, string> The header and payload of the response.
+ * 
+ * @throws string If no tracker can be reached.
+ */
+pair<FrameHeader, string> Leecher::exchangeTracker(string payload, uint8_t opcode, bool isRead) {
+    size_t firstTracker = isRead ? m_nextReadTracker++ % m_trackers.size() : m_homeTracker.load();
+    string lastError = "";
+    vector<bool> isTried(m_trackers.size(), false);
+    for (int round = 0; round < 2; round++) {
+        for (size_t i = 0; i < m_trackers.size(); i++) {
+            size_t trackerIndex = (firstTracker + i) % m_trackers.size();
+            TrackerLink& link = *m_trackers[trackerIndex];
+            if (isTried[trackerIndex]) continue;
+
+            //: Download threads announce pieces on the same connections as the commands of the user
+            lock_guard<mutex> guard(link.m_linkMutex);
+            auto now = chrono::steady_clock::now();
+            bool isResting = link.m_isDown && now - link.m_downSince < chrono::milliseconds(TRACKER_RETRY_INTERVAL);
+            if (round == 0 && isResting) continue;
+            isTried[trackerIndex] = true;
+
+            FrameHeader header;
+            string response;
+            bool isReused = link.m_socket != nullptr;
+            try {
+                if (!link.m_socket) link.m_socket = openTrackerSocket(link.m_trackerIp, link.m_trackerPort);
+                m_logger.log("COMMAND", "Sending to tracker " + link.m_trackerIp + ":" + to_string(link.m_trackerPort) + " : " + payload);
+                link.m_socket->sendSocket(payload, opcode);
+                response = link.m_socket->recvSocket(header);
+            } catch (const string& e) {
+                //: A change may have been applied before the connection was lost, its request id keeps it from being applied twice
+                link.m_socket = nullptr;
+                link.m_isDown = true;
+                link.m_downSince = now;
+                lastError = e;
+                m_logger.log("ERROR", "Tracker " + link.m_trackerIp + ":" + to_string(link.m_trackerPort) + " lost!! Error: " + e);
+
+                //: A tracker restarted since the last command closed the old connection, a new one may still reach it
+                if (isReused) isTried[trackerIndex] = false;
+                continue;
+            }
+            link.m_isDown = false;
+            if (!isRead) m_homeTracker = trackerIndex;
+            m_logger.log("COMMAND", "Received from tracker : " + response);
+            return {header, response};
+        }
+    }
+    throw string("No tracker can be reached!! " + lastError);
+}
+
+/**
+ * @brief Sends a message to a seeder and receives the response.
+ * 
+ * @param seederSocket The socket connected to the seeder.
+ * @param messageForSeeder The message to be sent to the seeder.
+ * 
+ * @return string The response received from the seeder.
+ * 
+ * @throws string If the seeder responds with an error.
+ */
+string Leecher::sendSeeder(ClientSocket& seederSocket, string messageForSeeder) {
+    seederSocket.sendSocket(messageForSeeder);
+
+    FrameHeader header;
+    string response = seederSocket.recvSocket(header);
+    checkForError(header, response);
     return response;
 }
 
@@ -197,6 +387,12 @@ void Leecher::quit(vector<string> tokens, string inputFromClient) {
         m_logger.log("INFO", "authToken not found!! No need to send logout request to tracker");
     }
 
+    //: Downloads still running keep their journals, pieces they wrote are not lost
+    {
+        lock_guard<mutex> guard(m_downloadFileMutex);
+        for (auto& it : m_journals) it.second->sync();
+    }
+
     stop();
     m_logger.log("SUCCESS", "Leecher Quit.");
     exit(0);
@@ -219,6 +415,9 @@ void Leecher::createUser(vector<string> tokens, string inputFromClient) {
 /**
  * @brief Logs in the user and sends login information to the tracker.
  * 
+ * Files the user shared or was downloading before are then taken up again from
+ * the user's journals, see resumeJournals().
+ * 
  * @param tokens Command tokens.
  * @param inputFromClient The input command string from the user.
  * 
@@ -228,8 +427,20 @@ void Leecher::login(vector<string> tokens, string inputFromClient) {
     string messageForTracker = inputFromClient + " " + m_seederIp + ":" + to_string(m_seederPort);
     string response = sendTracker(messageForTracker);
     vector<string> responseTokens = Utils::tokenize(response, ' ');
-    m_authToken = responseTokens[1];
+    {
+        //: Download threads read the token to announce pieces
+        lock_guard<mutex> guard(m_trackerMutex);
+        m_authToken = responseTokens[0];
+    }
     printResponse(tokens, response);
+
+    try {
+        m_userName = tokens[1];
+        m_journalDir = Journal::giveJournalDir(m_seederIp, m_seederPort, m_userName);
+        resumeJournals();
+    } catch (const string& e) {
+        m_logger.log("ERROR", "Resuming journals of " + m_userName + "!! Error: " + e);
+    }
 }
 
 /**
@@ -333,19 +544,88 @@ void Leecher::listFiles(vector<string> tokens, string inputFromClient) {
 /**
  * @brief Uploads a file to the tracker and sends the upload file command.
  * 
+ * Chooses a piece size scaled to the file size, computes the SHA of the entire
+ * file as well as of every piece, builds the Merkle tree over the piece SHAs,
+ * registers the file with the tracker by its SHA and Merkle root only and
+ * marks all of its pieces as available for seeding. The file is recorded in a
+ * journal, so that it is shared again on the next login.
+ * 
  * @param tokens Command tokens.
  * @param inputFromClient The input command string from the user.
  * 
  * @return void
  */
 void Leecher::uploadFile(vector<string> tokens, string inputFromClient) {
-    string messageForTracker = inputFromClient + " " + m_authToken;
-    string response = sendTracker(messageForTracker);
+    PendingUpload upload = prepareUpload(tokens);
+    string response = sendTracker(upload.m_messageForTracker);
+    finishUpload(upload);
     printResponse(tokens, response);
 }
 
 /**
- * @brief Downloads a file from the tracker and sends the download file command.
+ * @brief Hashes a file for upload and builds its command for the tracker.
+ * 
+ * @param tokens Tokens of the "upload_file" command.
+ * 
+ * @return PendingUpload The file, ready to be shared once the tracker accepts it.
+ * 
+ * @throws string If the arguments are invalid or the file can not be read.
+ */
+Leecher::PendingUpload Leecher::prepareUpload(vector<string> tokens) {
+    if (tokens.size() != 3) throw string("Invalid arguments to upload_file command!! Usage: upload_file <file_path> <group_id>");
+
+    string filePath = tokens[1];
+    string groupName = tokens[2];
+    string fileName = filePath.substr(filePath.find_last_of('/') + 1);
+
+    long long fileSize = Utils::giveFileSize(filePath);
+    int pieceSize = Utils::givePieceSize(fileSize);
+    vector<string> SHAs = Utils::findSHA(filePath, pieceSize);
+
+    vector<string> leaves;
+    leaves.reserve(SHAs.size() - 1);
+    for (size_t i = 1; i < SHAs.size(); i++) leaves.push_back(Utils::fromHex(SHAs[i]));
+
+    PendingUpload upload;
+    upload.m_info = {groupName, fileName, filePath, fileSize, pieceSize, SHAs[0]};
+    upload.m_merkleTree = make_shared<MerkleTree>(leaves);
+
+    //: Tracker message stays the same size for any file, piece SHAs are proven by seeders
+    string merkleRoot = upload.m_merkleTree->root();
+    string joinedSHAs = SHAs[0] + ":" + Utils::toHex((const unsigned char*)merkleRoot.data(), merkleRoot.size());
+    upload.m_messageForTracker = "upload_file " + fileName + " " + groupName + " " + to_string(fileSize) + " " + to_string(pieceSize) + " " + joinedSHAs + " " + m_authToken;
+    return upload;
+}
+
+/**
+ * @brief Shares a file accepted by the tracker and journals it.
+ * 
+ * @param upload The file.
+ * 
+ * @return void
+ */
+void Leecher::finishUpload(const PendingUpload& upload) {
+    const FileInfo& info = upload.m_info;
+
+    //: File is accepted by tracker, make all of its pieces available to leechers
+    Files::addFilepath(info.m_fileName, info.m_groupName, info.m_filePath, info.m_pieceSize, upload.m_merkleTree);
+    Files::giveBitfield(info.m_filePath)->setAll();
+
+    try {
+        shared_ptr<Journal> journal = make_shared<Journal>(Journal::giveJournalPath(m_journalDir, info.m_groupName, info.m_fileName), info, upload.m_merkleTree);
+        journal->markAllPieces();
+
+        lock_guard<mutex> guard(m_downloadFileMutex);
+        m_journals[{info.m_groupName, info.m_fileName}] = journal;
+    } catch (const string& e) {
+        m_logger.log("ERROR", "Journaling " + info.m_fileName + " of group " + info.m_groupName + "!! Error: " + e);
+    }
+}
+
+/**
+ * @brief Downloads a file from the peers sharing it in a group.
+ * 
+ * See startDownload().
  * 
  * @param tokens Command tokens.
  * @param inputFromClient The input command string from the user.
@@ -353,13 +633,477 @@ void Leecher::uploadFile(vector<string> tokens, string inputFromClient) {
  * @return void
  */
 void Leecher::downloadFile(vector<string> tokens, string inputFromClient) {
-    string messageForTracker = inputFromClient + " " + m_authToken;
+    if (tokens.size() != 4 && tokens.size() != 5) throw string("Invalid arguments to download_file command!! Usage: download_file <group_id> <file_name> <destination_path> [low|normal|high]");
+
+    string groupName = tokens[1];
+    string fileName = tokens[2];
+    string destinationPath = tokens[3];
+
+    //: Priority sets the share of the requests in flight the download gets while others are running
+    int priority = DOWNLOAD_PRIORITY_NORMAL;
+    if (tokens.size() == 5) {
+        if (tokens[4] == "low") priority = DOWNLOAD_PRIORITY_LOW;
+        else if (tokens[4] == "high") priority = DOWNLOAD_PRIORITY_HIGH;
+        else if (tokens[4] != "normal") throw string("Invalid priority to download_file command!! Usage: download_file <group_id> <file_name> <destination_path> [low|normal|high]");
+    }
+
+    //: If destination is a directory, save the file inside it with the same name
+    struct stat info;
+    if (stat(destinationPath.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+        destinationPath += "/" + fileName;
+    }
+
+    startDownload(groupName, fileName, destinationPath, nullptr, priority);
+}
+
+/**
+ * @brief Asks the tracker and the seeders for a file and starts downloading it in a separate thread.
+ * 
+ * Fetches the file size, SHA, Merkle root and sharing peers from the tracker, asks every peer
+ * which pieces it holds using "give_piece_info" and then starts the download in a
+ * separate thread so that the user can keep issuing commands. A resumed download only
+ * needs the pieces missing from its journal to be held by the peers.
+ * 
+ * @param groupName The name of the group.
+ * @param fileName The name of the file to download.
+ * @param destinationPath The path to save the downloaded file.
+ * @param resumedJournal Journal of an earlier download of the file to resume, null to start afresh.
+ * @param priority Priority weight of the download, one of the DOWNLOAD_PRIORITY_* values.
+ * 
+ * @return void
+ * 
+ * @throws string If the file can not be downloaded as of now.
+ */
+void Leecher::startDownload(string groupName, string fileName, string destinationPath, shared_ptr<Journal> resumedJournal, int priority) {
+    {
+        lock_guard<mutex> guard(m_downloadFileMutex);
+        if (m_downloadingFiles.count({groupName, fileName})) {
+            throw string("File is already being downloaded!!");
+        }
+    }
+
+    string messageForTracker = "download_file " + groupName + " " + fileName + " " + m_authToken;
     string response = sendTracker(messageForTracker);
-    printResponse(tokens, response);
+
+    //: Response is in the format of "FileSize PieceSize FileSHA MerkleRoot IP:Port_1,...,IP:Port_N"
+    vector<string> responseTokens = Utils::tokenize(response, ' ');
+    if (responseTokens.size() != 5) throw string("Invalid response from tracker for download_file!!");
+
+    long long fileSize = stoll(responseTokens[0]);
+    int pieceSize = stoi(responseTokens[1]);
+    string merkleRoot = Utils::fromHex(responseTokens[3]);
+    vector<string> seeders = Utils::tokenize(responseTokens[4], ',');
+    if (pieceSize <= 0 || merkleRoot.size() != SHA256_DIGEST_LENGTH) throw string("Invalid response from tracker for download_file!!");
+    int numPieces = (int)((fileSize + pieceSize - 1) / pieceSize);
+
+    //: Only the root is known up front, every piece arrives with the proof linking it to the root
+    shared_ptr<MerkleTree> merkleTree = make_shared<MerkleTree>(numPieces, merkleRoot);
+    vector<bool> isJournaled(numPieces, false);
+    if (resumedJournal) {
+        const FileInfo& info = resumedJournal->info();
+        if (info.m_fileSize != fileSize || info.m_pieceSize != pieceSize || resumedJournal->merkleTree()->root() != merkleRoot) {
+            resumedJournal->remove();
+            throw string("File has changed in the group since its download started!!");
+        }
+        merkleTree = resumedJournal->merkleTree();
+        for (int pieceNumber : resumedJournal->giveJournaledPieces()) isJournaled[pieceNumber] = true;
+    }
+    string ownIpPort = m_seederIp + ":" + to_string(m_seederPort);
+
+    //: Ask every seeder which pieces of the file it holds
+    unordered_map<int, vector<string>> pieceToSeeders;
+    for (auto& seederIpPort : seeders) {
+        if (seederIpPort == ownIpPort) continue;
+
+        try {
+            //: The connection goes back to the pool warm, the download workers pick it up right after
+            unique_ptr<PeerConnection> connection = m_peerPool.acquire(seederIpPort);
+            auto requestTime = chrono::steady_clock::now();
+            string pieceInfo = sendSeeder(connection->socket(), "give_piece_info " + fileName + " " + groupName);
+            m_peerStats.recordRtt(seederIpPort, chrono::duration<double>(chrono::steady_clock::now() - requestTime).count());
+
+            for (int pieceNumber : Bitfield::giveSetBits(pieceInfo, numPieces)) {
+                pieceToSeeders[pieceNumber].push_back(seederIpPort);
+            }
+        } catch (const string& e) {
+            m_peerStats.recordError(seederIpPort);
+            m_logger.log("ERROR", "Fetching piece info from " + seederIpPort + "!! Error: " + e);
+        }
+    }
+
+    //: Ensure that every piece is held by at least one reachable seeder, or was written before
+    for (int pieceNumber = 0; pieceNumber < numPieces; pieceNumber++) {
+        if (!isJournaled[pieceNumber] && !pieceToSeeders.count(pieceNumber)) {
+            throw string("File is not completely available among active peers as of now!!");
+        }
+    }
+
+    {
+        lock_guard<mutex> guard(m_downloadFileMutex);
+        m_downloadFailFiles.erase({groupName, fileName});
+        m_downloadedFiles.erase({groupName, fileName});
+        m_downloadingFiles.insert({groupName, fileName});
+    }
+
+    string journalPath = Journal::giveJournalPath(m_journalDir, groupName, fileName);
+    thread t(&Leecher::downloadFileThread, this, fileName, groupName, destinationPath, fileSize, pieceSize, merkleTree, pieceToSeeders, responseTokens[2], journalPath, resumedJournal, priority);
+    t.detach();
+
+    cout << string(GREEN) + "Download of " + fileName + (resumedJournal ? " resumed!!\n" : " started!!\n") + string(RESET) << flush;
+}
+
+/**
+ * @brief Downloads all pieces of a file from multiple seeders in parallel.
+ * 
+ * Every seeder gets one or more workers on a thread pool. Each worker keeps a
+ * connection to its seeder open and asks a shared PieceScheduler for the rarest
+ * piece that seeder holds, so different pieces are fetched from different peers at
+ * the same time. Every piece is verified against the Merkle root and written directly at its
+ * offset in the destination file. Pieces that fail are retried with any seeder holding them.
+ * Written pieces are recorded in the journal of the download. A resumed download first reads
+ * back the pieces in its old journal and fetches only those missing or not matching.
+ * 
+ * @param fileName The name of the file to download.
+ * @param groupName The name of the group.
+ * @param destinationPath The path to save the downloaded file.
+ * @param fileSize The size of the file.
+ * @param pieceSize The piece size the file is split into.
+ * @param merkleTree Merkle tree of the file, knowing its root.
+ * @param pieceToSeeders Mapping from piece index to seeders.
+ * @param fileSHA SHA of the entire file, in hexadecimal.
+ * @param journalPath Path of the journal of the download.
+ * @param resumedJournal Journal of an earlier download of the file to resume, null to start afresh.
+ * @param priority Priority weight of the download, one of the DOWNLOAD_PRIORITY_* values.
+ * 
+ * @return void
+ */
+void Leecher::downloadFileThread(string fileName, string groupName, string destinationPath, long long fileSize, int pieceSize, shared_ptr<MerkleTree> merkleTree, unordered_map<int, vector<string>> pieceToSeeders, string fileSHA, string journalPath, shared_ptr<Journal> resumedJournal, int priority) {
+    int numPieces = (int)merkleTree->numLeaves();
+    bool isDownloaded = false;
+    int downloadId = m_downloadScheduler.addDownload(priority);
+
+    try {
+        int fileFd = open(destinationPath.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fileFd < 0) {
+            throw string("Opening destination file " + destinationPath + "!!\nError: " + string(strerror(errno)));
+        }
+        if (ftruncate(fileFd, fileSize) < 0) {
+            close(fileFd);
+            throw string("Resizing destination file " + destinationPath + "!!\nError: " + string(strerror(errno)));
+        }
+
+        //: Pieces become available to other leechers as soon as they are written
+        Files::addFilepath(fileName, groupName, destinationPath, pieceSize, merkleTree);
+
+        //: A path already shared with the same content keeps its tree, proofs of new pieces must go there
+        merkleTree = Files::giveMerkleTree(destinationPath);
+
+        FileInfo info{groupName, fileName, destinationPath, fileSize, pieceSize, fileSHA};
+        shared_ptr<Journal> journal = make_shared<Journal>(journalPath, info, merkleTree, resumedJournal ? resumedJournal->givePieceBytes() : "");
+        {
+            lock_guard<mutex> guard(m_downloadFileMutex);
+            m_journals[{groupName, fileName}] = journal;
+        }
+
+        //: Build the rarity index from the "give_piece_info" replies
+        unordered_map<string, vector<int>> seederToPieces;
+        for (auto& it : pieceToSeeders) {
+            for (auto& seederIpPort : it.second) {
+                seederToPieces[seederIpPort].push_back(it.first);
+            }
+        }
+
+        PieceScheduler scheduler(numPieces);
+
+        //: Pieces written before a restart are read back and checked against their leaves instead of being fetched again
+        if (resumedJournal) verifyJournaledPieces(journal, &scheduler);
+
+        int workersPerSeeder = min(MAX_CONNECTIONS_PER_PEER, max(1, POOL_SIZE / max(1, (int)seederToPieces.size())));
+
+        //: An empty file has no pieces to fetch
+        isDownloaded = scheduler.isComplete();
+
+        for (int attempt = 0; attempt < MAX_PIECE_ATTEMPTS && !isDownloaded; attempt++) {
+            //: Seeders that started sharing the file meanwhile join with no pieces, their workers ask them with "give_piece_info"
+            {
+                lock_guard<mutex> guard(m_downloadFileMutex);
+                auto it = m_joinedSeeders.find({groupName, fileName});
+                if (it != m_joinedSeeders.end()) {
+                    for (const string& seederIpPort : it->second) seederToPieces[seederIpPort];
+                    m_joinedSeeders.erase(it);
+                }
+            }
+
+            //: Seeders that were unreachable in the previous round get another chance
+            for (auto& it : seederToPieces) {
+                scheduler.updateSeederPieces(it.first, it.second);
+            }
+
+            {
+                ThreadPool pool(POOL_SIZE, "download");
+                for (auto& it : seederToPieces) {
+                    for (int i = 0; i < workersPerSeeder; i++) {
+                        string seederIpPort = it.first;
+                        pool.enqueueTask([this, seederIpPort, fileName, groupName, fileFd, destinationPath, pieceSize, merkleTree, &scheduler, journal, downloadId] {
+                            downloadFromSeeder(seederIpPort, fileName, groupName, fileFd, destinationPath, pieceSize, *merkleTree, scheduler, *journal, downloadId);
+                        });
+                    }
+                }
+                pool.wait();
+            }
+
+            //: Stop when every piece is completed or when a piece cannot be downloaded anymore
+            if (scheduler.isComplete()) {
+                isDownloaded = true;
+                break;
+            }
+            if (scheduler.hasFailed()) break;
+        }
+
+        close(fileFd);
+        journal->sync();
+    } catch (const string& e) {
+        m_logger.log("ERROR", "Downloading " + fileName + " of group " + groupName + "!! Error: " + e);
+    }
+    m_downloadScheduler.removeDownload(downloadId);
+
+    //: Pieces of a failed download stay shared, the tracker lists this client by what it holds
+    flushAnnouncements(groupName, fileName);
+
+    {
+        lock_guard<mutex> guard(m_downloadFileMutex);
+        m_downloadingFiles.erase({groupName, fileName});
+        m_joinedSeeders.erase({groupName, fileName});
+        if (isDownloaded) m_downloadedFiles.insert({groupName, fileName});
+        else m_downloadFailFiles.insert({groupName, fileName});
+    }
+
+    if (isDownloaded) {
+        m_logger.log("SUCCESS", "Downloaded " + fileName + " of group " + groupName + " at " + destinationPath);
+        cout << string(GREEN) + "\nDownload of " + fileName + " completed!!\n" + string(RESET) + ">> " << flush;
+    } else {
+        m_logger.log("ERROR", "Download of " + fileName + " of group " + groupName + " failed!!");
+        cout << string(RED) + "\nDownload of " + fileName + " failed!!\n" + string(RESET) + ">> " << flush;
+    }
+}
+
+/**
+ * @brief Downloads pieces from a single seeder over one persistent connection.
+ * 
+ * The connection is leased from the peer connection pool and given back once done.
+ * Keeps up to PIPELINE_WINDOW pieces claimed from the scheduler requested with
+ * "give_piece" back-to-back, so the round trip of one piece overlaps the transfer of
+ * the others. The window is scaled to the measured throughput of the seeder, and a
+ * choked seeder is only asked for pieces no unchoked seeder holds, waiting for an
+ * optimistic unchoke while it has none of those. Every request takes a slot of the
+ * download scheduler, which shares the requests in flight between all downloads. The
+ * seeder answers in request order and tags every reply with its piece number,
+ * followed by the Merkle proof of the piece. Each piece is verified against the
+ * Merkle root using that proof and written at its offset in the destination file. A
+ * failed piece is released back so that any worker can retry it. When the scheduler
+ * has nothing left for this seeder, its piece list is refreshed once with
+ * "give_piece_info" since the seeder may be downloading the same file.
+ * 
+ * @param seederIpPort IP:Port of the seeder to download from.
+ * @param fileName The name of the file to download.
+ * @param groupName The name of the group.
+ * @param fileFd File descriptor of the destination file, opened for writing.
+ * @param destinationPath The path of the destination file.
+ * @param pieceSize The piece size the file is split into.
+ * @param merkleTree Merkle tree of the file, every piece is verified against it.
+ * @param scheduler Scheduler deciding which pieces to request, shared by all workers of this download.
+ * @param journal Journal every written piece is recorded in.
+ * @param downloadId Id of the download in the download scheduler.
+ * 
+ * @return void
+ * 
+ * @throws string If the seeder could not be reached.
+ */
+void Leecher::downloadFromSeeder(string seederIpPort, string fileName, string groupName, int fileFd, string destinationPath, int pieceSize, MerkleTree& merkleTree, PieceScheduler& scheduler, Journal& journal, int downloadId) {
+    //: Connections are shared with other downloads from the same seeder and outlive this one
+    unique_ptr<PeerConnection> connection;
+    try {
+        connection = m_peerPool.acquire(seederIpPort);
+    } catch (const string& e) {
+        m_peerStats.recordError(seederIpPort);
+        scheduler.removeSeeder(seederIpPort);
+        throw;
+    }
+    ClientSocket& seederSocket = connection->socket();
+
+    //: Pieces are received straight into this buffer, it is reused for every piece
+    vector<char> pieceBuffer(pieceSize);
+    size_t proofLength = merkleTree.proofLength();
+
+    //: Pieces requested on this connection whose replies have not been received yet, in request order
+    deque<int> requestedPieces;
+
+    //: Time the connection started on the piece received next, and the piece whose reply measures the round trip
+    auto transferStart = chrono::steady_clock::now();
+    int rttPiece = -1;
+
+    bool isPieceInfoFresh = true;
+    bool isConnectionAlive = true;
+    bool wasChoked = false;
+    while (true) {
+        bool isChoked = m_peerStats.isChoked(seederIpPort);
+        if (isChoked != wasChoked) {
+            m_logger.log("INFO", string(isChoked ? "Choked " : "Unchoked ") + seederIpPort + " for " + fileName);
+            wasChoked = isChoked;
+        }
+        scheduler.setSeederChoked(seederIpPort, isChoked);
+
+        try {
+            size_t window = m_peerStats.giveWindow(seederIpPort, pieceSize);
+            while (requestedPieces.size() < window) {
+                //: Every request holds a slot of the download scheduler until its reply is read
+                if (!m_downloadScheduler.acquireRequest(downloadId, seederIpPort, requestedPieces.empty())) break;
+                int nextPiece = scheduler.claimPiece(seederIpPort);
+                if (nextPiece == -1) {
+                    m_downloadScheduler.releaseRequest(downloadId, seederIpPort);
+                    break;
+                }
+
+                //: A request to an idle connection is not queued behind others, its reply measures the round trip
+                if (requestedPieces.empty()) {
+                    transferStart = chrono::steady_clock::now();
+                    rttPiece = nextPiece;
+                }
+                requestedPieces.push_back(nextPiece);
+                seederSocket.sendSocket("give_piece " + fileName + " " + groupName + " " + to_string(nextPiece));
+            }
+        } catch (const string& e) {
+            m_logger.log("ERROR", "Requesting pieces of " + fileName + " from " + seederIpPort + "!! Error: " + e);
+            isConnectionAlive = false;
+            break;
+        }
+
+        if (requestedPieces.empty()) {
+            //: A choked seeder stays around while it holds pieces that may still be needed from it
+            if (isChoked && scheduler.holdsRemainingPieces(seederIpPort)) {
+                this_thread::sleep_for(chrono::milliseconds(CHOKED_RECHECK_INTERVAL));
+                continue;
+            }
+
+            //: Seeder may have downloaded more pieces meanwhile, refresh its pieces once before giving up
+            if (isPieceInfoFresh) break;
+            isPieceInfoFresh = true;
+
+            vector<int> pieces;
+            try {
+                pieces = Bitfield::giveSetBits(sendSeeder(seederSocket, "give_piece_info " + fileName + " " + groupName), merkleTree.numLeaves());
+            } catch (const string& e) {
+                m_logger.log("ERROR", "Refreshing piece info from " + seederIpPort + "!! Error: " + e);
+                break;
+            }
+            if (scheduler.updateSeederPieces(seederIpPort, pieces) == 0) break;
+            continue;
+        }
+
+        int pieceNumber = requestedPieces.front();
+        requestedPieces.pop_front();
+        m_downloadScheduler.releaseRequest(downloadId, seederIpPort);
+
+        try {
+            FrameHeader header;
+            string error;
+            string proof;
+            try {
+                header = seederSocket.recvHeader();
+                if (pieceNumber == rttPiece) {
+                    m_peerStats.recordRtt(seederIpPort, chrono::duration<double>(chrono::steady_clock::now() - transferStart).count());
+                    rttPiece = -1;
+                }
+
+                uint32_t repliedPiece;
+                if (header.m_opcode != OPCODE_PIECE || header.m_length < sizeof(repliedPiece)) {
+                    throw string("Malformed reply to give_piece!!");
+                }
+                seederSocket.recvPayload((char*)&repliedPiece, sizeof(repliedPiece));
+                if ((int)ntohl(repliedPiece) != pieceNumber) {
+                    throw string("Reply for piece " + to_string(ntohl(repliedPiece)) + " while expecting piece " + to_string(pieceNumber) + "!!");
+                }
+                header.m_length -= sizeof(repliedPiece);
+
+                if (header.m_status == STATUS_ERROR || header.m_length < proofLength || header.m_length - proofLength > (uint32_t)pieceSize) {
+                    error.resize(header.m_length);
+                    seederSocket.recvPayload(&error[0], header.m_length);
+                } else {
+                    proof.resize(proofLength);
+                    seederSocket.recvPayload(&proof[0], proofLength);
+                    header.m_length -= proofLength;
+                    seederSocket.recvPayload(pieceBuffer.data(), header.m_length);
+                }
+            } catch (const string& e) {
+                //: An error response keeps the connection usable, a socket failure or a reply out of order does not
+                isConnectionAlive = false;
+                throw;
+            }
+            checkForError(header, error, OPCODE_PIECE);
+            Metrics::getInstance().addBytesReceived(seederIpPort, proof.size() + header.m_length);
+            if (proof.size() != proofLength || header.m_length > (uint32_t)pieceSize) {
+                throw string("Piece " + to_string(pieceNumber) + " does not match the piece size!!");
+            }
+            size_t pieceLength = header.m_length;
+            auto receivedTime = chrono::steady_clock::now();
+
+            //: Proof is checked before the piece is marked available, so it can be proven on to other leechers
+            if (!merkleTree.verifyPiece(pieceNumber, Utils::findPieceDigest(pieceBuffer.data(), pieceLength), proof)) {
+                Metrics::getInstance().addPieceMismatch();
+                throw string("Merkle proof mismatch of piece " + to_string(pieceNumber) + "!!");
+            }
+
+            //: Replies are back-to-back, so the time since the previous one is what this piece took
+            m_peerStats.recordPiece(seederIpPort, pieceLength, chrono::duration<double>(receivedTime - transferStart).count());
+            transferStart = receivedTime;
+
+            //: In endgame mode another seeder may have delivered this piece already
+            if (!scheduler.isPieceCompleted(pieceNumber)) {
+                if (pwrite(fileFd, pieceBuffer.data(), pieceLength, (off_t)pieceNumber * pieceSize) != (ssize_t)pieceLength) {
+                    throw string("Writing piece " + to_string(pieceNumber) + " to " + destinationPath + "!!\nError: " + string(strerror(errno)));
+                }
+            }
+
+            if (scheduler.completePiece(pieceNumber, seederIpPort)) {
+                Files::addPieceToFilepath(destinationPath, pieceNumber);
+                announcePieces(groupName, fileName, {pieceNumber});
+
+                //: A journal that can not be written only costs the piece being fetched again after a restart
+                try {
+                    journal.markPiece(pieceNumber);
+                } catch (const string& e) {
+                    m_logger.log("ERROR", "Journaling piece " + to_string(pieceNumber) + " of " + fileName + "!! Error: " + e);
+                }
+            }
+            isPieceInfoFresh = false;
+        } catch (const string& e) {
+            m_logger.log("ERROR", "Piece " + to_string(pieceNumber) + " of " + fileName + " from " + seederIpPort + "!! Error: " + e);
+            m_peerStats.recordError(seederIpPort);
+            transferStart = chrono::steady_clock::now();
+
+            //: Release the piece so that it can be retried from any seeder holding it
+            scheduler.releasePiece(pieceNumber, seederIpPort);
+
+            if (!isConnectionAlive) break;
+        }
+    }
+
+    //: Connection is lost, pieces still requested on it go back to the scheduler
+    if (!isConnectionAlive) {
+        connection->markBroken();
+        for (int pieceNumber : requestedPieces) {
+            scheduler.releasePiece(pieceNumber, seederIpPort);
+            m_downloadScheduler.releaseRequest(downloadId, seederIpPort);
+        }
+        scheduler.removeSeeder(seederIpPort);
+    }
 }
 
 /**
- * @brief Shows all currently downloaded files and sends the show downloads command.
+ * @brief Shows all downloads of the current session.
+ * 
+ * Prints "[D]" for files being downloaded, "[C]" for completed downloads and
+ * "[F]" for failed downloads, along with the group and file name.
  * 
  * @param tokens Command tokens.
  * @param inputFromClient The input command string from the user.
@@ -367,9 +1111,18 @@ void Leecher::downloadFile(vector<string> tokens, string inputFromClient) {
  * @return void
  */
 void Leecher::showDownloads(vector<string> tokens, string inputFromClient) {
-    string messageForTracker = inputFromClient + " " + m_authToken;
-    string response = sendTracker(messageForTracker);
-    printResponse(tokens, response);
+    if (tokens.size() != 1) throw string("Invalid arguments to show_downloads command!!");
+
+    lock_guard<mutex> guard(m_downloadFileMutex);
+    if (m_downloadingFiles.empty() && m_downloadedFiles.empty() && m_downloadFailFiles.empty()) {
+        cout << string(YELLOW) + "There are no downloads in this session!!\n" + string(RESET) << flush;
+        return;
+    }
+
+    for (auto& it : m_downloadingFiles) cout << "[D] [" + it.first + "] " + it.second + "\n";
+    for (auto& it : m_downloadedFiles) cout << string(GREEN) + "[C] [" + it.first + "] " + it.second + "\n" + string(RESET);
+    for (auto& it : m_downloadFailFiles) cout << string(RED) + "[F] [" + it.first + "] " + it.second + "\n" + string(RESET);
+    cout << flush;
 }
 
 /**
@@ -383,7 +1136,27 @@ void Leecher::showDownloads(vector<string> tokens, string inputFromClient) {
 void Leecher::logout(vector<string> tokens, string inputFromClient) {
     string messageForTracker = inputFromClient + " " + m_authToken;
     string response = sendTracker(messageForTracker);
-    m_authToken = "NULL";
+    {
+        lock_guard<mutex> guard(m_trackerMutex);
+        m_authToken = "NULL";
+    }
+
+    //: Subscriptions belong to the session, the tracker dropped them already
+    closeNotifications();
+
+    //: Only cached descriptors and idle peer connections are dropped, the seeder keeps serving and reopens shared files on demand
+    Files::closeAllFileHandles();
+    m_peerPool.closeIdle();
+
+    //: Journals stay on disk for the next login, only downloads still running keep writing theirs
+    {
+        lock_guard<mutex> guard(m_downloadFileMutex);
+        for (auto it = m_journals.begin(); it != m_journals.end();) {
+            it->second->sync();
+            if (m_downloadingFiles.count(it->first)) it++;
+            else it = m_journals.erase(it);
+        }
+    }
     printResponse(tokens, response);
 }
 
@@ -398,5 +1171,533 @@ void Leecher::logout(vector<string> tokens, string inputFromClient) {
 void Leecher::stopShare(vector<string> tokens, string inputFromClient) {
     string messageForTracker = inputFromClient + " " + m_authToken;
     string response = sendTracker(messageForTracker);
+    if (tokens.size() == 3) forgetShare(tokens[1], tokens[2]);
     printResponse(tokens, response);
 }
+
+/**
+ * @brief Stops serving a file locally and drops its journal.
+ * 
+ * @param groupName The group of the file.
+ * @param fileName The name of the file.
+ * 
+ * @return void
+ */
+void Leecher::forgetShare(string groupName, string fileName) {
+    //: Stop serving the file locally as well and release its open descriptor
+    Files::removeFilepath(fileName, groupName);
+
+    //: A file no longer shared is not shared again on the next login
+    lock_guard<mutex> guard(m_downloadFileMutex);
+    auto it = m_journals.find({groupName, fileName});
+    if (it != m_journals.end()) {
+        it->second->remove();
+        m_journals.erase(it);
+    } else {
+        unlink(Journal::giveJournalPath(m_journalDir, groupName, fileName).c_str());
+    }
+}
+
+/**
+ * @brief Runs the commands of a script file and sends them to the tracker in batches.
+ * 
+ * Each line of the script is one command. The commands are sent MAX_BATCH_COMMANDS at
+ * a time in a single frame, which the tracker runs in order, so that a script of many
+ * group commands costs one round trip instead of one per command. A failed command does
+ * not stop the ones after it.
+ * 
+ * @param tokens Command tokens.
+ * @param inputFromClient The input command string from the user.
+ * 
+ * @return void
+ */
+void Leecher::batch(vector<string> tokens, string inputFromClient) {
+    if (tokens.size() != 2) throw string("Invalid arguments to batch command!! Usage: batch <script_path>");
+
+    ifstream script(tokens[1]);
+    if (!script) throw string("Can not open script " + tokens[1] + "!!");
+
+    //: Only commands answered by the tracker alone can be batched
+    static const set<string> batchable = {"create_group", "join_group", "leave_group", "list_requests", "accept_request", "list_groups", "list_files", "upload_file", "stop_share"};
+
+    vector<string> lines;
+    string line;
+    while (getline(script, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (!Utils::tokenize(line, ' ').empty()) lines.push_back(line);
+    }
+
+    for (size_t first = 0; first < lines.size(); first += MAX_BATCH_COMMANDS) {
+        size_t last = min(lines.size(), first + MAX_BATCH_COMMANDS);
+
+        //: Lines refused locally are reported in place, the others are sent together
+        vector<string> errors(last - first);
+        vector<PendingUpload> uploads(last - first);
+        vector<size_t> sentLines;
+        vector<string> messagesForTracker;
+        for (size_t i = first; i < last; i++) {
+            vector<string> lineTokens = Utils::tokenize(lines[i], ' ');
+            try {
+                if (!batchable.count(lineTokens[0])) throw string("Command " + lineTokens[0] + " can not be batched!!");
+                if (lineTokens[0] == "upload_file") {
+                    uploads[i - first] = prepareUpload(lineTokens);
+                    messagesForTracker.push_back(uploads[i - first].m_messageForTracker);
+                } else {
+                    messagesForTracker.push_back(lines[i] + " " + m_authToken);
+                }
+                sentLines.push_back(i);
+            } catch (const string& e) {
+                errors[i - first] = e;
+            }
+        }
+
+        vector<pair<uint8_t, string>> replies;
+        if (!messagesForTracker.empty()) replies = sendTrackerBatch(messagesForTracker);
+
+        size_t nextReply = 0;
+        for (size_t i = first; i < last; i++) {
+            cout << ">> " + lines[i] + "\n" << flush;
+            if (nextReply < sentLines.size() && sentLines[nextReply] == i) {
+                pair<uint8_t, string>& reply = replies[nextReply++];
+                if (reply.first != STATUS_SUCCESS) {
+                    errors[i - first] = reply.second;
+                } else {
+                    vector<string> lineTokens = Utils::tokenize(lines[i], ' ');
+                    try {
+                        if (lineTokens[0] == "upload_file") finishUpload(uploads[i - first]);
+                        if (lineTokens[0] == "stop_share" && lineTokens.size() == 3) forgetShare(lineTokens[1], lineTokens[2]);
+                    } catch (const string& e) {
+                        errors[i - first] = e;
+                    }
+                    if (errors[i - first].empty()) printResponse(lineTokens, reply.second);
+                }
+            }
+            if (!errors[i - first].empty()) cout << string(RED) + "Error: " + errors[i - first] + "\n" + string(RESET) << flush;
+        }
+    }
+}
+
+/**
+ * @brief Prints the metrics of this client, or with "stats tracker" the ones of the tracker.
+ * 
+ * Shows the time commands took, bytes served to every leecher and received from every
+ * seeder, pieces that failed their Merkle proof, thread pools, seeder connections and
+ * waits for contended locks of the Files registry, see Metrics.
+ * 
+ * @param tokens Command tokens.
+ * @param inputFromClient The input command string from the user.
+ * 
+ * @return void
+ */
+void Leecher::stats(vector<string> tokens, string inputFromClient) {
+    if (tokens.size() > 2 || (tokens.size() == 2 && tokens[1] != "tracker")) {
+        throw string("Invalid arguments to stats command!! Usage: stats [tracker]");
+    }
+
+    string response = tokens.size() == 2 ? sendTracker("stats") : Metrics::getInstance().describe();
+    cout << response << flush;
+}
+
+/**
+ * @brief Subscribes to or unsubscribes from the changes of a group or of one of its files.
+ * 
+ * Subscriptions live on a second connection to the tracker, on which the tracker pushes
+ * a notification whenever a file is added or removed or a peer starts or stops sharing
+ * a file, so the group does not have to be polled with "list_files".
+ * 
+ * @param tokens Command tokens.
+ * @param inputFromClient The input command string from the user.
+ * 
+ * @return void
+ */
+void Leecher::subscribe(vector<string> tokens, string inputFromClient) {
+    if (tokens.size() != 2 && tokens.size() != 3) throw string("Invalid arguments to " + tokens[0] + " command!! Usage: " + tokens[0] + " <group_id> [file_name]");
+    string messageForTracker = inputFromClient + " " + m_authToken;
+    string response = sendSubscription(messageForTracker);
+    {
+        lock_guard<mutex> guard(m_notifyMutex);
+        m_subscriptions.push_back(messageForTracker);
+    }
+    printResponse(tokens, response);
+}
+
+/**
+ * @brief Sends a subscription command on the notification connection, opening it first if needed.
+ * 
+ * The connection is read by listenNotifications(), which hands responses back here and
+ * handles notifications itself.
+ * 
+ * @param messageForTracker The command to be sent to the tracker.
+ * 
+ * @return string The response of the tracker.
+ * 
+ * @throws string If the tracker can not be reached or responds with an error.
+ */
+string Leecher::sendSubscription(string messageForTracker) {
+    lock_guard<mutex> commandGuard(m_subscribeMutex);
+
+    shared_ptr<ClientSocket> notifySocket;
+    {
+        lock_guard<mutex> guard(m_notifyMutex);
+        notifySocket = m_notifySocket;
+    }
+    if (!notifySocket) {
+        //: Any tracker notifies of all changes, each applies every change
+        string lastError = "";
+        for (size_t i = 0; i < m_trackers.size() && !notifySocket; i++) {
+            TrackerLink& link = *m_trackers[(m_homeTracker + i) % m_trackers.size()];
+            try {
+                notifySocket = openTrackerSocket(link.m_trackerIp, link.m_trackerPort);
+            } catch (const string& e) {
+                lastError = e;
+            }
+        }
+        if (!notifySocket) throw string("No tracker can be reached!! " + lastError);
+        {
+            lock_guard<mutex> guard(m_notifyMutex);
+            m_notifySocket = notifySocket;
+            m_notifyReplies.clear();
+        }
+        thread listener(&Leecher::listenNotifications, this, notifySocket);
+        listener.detach();
+    }
+
+    m_logger.log("COMMAND", "Sending to tracker : " + messageForTracker);
+    notifySocket->sendSocket(messageForTracker);
+
+    unique_lock<mutex> guard(m_notifyMutex);
+    m_notifyReplied.wait(guard, [this, &notifySocket] { return !m_notifyReplies.empty() || m_notifySocket != notifySocket; });
+    if (m_notifyReplies.empty()) throw string("Notification connection to tracker lost!!");
+    pair<FrameHeader, string> reply = move(m_notifyReplies.front());
+    m_notifyReplies.pop_front();
+    guard.unlock();
+
+    m_logger.log("COMMAND", "Received from tracker : " + reply.second);
+    checkForError(reply.first, reply.second);
+    return reply.second;
+}
+
+/**
+ * @brief Receives the frames of a notification connection until it is closed, run on its own thread.
+ * 
+ * @param notifySocket The notification connection.
+ * 
+ * @return void
+ */
+void Leecher::listenNotifications(shared_ptr<ClientSocket> notifySocket) {
+    while (true) {
+        FrameHeader header;
+        string payload;
+        try {
+            payload = notifySocket->recvSocket(header);
+        } catch (const string& e) {
+            //: Subscriptions are gone with the connection, they are taken up by the next tracker that can be reached
+            vector<string> subscriptions;
+            {
+                lock_guard<mutex> guard(m_notifyMutex);
+                if (m_notifySocket == notifySocket) m_notifySocket = nullptr;
+                subscriptions = m_subscriptions;
+            }
+            m_notifyReplied.notify_all();
+            m_logger.log("INFO", "Notification connection to tracker closed!! " + e);
+            if (!subscriptions.empty()) resubscribe(subscriptions);
+            return;
+        }
+
+        if (header.m_opcode == OPCODE_NOTIFY) {
+            handleNotification(payload);
+            continue;
+        }
+        {
+            lock_guard<mutex> guard(m_notifyMutex);
+            m_notifyReplies.push_back({header, move(payload)});
+        }
+        m_notifyReplied.notify_all();
+    }
+}
+
+/**
+ * @brief Sends the subscriptions of the session again on a new notification connection.
+ * 
+ * Runs on the thread of the notification connection that was lost, once it is not read
+ * anymore. Unsubscriptions are sent again as well, so the subscriptions end up the same.
+ * 
+ * @param subscriptions The subscription commands, in the order they were sent.
+ * 
+ * @return void
+ */
+void Leecher::resubscribe(vector<string> subscriptions) {
+    for (string& it : subscriptions) {
+        try {
+            sendSubscription(it);
+        } catch (const string& e) {
+            m_logger.log("ERROR", "Sending subscription again!! Error: " + e);
+
+            //: No tracker can be reached, the notifications are gone until the next subscription
+            if (e.rfind("No tracker can be reached!!", 0) == 0) return;
+        }
+    }
+    m_logger.log("SUCCESS", "Subscriptions taken up by another tracker!!");
+}
+
+/**
+ * @brief Shows a notification and hands new seeders to the download of the file.
+ * 
+ * @param notification "Event GroupName FileName [IP:Port]", the event being file_added, file_removed, peer_joined or peer_left.
+ * 
+ * @return void
+ */
+void Leecher::handleNotification(string notification) {
+    m_logger.log("INFO", "Notification from tracker : " + notification);
+
+    vector<string> tokens = Utils::tokenize(notification, ' ');
+    if (tokens.size() < 3) return;
+    string event = tokens[0], groupName = tokens[1], fileName = tokens[2];
+    string seederIpPort = (tokens.size() > 3) ? tokens[3] : "";
+
+    //: Pieces announced by this client come back as its own peer_joined
+    if (seederIpPort == m_seederIp + ":" + to_string(m_seederPort)) return;
+
+    string text;
+    if (event == "file_added") text = "File " + fileName + " added to group " + groupName + " by " + seederIpPort;
+    else if (event == "file_removed") text = "File " + fileName + " removed from group " + groupName;
+    else if (event == "peer_joined") text = seederIpPort + " started sharing " + fileName + " of group " + groupName;
+    else if (event == "peer_left") text = seederIpPort + " stopped sharing " + fileName + " of group " + groupName;
+    else return;
+    cout << string(YELLOW) + "\n" + text + "!!\n" + string(RESET) + ">> " << flush;
+
+    //: A running download picks the seeder up in its next round
+    if (seederIpPort == "") return;
+    lock_guard<mutex> guard(m_downloadFileMutex);
+    if (event == "peer_left") {
+        auto it = m_joinedSeeders.find({groupName, fileName});
+        if (it != m_joinedSeeders.end()) it->second.erase(seederIpPort);
+    } else if (m_downloadingFiles.count({groupName, fileName})) {
+        m_joinedSeeders[{groupName, fileName}].insert(seederIpPort);
+    }
+}
+
+/**
+ * @brief Closes the notification connection, the tracker drops its subscriptions with it.
+ * 
+ * @return void
+ */
+void Leecher::closeNotifications() {
+    lock_guard<mutex> guard(m_notifyMutex);
+    m_subscriptions.clear();
+    if (m_notifySocket) m_notifySocket->shutdownSocket();
+}
+
+/**
+ * @brief Shares the files and resumes the downloads recorded in the journals of the logged in user.
+ * 
+ * A complete file is announced to the tracker with "upload_file" again and its pieces are
+ * read back and checked against their leaves in the background, each piece being served
+ * as soon as it is checked. An incomplete file is downloaded again with startDownload(),
+ * which checks the pieces already written before fetching the missing ones. Journals of
+ * files that are gone or changed are deleted.
+ * 
+ * @return void
+ */
+void Leecher::resumeJournals() {
+    for (string journalPath : Journal::listJournals(m_journalDir)) {
+        shared_ptr<Journal> journal;
+        try {
+            journal = Journal::load(journalPath);
+        } catch (const string& e) {
+            m_logger.log("ERROR", "Loading journal " + journalPath + "!! Error: " + e);
+            unlink(journalPath.c_str());
+            continue;
+        }
+        const FileInfo& info = journal->info();
+
+        {
+            lock_guard<mutex> guard(m_downloadFileMutex);
+            if (m_downloadingFiles.count({info.m_groupName, info.m_fileName})) continue;
+        }
+
+        struct stat fileInfo;
+        if (stat(info.m_filePath.c_str(), &fileInfo) != 0 || fileInfo.st_size != info.m_fileSize) {
+            m_logger.log("ERROR", "File " + info.m_filePath + " of journal " + journalPath + " is missing or changed!!");
+            journal->remove();
+            continue;
+        }
+
+        try {
+            if (!journal->isComplete()) {
+                startDownload(info.m_groupName, info.m_fileName, info.m_filePath, journal, DOWNLOAD_PRIORITY_NORMAL);
+                continue;
+            }
+
+            string merkleRoot = journal->merkleTree()->root();
+            string joinedSHAs = info.m_fileSHA + ":" + Utils::toHex((const unsigned char*)merkleRoot.data(), merkleRoot.size());
+            sendTracker("upload_file " + info.m_fileName + " " + info.m_groupName + " " + to_string(info.m_fileSize) + " " + to_string(info.m_pieceSize) + " " + joinedSHAs + " " + m_authToken);
+
+            Files::addFilepath(info.m_fileName, info.m_groupName, info.m_filePath, info.m_pieceSize, journal->merkleTree());
+            {
+                lock_guard<mutex> guard(m_downloadFileMutex);
+                m_journals[{info.m_groupName, info.m_fileName}] = journal;
+            }
+
+            thread t(&Leecher::verifyJournaledPieces, this, journal, nullptr);
+            t.detach();
+            cout << string(GREEN) + "Sharing of " + info.m_fileName + " in group " + info.m_groupName + " resumed!!\n" + string(RESET) << flush;
+        } catch (const string& e) {
+            m_logger.log("ERROR", "Resuming " + info.m_fileName + " of group " + info.m_groupName + "!! Error: " + e);
+            cout << string(RED) + "Resuming " + info.m_fileName + " of group " + info.m_groupName + " failed!! Error: " + e + "\n" + string(RESET) << flush;
+        }
+    }
+}
+
+/**
+ * @brief Checks the pieces recorded in a journal against the data on disk and makes the matching ones available.
+ * 
+ * Pieces are read back and hashed on a thread pool. A piece matching its leaf in the Merkle tree
+ * is marked available, and completed in the scheduler when given. A piece that does not match is
+ * removed from the journal, so it is fetched again.
+ * 
+ * @param journal The journal of the file.
+ * @param scheduler Scheduler of the download the pieces are completed in, null if the file is not being downloaded.
+ * 
+ * @return void
+ */
+void Leecher::verifyJournaledPieces(shared_ptr<Journal> journal, PieceScheduler* scheduler) {
+    const FileInfo& info = journal->info();
+    shared_ptr<MerkleTree> merkleTree = journal->merkleTree();
+    vector<int> pieces = journal->giveJournaledPieces();
+
+    int fileFd = open(info.m_filePath.c_str(), O_RDONLY);
+    if (fileFd < 0) {
+        m_logger.log("ERROR", "Opening " + info.m_filePath + " to verify journaled pieces!!\nError: " + string(strerror(errno)));
+        for (int pieceNumber : pieces) journal->unmarkPiece(pieceNumber);
+        journal->sync();
+        return;
+    }
+
+    atomic<int> verifiedPieces{0};
+    {
+        ThreadPool& pool = Utils::giveHashPool();
+        TaskGroup verifications;
+        for (int pieceNumber : pieces) {
+            pool.enqueueTask([&info, &merkleTree, &journal, &verifiedPieces, scheduler, fileFd, pieceNumber] {
+                off_t offset = (off_t)pieceNumber * info.m_pieceSize;
+                size_t pieceLength = min((long long)info.m_pieceSize, info.m_fileSize - offset);
+                vector<char> pieceBuffer(pieceLength);
+
+                bool isValid = pread(fileFd, pieceBuffer.data(), pieceLength, offset) == (ssize_t)pieceLength
+                    && merkleTree->matchesLeaf(pieceNumber, Utils::findPieceDigest(pieceBuffer.data(), pieceLength));
+                if (!isValid) {
+                    journal->unmarkPiece(pieceNumber);
+                    return;
+                }
+
+                if (scheduler) scheduler->completePiece(pieceNumber, "");
+                Files::addPieceToFilepath(info.m_filePath, pieceNumber);
+                verifiedPieces++;
+            }, &verifications);
+        }
+        pool.wait(verifications);
+    }
+    close(fileFd);
+
+    //: A resumed download is listed as sharing the pieces it kept, a shared file was announced with "upload_file"
+    if (scheduler) announcePieces(info.m_groupName, info.m_fileName, journal->giveJournaledPieces());
+
+    try {
+        journal->sync();
+    } catch (const string& e) {
+        m_logger.log("ERROR", e);
+    }
+    m_logger.log("INFO", "Verified " + to_string(verifiedPieces.load()) + " of " + to_string(pieces.size()) + " journaled pieces of " + info.m_fileName + " of group " + info.m_groupName);
+}
+
+/**
+ * @brief Collects downloaded pieces and announces them to the tracker with "have" once a batch is due.
+ * 
+ * The first piece of a file is announced at once, so the tracker lists this client as a sharer
+ * while the download is still running. Later pieces are sent in batches of HAVE_BATCH_PIECES,
+ * or after HAVE_INTERVAL, instead of one message per piece.
+ * 
+ * @param groupName The name of the group.
+ * @param fileName The name of the file.
+ * @param pieces The pieces verified and written.
+ * 
+ * @return void
+ */
+void Leecher::announcePieces(string groupName, string fileName, const vector<int>& pieces) {
+    if (pieces.empty()) return;
+
+    vector<int> batch;
+    {
+        lock_guard<mutex> guard(m_haveMutex);
+        HaveBatch& pending = m_pendingHaves[{groupName, fileName}];
+        pending.m_pieces.insert(pending.m_pieces.end(), pieces.begin(), pieces.end());
+
+        auto now = chrono::steady_clock::now();
+        bool isDue = !pending.m_isAnnounced || pending.m_pieces.size() >= HAVE_BATCH_PIECES
+            || now - pending.m_lastSent >= chrono::milliseconds(HAVE_INTERVAL);
+        if (!isDue) return;
+
+        batch.swap(pending.m_pieces);
+        pending.m_isAnnounced = true;
+        pending.m_lastSent = now;
+    }
+
+    //: Sent without the lock, other downloads keep collecting meanwhile
+    sendHave(groupName, fileName, move(batch));
+}
+
+/**
+ * @brief Announces the pieces of a file still collected, e.g. once its download ends.
+ * 
+ * @param groupName The name of the group.
+ * @param fileName The name of the file.
+ * 
+ * @return void
+ */
+void Leecher::flushAnnouncements(string groupName, string fileName) {
+    vector<int> batch;
+    {
+        lock_guard<mutex> guard(m_haveMutex);
+        auto it = m_pendingHaves.find({groupName, fileName});
+        if (it == m_pendingHaves.end()) return;
+        batch.swap(it->second.m_pieces);
+        m_pendingHaves.erase(it);
+    }
+    if (!batch.empty()) sendHave(groupName, fileName, move(batch));
+}
+
+/**
+ * @brief Sends one "have" message, keeping the pieces for the next one if it fails.
+ * 
+ * @param groupName The name of the group.
+ * @param fileName The name of the file.
+ * @param pieces The pieces to announce.
+ * 
+ * @return void
+ */
+void Leecher::sendHave(string groupName, string fileName, vector<int> pieces) {
+    //: Message is "have <group> <file> PieceNumber_1,...,PieceNumber_N <token>"
+    string pieceList = "";
+    for (int pieceNumber : pieces) pieceList += (pieceList.empty() ? "" : ",") + to_string(pieceNumber);
+
+    string authToken;
+    {
+        lock_guard<mutex> guard(m_trackerMutex);
+        authToken = m_authToken;
+    }
+
+    try {
+        sendTracker("have " + groupName + " " + fileName + " " + pieceList + " " + authToken);
+    } catch (const string& e) {
+        m_logger.log("ERROR", "Announcing pieces of " + fileName + " of group " + groupName + "!! Error: " + e);
+
+        //: Pieces are still held, they go out with the next batch of the file if there is one
+        lock_guard<mutex> guard(m_haveMutex);
+        auto it = m_pendingHaves.find({groupName, fileName});
+        if (it != m_pendingHaves.end()) {
+            it->second.m_pieces.insert(it->second.m_pieces.end(), pieces.begin(), pieces.end());
+            it->second.m_isAnnounced = false;
+        }
+    }
+}
@@ -1,5 +1,7 @@
 #include "../headers.h"
 
+atomic<int> Logger::m_runtimeLevel{-1};
+
 /**
 * @brief Constructs the Logger and creates necessary directories and log file.
 * @param seederIp The IP address of the seeder.
@@ -13,66 +15,81 @@ Logger::Logger(string seederIp, int seederPort, string name)
 , m_logDirPath("./logs/" + seederIp + ":" + to_string(seederPort))
 , m_logFilePath(m_logDirPath + "/" + name + ".txt")
 {
-    // TODO : FIXME : Race condition is occuring, when this function is checking stats 
-    
-    struct stat info;
-
-    //: Create base directory if it does not exist
-    if (stat("./logs", &info) != 0 || !(info.st_mode & S_IFDIR)) {
-        if (mkdir("./logs", 0755) != 0) {
-            throw string("Making base directory for log!!");
-        }
+    //: Creating a directory that already exists is not an error, another logger may create it meanwhile
+    if (mkdir("./logs", 0755) != 0 && errno != EEXIST) {
+        throw string("Making base directory for log!!");
     }
-
-    //: Create specific directory for this seeder if it does not exist
-    if (stat(m_logDirPath.c_str(), &info) != 0 || !(info.st_mode & S_IFDIR)) {
-        if (mkdir(m_logDirPath.c_str(), 0755) != 0) {
-            throw string("Making new directory for log!!");
-        }
+    if (mkdir(m_logDirPath.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw string("Making new directory for log!!");
     }
 
-    //: Create the log file
-    int fd = open(m_logFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if(fd <= 0){
+    //: Kept open for the life of the logger, the writer appends to it in batches
+    int fd = open(m_logFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
         throw string("Opening log file!!");
     }
-    close(fd);
+    m_logFile = make_shared<LogFile>(fd);
+    LogWriter::getInstance().addFile(m_logFile);
 }
 
 /**
-* @brief Logs a message with a timestamp and type to the log file.
-* @param type The type of the log message (e.g., "ERROR", "INFO").
-* @param content The content of the log message.
-* @details The method uses a mutex to ensure thread-safe access to the log file. 
-*          A timestamp is added to each log entry. 
+* @brief Gives the level of a type of log message.
+* @param type The type of the log message (e.g., "ERROR", "INFO"), in any case.
+* @return One of the LOG_LEVEL_* values.
 */
-void Logger::log(string type, string content) {
-    {
-        if(content.empty() || content[content.size() - 1] == '\n') {
-            content.pop_back(); // Remove trailing newline if present
-        }
+int Logger::giveLevel(const string& type) {
+    if (strcasecmp(type.c_str(), "COMMAND") == 0) return LOG_LEVEL_COMMAND;
+    if (strcasecmp(type.c_str(), "SUCCESS") == 0) return LOG_LEVEL_SUCCESS;
+    if (strcasecmp(type.c_str(), "ERROR") == 0) return LOG_LEVEL_ERROR;
+    return LOG_LEVEL_INFO;
+}
 
-        time_t current_time = time(nullptr);
-        struct tm* local_time = localtime(&current_time);
-        char buffer[100];
-        strftime(buffer, sizeof(buffer), "%d/%m/%Y %H:%M:%S", local_time);
-        string time = buffer;
+/**
+* @brief Sets the lowest level logged, MIN_LOG_LEVEL still applies.
+* @param level One of the LOG_LEVEL_* values.
+*/
+void Logger::setLevel(int level) {
+    m_runtimeLevel = level;
+}
 
-        lock_guard<mutex> guard(m_logMutex);
+/**
+* @brief Checks whether messages of a type are logged, so that hot paths can skip building them.
+* @param type The type of the log message (e.g., "ERROR", "INFO").
+* @return True if messages of the type are logged.
+*/
+bool Logger::isEnabled(const string& type) {
+    int level = giveLevel(type);
+    if (level < MIN_LOG_LEVEL) return false;
 
-        int fd = open(m_logFilePath.c_str(), O_WRONLY | O_APPEND, 0644);
-        if (fd == -1) {
-            return;
-        }
+    //: Read on first use, loggers of static objects may log before main() could set it
+    int runtimeLevel = m_runtimeLevel.load(memory_order_relaxed);
+    if (runtimeLevel < 0) {
+        const char* levelName = getenv("P2P_LOG_LEVEL");
+        runtimeLevel = levelName ? giveLevel(levelName) : LOG_LEVEL_COMMAND;
+        m_runtimeLevel = runtimeLevel;
+    }
+    return level >= runtimeLevel;
+}
 
-        string temp = "\n[" + time + "][" + type + "] " + content;
+/**
+* @brief Logs a message with a timestamp and type to the log file.
+* @param type The type of the log message (e.g., "ERROR", "INFO").
+* @param content The content of the log message.
+* @details The line is queued in the ring of the calling thread and written by the LogWriter.
+*          A full ring drops the line and counts it, so logging never blocks.
+*/
+void Logger::log(string type, string content) {
+    if (!m_logFile || !isEnabled(type)) return;
 
-        int bytesWritten = write(fd, temp.c_str(), temp.size());
-        if (bytesWritten == -1) {
-            close(fd);
-            return;
-        }
+    if (!content.empty() && content.back() == '\n') {
+        content.pop_back(); // Remove trailing newline if present
+    }
+    if (content.size() > LOG_MAX_LINE_LENGTH) content.resize(LOG_MAX_LINE_LENGTH);
 
-        close(fd);
+    bool isError = giveLevel(type) == LOG_LEVEL_ERROR;
+    LogWriter& writer = LogWriter::getInstance();
+    if (!writer.giveRing().push({m_logFile, time(nullptr), move(type), move(content)})) {
+        m_logFile->m_droppedLines++;
     }
+    if (isError) writer.wakeUp();
 }
@@ -0,0 +1,194 @@
+#include "../headers.h"
+
+/**
+* @brief Constructs a tree knowing only its root.
+* @param numLeaves The number of pieces of the file.
+* @param root Raw digest of the root.
+*/
+MerkleTree::MerkleTree(size_t numLeaves, const string& root)
+: m_numLeaves(numLeaves)
+, m_firstLeaf(1)
+{
+    while (m_firstLeaf < m_numLeaves) m_firstLeaf *= 2;
+    m_nodes.assign(2 * m_firstLeaf * SHA256_DIGEST_LENGTH, '\0');
+    m_isKnown.assign(2 * m_firstLeaf, false);
+
+    //: Padding leaves are zero digests, known without any proof
+    for (size_t i = m_firstLeaf + m_numLeaves; i < 2 * m_firstLeaf; i++) m_isKnown[i] = true;
+
+    m_nodes.replace(SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, root, 0, SHA256_DIGEST_LENGTH);
+    m_isKnown[1] = true;
+}
+
+/**
+* @brief Constructs a complete tree from the digests of all pieces.
+* @param leaves Raw digests of the pieces, in piece order.
+*/
+MerkleTree::MerkleTree(const vector<string>& leaves)
+: m_numLeaves(leaves.size())
+, m_firstLeaf(1)
+{
+    while (m_firstLeaf < m_numLeaves) m_firstLeaf *= 2;
+    m_nodes.assign(2 * m_firstLeaf * SHA256_DIGEST_LENGTH, '\0');
+    m_isKnown.assign(2 * m_firstLeaf, true);
+
+    for (size_t i = 0; i < m_numLeaves; i++) {
+        m_nodes.replace((m_firstLeaf + i) * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, leaves[i], 0, SHA256_DIGEST_LENGTH);
+    }
+
+    //: Inner nodes are filled bottom up, an empty file keeps the zero digest as its root
+    for (size_t i = m_firstLeaf - 1; i >= 1; i--) {
+        const char* children = m_nodes.data() + 2 * i * SHA256_DIGEST_LENGTH;
+        m_nodes.replace(i * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, hashChildren(children, children + SHA256_DIGEST_LENGTH));
+    }
+}
+
+/**
+* @brief Constructs a tree from the nodes saved by nodeBytes().
+* @param numLeaves The number of pieces of the file.
+* @param root Raw digest of the root.
+* @param nodes The saved nodes, unknown nodes are zero digests.
+* @throw string If the nodes do not belong to a tree with this root.
+*/
+MerkleTree::MerkleTree(size_t numLeaves, const string& root, const string& nodes)
+: MerkleTree(numLeaves, root)
+{
+    if (nodes.size() != m_nodes.size() || nodes.compare(SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, root) != 0) {
+        throw string("Merkle tree does not match its root!!");
+    }
+    m_nodes = nodes;
+
+    //: No node of a real tree hashes to zero, so a zero digest can only be a node that was not known
+    static const string zeroDigest(SHA256_DIGEST_LENGTH, '\0');
+    for (size_t i = 1; i < m_firstLeaf + m_numLeaves; i++) {
+        if (m_nodes.compare(i * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, zeroDigest) != 0) m_isKnown[i] = true;
+    }
+}
+
+/**
+* @brief Computes the digest of an inner node from the digests of its children.
+* @param left Raw digest of the left child.
+* @param right Raw digest of the right child.
+* @return Raw digest of the node.
+*/
+string MerkleTree::hashChildren(const char* left, const char* right) {
+    unsigned char children[2 * SHA256_DIGEST_LENGTH];
+    memcpy(children, left, SHA256_DIGEST_LENGTH);
+    memcpy(children + SHA256_DIGEST_LENGTH, right, SHA256_DIGEST_LENGTH);
+
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLength = 0;
+    if (!EVP_Digest(children, sizeof(children), hash, &hashLength, EVP_sha256(), nullptr)) {
+        throw string("Hashing a Merkle tree node!!");
+    }
+    return string((char*)hash, hashLength);
+}
+
+/**
+* @brief Gives the raw digest of the root.
+* @return The root digest.
+*/
+string MerkleTree::root() const {
+    lock_guard<mutex> guard(m_treeMutex);
+    return m_nodes.substr(SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+}
+
+/**
+* @brief Gives the number of leaves, i.e. pieces of the file.
+* @return The number of leaves before padding.
+*/
+size_t MerkleTree::numLeaves() const {
+    return m_numLeaves;
+}
+
+/**
+* @brief Gives the length of the proof of every piece.
+* @return Number of bytes of a proof, one digest per level below the root.
+*/
+size_t MerkleTree::proofLength() const {
+    return (size_t)__builtin_ctzll(m_firstLeaf) * SHA256_DIGEST_LENGTH;
+}
+
+/**
+* @brief Gives the proof of a piece, the sibling digests on its path from leaf to root.
+* @param leaf The piece number.
+* @return The proof, proofLength() bytes.
+* @throw string If the piece is out of range or its path is not known.
+*/
+string MerkleTree::giveProof(size_t leaf) const {
+    if (leaf >= m_numLeaves) throw string("Piece not Found!!");
+
+    string proof;
+    proof.reserve(proofLength());
+
+    lock_guard<mutex> guard(m_treeMutex);
+    for (size_t node = m_firstLeaf + leaf; node > 1; node /= 2) {
+        if (!m_isKnown[node ^ 1]) throw string("Proof of piece not Found!!");
+        proof.append(m_nodes, (node ^ 1) * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+    }
+    return proof;
+}
+
+/**
+* @brief Checks whether the digest of every piece is known.
+* @return True if every piece can be proven, false otherwise.
+*/
+bool MerkleTree::isComplete() const {
+    lock_guard<mutex> guard(m_treeMutex);
+    for (size_t i = m_firstLeaf; i < m_firstLeaf + m_numLeaves; i++) {
+        if (!m_isKnown[i]) return false;
+    }
+    return true;
+}
+
+/**
+* @brief Checks a piece digest against the leaf digest of the tree, without any proof.
+* @param leaf The piece number.
+* @param leafDigest Raw digest of the piece data.
+* @return True if the leaf is known and equal to the digest, false otherwise.
+*/
+bool MerkleTree::matchesLeaf(size_t leaf, const string& leafDigest) const {
+    if (leaf >= m_numLeaves) return false;
+    lock_guard<mutex> guard(m_treeMutex);
+    return m_isKnown[m_firstLeaf + leaf] && m_nodes.compare((m_firstLeaf + leaf) * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, leafDigest) == 0;
+}
+
+/**
+* @brief Gives the digests of all nodes, unknown nodes as zero digests.
+* @return The nodes, node i at offset i * SHA256_DIGEST_LENGTH.
+*/
+string MerkleTree::nodeBytes() const {
+    lock_guard<mutex> guard(m_treeMutex);
+    return m_nodes;
+}
+
+/**
+* @brief Verifies the digest of a piece against the root and learns its path if it matches.
+* @param leaf The piece number.
+* @param leafDigest Raw digest of the piece data.
+* @param proof The proof sent along with the piece.
+* @return True if the piece belongs to the file, false otherwise.
+*/
+bool MerkleTree::verifyPiece(size_t leaf, const string& leafDigest, const string& proof) {
+    if (leaf >= m_numLeaves || leafDigest.size() != SHA256_DIGEST_LENGTH || proof.size() != proofLength()) return false;
+
+    //: Digests on the path are computed without the lock, path[i] is the node i levels above the leaf
+    vector<string> path = {leafDigest};
+    size_t node = m_firstLeaf + leaf;
+    for (size_t level = 0; node > 1; level++, node /= 2) {
+        const char* sibling = proof.data() + level * SHA256_DIGEST_LENGTH;
+        path.push_back((node & 1) ? hashChildren(sibling, path.back().data()) : hashChildren(path.back().data(), sibling));
+    }
+
+    lock_guard<mutex> guard(m_treeMutex);
+    if (m_nodes.compare(SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, path.back()) != 0) return false;
+
+    //: The piece is proven, its path and the siblings on it are enough to prove it to other leechers
+    node = m_firstLeaf + leaf;
+    for (size_t level = 0; node > 1; level++, node /= 2) {
+        m_nodes.replace(node * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, path[level]);
+        m_nodes.replace((node ^ 1) * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH, proof, level * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+        m_isKnown[node] = m_isKnown[node ^ 1] = true;
+    }
+    return true;
+}
@@ -0,0 +1,208 @@
+#include "../headers.h"
+
+/**
+* @brief Records a duration.
+* @param duration The duration.
+*/
+void Histogram::record(chrono::steady_clock::duration duration) {
+    uint64_t micros = max((int64_t)0, (int64_t)chrono::duration_cast<chrono::microseconds>(duration).count());
+    int bucket = micros == 0 ? 0 : min(METRICS_BUCKETS - 1, 64 - __builtin_clzll(micros));
+    m_buckets[bucket].fetch_add(1, memory_order_relaxed);
+    m_totalMicros.fetch_add(micros, memory_order_relaxed);
+
+    uint64_t maxMicros = m_maxMicros.load(memory_order_relaxed);
+    while (micros > maxMicros && !m_maxMicros.compare_exchange_weak(maxMicros, micros, memory_order_relaxed));
+}
+
+/**
+* @brief Describes the durations recorded so far.
+* @return "count=N mean_us=N p50_us=N p90_us=N p99_us=N max_us=N", only "count=0" if none was recorded.
+*/
+string Histogram::describe() const {
+    //: Buckets are read one by one while others record, the percentiles are taken from this copy
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        buckets[i] = m_buckets[i].load(memory_order_relaxed);
+        count += buckets[i];
+    }
+    if (count == 0) return "count=0";
+
+    uint64_t maxMicros = m_maxMicros.load(memory_order_relaxed);
+    auto givePercentile = [&](double share) {
+        uint64_t rank = max((uint64_t)1, (uint64_t)ceil(share * count));
+        uint64_t seen = 0;
+        for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return min(maxMicros, (uint64_t)1 << i);
+        }
+        return maxMicros;
+    };
+
+    return "count=" + to_string(count) +
+        " mean_us=" + to_string(m_totalMicros.load(memory_order_relaxed) / count) +
+        " p50_us=" + to_string(givePercentile(0.5)) +
+        " p90_us=" + to_string(givePercentile(0.9)) +
+        " p99_us=" + to_string(givePercentile(0.99)) +
+        " max_us=" + to_string(maxMicros);
+}
+
+/**
+* @brief Creates the histograms of all known commands and locks.
+*/
+Metrics::Metrics() : m_startTime(chrono::steady_clock::now()) {
+    //: Maps are never changed after this, so recording looks up without a lock
+    for (const char* commandName : {"create_user", "login", "create_group", "join_group", "leave_group", "list_requests",
+                                      "accept_request", "list_groups", "list_files", "upload_file", "download_file",
+                                      "show_downloads", "logout", "stop_share", "subscribe", "unsubscribe", "batch",
+                                      "stats", "give_piece", "give_piece_info", "other"}) {
+        m_commandLatencies[commandName];
+    }
+    for (const char* lockName : {"files_registry", "files_open", "piece_cache"}) {
+        m_lockWaits[lockName];
+    }
+}
+
+/**
+* @brief Gives the byte counter of a peer, creating it if needed.
+* @param peerBytes The counters to look in.
+* @param peer The peer.
+* @return The counter, valid as long as the metrics exist.
+*/
+atomic<uint64_t>& Metrics::giveBytes(PeerBytes& peerBytes, const string& peer) {
+    {
+        shared_lock<shared_mutex> guard(peerBytes.m_bytesMutex);
+        auto it = peerBytes.m_bytes.find(peer);
+        if (it != peerBytes.m_bytes.end()) return *it->second;
+    }
+
+    //: Counters are never removed, so the map of a client talking to many peers stays bounded
+    unique_lock<shared_mutex> guard(peerBytes.m_bytesMutex);
+    string key = (peerBytes.m_bytes.size() < MAX_METRICS_PEERS || peerBytes.m_bytes.count(peer)) ? peer : "other";
+    unique_ptr<atomic<uint64_t>>& counter = peerBytes.m_bytes[key];
+    if (!counter) counter = make_unique<atomic<uint64_t>>(0);
+    return *counter;
+}
+
+/**
+* @brief Describes the bytes exchanged with every peer.
+* @param peerBytes The counters.
+* @param name Name of the lines.
+* @return A "name peer bytes" line per peer.
+*/
+string Metrics::describeBytes(PeerBytes& peerBytes, const string& name) {
+    string description = "";
+    shared_lock<shared_mutex> guard(peerBytes.m_bytesMutex);
+    for (auto& it : peerBytes.m_bytes) {
+        description += name + " " + it.first + " " + to_string(it.second->load(memory_order_relaxed)) + "\n";
+    }
+    return description;
+}
+
+/**
+* @brief Records the time a command took.
+* @param commandName Name of the command, first word of it.
+* @param duration The time it took.
+*/
+void Metrics::recordCommand(const string& commandName, chrono::steady_clock::duration duration) {
+    auto it = m_commandLatencies.find(commandName);
+    if (it == m_commandLatencies.end()) it = m_commandLatencies.find("other");
+    it->second.record(duration);
+}
+
+/**
+* @brief Gives the histogram the waits of a lock are recorded in, see TimedMutex.
+* @param lockName Name of the lock, one created by the constructor.
+* @throws out_of_range If the lock is unknown.
+*/
+Histogram& Metrics::giveLockWaits(const string& lockName) {
+    return m_lockWaits.at(lockName);
+}
+
+/**
+* @brief Gives the counter of piece bytes sent to a leecher, to be added to directly.
+* @param leecherIp IP address of the leecher.
+*/
+atomic<uint64_t>& Metrics::giveBytesServed(const string& leecherIp) {
+    return giveBytes(m_bytesServed, leecherIp);
+}
+
+/**
+* @brief Counts piece bytes received from a seeder.
+* @param seederIpPort IP:Port of the seeder.
+* @param bytes The number of bytes.
+*/
+void Metrics::addBytesReceived(const string& seederIpPort, size_t bytes) {
+    giveBytes(m_bytesReceived, seederIpPort).fetch_add(bytes, memory_order_relaxed);
+}
+
+/**
+* @brief Counts a piece that did not match its Merkle proof.
+*/
+void Metrics::addPieceMismatch() {
+    m_pieceMismatches.fetch_add(1, memory_order_relaxed);
+}
+
+/**
+* @brief Counts a connection accepted by the seeder.
+*/
+void Metrics::addConnection() {
+    m_acceptedConnections.fetch_add(1, memory_order_relaxed);
+    m_openConnections.fetch_add(1, memory_order_relaxed);
+}
+
+/**
+* @brief Counts a connection of the seeder that was closed.
+*/
+void Metrics::removeConnection() {
+    m_openConnections.fetch_sub(1, memory_order_relaxed);
+}
+
+/**
+* @brief Adds a thread pool to the ones described, called by its constructor.
+* @param pool The pool.
+*/
+void Metrics::addPool(const ThreadPool* pool) {
+    lock_guard<mutex> guard(m_poolsMutex);
+    m_pools.push_back(pool);
+}
+
+/**
+* @brief Removes a thread pool, called by its destructor.
+* @param pool The pool.
+*/
+void Metrics::removePool(const ThreadPool* pool) {
+    lock_guard<mutex> guard(m_poolsMutex);
+    m_pools.erase(remove(m_pools.begin(), m_pools.end(), pool), m_pools.end());
+}
+
+/**
+* @brief Describes everything counted so far.
+* @return One line per value, "name value" or "name key field=value ...".
+*/
+string Metrics::describe() {
+    string description = "uptime_seconds " + to_string(chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - m_startTime).count()) + "\n";
+    description += "connections_open " + to_string(m_openConnections.load(memory_order_relaxed)) + "\n";
+    description += "connections_accepted " + to_string(m_acceptedConnections.load(memory_order_relaxed)) + "\n";
+    description += "piece_mismatches " + to_string(m_pieceMismatches.load(memory_order_relaxed)) + "\n";
+    description += describeBytes(m_bytesServed, "bytes_served");
+    description += describeBytes(m_bytesReceived, "bytes_received");
+    {
+        //: A pool is removed before it is destroyed, so the pools listed here are alive
+        lock_guard<mutex> guard(m_poolsMutex);
+        for (const ThreadPool* pool : m_pools) {
+            description += "pool " + pool->giveName() + " workers=" + to_string(pool->giveWorkers()) +
+                " queued_tasks=" + to_string(pool->giveQueuedTasks()) + " active_tasks=" + to_string(pool->giveActiveTasks()) + "\n";
+        }
+    }
+
+    //: Commands never run are left out, lock waits are listed always
+    for (auto& it : m_commandLatencies) {
+        string histogram = it.second.describe();
+        if (histogram != "count=0") description += "command " + it.first + " " + histogram + "\n";
+    }
+    for (auto& it : m_lockWaits) {
+        description += "lock_wait " + it.first + " " + it.second.describe() + "\n";
+    }
+    return description;
+}
@@ -0,0 +1,137 @@
+#include "../headers.h"
+
+/**
+* @brief Constructs a lease of a connected socket.
+* @param pool The pool the connection is leased from.
+* @param seederIpPort IP:Port of the seeder.
+* @param socket The connected socket.
+*/
+PeerConnection::PeerConnection(PeerConnectionPool& pool, string seederIpPort, unique_ptr<ClientSocket> socket)
+: m_pool(pool)
+, m_seederIpPort(seederIpPort)
+, m_socket(move(socket))
+{}
+
+/**
+* @brief Gives the connection back to the pool, which closes it if it is not reusable.
+*/
+PeerConnection::~PeerConnection() {
+    m_pool.release(m_seederIpPort, move(m_socket), m_isReusable);
+}
+
+/**
+* @brief Gives the connected socket.
+* @return The socket.
+*/
+ClientSocket& PeerConnection::socket() {
+    return *m_socket;
+}
+
+/**
+* @brief Marks the connection as not reusable, e.g. after a failure or with replies still unread.
+*/
+void PeerConnection::markBroken() {
+    m_isReusable = false;
+}
+
+/**
+* @brief Leases a connection to a seeder, reusing an idle one if there is any.
+* @param seederIpPort IP:Port of the seeder.
+* @return The leased connection.
+* @throws string If the seeder address is invalid or the seeder can not be reached.
+*/
+unique_ptr<PeerConnection> PeerConnectionPool::acquire(const string& seederIpPort) {
+    vector<string> ipPort = Utils::tokenize(seederIpPort, ':');
+    if (ipPort.size() != 2) throw string("Invalid IP:Port of seeder " + seederIpPort + "!!");
+
+    {
+        unique_lock<mutex> guard(m_poolMutex);
+        evictIdleLocked();
+
+        while (true) {
+            //: Looked up again after every wait, the entry of a seeder without connections may be evicted meanwhile
+            Peer& peer = m_peers[seederIpPort];
+
+            //: Most recently used connections are the most likely to be still open on the seeder side
+            while (!peer.m_idleConnections.empty()) {
+                unique_ptr<ClientSocket> socket = move(peer.m_idleConnections.back().m_socket);
+                peer.m_idleConnections.pop_back();
+                if (socket->isIdleConnected()) {
+                    return make_unique<PeerConnection>(*this, seederIpPort, move(socket));
+                }
+                peer.m_openConnections--;
+            }
+
+            //: Slot is taken before connecting, so that the cap holds while the lock is released
+            if (peer.m_openConnections < MAX_CONNECTIONS_PER_PEER) {
+                peer.m_openConnections++;
+                break;
+            }
+            m_connectionReleased.wait(guard);
+        }
+    }
+
+    //: Connecting may take a round trip or a timeout, other seeders must not wait for it
+    unique_ptr<ClientSocket> socket = make_unique<ClientSocket>();
+    try {
+        socket->createSocket();
+        socket->connectSocket(ipPort[0], stoi(ipPort[1]));
+    } catch (const string& e) {
+        release(seederIpPort, nullptr, false);
+        throw;
+    }
+    return make_unique<PeerConnection>(*this, seederIpPort, move(socket));
+}
+
+/**
+* @brief Takes back a leased connection.
+* @param seederIpPort IP:Port of the seeder.
+* @param socket The socket of the connection.
+* @param isReusable Whether the connection can be handed to the next user.
+*/
+void PeerConnectionPool::release(const string& seederIpPort, unique_ptr<ClientSocket> socket, bool isReusable) {
+    {
+        lock_guard<mutex> guard(m_poolMutex);
+        Peer& peer = m_peers[seederIpPort];
+        if (isReusable && socket && socket->isIdleConnected()) {
+            peer.m_idleConnections.push_back({move(socket), chrono::steady_clock::now()});
+        } else {
+            peer.m_openConnections--;
+        }
+    }
+    m_connectionReleased.notify_all();
+}
+
+/**
+* @brief Closes the connections idle for longer than PEER_IDLE_TIMEOUT.
+* @note Expects m_poolMutex to be held.
+*/
+void PeerConnectionPool::evictIdleLocked() {
+    auto now = chrono::steady_clock::now();
+    for (auto it = m_peers.begin(); it != m_peers.end();) {
+        Peer& peer = it->second;
+
+        //: Idle connections are ordered by the time they were given back, the oldest come first
+        while (!peer.m_idleConnections.empty() && now - peer.m_idleConnections.front().m_idleSince >= chrono::milliseconds(PEER_IDLE_TIMEOUT)) {
+            peer.m_idleConnections.pop_front();
+            peer.m_openConnections--;
+        }
+
+        if (peer.m_openConnections == 0) it = m_peers.erase(it);
+        else it++;
+    }
+}
+
+/**
+* @brief Closes all idle connections, leased ones are closed when given back.
+*/
+void PeerConnectionPool::closeIdle() {
+    {
+        lock_guard<mutex> guard(m_poolMutex);
+        for (auto& it : m_peers) {
+            it.second.m_openConnections -= it.second.m_idleConnections.size();
+            it.second.m_idleConnections.clear();
+        }
+    }
+    m_connectionReleased.notify_all();
+}
@@ -0,0 +1,123 @@
+#include "../headers.h"
+
+/**
+* @brief Folds a new sample into a moving average.
+* @param average The average to update.
+* @param sample The new sample.
+* @param isFirst Whether this is the first sample, which is taken as is.
+*/
+void PeerStats::addSample(double& average, double sample, bool isFirst) {
+    average = isFirst ? sample : (1 - PEER_STATS_WEIGHT) * average + PEER_STATS_WEIGHT * sample;
+}
+
+/**
+* @brief Gives the throughput of the fastest seeder that can be judged.
+* @return Bytes per second, 0 if no seeder was measured enough yet.
+* @note Expects m_statsMutex to be held.
+*/
+double PeerStats::bestBytesPerSecondLocked() const {
+    double best = 0;
+    for (const auto& it : m_stats) {
+        const Stats& stats = it.second;
+        if (stats.m_samples >= PEER_MIN_SAMPLES && stats.m_errorRate <= PEER_CHOKE_ERROR_RATE) {
+            best = max(best, stats.m_bytesPerSecond);
+        }
+    }
+    return best;
+}
+
+/**
+* @brief Records a piece received from a seeder.
+* @param seederIpPort IP:Port of the seeder.
+* @param bytes Length of the piece.
+* @param seconds Time the connection spent on the piece.
+*/
+void PeerStats::recordPiece(const string& seederIpPort, size_t bytes, double seconds) {
+    lock_guard<mutex> guard(m_statsMutex);
+    Stats& stats = m_stats[seederIpPort];
+
+    //: Failures before the first piece only count towards the error rate, not the throughput
+    addSample(stats.m_bytesPerSecond, bytes / max(seconds, 1e-6), stats.m_bytesPerSecond == 0);
+    addSample(stats.m_errorRate, 0, stats.m_samples == 0);
+    stats.m_samples++;
+    if (stats.m_trialPieces > 0) stats.m_trialPieces--;
+}
+
+/**
+* @brief Records the time between a request to an idle seeder and the start of its reply.
+* @param seederIpPort IP:Port of the seeder.
+* @param seconds The round trip time.
+*/
+void PeerStats::recordRtt(const string& seederIpPort, double seconds) {
+    lock_guard<mutex> guard(m_statsMutex);
+    Stats& stats = m_stats[seederIpPort];
+    addSample(stats.m_rttSeconds, seconds, stats.m_rttSeconds == 0);
+}
+
+/**
+* @brief Records a piece that failed, e.g. an error reply or a Merkle proof mismatch.
+* @param seederIpPort IP:Port of the seeder.
+*/
+void PeerStats::recordError(const string& seederIpPort) {
+    lock_guard<mutex> guard(m_statsMutex);
+    Stats& stats = m_stats[seederIpPort];
+    addSample(stats.m_errorRate, 1, stats.m_samples == 0);
+    stats.m_samples++;
+    if (stats.m_trialPieces > 0) stats.m_trialPieces--;
+}
+
+/**
+* @brief Checks whether a seeder is choked, trying it again once it was choked long enough.
+* @param seederIpPort IP:Port of the seeder.
+* @return True if the seeder should only be asked for pieces no unchoked seeder holds.
+*/
+bool PeerStats::isChoked(const string& seederIpPort) {
+    lock_guard<mutex> guard(m_statsMutex);
+    Stats& stats = m_stats[seederIpPort];
+
+    //: New seeders and seeders on trial are not judged until they are measured enough
+    if (stats.m_samples < PEER_MIN_SAMPLES || stats.m_trialPieces > 0) return false;
+
+    bool isFlaky = stats.m_errorRate > PEER_CHOKE_ERROR_RATE;
+    bool isSlow = stats.m_bytesPerSecond < PEER_CHOKE_SPEED_RATIO * bestBytesPerSecondLocked();
+    if (!isFlaky && !isSlow) {
+        stats.m_isChoked = false;
+        return false;
+    }
+
+    auto now = chrono::steady_clock::now();
+    if (!stats.m_isChoked) {
+        stats.m_isChoked = true;
+        stats.m_chokedSince = now;
+        return true;
+    }
+
+    //: Optimistic unchoke, conditions of the seeder or of the network may have changed
+    if (now - stats.m_chokedSince >= chrono::milliseconds(OPTIMISTIC_UNCHOKE_INTERVAL)) {
+        stats.m_chokedSince = now;
+        stats.m_trialPieces = OPTIMISTIC_UNCHOKE_PIECES;
+        return false;
+    }
+    return true;
+}
+
+/**
+* @brief Gives the number of requests to keep in flight on one connection to a seeder.
+* @param seederIpPort IP:Port of the seeder.
+* @param pieceSize The piece size of the download.
+* @return Between 1 and PIPELINE_WINDOW.
+* @details The fastest seeder gets the full window and slower ones a share matching their
+*          throughput, so fewer pieces wait on them. The window never drops below the
+*          pieces in flight during one round trip, which keeps a high latency link busy.
+*/
+int PeerStats::giveWindow(const string& seederIpPort, int pieceSize) const {
+    lock_guard<mutex> guard(m_statsMutex);
+    auto it = m_stats.find(seederIpPort);
+    double best = bestBytesPerSecondLocked();
+    if (it == m_stats.end() || it->second.m_bytesPerSecond == 0 || best == 0) return PIPELINE_WINDOW;
+
+    const Stats& stats = it->second;
+    double share = PIPELINE_WINDOW * stats.m_bytesPerSecond / best;
+    double bandwidthDelay = stats.m_bytesPerSecond * stats.m_rttSeconds / pieceSize + 1;
+    return max(1, min(PIPELINE_WINDOW, (int)ceil(max(share, bandwidthDelay))));
+}
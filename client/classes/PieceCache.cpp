@@ -0,0 +1,97 @@
+#include "../headers.h"
+
+/**
+* @brief Checks whether an entry was read from the file as it is now.
+* @param entry The cached piece.
+* @param info Status of the file now.
+* @return True if the entry can be used.
+*/
+bool PieceCache::isFresh(const Entry& entry, const struct stat& info) {
+    //: A file rewritten in place keeps its inode, its size or modification time tells
+    return entry.m_device == info.st_dev && entry.m_inode == info.st_ino && entry.m_fileSize == info.st_size
+        && entry.m_modifiedAt.tv_sec == info.st_mtim.tv_sec && entry.m_modifiedAt.tv_nsec == info.st_mtim.tv_nsec;
+}
+
+/**
+* @brief Gives the shard holding a piece.
+* @param key File path and piece number of the piece.
+* @return The shard of the piece.
+*/
+PieceCache::Shard& PieceCache::giveShard(const pair<string, int>& key) {
+    //: Pieces of one popular file are spread over the shards too
+    return m_shards[(hash<string>{}(key.first) ^ hash<int>{}(key.second)) % PIECE_CACHE_SHARDS];
+}
+
+/**
+* @brief Drops a cached piece.
+* @param shard The shard holding the piece.
+* @param it The piece.
+* @note Expects the mutex of the shard to be held.
+*/
+void PieceCache::eraseLocked(Shard& shard, map<pair<string, int>, Entry>::iterator it) {
+    shard.m_cachedBytes -= it->second.m_data->size();
+    shard.m_lru.erase(it->second.m_lruPosition);
+    shard.m_entries.erase(it);
+}
+
+/**
+* @brief Gives the data of a piece if it is cached, reading it in if it was asked for lately.
+* @param filePath The path to the file.
+* @param pieceNumber The piece number.
+* @param fd Open descriptor of the file.
+* @param info Status of the file now.
+* @param offset Offset of the piece in the file.
+* @param length Length of the piece.
+* @return The data of the piece, null if it is to be sent from disk.
+*/
+shared_ptr<const string> PieceCache::givePiece(const string& filePath, int pieceNumber, int fd, const struct stat& info, off_t offset, size_t length) {
+    pair<string, int> key = {filePath, pieceNumber};
+    Shard& shard = giveShard(key);
+    {
+        lock_guard<TimedMutex<mutex>> guard(shard.m_cacheMutex);
+        auto it = shard.m_entries.find(key);
+        if (it != shard.m_entries.end()) {
+            if (isFresh(it->second, info)) {
+                shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, it->second.m_lruPosition);
+                return it->second.m_data;
+            }
+            eraseLocked(shard, it);
+        }
+
+        //: First request is sent from disk, only a piece asked for again is worth a copy in memory
+        if (!shard.m_ghosts.count(key)) {
+            shard.m_ghosts.insert(key);
+            shard.m_ghostOrder.push_back(key);
+            if (shard.m_ghostOrder.size() > PIECE_CACHE_GHOSTS / PIECE_CACHE_SHARDS) {
+                shard.m_ghosts.erase(shard.m_ghostOrder.front());
+                shard.m_ghostOrder.pop_front();
+            }
+            return nullptr;
+        }
+    }
+    if (length > PIECE_CACHE_BYTES / PIECE_CACHE_SHARDS) return nullptr;
+
+    //: Disk is read without the lock, other workers keep being served from the cache meanwhile
+    string data(length, '\0');
+    size_t bytesRead = 0;
+    while (bytesRead < length) {
+        ssize_t result = pread(fd, &data[bytesRead], length - bytesRead, offset + bytesRead);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return nullptr;
+        bytesRead += result;
+    }
+    shared_ptr<const string> buffer = make_shared<const string>(move(data));
+
+    lock_guard<TimedMutex<mutex>> guard(shard.m_cacheMutex);
+    auto it = shard.m_entries.find(key);
+    if (it != shard.m_entries.end()) return buffer;
+
+    //: Every shard keeps within its share of the bytes, so the cache keeps within PIECE_CACHE_BYTES
+    while (!shard.m_lru.empty() && shard.m_cachedBytes + length > PIECE_CACHE_BYTES / PIECE_CACHE_SHARDS) {
+        eraseLocked(shard, shard.m_entries.find(shard.m_lru.back()));
+    }
+    shard.m_lru.push_front(key);
+    shard.m_entries[key] = {buffer, info.st_dev, info.st_ino, info.st_size, info.st_mtim, shard.m_lru.begin()};
+    shard.m_cachedBytes += length;
+    return buffer;
+}
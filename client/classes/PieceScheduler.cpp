@@ -0,0 +1,293 @@
+#include "../headers.h"
+
+/**
+* @brief Constructs a scheduler for a file with the given number of pieces.
+* @param numPieces The number of pieces in the file.
+* @details All pieces start as pending with no seeder holding them.
+*/
+PieceScheduler::PieceScheduler(int numPieces)
+: m_randomGenerator(random_device{}())
+, m_numPieces(numPieces)
+, m_remainingPieces(numPieces)
+, m_pendingPieces(numPieces)
+, m_pieceState(numPieces, PENDING)
+, m_availability(numPieces, 0)
+, m_failedAttempts(numPieces, 0)
+, m_requestedFrom(numPieces)
+, m_rarityBuckets(1)
+, m_bucketPosition(numPieces, -1)
+{
+    for (int i = 0; i < m_numPieces; i++) insertIntoBucket(i);
+}
+
+/**
+* @brief Inserts a pending piece at a random position in the bucket of its availability.
+* @param pieceNumber The piece to insert.
+*/
+void PieceScheduler::insertIntoBucket(int pieceNumber) {
+    int availability = m_availability[pieceNumber];
+    if ((int)m_rarityBuckets.size() <= availability) m_rarityBuckets.resize(availability + 1);
+
+    vector<int>& bucket = m_rarityBuckets[availability];
+    bucket.push_back(pieceNumber);
+    m_bucketPosition[pieceNumber] = bucket.size() - 1;
+
+    //: Swap with a random piece of the bucket so that equally rare pieces are handed out randomly
+    int randomPosition = uniform_int_distribution<int>(0, bucket.size() - 1)(m_randomGenerator);
+    swap(bucket[randomPosition], bucket.back());
+    m_bucketPosition[bucket[randomPosition]] = randomPosition;
+    m_bucketPosition[bucket.back()] = bucket.size() - 1;
+}
+
+/**
+* @brief Removes a piece from its bucket, if it is in one.
+* @param pieceNumber The piece to remove.
+*/
+void PieceScheduler::removeFromBucket(int pieceNumber) {
+    int position = m_bucketPosition[pieceNumber];
+    if (position == -1) return;
+
+    vector<int>& bucket = m_rarityBuckets[m_availability[pieceNumber]];
+    bucket[position] = bucket.back();
+    m_bucketPosition[bucket[position]] = position;
+    bucket.pop_back();
+    m_bucketPosition[pieceNumber] = -1;
+}
+
+/**
+* @brief Changes the availability of a piece and moves it to the matching bucket.
+* @param pieceNumber The piece whose availability changes.
+* @param delta The change in the number of seeders holding the piece.
+*/
+void PieceScheduler::updateAvailability(int pieceNumber, int delta) {
+    bool isInBucket = m_bucketPosition[pieceNumber] != -1;
+    if (isInBucket) removeFromBucket(pieceNumber);
+    m_availability[pieceNumber] += delta;
+    if (isInBucket) insertIntoBucket(pieceNumber);
+}
+
+/**
+* @brief Checks whether the download is in endgame mode.
+* @return True if only the last few pieces are left or every remaining piece is already in flight.
+* @note Expects m_schedulerMutex to be held.
+*/
+bool PieceScheduler::isEndgameLocked() const {
+    return m_remainingPieces > 0 && (m_remainingPieces <= ENDGAME_PIECES || m_pendingPieces == 0);
+}
+
+/**
+* @brief Sets the pieces held by a seeder and updates the rarity of every affected piece.
+* @param seederIpPort IP:Port of the seeder.
+* @param pieces Piece numbers the seeder holds. Replaces any earlier list.
+* @return The number of pieces the seeder holds that are not completed yet.
+*/
+int PieceScheduler::updateSeederPieces(string seederIpPort, const vector<int>& pieces) {
+    lock_guard<mutex> guard(m_schedulerMutex);
+
+    vector<bool> newPieces(m_numPieces, false);
+    for (int pieceNumber : pieces) {
+        if (pieceNumber >= 0 && pieceNumber < m_numPieces) newPieces[pieceNumber] = true;
+    }
+
+    vector<bool>& oldPieces = m_seederPieces[seederIpPort];
+    if (oldPieces.empty()) oldPieces.assign(m_numPieces, false);
+
+    int usefulPieces = 0;
+    for (int i = 0; i < m_numPieces; i++) {
+        if (newPieces[i] != oldPieces[i]) updateAvailability(i, newPieces[i] ? 1 : -1);
+        if (newPieces[i] && m_pieceState[i] != COMPLETED) usefulPieces++;
+    }
+
+    oldPieces = move(newPieces);
+    return usefulPieces;
+}
+
+/**
+* @brief Forgets a seeder and lowers the availability of every piece it held.
+* @param seederIpPort IP:Port of the seeder.
+*/
+void PieceScheduler::removeSeeder(string seederIpPort) {
+    lock_guard<mutex> guard(m_schedulerMutex);
+
+    auto it = m_seederPieces.find(seederIpPort);
+    if (it == m_seederPieces.end()) return;
+
+    for (int i = 0; i < m_numPieces; i++) {
+        if (it->second[i]) updateAvailability(i, -1);
+    }
+    m_seederPieces.erase(it);
+    m_chokedSeeders.erase(seederIpPort);
+}
+
+/**
+* @brief Checks whether a seeder other than the given one, which is not choked, holds a piece.
+* @param pieceNumber The piece to check.
+* @param seederIpPort IP:Port of the seeder asking.
+* @return True if the piece can be left to an unchoked seeder, false otherwise.
+* @note Expects m_schedulerMutex to be held.
+*/
+bool PieceScheduler::isHeldByUnchokedLocked(int pieceNumber, const string& seederIpPort) const {
+    for (const auto& it : m_seederPieces) {
+        if (it.first != seederIpPort && it.second[pieceNumber] && !m_chokedSeeders.count(it.first)) return true;
+    }
+    return false;
+}
+
+/**
+* @brief Claims the next piece to request from a seeder.
+* @param seederIpPort IP:Port of the seeder.
+* @return The rarest pending piece held by the seeder, an in-flight piece in endgame
+*         mode, or -1 if there is nothing to request from this seeder.
+* @details In endgame mode the in-flight piece with the fewest outstanding requests is
+*          chosen, so that a slow seeder holding the tail of the file is raced by others.
+*          A choked seeder is only given pending pieces no unchoked seeder holds and
+*          takes no part in the endgame.
+*/
+int PieceScheduler::claimPiece(string seederIpPort) {
+    lock_guard<mutex> guard(m_schedulerMutex);
+
+    auto it = m_seederPieces.find(seederIpPort);
+    if (it == m_seederPieces.end()) return -1;
+    const vector<bool>& seederPieces = it->second;
+    bool isChoked = m_chokedSeeders.count(seederIpPort) > 0;
+
+    //: Rarest first, bucket 0 holds pieces no seeder has
+    for (size_t availability = 1; availability < m_rarityBuckets.size(); availability++) {
+        for (int pieceNumber : m_rarityBuckets[availability]) {
+            if (!seederPieces[pieceNumber]) continue;
+            if (isChoked && isHeldByUnchokedLocked(pieceNumber, seederIpPort)) continue;
+
+            removeFromBucket(pieceNumber);
+            m_pieceState[pieceNumber] = IN_FLIGHT;
+            m_requestedFrom[pieceNumber].push_back(seederIpPort);
+            m_inFlightPieces.insert(pieceNumber);
+            m_pendingPieces--;
+            return pieceNumber;
+        }
+    }
+
+    if (isChoked || !isEndgameLocked()) return -1;
+
+    //: Endgame, duplicate the in-flight piece with the fewest outstanding requests
+    int bestPiece = -1;
+    for (int pieceNumber : m_inFlightPieces) {
+        if (!seederPieces[pieceNumber]) continue;
+
+        const vector<string>& requestedFrom = m_requestedFrom[pieceNumber];
+        if (find(requestedFrom.begin(), requestedFrom.end(), seederIpPort) != requestedFrom.end()) continue;
+
+        if (bestPiece == -1 || requestedFrom.size() < m_requestedFrom[bestPiece].size()) bestPiece = pieceNumber;
+    }
+
+    if (bestPiece != -1) m_requestedFrom[bestPiece].push_back(seederIpPort);
+    return bestPiece;
+}
+
+/**
+* @brief Sets whether a seeder is choked, a choked seeder is only given pieces no unchoked seeder holds.
+* @param seederIpPort IP:Port of the seeder.
+* @param isChoked Whether the seeder is choked.
+*/
+void PieceScheduler::setSeederChoked(string seederIpPort, bool isChoked) {
+    lock_guard<mutex> guard(m_schedulerMutex);
+    if (isChoked) m_chokedSeeders.insert(seederIpPort);
+    else m_chokedSeeders.erase(seederIpPort);
+}
+
+/**
+* @brief Checks whether a seeder holds a piece that is not completed yet.
+* @param seederIpPort IP:Port of the seeder.
+* @return True if the seeder may still be needed, false otherwise.
+*/
+bool PieceScheduler::holdsRemainingPieces(string seederIpPort) const {
+    lock_guard<mutex> guard(m_schedulerMutex);
+
+    auto it = m_seederPieces.find(seederIpPort);
+    if (it == m_seederPieces.end()) return false;
+    for (int i = 0; i < m_numPieces; i++) {
+        if (it->second[i] && m_pieceState[i] != COMPLETED) return true;
+    }
+    return false;
+}
+
+/**
+* @brief Marks a claimed piece as downloaded and verified.
+* @param pieceNumber The piece that was downloaded.
+* @param seederIpPort IP:Port of the seeder it was downloaded from.
+* @return True if this is the first copy of the piece, false if an endgame duplicate won already.
+*/
+bool PieceScheduler::completePiece(int pieceNumber, string seederIpPort) {
+    lock_guard<mutex> guard(m_schedulerMutex);
+
+    vector<string>& requestedFrom = m_requestedFrom[pieceNumber];
+    auto it = find(requestedFrom.begin(), requestedFrom.end(), seederIpPort);
+    if (it != requestedFrom.end()) requestedFrom.erase(it);
+
+    if (m_pieceState[pieceNumber] == COMPLETED) return false;
+
+    if (m_pieceState[pieceNumber] == PENDING) {
+        removeFromBucket(pieceNumber);
+        m_pendingPieces--;
+    }
+    m_pieceState[pieceNumber] = COMPLETED;
+    m_inFlightPieces.erase(pieceNumber);
+    m_remainingPieces--;
+    return true;
+}
+
+/**
+* @brief Releases a claimed piece after a failed attempt so that it can be retried.
+* @param pieceNumber The piece that failed.
+* @param seederIpPort IP:Port of the seeder it was requested from.
+* @details The piece becomes pending again once no other seeder is working on it,
+*          unless it ran out of attempts.
+*/
+void PieceScheduler::releasePiece(int pieceNumber, string seederIpPort) {
+    lock_guard<mutex> guard(m_schedulerMutex);
+
+    vector<string>& requestedFrom = m_requestedFrom[pieceNumber];
+    auto it = find(requestedFrom.begin(), requestedFrom.end(), seederIpPort);
+    if (it != requestedFrom.end()) requestedFrom.erase(it);
+
+    if (m_pieceState[pieceNumber] != IN_FLIGHT) return;
+
+    m_failedAttempts[pieceNumber]++;
+    if (!requestedFrom.empty()) return;
+
+    m_pieceState[pieceNumber] = PENDING;
+    m_inFlightPieces.erase(pieceNumber);
+    m_pendingPieces++;
+    if (m_failedAttempts[pieceNumber] < MAX_PIECE_ATTEMPTS) insertIntoBucket(pieceNumber);
+}
+
+/**
+* @brief Checks whether a piece has been completed.
+* @param pieceNumber The piece to check.
+* @return True if the piece is completed, false otherwise.
+*/
+bool PieceScheduler::isPieceCompleted(int pieceNumber) const {
+    lock_guard<mutex> guard(m_schedulerMutex);
+    return m_pieceState[pieceNumber] == COMPLETED;
+}
+
+/**
+* @brief Checks whether all pieces have been completed.
+* @return True if the download is complete, false otherwise.
+*/
+bool PieceScheduler::isComplete() const {
+    lock_guard<mutex> guard(m_schedulerMutex);
+    return m_remainingPieces == 0;
+}
+
+/**
+* @brief Checks whether the download cannot complete anymore.
+* @return True if a remaining piece ran out of attempts or is not held by any seeder, false otherwise.
+*/
+bool PieceScheduler::hasFailed() const {
+    lock_guard<mutex> guard(m_schedulerMutex);
+    for (int i = 0; i < m_numPieces; i++) {
+        if (m_pieceState[i] == COMPLETED) continue;
+        if (m_failedAttempts[i] >= MAX_PIECE_ATTEMPTS || m_availability[i] == 0) return true;
+    }
+    return false;
+}
@@ -14,95 +14,105 @@ void Seeder::init(){
 }
 
 /**
- * @brief Starts the Seeder by creating and detaching a thread to accept connections.
+ * @brief Starts the Seeder by handing its listening socket to the event loop.
  * 
- * This method spawns a new thread to handle incoming connections and detaches it
- * to allow it to run independently.
+ * The event loop accepts connections on its own thread and runs handleLeecher() for every
+ * frame on one of its EVENT_LOOP_WORKERS workers, so no thread is created per connection.
+ * Piece data is sent within the rate limits and upload slots of the UploadLimiter, a
+ * connection held back by them waits without taking a worker.
  * 
  * @return void
  */
 void Seeder::start(){
-    thread t(&Seeder::acceptConnections, this);
-    t.detach();
+    m_eventLoop.start(m_seederSocket.giveSocketFd(), [this](Connection& connection, const FrameHeader& header, string& receivedData) {
+        handleLeecher(connection, header, receivedData);
+    }, &m_uploadLimiter);
 }
 
 /**
- * @brief Stops the Seeder by closing the socket.
+ * @brief Stops the Seeder by stopping the event loop and closing the socket.
  * 
- * This method closes the socket, stopping the Seeder from accepting further connections.
+ * This method closes all connections and the socket, stopping the Seeder from accepting further connections.
  * 
  * @return void
  */
 void Seeder::stop(){
+    m_eventLoop.stop();
     m_seederSocket.closeSocket();
 }
 
 /**
- * @brief Accepts incoming connections and handles each connection in a separate thread.
+ * @brief Handles one frame received from a connected leecher.
  * 
- * This method runs in an infinite loop to accept incoming connections. For each connection,
- * it logs the event and spawns a new thread to handle the connection.
+ * This method processes the command in the frame and queues the appropriate response on the connection.
+ * It handles two commands: "give_piece_info" and "give_piece". Piece data is queued as a file range
+ * that is handed from the file to the socket with sendfile(), so it is never copied through user space,
+ * or as the buffer of a piece kept in the PieceCache, so a popular piece is not read from disk again.
+ * Every piece is preceded by its Merkle proof, so the leecher can verify it against the root alone.
+ * Leechers may pipeline "give_piece" requests, the replies are queued in request order and each
+ * starts with the piece number it answers.
+ * 
+ * @param connection The connection of the leecher.
+ * @param header The header of the frame.
+ * @param receivedData The command in the frame.
  * 
  * @return void
  */
-void Seeder::acceptConnections(){
-    while(true){
-        try{
-            int leecherSocketFd = m_seederSocket.acceptSocket();
-            m_logger.log("INFO", "Connection established with FD of " + to_string(leecherSocketFd));
-            thread t1(&Seeder::handleLeecher, this, leecherSocketFd);
-            t1.detach();
-        }
-        catch(const string& e){
-            m_logger.log("ERROR", e);
-        }
+void Seeder::handleLeecher(Connection& connection, const FrameHeader& header, string& receivedData){
+    int leecherSocketFd = connection.m_fd;
+    //: Every piece request passes here, the line is not built when COMMAND lines are filtered out
+    if (Logger::isEnabled("COMMAND")) {
+        m_logger.log("COMMAND", "LeecherSocket = " + to_string(leecherSocketFd) + " | Recieved from leecher : " + receivedData);
     }
-}
+    
+    string response = "";
+    uint8_t status = STATUS_SUCCESS;
+    auto startTime = chrono::steady_clock::now();
 
-/**
- * @brief Handles communication with a connected leecher.
- * 
- * This method reads commands from the leecher, processes them, and sends back appropriate responses.
- * It handles two commands: "give_piece_info" and "give_piece".
- * 
- * @param leecherSocketFd The file descriptor for the connected leecher's socket.
- * 
- * @return void
- */
-void Seeder::handleLeecher(int leecherSocketFd){
-    while (true) {
-        try{
-            string receivedData = m_seederSocket.recvSocket(leecherSocketFd);
+    vector <string> tokens = Utils::tokenize(receivedData, ' ');
+    if(!tokens.empty() && tokens[0] == "give_piece"){
+        uint32_t pieceNumber = htonl(tokens.size() == 4 ? (uint32_t)atoi(tokens[3].c_str()) : UINT32_MAX);
+        string pieceTag((char*)&pieceNumber, sizeof(pieceNumber));
 
-            if(receivedData == "") {
-                m_logger.log("INFO", "LeecherSocket = " + to_string(leecherSocketFd) + " | Leecher closed the connection!!");
-                break;
+        try{
+            PieceLocation location = locatePiece(tokens);
+            if (Logger::isEnabled("INFO")) {
+                m_logger.log("INFO", "leecherSocket = " + to_string(leecherSocketFd) + 
+                    " | Sending pieceData to leecher");
             }
-            m_logger.log("COMMAND", "LeecherSocket = " + to_string(leecherSocketFd) + " | Recieved from leecher : " + receivedData);
-            
-            string response = "";
 
-            try{
-                response = "Success: " + executeCommand(receivedData, leecherSocketFd);
-            }
-            catch(const string& e){
-                response = "Error: " + e;
-            }
-            
-            m_seederSocket.sendSocket(leecherSocketFd, response);
+            //: Piece data goes from the file or the cache to the socket without being copied
+            if(location.m_data) connection.queueBuffer(pieceTag + location.m_proof, location.m_data, OPCODE_PIECE);
+            else connection.queueFile(pieceTag + location.m_proof, location.m_file, location.m_offset, location.m_length, OPCODE_PIECE);
         }
         catch(const string& e){
-            m_logger.log("ERROR", "LeecherSocket = " + to_string(leecherSocketFd) + " | While handling leecher!! Error: " + e);
+            connection.queueFrame(pieceTag + e, OPCODE_PIECE, STATUS_ERROR);
         }
+
+        //: Time to find and queue the piece, sending it happens later as the socket takes it
+        Metrics::getInstance().recordCommand(tokens[0], chrono::steady_clock::now() - startTime);
+        return;
+    }
+
+    try{
+        response = executeCommand(receivedData, leecherSocketFd);
+    }
+    catch(const string& e){
+        response = e;
+        status = STATUS_ERROR;
     }
+    Metrics::getInstance().recordCommand(tokens.empty() ? "other" : tokens[0], chrono::steady_clock::now() - startTime);
+    
+    connection.queueFrame(response, OPCODE_RESPONSE, status);
 }
 
 /**
  * @brief Executes a command received from a leecher.
  * 
  * This method parses and executes commands from the leecher. It supports the following commands:
- * - "give_piece_info": Returns available piece information for a given file and group.
- * - "give_piece": Returns the requested piece data for a given file, group, and piece number.
+ * - "give_piece_info": Returns the packed bitfield of available pieces for a given file and group.
+ * 
+ * "give_piece" is not answered with a string, see locatePiece() and handleLeecher().
  * 
  * @param command The command string received from the leecher.
  * @param leecherSocketFd The file descriptor for the connected leecher's socket.
@@ -123,83 +133,120 @@ string Seeder::executeCommand(string command, int leecherSocketFd){
         string fileName = tokens[1];
         string groupName = tokens[2];
 
-        lock_guard <mutex> guard_1(Files::m_fileNameToFilePathMutex);
-        lock_guard <mutex> guard_2(Files::m_filePathToAvailablePiecesMutex);
-
-        // If {fileName, groupName} does not exist, return response with an empty string
-        if(Files::m_fileNameToFilePath.find({fileName, groupName}) == Files::m_fileNameToFilePath.end()){
-            return " ";
-        }
-
-        string filePath = Files::m_fileNameToFilePath[{fileName, groupName}];
-
-        // If filePath does not exist, remove entry from the first map and return response with an empty string
-        if(Files::m_filePathToAvailablePieces.find(filePath) == Files::m_filePathToAvailablePieces.end()){
-            Files::m_fileNameToFilePath.erase({fileName, groupName});
-            return " ";
+        // If {fileName, groupName} does not exist, return response with an empty bitfield
+        string filePath = Files::giveFilePath(fileName, groupName);
+        if(filePath == ""){
+            return "";
         }
 
-        // Building a space-separated response with available pieces
-        string temp = "";
-        for(auto it: Files::m_filePathToAvailablePieces[filePath]){
-            temp.append(" " + to_string(it));
-        }
+        // Packed bitfield of the available pieces, one bit per piece
+        string pieceInfo = Files::giveAvailablePieces(filePath);
 
         m_logger.log("INFO", "leecherSocket = " + to_string(leecherSocketFd) + 
-            " | Sending response to leecher. Response = " + temp);
-        return temp;
+            " | Sending piece bitfield of " + to_string(pieceInfo.size()) + " bytes to leecher");
+        return pieceInfo;
     }
 
-    if(tokens[0] == "give_piece"){
-        if(tokens.size() != 4) throw string("Invalid arguments to give_piece command!!");
-        
-        string fileName = tokens[1];
-        string groupName = tokens[2];
-        int pieceNumber = stoi(tokens[3]);
+    throw string("Invalid command!!");
+}
 
-        lock_guard <mutex> guard_1(Files::m_fileNameToFilePathMutex);
-        lock_guard <mutex> guard_2(Files::m_filePathToAvailablePiecesMutex);
+/**
+ * @brief Validates a "give_piece" command and locates the requested piece on disk.
+ * 
+ * The command is in the format of "give_piece fileName groupName pieceNumber". Registry
+ * locks are held only while looking up the file, not while touching the disk.
+ * 
+ * @param tokens Tokens of the "give_piece" command.
+ * 
+ * @return Location of the piece and its Merkle proof, holding the file open until it is dropped.
+ * 
+ * @throws string If the arguments are invalid, the piece is not available or the file can not be read.
+ */
+PieceLocation Seeder::locatePiece(vector<string> tokens){
+    if(tokens.size() != 4) throw string("Invalid arguments to give_piece command!!");
+    
+    string fileName = tokens[1];
+    string groupName = tokens[2];
+    int pieceNumber = atoi(tokens[3].c_str());
 
-        if(Files::m_fileNameToFilePath.find({fileName, groupName}) == Files::m_fileNameToFilePath.end()){
-            throw string("File not Exist!!");
-        }
+    string filePath = Files::giveFilePath(fileName, groupName);
+    if(filePath == ""){
+        throw string("File not Exist!!");
+    }
 
-        string filePath = Files::m_fileNameToFilePath[{fileName, groupName}];
-        if(Files::m_filePathToAvailablePieces.find(filePath) == Files::m_filePathToAvailablePieces.end()){
-            throw string("Filepieces map not Exist!!");
-        }
+    //: Lookups take shared locks of one registry shard only, the bits are read without any lock
+    shared_ptr<Bitfield> bitfield = Files::giveBitfield(filePath);
+    if(!bitfield){
+        throw string("Filepieces map not Exist!!");
+    }
+    if(pieceNumber < 0 || !bitfield->testBit(pieceNumber)){
+        throw string("Piece not Found!!");
+    }
 
-        vector <int> tempVec = Files::m_filePathToAvailablePieces[filePath];
-        if(find(tempVec.begin(), tempVec.end(), pieceNumber) == tempVec.end()){
-            throw string("Piece not Found!!");
-        }
+    int pieceSize = Files::givePieceSize(filePath);
+    shared_ptr<MerkleTree> merkleTree = Files::giveMerkleTree(filePath);
+    if(pieceSize <= 0 || !merkleTree){
+        throw string("Filepieces map not Exist!!");
+    }
 
-        int fd = open(filePath.c_str(), O_RDONLY, S_IRUSR);
-        if (fd == -1) {
-            throw string("Failed to open file at Seeder!!");
-        }
+    //: Files being shared stay open in the Files cache, so no path lookup is done per piece
+    PieceLocation location;
+    location.m_file = Files::giveFileHandle(filePath);
 
-        int pieceOffset = PIECE_SIZE * pieceNumber;
-        if(lseek(fd, pieceOffset, SEEK_SET) == -1){
-            throw string("Failed to Seek at seeder!!");
-        }
+    struct stat info;
+    if(fstat(location.m_file->m_fd, &info) == -1){
+        throw string("Failed to Stat file at seeder!!");
+    }
 
-        char buffer[PIECE_SIZE];
-        int bytesRead = read(fd, buffer, PIECE_SIZE);
-        if(bytesRead == -1){
-            throw string("Failed to Read a piece at seeder!!");
-        }
+    //: The last piece is shorter than the piece size
+    location.m_offset = (off_t)pieceSize * pieceNumber;
+    if(location.m_offset >= info.st_size){
+        throw string("Piece not Found!!");
+    }
+    location.m_length = min((off_t)pieceSize, info.st_size - location.m_offset);
 
-        close(fd);
-        
-        string pieceData(buffer, bytesRead);
+    //: Pieces are marked available only after their proof is known, so this holds for any set bit
+    location.m_proof = merkleTree->giveProof(pieceNumber);
 
-        m_logger.log("INFO", "leecherSocket = " + to_string(leecherSocketFd) + 
-            " | Sending pieceData to leecher");
+    readAhead(*location.m_file, pieceNumber, pieceSize, info.st_size);
+    location.m_data = m_pieceCache.givePiece(filePath, pieceNumber, location.m_file->m_fd, info, location.m_offset, location.m_length);
 
-        return pieceData;
+    return location;
+}
 
+/**
+ * @brief Asks the kernel to read the next pieces of a file walked in order.
+ * 
+ * Leechers ask for the rarest pieces first, which are in order while all seeders hold
+ * the same pieces, over several connections at once. A piece just after the one asked
+ * for last, within READAHEAD_PIECES, counts as walking in order. The kernel is then
+ * asked to read the following READAHEAD_PIECES pieces, only once for every piece, so
+ * that sendfile() finds them in the page cache.
+ * 
+ * @param file The open file.
+ * @param pieceNumber The piece asked for.
+ * @param pieceSize The piece size of the file.
+ * @param fileSize The size of the file.
+ * 
+ * @return void
+ */
+void Seeder::readAhead(FileHandle& file, int pieceNumber, int pieceSize, off_t fileSize){
+    //: Leechers racing on the same file may swap the last piece, it only costs a late read-ahead
+    int lastPiece = file.m_lastPiece.exchange(pieceNumber);
+    if(pieceNumber <= lastPiece || pieceNumber - lastPiece > READAHEAD_PIECES) return;
+
+    //: Pieces read ahead before are skipped, a walk starting over elsewhere reads ahead anew
+    int endPiece = pieceNumber + 1 + READAHEAD_PIECES;
+    int readAheadEnd = file.m_readAheadEnd.load();
+    int startPiece = (readAheadEnd > pieceNumber + 1 && readAheadEnd <= endPiece) ? readAheadEnd : pieceNumber + 1;
+    if(startPiece >= endPiece) return;
+    file.m_readAheadEnd = endPiece;
+
+    off_t offset = (off_t)pieceSize * startPiece;
+    if(offset >= fileSize) return;
+    off_t length = min((off_t)pieceSize * (endPiece - startPiece), fileSize - offset);
+    int result = posix_fadvise(file.m_fd, offset, length, POSIX_FADV_WILLNEED);
+    if(result != 0){
+        m_logger.log("ERROR", "Reading ahead " + to_string(length) + " bytes!! Error: " + string(strerror(result)));
     }
-
-    throw string("Invalid command!!");
 }
@@ -1,5 +1,15 @@
 #include "../headers.h"
 
+/**
+* @brief Initializes the server socket with the IP and port it will listen on.
+* @param serverIp The IP address of the server.
+* @param serverPort The port number on which the server will listen.
+*/
+ServerSocket::ServerSocket(string serverIp, int serverPort)
+: m_serverIp(serverIp)
+, m_serverPort(serverPort)
+{}
+
 /**
 * @brief Creates a socket using IPv4 and TCP.
 * @throws string If socket creation fails.
@@ -90,6 +100,14 @@ int ServerSocket::acceptSocket(){
     return clientSocket;
 }
 
+/**
+* @brief Gives the file descriptor of the listening socket.
+* @return The file descriptor, -1 if the socket is not created.
+*/
+int ServerSocket::giveSocketFd(){
+    return m_socketFd;
+}
+
 /**
 * @brief Closes the server socket and resets internal state.
 * @throws string If socket is not created before attempting to close.
@@ -105,65 +123,124 @@ void ServerSocket::closeSocket(){
 }
 
 /**
-* @brief Sends a response message to a client socket.
+* @brief Sends a response message to a client socket as a single frame.
 * @param clientSocketFd The file descriptor of the client socket.
 * @param response The response message to be sent.
+* @param opcode The kind of message, one of the OPCODE_* values.
+* @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
 * @throws string If sending message fails.
 */
-void ServerSocket::sendSocket(int clientSocketFd, string response){
+void ServerSocket::sendSocket(int clientSocketFd, string response, uint8_t opcode, uint8_t status){
     if(m_socketFd == -1) {
         throw string("Socket not exist!! Create socket first using createSocket()!!");
     }
-    string messageLength = to_string(response.size());
-    response = messageLength + " " + response;
 
-    // Send response to client socket
-    if(send(clientSocketFd, response.c_str(), response.size(), 0) < 0){
-        close(clientSocketFd);
-        throw string("Sending message to client at fd " + to_string(clientSocketFd) + "!!\nError: " + string(strerror(errno)));
+    FrameHeader header;
+    header.m_length = htonl(response.size());
+    header.m_opcode = opcode;
+    header.m_status = status;
+    header.m_reserved = 0;
+
+    //: Header and payload are gathered by the kernel, no need to concatenate them
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)response.data();
+    iov[1].iov_len = response.size();
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+
+    //: sendmsg() may send less than asked for, continue from where it stopped
+    while(message.msg_iovlen > 0){
+        ssize_t bytesSent = sendmsg(clientSocketFd, &message, MSG_NOSIGNAL);
+        if(bytesSent < 0){
+            if(errno == EINTR) continue;
+            throw string("Sending message to client at fd " + to_string(clientSocketFd) + "!!\nError: " + string(strerror(errno)));
+        }
+        while(message.msg_iovlen > 0 && (size_t)bytesSent >= message.msg_iov->iov_len){
+            bytesSent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if(message.msg_iovlen > 0){
+            message.msg_iov->iov_base = (char*)message.msg_iov->iov_base + bytesSent;
+            message.msg_iov->iov_len -= bytesSent;
+        }
     }
 }
 
 /**
-* @brief Receives a message from a client socket.
+* @brief Receives the header of the next frame from a client socket.
 * @param clientSocketFd The file descriptor of the client socket.
-* @return The received message as a string.
-* @throws string If receiving message fails.
+* @param header Set to the frame header in host byte order.
+* @return False if the client closed the connection before sending a header, true otherwise.
+* @throws string If receiving fails or the header is invalid.
 */
-string ServerSocket::recvSocket(int clientSocketFd){
+bool ServerSocket::recvHeader(int clientSocketFd, FrameHeader& header){
     if(m_socketFd == -1) {
         throw string("Socket not exist!! Create socket first using createSocket()!!");
     }
-    int totalDataLength = -1;
-    string receivedData = "";
 
-    while(true){
-        char buffer[524288]; // 512 KB Buffer
-        int bytesRead = recv(clientSocketFd, buffer, sizeof(buffer), 0);
-
-        if(bytesRead == 0) return ""; // Connection closed by client
-
-        if (bytesRead < 0) {
-            close(clientSocketFd);
-            throw string("Error receiving message from client-socket at fd " + to_string(clientSocketFd) + "!! Connection closed forcefully!!");
+    //: Header may arrive in parts, keep reading until all of it is received
+    char* buffer = (char*)&header;
+    size_t bytesReceived = 0;
+    while(bytesReceived < sizeof(header)){
+        ssize_t bytesRead = recv(clientSocketFd, buffer + bytesReceived, sizeof(header) - bytesReceived, 0);
+        if(bytesRead == 0) {
+            if(bytesReceived == 0) return false; // Connection closed by client
+            throw string("Client-socket at fd " + to_string(clientSocketFd) + " closed the connection in the middle of a frame!!");
+        }
+        if(bytesRead < 0) {
+            if(errno == EINTR) continue;
+            throw string("Error receiving message from client-socket at fd " + to_string(clientSocketFd) + "!!\nError: " + string(strerror(errno)));
         }
+        bytesReceived += bytesRead;
+    }
 
-        //: First token of receivedData will always be a length of total data to be recieved
-        receivedData += string(buffer, bytesRead);
+    header.m_length = ntohl(header.m_length);
+    header.m_reserved = ntohs(header.m_reserved);
+    if(header.m_length > MAX_FRAME_LENGTH) {
+        throw string("Frame of " + to_string(header.m_length) + " bytes from client-socket at fd " + to_string(clientSocketFd) + " is too large!!");
+    }
+    return true;
+}
 
-        if(totalDataLength == -1) {
-            vector<string> temp = Utils::tokenize(receivedData, ' ');
-            totalDataLength = stoi(temp[0]) - (bytesRead - (temp[0].size() + 1));
-            receivedData = receivedData.substr(temp[0].size() + 1);
-        }
-        else {
-            totalDataLength -= bytesRead;
+/**
+* @brief Receives the payload of a frame directly into a caller-supplied buffer.
+* @param clientSocketFd The file descriptor of the client socket.
+* @param buffer The buffer to receive into, at least length bytes long.
+* @param length The payload length from the frame header.
+* @throws string If receiving fails or the connection is closed.
+*/
+void ServerSocket::recvPayload(int clientSocketFd, char* buffer, size_t length){
+    size_t bytesReceived = 0;
+    while(bytesReceived < length){
+        ssize_t bytesRead = recv(clientSocketFd, buffer + bytesReceived, length - bytesReceived, 0);
+        if(bytesRead == 0) {
+            throw string("Client-socket at fd " + to_string(clientSocketFd) + " closed the connection in the middle of a frame!!");
         }
-
-        if(totalDataLength == 0) {
-            break;
+        if(bytesRead < 0) {
+            if(errno == EINTR) continue;
+            throw string("Error receiving message from client-socket at fd " + to_string(clientSocketFd) + "!!\nError: " + string(strerror(errno)));
         }
+        bytesReceived += bytesRead;
     }
+}
+
+/**
+* @brief Receives a whole frame from a client socket.
+* @param clientSocketFd The file descriptor of the client socket.
+* @return The payload of the frame as a string, or an empty string if the client closed the connection.
+* @throws string If receiving message fails.
+*/
+string ServerSocket::recvSocket(int clientSocketFd){
+    FrameHeader header;
+    if(!recvHeader(clientSocketFd, header)) return "";
 
+    string receivedData(header.m_length, '\0');
+    recvPayload(clientSocketFd, &receivedData[0], header.m_length);
     return receivedData;
 }
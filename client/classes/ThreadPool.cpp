@@ -1,52 +1,29 @@
 #include "../headers.h"
 
+thread_local ThreadPool* ThreadPool::m_currentPool = nullptr;
+thread_local size_t ThreadPool::m_currentWorker = 0;
+
 /**
 * @brief Constructs the ThreadPool and starts a specified number of worker threads.
 * @param numThreads The number of worker threads to create.
+* @param name Name of the pool in the metrics.
 */
-ThreadPool::ThreadPool(size_t numThreads) : m_stop(false), m_activeTasks(0) {
-    for (size_t i = 0; i < numThreads; ++i) {
-        m_workers.emplace_back([this] {
-            while (true) {
-                function<void()> task;
-
-                {
-                    unique_lock<mutex> lock(this->m_queueMutex);
-                    this->m_condition.wait(lock, [this] {
-                        return this->m_stop || !this->m_tasks.empty();
-                    });
-
-                    if (this->m_stop && this->m_tasks.empty()) return;
-
-                    task = move(this->m_tasks.front());
-                    this->m_tasks.pop();
-                    m_activeTasks++;
-                }
-
-                try {
-                    // Execute the task
-                    task();
-                } catch(const string& e) {
-                    generalLogger.log("ERROR", "THREAD POOL ERROR!! Error: " + e);
-                } catch (...) {
-                    generalLogger.log("ERROR", "THREAD POOL ERROR!! Unknown exception occurred.");
-                }
-
-                m_activeTasks--;
-
-                // Notify that a task has completed
-                m_waitCondition.notify_one();
-            }
-        });
-    }
+ThreadPool::ThreadPool(size_t numThreads, string name) : m_name(name) {
+    numThreads = max((size_t)1, numThreads);
+    for (size_t i = 0; i < numThreads; ++i) m_queues.push_back(make_unique<WorkerQueue>());
+
+    //: Queues exist before any worker starts, workers steal from all of them
+    for (size_t i = 0; i < numThreads; ++i) m_workers.emplace_back(&ThreadPool::workerThread, this, i);
+    Metrics::getInstance().addPool(this);
 }
 
 /**
-* @brief Destroys the ThreadPool by stopping all worker threads and joining them.
+* @brief Destroys the ThreadPool, running the tasks still queued, and joins all worker threads.
 */
 ThreadPool::~ThreadPool() {
+    Metrics::getInstance().removePool(this);
     {
-        unique_lock<mutex> lock(m_queueMutex);
+        lock_guard<mutex> lock(m_sleepMutex);
         m_stop = true;
     }
     m_condition.notify_all();
@@ -54,23 +31,154 @@ ThreadPool::~ThreadPool() {
 }
 
 /**
-* @brief Enqueues a task for execution by the thread pool.
-* @param task The task to be executed. It is a callable object (function, lambda, etc.).
+* @brief Takes a task for a worker, from its own queue or else from another one.
+* @param index Index of the worker.
+* @param task The task taken.
+* @return True if a task was taken, false if all queues are empty.
+*/
+bool ThreadPool::takeTask(size_t index, QueuedTask& task) {
+    //: Own queue oldest first, so tasks of a producer run in about the order they were given
+    {
+        WorkerQueue& queue = *m_queues[index];
+        lock_guard<mutex> lock(queue.m_queueMutex);
+        if (!queue.m_tasks.empty()) {
+            task = move(queue.m_tasks.front());
+            queue.m_tasks.pop_front();
+            return true;
+        }
+    }
+
+    //: Steal from the other end, away from the tasks the owner takes next
+    for (size_t i = 1; i < m_queues.size(); i++) {
+        WorkerQueue& queue = *m_queues[(index + i) % m_queues.size()];
+        lock_guard<mutex> lock(queue.m_queueMutex);
+        if (!queue.m_tasks.empty()) {
+            task = move(queue.m_tasks.back());
+            queue.m_tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* @brief The worker thread function that runs and steals tasks until the pool is stopped.
+* @param index Index of the worker.
+*/
+void ThreadPool::workerThread(size_t index) {
+    m_currentPool = this;
+    m_currentWorker = index;
+
+    while (true) {
+        QueuedTask task;
+        if (!takeTask(index, task)) {
+            unique_lock<mutex> lock(m_sleepMutex);
+            m_sleepingWorkers++;
+            m_condition.wait(lock, [this] {
+                return m_stop || m_queuedTasks > 0;
+            });
+            m_sleepingWorkers--;
+
+            if (m_stop && m_queuedTasks == 0) return;
+            continue;
+        }
+        m_queuedTasks--;
+
+        try {
+            // Execute the task
+            task.m_task();
+        } catch(const string& e) {
+            generalLogger.log("ERROR", "THREAD POOL ERROR!! Error: " + e);
+        } catch (...) {
+            generalLogger.log("ERROR", "THREAD POOL ERROR!! Unknown exception occurred.");
+        }
+
+        //: Captures are released before the waiter may return and free what they refer to
+        task.m_task = Task();
+
+        //: Waiters are woken once their last task is done, not after every task.
+        //: Counted down under the lock, a waiter may free its group as soon as it sees zero
+        if (task.m_group) {
+            lock_guard<mutex> lock(task.m_group->m_groupMutex);
+            if (--task.m_group->m_pendingTasks == 0) task.m_group->m_groupDone.notify_all();
+        }
+        if (--m_unfinishedTasks == 0) {
+            lock_guard<mutex> lock(m_waitMutex);
+            m_waitCondition.notify_all();
+        }
+    }
+}
+
+/**
+* @brief Queues a task.
+* @param task The task.
+* @param group Group of the task, null if it has none.
 * @throws runtime_error If the thread pool is stopped and no more tasks can be enqueued.
 */
-void ThreadPool::enqueueTask(function<void()> task) {
+void ThreadPool::pushTask(Task task, TaskGroup* group) {
+    if (m_stop) throw runtime_error("enqueue on stopped ThreadPool");
+
+    //: Counted before it is queued, a worker may finish it before this returns
+    if (group) group->m_pendingTasks++;
+    m_unfinishedTasks++;
+
+    size_t index = (m_currentPool == this) ? m_currentWorker : m_nextQueue++ % m_queues.size();
     {
-        unique_lock<mutex> lock(m_queueMutex);
-        if (m_stop) throw runtime_error("enqueue on stopped ThreadPool");
-        m_tasks.emplace(move(task));
+        WorkerQueue& queue = *m_queues[index];
+        lock_guard<mutex> lock(queue.m_queueMutex);
+        queue.m_tasks.push_back({move(task), group});
+    }
+    m_queuedTasks++;
+
+    //: A worker going to sleep counts itself before it checks for tasks, so one of the two sees the other
+    if (m_sleepingWorkers > 0) {
+        { lock_guard<mutex> lock(m_sleepMutex); }
+        m_condition.notify_one();
     }
-    m_condition.notify_one();
 }
 
 /**
 * @brief Blocks until all enqueued tasks have been completed.
 */
 void ThreadPool::wait() {
-    unique_lock<mutex> lock(m_queueMutex);
-    m_waitCondition.wait(lock, [this] { return m_tasks.empty() && m_activeTasks == 0; });
+    unique_lock<mutex> lock(m_waitMutex);
+    m_waitCondition.wait(lock, [this] { return m_unfinishedTasks == 0; });
+}
+
+/**
+* @brief Gives the name of the pool in the metrics.
+*/
+const string& ThreadPool::giveName() const {
+    return m_name;
+}
+
+/**
+* @brief Gives the number of worker threads.
+*/
+size_t ThreadPool::giveWorkers() const {
+    return m_workers.size();
+}
+
+/**
+* @brief Gives the number of tasks waiting in the queues, not taken by a worker yet.
+*/
+int ThreadPool::giveQueuedTasks() const {
+    return max(0, m_queuedTasks.load(memory_order_relaxed));
+}
+
+/**
+* @brief Gives the number of tasks being run by workers now.
+*/
+int ThreadPool::giveActiveTasks() const {
+    //: Both counters are read apart, so a task just queued or taken may be off by one for a moment
+    return max(0, m_unfinishedTasks.load(memory_order_relaxed) - m_queuedTasks.load(memory_order_relaxed));
+}
+
+/**
+* @brief Blocks until all tasks of a group have been completed.
+* @param group The group to wait for.
+*/
+void ThreadPool::wait(TaskGroup& group) {
+    unique_lock<mutex> lock(group.m_groupMutex);
+    group.m_groupDone.wait(lock, [&group] { return group.m_pendingTasks == 0; });
 }
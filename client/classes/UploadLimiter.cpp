@@ -0,0 +1,195 @@
+#include "../headers.h"
+
+/**
+* @brief Sets the rate and fills the bucket.
+* @param rate Bytes per second, 0 for no limit.
+*/
+void UploadLimiter::TokenBucket::setRate(double rate) {
+    m_rate = rate;
+    //: A quantum always fits, so a slow rate still sends whole quanta instead of a trickle of small sends
+    m_capacity = max(rate * UPLOAD_BURST_INTERVAL / 1000, (double)UPLOAD_QUANTUM);
+    m_tokens = m_capacity;
+    m_refilledAt = chrono::steady_clock::now();
+}
+
+/**
+* @brief Cuts an allowance down to the bytes the bucket holds.
+* @param now The current time.
+* @param wanted Bytes waiting to be sent.
+* @param allowed Bytes to be sent, lowered to what the bucket allows, 0 if it must be waited for.
+* @param wait Raised to the time until the bucket allows a quantum, if it does not now.
+*/
+void UploadLimiter::TokenBucket::limit(chrono::steady_clock::time_point now, size_t wanted, size_t& allowed, chrono::steady_clock::duration& wait) {
+    if (m_rate <= 0) return;
+
+    double elapsed = chrono::duration<double>(now - m_refilledAt).count();
+    m_tokens = min(m_capacity, m_tokens + elapsed * m_rate);
+    m_refilledAt = now;
+
+    double needed = min(wanted, (size_t)UPLOAD_QUANTUM);
+    if (m_tokens < needed) {
+        wait = max(wait, chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>((needed - m_tokens) / m_rate)));
+        allowed = 0;
+        return;
+    }
+    allowed = min(allowed, (size_t)min(m_tokens, (double)UPLOAD_QUANTUM));
+}
+
+/**
+* @brief Reads a limit from the environment.
+* @param name Name of the environment variable.
+* @param fallback The limit used if the variable is not set or not a number.
+* @return The limit.
+*/
+long long UploadLimiter::giveSetting(const char* name, long long fallback) {
+    const char* value = getenv(name);
+    if (!value || !*value || string(value).find_first_not_of("0123456789") != string::npos) return fallback;
+    return atoll(value);
+}
+
+/**
+* @brief Creates the limiter with the limits of the environment, see UPLOAD_RATE_LIMIT,
+*        PEER_UPLOAD_RATE_LIMIT and UPLOAD_SLOTS.
+*/
+UploadLimiter::UploadLimiter() {
+    m_bucket.setRate(giveSetting("P2P_UPLOAD_RATE", UPLOAD_RATE_LIMIT));
+    m_peerRate = giveSetting("P2P_PEER_UPLOAD_RATE", PEER_UPLOAD_RATE_LIMIT);
+    m_slots = giveSetting("P2P_UPLOAD_SLOTS", UPLOAD_SLOTS);
+}
+
+/**
+* @brief Counts a new connection of a leecher.
+* @param peerIp IP address of the leecher.
+*/
+void UploadLimiter::addConnection(const string& peerIp) {
+    lock_guard<mutex> guard(m_limiterMutex);
+    Peer& peer = m_peers[peerIp];
+    if (peer.m_connections++ == 0) peer.m_bucket.setRate(m_peerRate);
+}
+
+/**
+* @brief Forgets a closed connection of a leecher, freeing its slot with its last connection.
+* @param peerIp IP address of the leecher.
+*/
+void UploadLimiter::removeConnection(const string& peerIp) {
+    lock_guard<mutex> guard(m_limiterMutex);
+    auto it = m_peers.find(peerIp);
+    if (it == m_peers.end() || --it->second.m_connections > 0) return;
+
+    chokeLocked(it->second);
+    if (it->second.m_isWaiting) m_waitingPeers.erase(find(m_waitingPeers.begin(), m_waitingPeers.end(), peerIp));
+    m_peers.erase(it);
+    rotateLocked(chrono::steady_clock::now());
+}
+
+/**
+* @brief Takes the slot of a leecher.
+* @param peer The leecher.
+* @note Expects m_limiterMutex to be held.
+*/
+void UploadLimiter::chokeLocked(Peer& peer) {
+    if (!peer.m_isUnchoked) return;
+    peer.m_isUnchoked = false;
+    m_unchokedPeers--;
+}
+
+/**
+* @brief Takes slots from idle and long holders and gives free slots to waiting leechers.
+* @param now The current time.
+* @note Expects m_limiterMutex to be held.
+*/
+void UploadLimiter::rotateLocked(chrono::steady_clock::time_point now) {
+    if (!m_waitingPeers.empty() && m_slots > 0) {
+        Peer* longestHolder = nullptr;
+        string longestHolderIp;
+        for (auto& it : m_peers) {
+            Peer& peer = it.second;
+            if (!peer.m_isUnchoked) continue;
+
+            //: A leecher asks for a slot again once it asks for pieces again
+            if (now - peer.m_lastActiveAt >= chrono::milliseconds(UPLOAD_IDLE_TIMEOUT)) {
+                chokeLocked(peer);
+                continue;
+            }
+            if (!longestHolder || peer.m_unchokedSince < longestHolder->m_unchokedSince) {
+                longestHolder = &peer;
+                longestHolderIp = it.first;
+            }
+        }
+
+        //: Busy holder goes to the back of the queue, so the slots go round all leechers
+        if (m_unchokedPeers >= m_slots && longestHolder && now - longestHolder->m_unchokedSince >= chrono::milliseconds(UPLOAD_SLOT_ROTATION)) {
+            chokeLocked(*longestHolder);
+            longestHolder->m_isWaiting = true;
+            m_waitingPeers.push_back(longestHolderIp);
+        }
+    }
+
+    while (!m_waitingPeers.empty() && (m_slots == 0 || m_unchokedPeers < m_slots)) {
+        Peer& peer = m_peers[m_waitingPeers.front()];
+        m_waitingPeers.pop_front();
+        peer.m_isWaiting = false;
+        peer.m_isUnchoked = true;
+        peer.m_unchokedSince = now;
+        peer.m_lastActiveAt = now;
+        m_unchokedPeers++;
+    }
+}
+
+/**
+* @brief Checks whether a leecher holds an upload slot, queueing it for one if it does not.
+* @param peerIp IP address of the leecher.
+* @param resumeAt Set to the time to check again if the leecher is choked.
+* @return True if a piece can be sent to the leecher.
+*/
+bool UploadLimiter::admit(const string& peerIp, chrono::steady_clock::time_point& resumeAt) {
+    lock_guard<mutex> guard(m_limiterMutex);
+    auto now = chrono::steady_clock::now();
+    Peer& peer = m_peers[peerIp];
+    peer.m_lastActiveAt = now;
+
+    if (!peer.m_isUnchoked && !peer.m_isWaiting) {
+        peer.m_isWaiting = true;
+        m_waitingPeers.push_back(peerIp);
+    }
+    rotateLocked(now);
+    if (peer.m_isUnchoked) return true;
+
+    resumeAt = now + chrono::milliseconds(UPLOAD_CHOKED_RECHECK);
+    return false;
+}
+
+/**
+* @brief Gives the bytes of piece data that may be sent to a leecher now.
+* @param peerIp IP address of the leecher.
+* @param wanted Bytes waiting to be sent.
+* @param resumeAt Set to the time more bytes may be sent if none may be sent now.
+* @return Between 0 and wanted bytes, the bytes sent must be passed to consume().
+*/
+size_t UploadLimiter::giveAllowance(const string& peerIp, size_t wanted, chrono::steady_clock::time_point& resumeAt) {
+    lock_guard<mutex> guard(m_limiterMutex);
+    auto now = chrono::steady_clock::now();
+    Peer& peer = m_peers[peerIp];
+    peer.m_lastActiveAt = now;
+
+    //: Both buckets are refilled before either is waited for, the longer wait wins
+    size_t allowed = wanted;
+    chrono::steady_clock::duration wait{0};
+    m_bucket.limit(now, wanted, allowed, wait);
+    peer.m_bucket.limit(now, wanted, allowed, wait);
+    if (allowed == 0) resumeAt = now + wait;
+    return allowed;
+}
+
+/**
+* @brief Takes the bytes sent to a leecher from the buckets.
+* @param peerIp IP address of the leecher.
+* @param bytes Bytes of piece data sent.
+*/
+void UploadLimiter::consume(const string& peerIp, size_t bytes) {
+    lock_guard<mutex> guard(m_limiterMutex);
+    if (m_bucket.m_rate > 0) m_bucket.m_tokens -= bytes;
+
+    auto it = m_peers.find(peerIp);
+    if (it != m_peers.end() && it->second.m_bucket.m_rate > 0) it->second.m_bucket.m_tokens -= bytes;
+}
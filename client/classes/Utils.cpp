@@ -4,7 +4,7 @@
 * @brief Processes and validates command-line arguments.
 * @param argc The argument count.
 * @param argv The argument vector.
-* @return A vector of strings containing the processed arguments.
+* @return IP and port of the seeder, then IP and port of every tracker, the tracker picked by number first.
 * @throws string If the number of arguments is incorrect or if any argument is invalid.
 */
 vector<string> Utils::processArgs(int argc, char *argv[]) {
@@ -37,24 +37,27 @@ vector<string> Utils::processArgs(int argc, char *argv[]) {
 
     char buffer[524288];
     int bytesRead = read(fd, buffer, sizeof(buffer));
+    close(fd);
     if (bytesRead <= 0) {
         string s = trackerInfoFileName;
         throw string("Reading " + s + " file!!");
     }
 
-    vector<string> ipAndPorts = tokenize(buffer, '\n');
-    if (ipAndPorts.size() < trackerNumber) {
+    vector<string> ipAndPorts = tokenize(string(buffer, bytesRead), '\n');
+    if ((int)ipAndPorts.size() < trackerNumber) {
         throw string("IP and port of tracker number " + to_string(trackerNumber) + " is not defined in file!!");
     }
 
-    string ipAndPort = ipAndPorts[trackerNumber - 1];
-    vector<string> trackerIpPortVec = tokenize(ipAndPort, ':');
-    if (trackerIpPortVec.size() != 2) {
-        throw string("Invalid format of ip:port of tracker number " + to_string(trackerNumber) + "!!");
+    //: The tracker picked is tried first, the others take over when it can not be reached
+    for (int i = 0; i < (int)ipAndPorts.size(); i++) {
+        int number = (trackerNumber - 1 + i) % ipAndPorts.size();
+        vector<string> trackerIpPortVec = tokenize(ipAndPorts[number], ':');
+        if (trackerIpPortVec.size() != 2) {
+            throw string("Invalid format of ip:port of tracker number " + to_string(number + 1) + "!!");
+        }
+        temp.push_back(trackerIpPortVec[0]);
+        temp.push_back(trackerIpPortVec[1]);
     }
-
-    temp.push_back(trackerIpPortVec[0]);
-    temp.push_back(trackerIpPortVec[1]);
     return temp;
 }
 
@@ -79,78 +82,201 @@ vector<string> Utils::tokenize(string buffer, char separator) {
     return ans;
 }
 
+/**
+* @brief Splits the payload of a batch response into the responses of its commands.
+* @param payload The payload, "Status <space> Length \n Response" for every command.
+* @return Status and response of every command, in order.
+* @throws string If the payload is not made of such responses.
+*/
+vector<pair<uint8_t, string>> Utils::unpackReplies(const string& payload) {
+    vector<pair<uint8_t, string>> replies;
+    size_t offset = 0;
+    while (offset < payload.size()) {
+        //: Responses may hold '\n' themselves, only the line before each one is parsed
+        size_t lineEnd = payload.find('\n', offset);
+        if (lineEnd == string::npos) throw string("Invalid responses of batch!!");
+        vector<string> tokens = tokenize(payload.substr(offset, lineEnd - offset), ' ');
+        if (tokens.size() != 2 || (tokens[0] != to_string(STATUS_SUCCESS) && tokens[0] != to_string(STATUS_ERROR))
+            || tokens[1].find_first_not_of("0123456789") != string::npos) {
+            throw string("Invalid responses of batch!!");
+        }
+
+        size_t length = stoull(tokens[1]);
+        if (length > payload.size() - lineEnd - 1) throw string("Invalid responses of batch!!");
+        replies.push_back({(uint8_t)stoi(tokens[0]), payload.substr(lineEnd + 1, length)});
+        offset = lineEnd + 1 + length;
+    }
+    return replies;
+}
+
 /**
 * @brief Computes the SHA-256 hashes of a file.
 * @param filePath The path to the file.
+* @param pieceSize The size of every piece except possibly the last one.
 * @return A vector of SHA-256 hashes, where the first entry is the hash of the entire file
 *         and the subsequent entries are hashes of individual pieces.
 * @throws string If there is an error opening or reading the file.
+* @details The file is mapped into memory and walked once from start to end. Every piece
+*          is handed to a thread pool as soon as it is reached and hashed there, while this
+*          thread feeds the same bytes into the digest of the entire file, so the page cache
+*          is read sequentially and piece digests cost no extra wall time.
 */
-vector<string> Utils::findSHA(string filePath) {
+vector<string> Utils::findSHA(string filePath, int pieceSize) {
     int fileFd = open(filePath.c_str(), O_RDONLY);
     if (fileFd < 0) {
         throw string("Opening file at findSHA()!!\nError: " + string(strerror(errno)));
     }
-    SHA256_CTX sha256_1;
-    SHA256_Init(&sha256_1);
 
-    vector<SHA256_CTX> temp;
-    char buffer[PIECE_SIZE];
-    ssize_t bytesRead;
-
-    while ((bytesRead = read(fileFd, buffer, sizeof(buffer))) > 0) {
-        SHA256_CTX sha256_2;
-        SHA256_Init(&sha256_2);
-        SHA256_Update(&sha256_1, buffer, bytesRead);
-        SHA256_Update(&sha256_2, buffer, bytesRead);
+    struct stat info;
+    if (fstat(fileFd, &info) < 0) {
+        close(fileFd);
+        throw string("Reading file at findSHA()!!\nError: " + string(strerror(errno)));
+    }
+    size_t fileSize = info.st_size;
+    size_t numPieces = (fileSize + pieceSize - 1) / pieceSize;
 
-        temp.push_back(sha256_2);
+    //: An empty file can not be mapped, it has no pieces and only the digest of no data
+    const char* fileData = nullptr;
+    if (fileSize > 0) {
+        void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fileFd, 0);
+        if (mapping == MAP_FAILED) {
+            close(fileFd);
+            throw string("Mapping file at findSHA()!!\nError: " + string(strerror(errno)));
+        }
+        fileData = (const char*)mapping;
+        madvise(mapping, fileSize, MADV_SEQUENTIAL);
     }
     close(fileFd);
 
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_Final(hash, &sha256_1);
+    vector<string> fileSHAs(numPieces + 1);
+    EVP_MD_CTX* fileContext = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(fileContext, EVP_sha256(), nullptr);
+    {
+        //: Every task writes only its own entry of fileSHAs, so they need no locking
+        ThreadPool& pool = giveHashPool();
+        TaskGroup pieces;
+        for (size_t i = 0; i < numPieces; i++) {
+            const char* pieceData = fileData + i * pieceSize;
+            size_t pieceLength = min((size_t)pieceSize, fileSize - i * pieceSize);
 
-    char hex_hash[2 * SHA256_DIGEST_LENGTH + 1];
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(hex_hash + 2 * i, "%02x", hash[i]);
+            pool.enqueueTask([&fileSHAs, i, pieceData, pieceLength] {
+                fileSHAs[i + 1] = findPieceSHA(pieceData, pieceLength);
+            }, &pieces);
+            EVP_DigestUpdate(fileContext, pieceData, pieceLength);
+        }
+        pool.wait(pieces);
     }
 
-    vector<string> fileSHAs;
-    fileSHAs.push_back(hex_hash);
-    
-    for (auto &it : temp) {
-        unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256_Final(hash, &it);
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLength = 0;
+    EVP_DigestFinal_ex(fileContext, hash, &hashLength);
+    EVP_MD_CTX_free(fileContext);
+    fileSHAs[0] = toHex(hash, hashLength);
 
-        char hex_hash[2 * SHA256_DIGEST_LENGTH + 1];
-        for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-            sprintf(hex_hash + 2 * i, "%02x", hash[i]);
-        }
-        fileSHAs.push_back(hex_hash);
-    }
+    if (fileData) munmap((void*)fileData, fileSize);
     return fileSHAs;
 }
 
+/**
+* @brief Gives the pool hashing pieces, shared by all uploads and journal checks.
+* @return The pool, with one worker per CPU.
+*/
+ThreadPool& Utils::giveHashPool() {
+    //: Hashing is bound by the CPU, concurrent uploads share the workers instead of each starting its own
+    static ThreadPool hashPool(max(1u, thread::hardware_concurrency()), "hash");
+    return hashPool;
+}
+
+/**
+* @brief Formats bytes as lowercase hexadecimal.
+* @param bytes The bytes to format.
+* @param length The number of bytes.
+* @return The hexadecimal string, twice as long as the input.
+*/
+string Utils::toHex(const unsigned char* bytes, size_t length) {
+    static const char hexDigits[] = "0123456789abcdef";
+    string hex(2 * length, '0');
+    for (size_t i = 0; i < length; i++) {
+        hex[2 * i] = hexDigits[bytes[i] >> 4];
+        hex[2 * i + 1] = hexDigits[bytes[i] & 0x0F];
+    }
+    return hex;
+}
+
+/**
+* @brief Parses lowercase or uppercase hexadecimal into bytes.
+* @param hex The hexadecimal string, of even length.
+* @return The bytes, half as long as the input.
+* @throws string If the string is not valid hexadecimal.
+*/
+string Utils::fromHex(const string& hex) {
+    if (hex.size() % 2) throw string("Invalid hexadecimal string!!");
+
+    string bytes(hex.size() / 2, '\0');
+    for (size_t i = 0; i < hex.size(); i++) {
+        char c = hex[i];
+        int value = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        if (value < 0) throw string("Invalid hexadecimal string!!");
+        bytes[i / 2] = (char)((bytes[i / 2] << 4) | value);
+    }
+    return bytes;
+}
+
+/**
+* @brief Chooses the piece size of a file based on its size.
+* @param fileSize The size of the file in bytes.
+* @return The smallest power of two between MIN_PIECE_SIZE and MAX_PIECE_SIZE
+*         that splits the file into at most TARGET_PIECES pieces, or P2P_PIECE_SIZE
+*         if it is set to such a power of two.
+*/
+int Utils::givePieceSize(long long fileSize) {
+    //: Fixed piece size is for benchmarks, a size the tracker would refuse is ignored
+    const char* fixedSize = getenv("P2P_PIECE_SIZE");
+    long long fixedPieceSize = fixedSize ? atoll(fixedSize) : 0;
+    if (fixedPieceSize >= MIN_PIECE_SIZE && fixedPieceSize <= MAX_PIECE_SIZE && !(fixedPieceSize & (fixedPieceSize - 1))) {
+        return fixedPieceSize;
+    }
+
+    int pieceSize = MIN_PIECE_SIZE;
+    while (pieceSize < MAX_PIECE_SIZE && (long long)pieceSize * TARGET_PIECES < fileSize) {
+        pieceSize *= 2;
+    }
+    return pieceSize;
+}
+
 /**
 * @brief Computes the SHA-256 hash of a piece of data.
 * @param pieceData The data for which to compute the hash.
 * @return The SHA-256 hash as a hexadecimal string.
 */
 string Utils::findPieceSHA(string pieceData) {
-    SHA256_CTX sha256_2;
-    SHA256_Init(&sha256_2);
-    SHA256_Update(&sha256_2, pieceData.c_str(), pieceData.size());
+    return findPieceSHA(pieceData.c_str(), pieceData.size());
+}
 
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_Final(hash, &sha256_2);
+/**
+* @brief Computes the SHA-256 hash of a piece of data held in a buffer.
+* @param pieceData The buffer holding the data.
+* @param length The number of bytes in the buffer.
+* @return The SHA-256 hash as a hexadecimal string.
+*/
+string Utils::findPieceSHA(const char* pieceData, size_t length) {
+    string digest = findPieceDigest(pieceData, length);
+    return toHex((const unsigned char*)digest.data(), digest.size());
+}
 
-    char hex_hash[2 * SHA256_DIGEST_LENGTH + 1];
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(hex_hash + 2 * i, "%02x", hash[i]);
+/**
+* @brief Computes the raw SHA-256 digest of a piece of data held in a buffer.
+* @param pieceData The buffer holding the data.
+* @param length The number of bytes in the buffer.
+* @return The SHA-256 digest, SHA256_DIGEST_LENGTH bytes.
+*/
+string Utils::findPieceDigest(const char* pieceData, size_t length) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLength = 0;
+    if (!EVP_Digest(pieceData, length, hash, &hashLength, EVP_sha256(), nullptr)) {
+        throw string("Hashing a piece!!");
     }
-
-    return hex_hash;
+    return string((char*)hash, hashLength);
 }
 
 /**
@@ -159,7 +285,7 @@ string Utils::findPieceSHA(string pieceData) {
 * @return The size of the file in bytes.
 * @throws string If there is an error opening or seeking the file.
 */
-int Utils::giveFileSize(string filePath) {
+long long Utils::giveFileSize(string filePath) {
     int fileFd = open(filePath.c_str(), O_RDONLY);
     if (fileFd < 0) {
         throw string("Opening file at giveFileSize()\nError: " + string(strerror(errno)));
@@ -18,8 +18,8 @@ int main(int argc, char* argv[]){
         // Process command-line arguments to extract IP addresses and port numbers
         vector <string> ipAndPorts = Utils::processArgs(argc, argv);
 
-        // Check if the correct number of arguments have been provided
-        if(ipAndPorts.size() != 4) {
+        // Check if the seeder and at least one tracker have been provided
+        if(ipAndPorts.size() < 4 || ipAndPorts.size() % 2 != 0) {
             cout << string(RED) + "Args processing failed!!\n" + string(RESET) << flush;
             return 1; // Exit with an error code if arguments are incorrect
         }
@@ -27,8 +27,8 @@ int main(int argc, char* argv[]){
         // Extract IP and port values from processed arguments
         string seederIp = ipAndPorts[0];
         int seederPort = stoi(ipAndPorts[1]);
-        string trackerIp = ipAndPorts[2];
-        int trackerPort = stoi(ipAndPorts[3]);
+        vector<pair<string, int>> trackers;
+        for(size_t i = 2; i < ipAndPorts.size(); i += 2) trackers.push_back({ipAndPorts[i], stoi(ipAndPorts[i + 1])});
 
         // Initialize the logger with the Seeder's IP and port
         generalLogger = Logger(seederIp, seederPort, "general");
@@ -43,9 +43,8 @@ int main(int argc, char* argv[]){
         Leecher& leecher = Leecher::getInstance(seederIp, seederPort);
         generalLogger.log("INFO", "Leecher created successfully!!");   
 
-        // Initialize and connect the Leecher to the tracker
-        leecher.init();
-        leecher.connectTracker(trackerIp, trackerPort);
+        // Connect the Leecher to the first reachable tracker, the others are used for reads and failover
+        leecher.connectTracker(trackers);
         generalLogger.log("INFO", "Leecher connected to tracker successfully!!");
         
         // Start the Leecher
@@ -2,25 +2,112 @@
 #include <string>                   // For string
 #include <vector>                   // For vector
 #include <map>                      // For map
+#include <unordered_map>            // For unordered_map
+#include <unordered_set>            // For unordered_set of choked seeders
 #include <set>                      // For set
 #include <queue>                    // For queue
+#include <deque>                    // For deque of queued output
+#include <list>                     // For list of the open file cache
+#include <fstream>                  // For ifstream of batch scripts
+#include <memory>                   // For shared_ptr
 #include <atomic>                   // For atomic
 #include <condition_variable>       // For condition_variable
 #include <thread>                   // For threads
 #include <mutex>                    // For mutex
+#include <shared_mutex>             // For shared_mutex of the Files registry
 #include <functional>               // for function <void()>
+#include <type_traits>              // For the callables stored in pool tasks
+#include <new>                      // For placement new of pool tasks
+#include <cstddef>                  // For max_align_t
+#include <ctime>                    // For timestamps of log lines
+#include <climits>                  // For IOV_MAX
+#include <algorithm>                // For shuffle
+#include <cstdint>                  // For fixed width integers of frame header
 #include <arpa/inet.h>              // For socket programming
+#include <sys/uio.h>                // For iovec
 #include <fcntl.h>                  // For open()
 #include <unistd.h>                 // For close()
 #include <sys/stat.h>               // For stat()
+#include <sys/sendfile.h>           // For sendfile()
+#include <sys/mman.h>               // For mmap() of files being hashed
+#include <sys/epoll.h>              // For epoll
+#include <sys/eventfd.h>            // For eventfd to wake the event loop
+#include <dirent.h>                 // For listing journals
+#include <chrono>                   // For the sync interval of journals
 #include <errno.h>                  // For errno
 #include <cstring>                  // For strerror
+#include <strings.h>                // For strcasecmp() of log types
 #include <openssl/hmac.h>           // For HMAC operations
 #include <openssl/sha.h>            // For SHA hashing
+#include <openssl/evp.h>            // For EVP digests, which use SHA extensions of the CPU where available
 #include <random>                   // For randomness at piece selection
+#include <cmath>                    // For ceil() of pipeline windows
 
 #define POOL_SIZE 10
-#define PIECE_SIZE 1024
+#define LOG_LEVEL_COMMAND 0         // Level of "COMMAND" lines, every message sent and received
+#define LOG_LEVEL_INFO 1            // Level of "INFO" lines and of lines of unknown type
+#define LOG_LEVEL_SUCCESS 2         // Level of "SUCCESS" lines
+#define LOG_LEVEL_ERROR 3           // Level of "ERROR" lines, written without waiting for the next flush
+#define MIN_LOG_LEVEL LOG_LEVEL_COMMAND // Lines below this level are dropped before anything is formatted, P2P_LOG_LEVEL raises it at runtime
+#define LOG_RING_CAPACITY 1024      // Lines a thread can queue for the log writer before further lines are dropped
+#define LOG_FLUSH_INTERVAL 50       // Milliseconds between two writes of queued log lines
+#define LOG_MAX_LINE_LENGTH 4096    // Bytes of a log line kept, longer lines are cut
+#define TASK_INLINE_SIZE 64         // Bytes of a callable stored inside a pool task, larger ones are heap allocated
+#define EVENT_LOOP_WORKERS 4        // Worker threads handling the frames of all seeder connections
+#define MAX_EPOLL_EVENTS 256        // Events fetched by one epoll_wait() call
+#define READ_CHUNK_SIZE 65536       // Bytes read from a connection by one recv() call
+#define MAX_READ_PER_EVENT 1048576  // Bytes read from a connection before its frames are handled
+#define MIN_PIECE_SIZE 262144       // Smallest piece size a file is split into (256 KiB)
+#define MAX_PIECE_SIZE 4194304      // Largest piece size a file is split into (4 MiB)
+#define TARGET_PIECES 1024          // Number of pieces the piece size is scaled for
+#define MAX_PIECE_ATTEMPTS 3        // Attempts per piece before the download is marked as failed
+#define ENDGAME_PIECES 16           // Remaining pieces at which duplicate requests are raced
+#define PIPELINE_WINDOW 8           // "give_piece" requests kept in flight on one seeder connection
+#define MAX_CONNECTIONS_PER_PEER 4  // Connections to one seeder open at once, shared by all downloads
+#define PEER_IDLE_TIMEOUT 30000     // Milliseconds an unused connection to a seeder is kept open
+#define PEER_STATS_WEIGHT 0.25      // Weight of the newest sample in the moving averages of a seeder
+#define PEER_MIN_SAMPLES 4          // Pieces measured from a seeder before it can be choked
+#define PEER_CHOKE_SPEED_RATIO 0.2  // Seeders slower than this share of the fastest one are choked
+#define PEER_CHOKE_ERROR_RATE 0.5   // Seeders failing more than this share of pieces are choked
+#define OPTIMISTIC_UNCHOKE_INTERVAL 10000 // Milliseconds a seeder stays choked before it is tried again
+#define OPTIMISTIC_UNCHOKE_PIECES 4 // Pieces a seeder tried again is measured on before it is judged again
+#define CHOKED_RECHECK_INTERVAL 200 // Milliseconds a worker of a choked seeder waits before checking again
+#define MAX_OPEN_FILES 64           // Shared files the seeder keeps open at once, least recently used of a shard are closed first
+#define REGISTRY_SHARDS 16          // Shards of the Files registry, each with its own locks
+#define JOURNAL_SYNC_PIECES 32      // Completed pieces a journal collects before it is synced to disk
+#define JOURNAL_SYNC_INTERVAL 1000  // Milliseconds after which a journal with completed pieces is synced anyway
+#define MAX_INFLIGHT_REQUESTS 64    // "give_piece" requests in flight across all downloads, shared by priority
+#define MAX_INFLIGHT_PER_PEER 16    // "give_piece" requests in flight to one seeder across all downloads
+#define DOWNLOAD_PRIORITY_LOW 1     // Weight of a download started with priority "low"
+#define DOWNLOAD_PRIORITY_NORMAL 2  // Weight of a download started without a priority or with "normal"
+#define DOWNLOAD_PRIORITY_HIGH 4    // Weight of a download started with priority "high"
+#define HAVE_BATCH_PIECES 32        // Downloaded pieces collected before they are announced to the tracker with "have"
+#define HAVE_INTERVAL 2000          // Milliseconds after which collected pieces are announced anyway
+#define TRACKER_RETRY_INTERVAL 5000 // Milliseconds a tracker that could not be reached is tried only after the others
+#define UPLOAD_RATE_LIMIT 0         // Bytes per second the seeder uploads to all leechers together, 0 for no limit, P2P_UPLOAD_RATE overrides it
+#define PEER_UPLOAD_RATE_LIMIT 0    // Bytes per second the seeder uploads to one leecher, 0 for no limit, P2P_PEER_UPLOAD_RATE overrides it
+#define UPLOAD_SLOTS 8              // Leechers the seeder uploads pieces to at once, 0 for no limit, P2P_UPLOAD_SLOTS overrides it
+#define UPLOAD_SLOT_ROTATION 10000  // Milliseconds after which the leecher holding a slot longest gives it to a waiting one
+#define UPLOAD_IDLE_TIMEOUT 1000    // Milliseconds a leecher can hold a slot without asking for pieces while others wait
+#define UPLOAD_CHOKED_RECHECK 100   // Milliseconds a leecher waiting for a slot waits before checking again
+#define UPLOAD_QUANTUM 65536        // Bytes of piece data sent at once while a rate limit is set
+#define UPLOAD_BURST_INTERVAL 100   // Milliseconds of a rate limit that may be sent in one burst
+#define PIECE_CACHE_BYTES 67108864  // Bytes of pieces the seeder keeps in memory (64 MiB), least recently used evicted first
+#define PIECE_CACHE_GHOSTS 4096     // Pieces sent from disk the seeder remembers, one asked for again meanwhile is cached
+#define PIECE_CACHE_SHARDS 8        // Shards of the piece cache, each with its own lock and its share of the bytes and ghosts
+#define READAHEAD_PIECES 4          // Pieces read ahead of the leechers walking a file in order
+#define METRICS_BUCKETS 32          // Buckets of a latency histogram, bucket i counts durations below 2^i microseconds
+#define MAX_METRICS_PEERS 1024      // Peers whose bytes are counted one by one, further ones are counted as "other"
+
+#define OPCODE_COMMAND 1            // Frame carries a text command
+#define OPCODE_RESPONSE 2           // Frame carries the response to a command
+#define OPCODE_PIECE 3              // Response to "give_piece": 4-byte piece number, then Merkle proof and piece data, or the error message
+#define OPCODE_NOTIFY 4             // Change of a subscribed group pushed by the tracker without a command
+#define OPCODE_BATCH 6              // Commands separated by '\n' for the tracker, answered by one frame of their responses in order
+#define STATUS_SUCCESS 0            // Command executed successfully
+#define STATUS_ERROR 1              // Command failed, payload is the error message
+#define MAX_FRAME_LENGTH 67108864   // Largest payload accepted in a single frame (64 MiB)
+#define MAX_BATCH_COMMANDS 1024     // Commands the tracker accepts in a single batch frame
 
 #define RED "\033[31m"
 #define GREEN "\033[32m"
@@ -29,19 +116,151 @@
 
 using namespace std;
 
+/**
+ * @struct LogFile
+ * @brief An open log file, closed once no logger and no queued line refers to it.
+ */
+struct LogFile {
+    int m_fd{-1}; ///< Descriptor of the file, opened for appending.
+    atomic<uint64_t> m_droppedLines{0}; ///< Lines dropped since the writer last reported it.
+
+    LogFile(int fd) : m_fd(fd) {}
+    ~LogFile() { if (m_fd != -1) close(m_fd); }
+    LogFile(const LogFile&) = delete;
+    LogFile& operator=(const LogFile&) = delete;
+};
+
+/**
+ * @struct LogRecord
+ * @brief A log line queued for the writer, formatted only once it is written.
+ */
+struct LogRecord {
+    shared_ptr<LogFile> m_file; ///< File the line goes to.
+    time_t m_time{0}; ///< Time the line was logged.
+    string m_type; ///< Type of the line, e.g. "ERROR".
+    string m_content; ///< Content of the line.
+};
+
+/**
+ * @class LogRing
+ * @brief Lines queued by one thread, a lock-free ring with the thread as the only producer and the writer as the only consumer.
+ */
+class LogRing {
+    private:
+        vector<LogRecord> m_records; ///< Slots of the ring.
+        atomic<size_t> m_head{0}; ///< Records taken by the writer, only advanced by the writer.
+        atomic<size_t> m_tail{0}; ///< Records queued, only advanced by the owning thread.
+
+    public:
+        atomic<bool> m_isOrphan{false}; ///< Whether the owning thread has exited.
+
+        LogRing() : m_records(LOG_RING_CAPACITY) {}
+        LogRing(const LogRing&) = delete;
+        LogRing& operator=(const LogRing&) = delete;
+
+        /**
+        * @brief Queues a record, called by the owning thread only.
+        * @param record The record.
+        * @return True if it was queued, false if the ring is full.
+        */
+        bool push(LogRecord&& record);
+
+        /**
+        * @brief Takes all queued records, called by the writer only.
+        * @param records Vector the records are appended to.
+        */
+        void drain(vector<LogRecord>& records);
+
+        /**
+        * @brief Checks whether no record is queued.
+        * @return True if the ring is empty.
+        */
+        bool isEmpty() const;
+};
+
+/**
+ * @class LogWriter
+ * @brief Background thread writing the lines of all loggers.
+ * @details Every thread queues its lines in its own LogRing without locking. The writer
+ *          drains all rings every LOG_FLUSH_INTERVAL, or at once for an error, formats the
+ *          lines and writes them with one writev() per file. Lines of a full ring are
+ *          dropped and counted, the count is written to the file instead. The writer lives
+ *          as long as the process and writes what is left when it exits.
+ */
+class LogWriter {
+    private:
+        mutex m_writerMutex; ///< Mutex to protect rings and files, and the writer sleeps on.
+        condition_variable m_wakeUp; ///< Signalled to write before the next interval.
+        bool m_isUrgent{false}; ///< Whether the writer was asked to write at once.
+        bool m_stop{false}; ///< Whether the process is exiting.
+        vector<shared_ptr<LogRing>> m_rings; ///< Rings of all threads that logged.
+        vector<weak_ptr<LogFile>> m_files; ///< Files of all loggers, to report dropped lines.
+        thread m_writer; ///< The writer thread.
+
+        LogWriter();
+
+        /**
+        * @brief Writes the queued lines until the process exits.
+        */
+        void run();
+
+        /**
+        * @brief Takes the lines of all rings and writes them.
+        * @param rings The rings.
+        * @param files The files to report dropped lines of.
+        */
+        void writeQueued(const vector<shared_ptr<LogRing>>& rings, const vector<shared_ptr<LogFile>>& files);
+
+        /**
+        * @brief Writes all queued lines and stops the writer, called when the process exits.
+        */
+        static void flushAtExit();
+
+    public:
+        LogWriter(const LogWriter&) = delete;
+        LogWriter& operator=(const LogWriter&) = delete;
+
+        /**
+        * @brief Gives the writer, starting it on first use.
+        * @return The writer.
+        */
+        static LogWriter& getInstance();
+
+        /**
+        * @brief Gives the ring of the calling thread, registering it on first use.
+        * @return The ring.
+        */
+        LogRing& giveRing();
+
+        /**
+        * @brief Registers a file so that its dropped lines are reported.
+        * @param file The file.
+        */
+        void addFile(const shared_ptr<LogFile>& file);
+
+        /**
+        * @brief Asks the writer to write before the next interval, e.g. for an error.
+        */
+        void wakeUp();
+};
+
 /**
  * @class Logger
  * @brief A class to handle logging messages to a file.
  *        It supports creating directories and log files, and writing log entries.
+ * @details Lines are queued for the LogWriter, so logging takes no lock and makes no
+ *          system call. Lines below MIN_LOG_LEVEL, or below the level named by the
+ *          P2P_LOG_LEVEL environment variable, are dropped.
  */
 class Logger {
     private:
-        mutex m_logMutex; ///< Mutex to ensure thread-safe access to the log file.
+        static atomic<int> m_runtimeLevel; ///< Lowest level logged, from P2P_LOG_LEVEL.
 
         string m_seederIp; ///< IP address of the seeder.
         string m_seederPort; ///< Port number of the seeder.
         string m_logDirPath; ///< Directory path where logs are stored.
         string m_logFilePath; ///< File path for the log file.
+        shared_ptr<LogFile> m_logFile; ///< The open log file, null for a default constructed logger.
 
     public:
         /**
@@ -57,20 +276,28 @@ class Logger {
         */
         Logger(string seederIp, int seederPort, string name);
 
+        Logger(Logger&& other) noexcept = default;
+        Logger& operator=(Logger&& other) noexcept = default;
+
+        /**
+        * @brief Gives the level of a type of log message.
+        * @param type The type of the log message (e.g., "ERROR", "INFO"), in any case.
+        * @return One of the LOG_LEVEL_* values.
+        */
+        static int giveLevel(const string& type);
+
         /**
-        * @brief Move constructor for Logger.
-        * @param other The Logger object to move from.
-        * @note Mutexes are not movable; hence, only data members are moved.
+        * @brief Sets the lowest level logged, MIN_LOG_LEVEL still applies.
+        * @param level One of the LOG_LEVEL_* values.
         */
-        Logger(Logger&& other) noexcept;
+        static void setLevel(int level);
 
         /**
-        * @brief Move assignment operator for Logger.
-        * @param other The Logger object to move from.
-        * @return A reference to this Logger object.
-        * @note Mutexes are not movable; hence, only data members are moved.
+        * @brief Checks whether messages of a type are logged, so that hot paths can skip building them.
+        * @param type The type of the log message (e.g., "ERROR", "INFO").
+        * @return True if messages of the type are logged.
         */
-        Logger& operator=(Logger&& other) noexcept;
+        static bool isEnabled(const string& type);
 
         /**
         * @brief Logs a message to the log file.
@@ -81,53 +308,453 @@ class Logger {
         void log(string type, string content);
 };
 
+/**
+ * @class Histogram
+ * @brief Counts durations in buckets of powers of two microseconds, recorded from any thread without locking.
+ * @details Bucket 0 counts durations below 1 microsecond, bucket i the ones of at least
+ *          2^(i-1) and below 2^i microseconds, the last bucket everything longer.
+ *          Percentiles are given as the upper bound of the bucket they fall into.
+ */
+class Histogram {
+    private:
+        atomic<uint64_t> m_buckets[METRICS_BUCKETS]{}; ///< Durations counted in every bucket.
+        atomic<uint64_t> m_totalMicros{0}; ///< Sum of all durations in microseconds.
+        atomic<uint64_t> m_maxMicros{0}; ///< Longest duration in microseconds.
+
+    public:
+        /**
+        * @brief Records a duration.
+        * @param duration The duration.
+        */
+        void record(chrono::steady_clock::duration duration);
+
+        /**
+        * @brief Describes the durations recorded so far.
+        * @return "count=N mean_us=N p50_us=N p90_us=N p99_us=N max_us=N", only "count=0" if none was recorded.
+        */
+        string describe() const;
+};
+
+/**
+ * @class TimedMutex
+ * @brief A mutex or shared_mutex recording in a histogram how long a lock waited while another thread held it.
+ * @details A lock taken at the first try records nothing, so an uncontended lock costs
+ *          what the plain mutex costs. Works with lock_guard and unique_lock, and with
+ *          shared_lock when the mutex is a shared_mutex.
+ */
+template <typename Mutex>
+class TimedMutex {
+    private:
+        Mutex m_mutex; ///< The mutex.
+        Histogram& m_waits; ///< Histogram of the waits of contended locks.
+
+    public:
+        /**
+        * @brief Creates an unlocked mutex.
+        * @param waits Histogram the waits are recorded in.
+        */
+        explicit TimedMutex(Histogram& waits) : m_waits(waits) {}
+
+        TimedMutex(const TimedMutex&) = delete;
+        TimedMutex& operator=(const TimedMutex&) = delete;
+
+        void lock() {
+            if (m_mutex.try_lock()) return;
+            auto waitStart = chrono::steady_clock::now();
+            m_mutex.lock();
+            m_waits.record(chrono::steady_clock::now() - waitStart);
+        }
+        bool try_lock() { return m_mutex.try_lock(); }
+        void unlock() { m_mutex.unlock(); }
+
+        void lock_shared() {
+            if (m_mutex.try_lock_shared()) return;
+            auto waitStart = chrono::steady_clock::now();
+            m_mutex.lock_shared();
+            m_waits.record(chrono::steady_clock::now() - waitStart);
+        }
+        bool try_lock_shared() { return m_mutex.try_lock_shared(); }
+        void unlock_shared() { m_mutex.unlock_shared(); }
+};
+
+class ThreadPool;
+
+/**
+ * @class Metrics
+ * @brief Counters and histograms of the hot paths of the client, printed by the "stats" command.
+ * @details Counters are atomics and the histograms of commands and locks are created up
+ *          front, so recording takes no lock. Bytes are counted per peer, leechers by IP
+ *          and seeders by IP:Port, each peer's counter is created once and then only
+ *          added to. Thread pools add themselves while they exist.
+ */
+class Metrics {
+    private:
+        /**
+        * @struct PeerBytes
+        * @brief Bytes exchanged with every peer, at most MAX_METRICS_PEERS of them, later ones under "other".
+        */
+        struct PeerBytes {
+            shared_mutex m_bytesMutex; ///< Shared for lookups, exclusive for new peers.
+            map<string, unique_ptr<atomic<uint64_t>>> m_bytes; ///< Bytes by peer, never removed.
+        };
+
+        chrono::steady_clock::time_point m_startTime; ///< Time the metrics were created.
+        map<string, Histogram> m_commandLatencies; ///< Time commands took by command name, unknown ones under "other".
+        map<string, Histogram> m_lockWaits; ///< Waits of contended locks by lock name.
+        PeerBytes m_bytesServed; ///< Piece bytes the seeder sent, by leecher IP.
+        PeerBytes m_bytesReceived; ///< Piece bytes downloads received, by seeder IP:Port.
+        atomic<uint64_t> m_pieceMismatches{0}; ///< Pieces received that did not match their Merkle proof.
+        atomic<uint64_t> m_acceptedConnections{0}; ///< Connections the seeder accepted.
+        atomic<int64_t> m_openConnections{0}; ///< Connections of the seeder open now.
+
+        mutex m_poolsMutex; ///< Mutex to protect pools.
+        vector<const ThreadPool*> m_pools; ///< Thread pools alive now.
+
+        /**
+        * @brief Creates the histograms of all known commands and locks.
+        */
+        Metrics();
+
+        Metrics(const Metrics&) = delete;
+        Metrics& operator=(const Metrics&) = delete;
+
+        /**
+        * @brief Gives the byte counter of a peer, creating it if needed.
+        * @param peerBytes The counters to look in.
+        * @param peer The peer.
+        * @return The counter, valid as long as the metrics exist.
+        */
+        static atomic<uint64_t>& giveBytes(PeerBytes& peerBytes, const string& peer);
+
+        /**
+        * @brief Describes the bytes exchanged with every peer.
+        * @param peerBytes The counters.
+        * @param name Name of the lines.
+        * @return A "name peer bytes" line per peer.
+        */
+        static string describeBytes(PeerBytes& peerBytes, const string& name);
+
+    public:
+        /**
+        * @brief Gives the metrics of the process.
+        */
+        static Metrics& getInstance() {
+            static Metrics m_instance;
+            return m_instance;
+        }
+
+        /**
+        * @brief Records the time a command took.
+        * @param commandName Name of the command, first word of it.
+        * @param duration The time it took.
+        */
+        void recordCommand(const string& commandName, chrono::steady_clock::duration duration);
+
+        /**
+        * @brief Gives the histogram the waits of a lock are recorded in, see TimedMutex.
+        * @param lockName Name of the lock, one created by the constructor.
+        * @throws out_of_range If the lock is unknown.
+        */
+        Histogram& giveLockWaits(const string& lockName);
+
+        /**
+        * @brief Gives the counter of piece bytes sent to a leecher, to be added to directly.
+        * @param leecherIp IP address of the leecher.
+        */
+        atomic<uint64_t>& giveBytesServed(const string& leecherIp);
+
+        /**
+        * @brief Counts piece bytes received from a seeder.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param bytes The number of bytes.
+        */
+        void addBytesReceived(const string& seederIpPort, size_t bytes);
+
+        /**
+        * @brief Counts a piece that did not match its Merkle proof.
+        */
+        void addPieceMismatch();
+
+        /**
+        * @brief Counts a connection accepted by the seeder.
+        */
+        void addConnection();
+
+        /**
+        * @brief Counts a connection of the seeder that was closed.
+        */
+        void removeConnection();
+
+        /**
+        * @brief Adds a thread pool to the ones described, called by its constructor.
+        * @param pool The pool.
+        */
+        void addPool(const ThreadPool* pool);
+
+        /**
+        * @brief Removes a thread pool, called by its destructor.
+        * @param pool The pool.
+        */
+        void removePool(const ThreadPool* pool);
+
+        /**
+        * @brief Describes everything counted so far.
+        * @return One line per value, "name value" or "name key field=value ...".
+        */
+        string describe();
+};
+
+/**
+ * @class Task
+ * @brief A callable taking no arguments, stored inline when small enough.
+ * @details Callables of up to TASK_INLINE_SIZE bytes, like lambdas capturing a few
+ *          pointers, are kept in the task itself, so queueing them allocates nothing.
+ *          Larger ones are moved to the heap. A task can be moved but not copied.
+ */
+class Task {
+    private:
+        /**
+        * @struct Operations
+        * @brief How to run, move and destroy the stored callable.
+        */
+        struct Operations {
+            void (*m_invoke)(void* storage); ///< Runs the callable.
+            void (*m_move)(void* from, void* to); ///< Moves the callable to empty storage.
+            void (*m_destroy)(void* storage); ///< Destroys the callable.
+        };
+
+        template <typename F>
+        static constexpr bool isInline = sizeof(F) <= TASK_INLINE_SIZE && alignof(F) <= alignof(max_align_t) && is_nothrow_move_constructible<F>::value;
+
+        template <typename F>
+        static constexpr Operations m_inlineOperations = {
+            [](void* storage) { (*(F*)storage)(); },
+            [](void* from, void* to) { new (to) F(move(*(F*)from)); ((F*)from)->~F(); },
+            [](void* storage) { ((F*)storage)->~F(); }
+        };
+
+        template <typename F>
+        static constexpr Operations m_heapOperations = {
+            [](void* storage) { (**(F**)storage)(); },
+            [](void* from, void* to) { *(F**)to = *(F**)from; },
+            [](void* storage) { delete *(F**)storage; }
+        };
+
+        alignas(max_align_t) unsigned char m_storage[TASK_INLINE_SIZE]; ///< The callable, or a pointer to it if it is too large.
+        const Operations* m_operations{nullptr}; ///< Operations of the stored callable, null if the task is empty.
+
+    public:
+        Task() = default;
+
+        /**
+        * @brief Constructs a task from a callable.
+        * @param callable The callable, e.g. a lambda.
+        */
+        template <typename F, typename = enable_if_t<!is_same<decay_t<F>, Task>::value>>
+        Task(F&& callable) {
+            using Callable = decay_t<F>;
+            if constexpr (isInline<Callable>) {
+                new (m_storage) Callable(forward<F>(callable));
+                m_operations = &m_inlineOperations<Callable>;
+            } else {
+                *(Callable**)m_storage = new Callable(forward<F>(callable));
+                m_operations = &m_heapOperations<Callable>;
+            }
+        }
+
+        Task(Task&& other) noexcept : m_operations(other.m_operations) {
+            if (m_operations) m_operations->m_move(other.m_storage, m_storage);
+            other.m_operations = nullptr;
+        }
+
+        Task& operator=(Task&& other) noexcept {
+            if (this != &other) {
+                if (m_operations) m_operations->m_destroy(m_storage);
+                m_operations = other.m_operations;
+                if (m_operations) m_operations->m_move(other.m_storage, m_storage);
+                other.m_operations = nullptr;
+            }
+            return *this;
+        }
+
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        ~Task() {
+            if (m_operations) m_operations->m_destroy(m_storage);
+        }
+
+        /**
+        * @brief Runs the callable.
+        */
+        void operator()() {
+            m_operations->m_invoke(m_storage);
+        }
+};
+
+/**
+ * @class TaskGroup
+ * @brief Tasks waited for together, e.g. the pieces of one file.
+ * @details A group can be given to ThreadPool::enqueueTask() and waited for with
+ *          ThreadPool::wait(), which only covers the tasks of that group. The waiter is
+ *          woken once, when the last task of the group is done.
+ */
+class TaskGroup {
+    private:
+        friend class ThreadPool;
+
+        atomic<int> m_pendingTasks{0}; ///< Tasks of the group not done yet.
+        mutex m_groupMutex; ///< Mutex the waiter sleeps on.
+        condition_variable m_groupDone; ///< Signalled when the last task of the group is done.
+
+    public:
+        TaskGroup() = default;
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+};
+
 /**
  * @class ThreadPool
- * @brief A thread pool class to manage a pool of worker threads and a queue of tasks.
- *        Tasks are executed by threads in the pool, allowing for concurrent task execution.
+ * @brief A work-stealing pool of worker threads.
+ * @details Every worker has its own task queue behind its own mutex, so workers and
+ *          producers do not contend on a single lock. A task enqueued by a worker goes
+ *          to that worker's queue, other tasks are spread over the queues in turn. A
+ *          worker runs the oldest task of its own queue, and when that is empty steals
+ *          the newest task of another queue. Idle workers sleep until a task is queued.
  */
 class ThreadPool {
     private:
+        /**
+        * @struct QueuedTask
+        * @brief A task waiting in a queue, along with the group it belongs to.
+        */
+        struct QueuedTask {
+            Task m_task; ///< The task.
+            TaskGroup* m_group{nullptr}; ///< Group of the task, null if it has none.
+        };
+
+        /**
+        * @struct WorkerQueue
+        * @brief Task queue of one worker.
+        */
+        struct WorkerQueue {
+            mutex m_queueMutex; ///< Mutex to protect the tasks.
+            deque<QueuedTask> m_tasks; ///< Tasks, oldest first.
+        };
+
+        static thread_local ThreadPool* m_currentPool; ///< Pool the calling thread is a worker of, null for other threads.
+        static thread_local size_t m_currentWorker; ///< Index of the calling thread in its pool.
+
+        string m_name; ///< Name of the pool in the metrics.
         vector<thread> m_workers; ///< Vector of worker threads in the pool.
-        queue<function<void()>> m_tasks; ///< Queue of tasks to be executed by the worker threads.
+        vector<unique_ptr<WorkerQueue>> m_queues; ///< Task queue of every worker.
+        atomic<size_t> m_nextQueue{0}; ///< Queue given the next task enqueued from outside the pool.
+
+        atomic<bool> m_stop{false}; ///< Flag indicating whether the thread pool should stop processing tasks.
+        atomic<int> m_queuedTasks{0}; ///< Tasks in the queues, not taken by a worker yet.
+        atomic<int> m_unfinishedTasks{0}; ///< Tasks enqueued and not done yet.
+        atomic<int> m_sleepingWorkers{0}; ///< Workers sleeping until a task is queued.
 
-        mutex m_queueMutex; ///< Mutex to protect access to the task queue.
+        mutex m_sleepMutex; ///< Mutex idle workers sleep on.
         condition_variable m_condition; ///< Condition variable to notify worker threads about new tasks or stop signal.
-        condition_variable m_waitCondition; ///< Condition variable to wait for all tasks to complete.
+        mutex m_waitMutex; ///< Mutex wait() sleeps on.
+        condition_variable m_waitCondition; ///< Condition variable signalled when the last unfinished task is done.
+
+        /**
+        * @brief The worker thread function that runs and steals tasks until the pool is stopped.
+        * @param index Index of the worker.
+        */
+        void workerThread(size_t index);
 
-        atomic<bool> m_stop; ///< Flag indicating whether the thread pool should stop processing tasks.
-        atomic<int> m_activeTasks; ///< Number of active tasks currently being processed.
+        /**
+        * @brief Takes a task for a worker, from its own queue or else from another one.
+        * @param index Index of the worker.
+        * @param task The task taken.
+        * @return True if a task was taken, false if all queues are empty.
+        */
+        bool takeTask(size_t index, QueuedTask& task);
 
         /**
-        * @brief The worker thread function that continuously processes tasks from the queue.
+        * @brief Queues a task.
+        * @param task The task.
+        * @param group Group of the task, null if it has none.
+        * @throws runtime_error If the thread pool has been stopped and no more tasks can be enqueued.
         */
-        void workerThread();
+        void pushTask(Task task, TaskGroup* group);
 
     public:
         /**
         * @brief Constructs a ThreadPool with a specified number of worker threads.
         * @param numThreads The number of worker threads to create.
+        * @param name Name of the pool in the metrics.
         */
-        ThreadPool(size_t numThreads);
+        ThreadPool(size_t numThreads, string name = "pool");
 
         /**
-        * @brief Destroys the ThreadPool and joins all worker threads.
+        * @brief Destroys the ThreadPool, running the tasks still queued, and joins all worker threads.
         */
         ~ThreadPool();
 
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
         /**
         * @brief Enqueues a task for execution by the thread pool.
         * @param task The task to be executed. It is a callable object (function, lambda, etc.).
+        * @param group Group the task belongs to, null if it has none.
         * @throws runtime_error If the thread pool has been stopped and no more tasks can be enqueued.
         */
-        void enqueueTask(function<void()> task);
+        template <typename F>
+        void enqueueTask(F&& task, TaskGroup* group = nullptr) {
+            pushTask(Task(forward<F>(task)), group);
+        }
 
         /**
         * @brief Blocks until all enqueued tasks have been completed.
         */
         void wait();
+
+        /**
+        * @brief Gives the name of the pool in the metrics.
+        */
+        const string& giveName() const;
+
+        /**
+        * @brief Gives the number of worker threads.
+        */
+        size_t giveWorkers() const;
+
+        /**
+        * @brief Gives the number of tasks waiting in the queues, not taken by a worker yet.
+        */
+        int giveQueuedTasks() const;
+
+        /**
+        * @brief Gives the number of tasks being run by workers now.
+        */
+        int giveActiveTasks() const;
+
+        /**
+        * @brief Blocks until all tasks of a group have been completed.
+        * @param group The group to wait for.
+        * @note Must not be called from a task of the same pool, the task would hold a worker the group may need.
+        */
+        void wait(TaskGroup& group);
 };
 
+/**
+ * @struct FrameHeader
+ * @brief Fixed-size header sent in front of every message on the wire.
+ * @details A frame is this header followed by m_length bytes of payload. All fields
+ *          are in network byte order on the wire and in host byte order once received.
+ */
+struct FrameHeader {
+    uint32_t m_length; ///< Length of the payload following the header, in bytes.
+    uint8_t m_opcode; ///< Kind of message, one of the OPCODE_* values.
+    uint8_t m_status; ///< Result of a response, STATUS_SUCCESS or STATUS_ERROR.
+    uint16_t m_reserved; ///< Unused, always zero.
+} __attribute__((packed));
+
 /**
  * @class ClientSocket
  * @brief A class that handles client-side socket operations including creating, connecting, 
@@ -145,6 +772,14 @@ class ClientSocket {
         */
         ClientSocket() = default;
 
+        /**
+        * @brief Closes the socket if it is still open.
+        */
+        ~ClientSocket();
+
+        ClientSocket(const ClientSocket&) = delete; ///< Delete copy constructor, socket is owned by a single object.
+        ClientSocket& operator=(const ClientSocket&) = delete; ///< Delete copy assignment operator.
+
         /**
         * @brief Creates a socket and assigns it to m_socketFd.
         * @throws string If socket creation fails.
@@ -166,97 +801,343 @@ class ClientSocket {
         void connectSocket(string serverIp, int serverPort);
 
         /**
-        * @brief Sends a message to the connected server.
+        * @brief Sends a message to the connected server as a single frame.
         * @param message The message to be sent to the server.
+        * @param opcode The kind of message, one of the OPCODE_* values.
         * @throws string If sending the message fails.
         */
-        void sendSocket(string message);
+        void sendSocket(string message, uint8_t opcode = OPCODE_COMMAND);
 
         /**
-        * @brief Receives a message from the connected server.
-        * @return The received message as a string.
+        * @brief Shuts the connection down, a thread blocked receiving on it returns with an error.
+        */
+        void shutdownSocket();
+
+        /**
+        * @brief Receives the header of the next frame from the connected server.
+        * @return The frame header in host byte order.
+        * @throws string If receiving fails, the connection is closed or the header is invalid.
+        */
+        FrameHeader recvHeader();
+
+        /**
+        * @brief Receives the payload of a frame directly into a caller-supplied buffer.
+        * @param buffer The buffer to receive into, at least length bytes long.
+        * @param length The payload length from the frame header.
+        * @throws string If receiving fails or the connection is closed.
+        */
+        void recvPayload(char* buffer, size_t length);
+
+        /**
+        * @brief Receives a whole frame from the connected server.
+        * @param header Set to the header of the received frame.
+        * @return The payload of the frame as a string.
         * @throws string If receiving the message fails or if the connection is closed.
         */
-        string recvSocket();
+        string recvSocket(FrameHeader& header);
 
         /**
         * @brief Closes the client socket and resets internal state.
         * @throws string If socket is not created before attempting to close.
         */
         void closeSocket();
+
+        /**
+        * @brief Checks without blocking whether the socket is still connected and has no unread data.
+        * @return True if the socket can be used for a new request, false otherwise.
+        */
+        bool isIdleConnected() const;
 };
 
+class PeerConnectionPool;
+
 /**
- * @class ServerSocket
- * @brief A class that handles server-side socket operations including creating, binding, 
- *        listening, accepting connections, sending and receiving data.
+ * @class PeerConnection
+ * @brief A connection to a seeder leased from the PeerConnectionPool, given back when dropped.
  */
-class ServerSocket {
+class PeerConnection {
     private:
-        string m_serverIp; ///< The IP address of the server.
-        int m_serverPort; ///< The port number for the server socket.
-        int m_socketFd{-1}; ///< File descriptor for the socket.
+        PeerConnectionPool& m_pool; ///< The pool the connection is leased from.
+        string m_seederIpPort; ///< IP:Port of the seeder.
+        unique_ptr<ClientSocket> m_socket; ///< The connected socket.
+        bool m_isReusable{true}; ///< Whether the connection can be handed to the next user.
 
     public:
         /**
-        * @brief Default constructor for ServerSocket.
+        * @brief Constructs a lease of a connected socket.
+        * @param pool The pool the connection is leased from.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param socket The connected socket.
         */
-        ServerSocket() = default;
+        PeerConnection(PeerConnectionPool& pool, string seederIpPort, unique_ptr<ClientSocket> socket);
 
         /**
-        * @brief Parameterized constructor to initialize the server's IP and port.
-        * @param serverIp The IP address of the server.
-        * @param serverPort The port number on which the server will listen.
+        * @brief Gives the connection back to the pool, which closes it if it is not reusable.
         */
-        ServerSocket(string serverIp, int serverPort);
+        ~PeerConnection();
+
+        PeerConnection(const PeerConnection&) = delete;
+        PeerConnection& operator=(const PeerConnection&) = delete;
 
         /**
-        * @brief Creates a socket and assigns it to m_socketFd.
-        * @throws string If socket creation fails.
+        * @brief Gives the connected socket.
+        * @return The socket.
         */
-        void createSocket();
+        ClientSocket& socket();
 
         /**
-        * @brief Sets socket options for reusing address and port.
-        * @throws string If setting options fails.
+        * @brief Marks the connection as not reusable, e.g. after a failure or with replies still unread.
         */
-        void setOptions();
+        void markBroken();
+};
+
+/**
+ * @class PeerConnectionPool
+ * @brief Keeps connections to seeders open across pieces and downloads, keyed by IP:Port.
+ * @details A connection given back is kept idle and handed to the next download needing the
+ *          same seeder, so the TCP handshake and slow start are paid once per seeder instead of
+ *          once per worker. At most MAX_CONNECTIONS_PER_PEER connections to a seeder are open
+ *          at once, further users wait until one is given back. Connections idle for longer
+ *          than PEER_IDLE_TIMEOUT are closed. All methods are thread-safe.
+ */
+class PeerConnectionPool {
+    private:
+        friend class PeerConnection;
 
         /**
-        * @brief Binds the socket to the server's IP and port.
-        * @throws string If binding fails.
+        * @struct IdleConnection
+        * @brief A connected socket not leased to anyone.
         */
-        void bindSocket();
+        struct IdleConnection {
+            unique_ptr<ClientSocket> m_socket; ///< The connected socket.
+            chrono::steady_clock::time_point m_idleSince; ///< Time it was given back.
+        };
 
         /**
-        * @brief Listens for incoming connections on the bound socket.
-        * @throws string If listening fails.
+        * @struct Peer
+        * @brief Connections to one seeder.
         */
-        void listenSocket();
+        struct Peer {
+            deque<IdleConnection> m_idleConnections; ///< Idle connections, most recently used last.
+            int m_openConnections{0}; ///< Idle and leased connections.
+        };
+
+        mutex m_poolMutex; ///< Mutex to protect peers.
+        condition_variable m_connectionReleased; ///< Signalled when a connection is given back or closed.
+        unordered_map<string, Peer> m_peers; ///< Connections of every seeder by IP:Port.
 
         /**
-        * @brief Accepts an incoming connection request.
-        * @return The file descriptor for the accepted client socket.
-        * @throws string If accepting connection fails.
+        * @brief Takes back a leased connection.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param socket The socket of the connection.
+        * @param isReusable Whether the connection can be handed to the next user.
+        */
+        void release(const string& seederIpPort, unique_ptr<ClientSocket> socket, bool isReusable);
+
+        /**
+        * @brief Closes the connections idle for longer than PEER_IDLE_TIMEOUT.
+        * @note Expects m_poolMutex to be held.
+        */
+        void evictIdleLocked();
+
+    public:
+        PeerConnectionPool() = default;
+        PeerConnectionPool(const PeerConnectionPool&) = delete;
+        PeerConnectionPool& operator=(const PeerConnectionPool&) = delete;
+
+        /**
+        * @brief Leases a connection to a seeder, reusing an idle one if there is any.
+        * @param seederIpPort IP:Port of the seeder.
+        * @return The leased connection.
+        * @throws string If the seeder address is invalid or the seeder can not be reached.
+        */
+        unique_ptr<PeerConnection> acquire(const string& seederIpPort);
+
+        /**
+        * @brief Closes all idle connections, leased ones are closed when given back.
+        */
+        void closeIdle();
+};
+
+/**
+ * @class PeerStats
+ * @brief Measures every seeder and decides which ones are choked, keyed by IP:Port.
+ * @details Keeps moving averages of the bytes per second of one connection, the round
+ *          trip time and the share of failed pieces of every seeder, shared by all
+ *          downloads. A seeder failing too often, or much slower than the fastest one, is
+ *          choked: it is only asked for pieces no unchoked seeder holds. A seeder choked
+ *          for OPTIMISTIC_UNCHOKE_INTERVAL is unchoked on trial for a few pieces, so a
+ *          seeder that got faster is noticed again. All methods are thread-safe.
+ */
+class PeerStats {
+    private:
+        /**
+        * @struct Stats
+        * @brief Measurements of one seeder.
+        */
+        struct Stats {
+            double m_bytesPerSecond{0}; ///< Moving average of the throughput of one connection.
+            double m_rttSeconds{0}; ///< Moving average of the round trip time.
+            double m_errorRate{0}; ///< Moving average of the share of failed pieces.
+            int m_samples{0}; ///< Number of pieces measured, failed ones included.
+            bool m_isChoked{false}; ///< Whether the seeder is choked.
+            chrono::steady_clock::time_point m_chokedSince; ///< Time it was choked or last tried again.
+            int m_trialPieces{0}; ///< Pieces left to measure before a seeder tried again is judged again.
+        };
+
+        mutable mutex m_statsMutex; ///< Mutex to protect stats.
+        unordered_map<string, Stats> m_stats; ///< Measurements of every seeder by IP:Port.
+
+        /**
+        * @brief Gives the throughput of the fastest seeder that can be judged.
+        * @return Bytes per second, 0 if no seeder was measured enough yet.
+        * @note Expects m_statsMutex to be held.
+        */
+        double bestBytesPerSecondLocked() const;
+
+        /**
+        * @brief Folds a new sample into a moving average.
+        * @param average The average to update.
+        * @param sample The new sample.
+        * @param isFirst Whether this is the first sample, which is taken as is.
+        */
+        static void addSample(double& average, double sample, bool isFirst);
+
+    public:
+        /**
+        * @brief Records a piece received from a seeder.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param bytes Length of the piece.
+        * @param seconds Time the connection spent on the piece.
+        */
+        void recordPiece(const string& seederIpPort, size_t bytes, double seconds);
+
+        /**
+        * @brief Records the time between a request to an idle seeder and the start of its reply.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param seconds The round trip time.
+        */
+        void recordRtt(const string& seederIpPort, double seconds);
+
+        /**
+        * @brief Records a piece that failed, e.g. an error reply or a Merkle proof mismatch.
+        * @param seederIpPort IP:Port of the seeder.
+        */
+        void recordError(const string& seederIpPort);
+
+        /**
+        * @brief Checks whether a seeder is choked, trying it again once it was choked long enough.
+        * @param seederIpPort IP:Port of the seeder.
+        * @return True if the seeder should only be asked for pieces no unchoked seeder holds.
+        */
+        bool isChoked(const string& seederIpPort);
+
+        /**
+        * @brief Gives the number of requests to keep in flight on one connection to a seeder.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param pieceSize The piece size of the download.
+        * @return Between 1 and PIPELINE_WINDOW.
+        */
+        int giveWindow(const string& seederIpPort, int pieceSize) const;
+};
+
+/**
+ * @class ServerSocket
+ * @brief A class that handles server-side socket operations including creating, binding, 
+ *        listening, accepting connections, sending and receiving data.
+ */
+class ServerSocket {
+    private:
+        string m_serverIp; ///< The IP address of the server.
+        int m_serverPort; ///< The port number for the server socket.
+        int m_socketFd{-1}; ///< File descriptor for the socket.
+
+    public:
+        /**
+        * @brief Default constructor for ServerSocket.
+        */
+        ServerSocket() = default;
+
+        /**
+        * @brief Parameterized constructor to initialize the server's IP and port.
+        * @param serverIp The IP address of the server.
+        * @param serverPort The port number on which the server will listen.
+        */
+        ServerSocket(string serverIp, int serverPort);
+
+        /**
+        * @brief Creates a socket and assigns it to m_socketFd.
+        * @throws string If socket creation fails.
+        */
+        void createSocket();
+
+        /**
+        * @brief Sets socket options for reusing address and port.
+        * @throws string If setting options fails.
+        */
+        void setOptions();
+
+        /**
+        * @brief Binds the socket to the server's IP and port.
+        * @throws string If binding fails.
+        */
+        void bindSocket();
+
+        /**
+        * @brief Listens for incoming connections on the bound socket.
+        * @throws string If listening fails.
+        */
+        void listenSocket();
+
+        /**
+        * @brief Accepts an incoming connection request.
+        * @return The file descriptor for the accepted client socket.
+        * @throws string If accepting connection fails.
         */
         int acceptSocket();
 
         /**
-        * @brief Sends a response message to a client socket.
+        * @brief Sends a response message to a client socket as a single frame.
         * @param clientSocketFd The file descriptor of the client socket.
         * @param response The response message to be sent.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        * @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
         * @throws string If sending message fails.
         */
-        void sendSocket(int clientSocketFd, string response);
+        void sendSocket(int clientSocketFd, string response, uint8_t opcode = OPCODE_RESPONSE, uint8_t status = STATUS_SUCCESS);
+
+        /**
+        * @brief Receives the header of the next frame from a client socket.
+        * @param clientSocketFd The file descriptor of the client socket.
+        * @param header Set to the frame header in host byte order.
+        * @return False if the client closed the connection before sending a header, true otherwise.
+        * @throws string If receiving fails or the header is invalid.
+        */
+        bool recvHeader(int clientSocketFd, FrameHeader& header);
+
+        /**
+        * @brief Receives the payload of a frame directly into a caller-supplied buffer.
+        * @param clientSocketFd The file descriptor of the client socket.
+        * @param buffer The buffer to receive into, at least length bytes long.
+        * @param length The payload length from the frame header.
+        * @throws string If receiving fails or the connection is closed.
+        */
+        void recvPayload(int clientSocketFd, char* buffer, size_t length);
 
         /**
-        * @brief Receives a message from a client socket.
+        * @brief Receives a whole frame from a client socket.
         * @param clientSocketFd The file descriptor of the client socket.
-        * @return The received message as a string.
+        * @return The payload of the frame as a string, or an empty string if the client closed the connection.
         * @throws string If receiving message fails.
         */
         string recvSocket(int clientSocketFd);
 
+        /**
+        * @brief Gives the file descriptor of the listening socket.
+        * @return The file descriptor, -1 if the socket is not created.
+        */
+        int giveSocketFd();
+
         /**
         * @brief Closes the server socket and resets internal state.
         * @throws string If socket is not created before attempting to close.
@@ -274,17 +1155,50 @@ class ServerSocket {
 class Utils {
     private:
         friend class Leecher;
+        friend class Journal;
         
         Utils() = delete; ///< Prevents instantiation of the Utils class.
 
         /**
         * @brief Computes the SHA-256 hashes of a file.
         * @param filePath The path to the file.
+        * @param pieceSize The size of every piece except possibly the last one.
         * @return A vector of SHA-256 hashes, where the first entry is the hash of the entire file
         *         and the subsequent entries are hashes of individual pieces.
         * @throws string If there is an error opening or reading the file.
         */
-        static vector<string> findSHA(string filePath);
+        static vector<string> findSHA(string filePath, int pieceSize);
+
+        /**
+        * @brief Gives the pool hashing pieces, shared by all uploads and journal checks.
+        * @return The pool, with one worker per CPU.
+        */
+        static ThreadPool& giveHashPool();
+
+        /**
+        * @brief Formats bytes as lowercase hexadecimal.
+        * @param bytes The bytes to format.
+        * @param length The number of bytes.
+        * @return The hexadecimal string, twice as long as the input.
+        */
+        static string toHex(const unsigned char* bytes, size_t length);
+
+        /**
+        * @brief Parses lowercase or uppercase hexadecimal into bytes.
+        * @param hex The hexadecimal string, of even length.
+        * @return The bytes, half as long as the input.
+        * @throws string If the string is not valid hexadecimal.
+        */
+        static string fromHex(const string& hex);
+
+        /**
+        * @brief Chooses the piece size of a file based on its size.
+        * @param fileSize The size of the file in bytes.
+        * @return The smallest power of two between MIN_PIECE_SIZE and MAX_PIECE_SIZE
+        *         that splits the file into at most TARGET_PIECES pieces, or P2P_PIECE_SIZE
+        *         if it is set to such a power of two.
+        */
+        static int givePieceSize(long long fileSize);
 
         /**
         * @brief Computes the SHA-256 hash of a piece of data.
@@ -293,20 +1207,36 @@ class Utils {
         */
         static string findPieceSHA(string pieceData);
 
+        /**
+        * @brief Computes the SHA-256 hash of a piece of data held in a buffer.
+        * @param pieceData The buffer holding the data.
+        * @param length The number of bytes in the buffer.
+        * @return The SHA-256 hash as a hexadecimal string.
+        */
+        static string findPieceSHA(const char* pieceData, size_t length);
+
+        /**
+        * @brief Computes the raw SHA-256 digest of a piece of data held in a buffer.
+        * @param pieceData The buffer holding the data.
+        * @param length The number of bytes in the buffer.
+        * @return The SHA-256 digest, SHA256_DIGEST_LENGTH bytes.
+        */
+        static string findPieceDigest(const char* pieceData, size_t length);
+
         /**
         * @brief Retrieves the size of a file.
         * @param filePath The path to the file.
         * @return The size of the file in bytes.
         * @throws string If there is an error opening or seeking the file.
         */
-        static int giveFileSize(string filePath);
+        static long long giveFileSize(string filePath);
 
     public:
         /**
         * @brief Processes command-line arguments.
         * @param argc The argument count.
         * @param argv The argument vector.
-        * @return A vector of strings containing the processed arguments.
+        * @return IP and port of the seeder, then IP and port of every tracker, the tracker picked by number first.
         * @throws string If the number of arguments is incorrect or if any argument is invalid.
         */
         static vector<string> processArgs(int argc, char *argv[]);
@@ -318,6 +1248,365 @@ class Utils {
         * @return A vector of strings obtained by splitting the input string.
         */
         static vector<string> tokenize(string buffer, char separator);
+
+        /**
+        * @brief Splits the payload of a batch response into the responses of its commands.
+        * @param payload The payload, "Status <space> Length \n Response" for every command.
+        * @return Status and response of every command, in order.
+        * @throws string If the payload is not made of such responses.
+        */
+        static vector<pair<uint8_t, string>> unpackReplies(const string& payload);
+};
+
+/**
+ * @class Bitfield
+ * @brief Fixed-size set of piece numbers, one bit per piece.
+ * @details Bits live in atomic 64-bit words, so pieces can be marked and looked up
+ *          concurrently without a lock. On the wire it is packed into bytes with
+ *          piece 0 in the most significant bit of the first byte.
+ */
+class Bitfield {
+    private:
+        size_t m_numBits; ///< Number of bits.
+        size_t m_numWords; ///< Number of 64-bit words holding the bits.
+        unique_ptr<atomic<uint64_t>[]> m_words; ///< The bits, bit i is bit (i % 64) of word i / 64.
+
+    public:
+        /**
+        * @brief Constructs a bitfield with all bits cleared.
+        * @param numBits The number of bits, i.e. pieces of the file.
+        */
+        Bitfield(size_t numBits);
+
+        Bitfield(const Bitfield&) = delete;
+        Bitfield& operator=(const Bitfield&) = delete;
+
+        /**
+        * @brief Sets a bit.
+        * @param bit The bit to set.
+        * @return True if the bit was not set before, false if it was set or is out of range.
+        */
+        bool setBit(size_t bit);
+
+        /**
+        * @brief Clears a bit.
+        * @param bit The bit to clear.
+        */
+        void clearBit(size_t bit);
+
+        /**
+        * @brief Sets all bits.
+        */
+        void setAll();
+
+        /**
+        * @brief Checks whether a bit is set.
+        * @param bit The bit to check.
+        * @return True if the bit is set, false if it is not set or out of range.
+        */
+        bool testBit(size_t bit) const;
+
+        /**
+        * @brief Gives the number of bits.
+        * @return The number of bits.
+        */
+        size_t size() const;
+
+        /**
+        * @brief Counts the set bits.
+        * @return The number of set bits.
+        */
+        size_t count() const;
+
+        /**
+        * @brief Packs the bitfield into bytes, bit 0 is the most significant bit of the first byte.
+        * @return ceil(size() / 8) bytes.
+        */
+        string toBytes() const;
+
+        /**
+        * @brief Unpacks bytes produced by toBytes() into the indices of the set bits.
+        * @param bytes The packed bitfield.
+        * @param numBits The number of bits, bits beyond it are ignored.
+        * @return The set bits in increasing order.
+        */
+        static vector<int> giveSetBits(const string& bytes, size_t numBits);
+};
+
+/**
+ * @class MerkleTree
+ * @brief Binary hash tree over the piece SHAs of a file, used to verify pieces against its root.
+ * @details Leaves are the SHA-256 of every piece, padded with zero digests up to a power of two,
+ *          and every inner node is the SHA-256 of its two children. Nodes are kept in one flat
+ *          buffer, node 1 is the root and node i has children 2i and 2i + 1. A seeder that owns
+ *          the whole file knows every node, a leecher starts from the root only and learns the
+ *          nodes on the path of each piece it verifies, so every piece it holds can be proven on.
+ */
+class MerkleTree {
+    private:
+        size_t m_numLeaves; ///< Number of pieces of the file.
+        size_t m_firstLeaf; ///< Index of the first leaf, the number of leaves after padding.
+        string m_nodes; ///< Raw digests of all nodes, node i at offset i * SHA256_DIGEST_LENGTH.
+        vector<bool> m_isKnown; ///< Whether the digest of a node is known.
+        mutable mutex m_treeMutex; ///< Mutex to protect access to nodes and isKnown.
+
+        /**
+        * @brief Computes the digest of an inner node from the digests of its children.
+        * @param left Raw digest of the left child.
+        * @param right Raw digest of the right child.
+        * @return Raw digest of the node.
+        */
+        static string hashChildren(const char* left, const char* right);
+
+    public:
+        /**
+        * @brief Constructs a tree knowing only its root.
+        * @param numLeaves The number of pieces of the file.
+        * @param root Raw digest of the root.
+        */
+        MerkleTree(size_t numLeaves, const string& root);
+
+        /**
+        * @brief Constructs a complete tree from the digests of all pieces.
+        * @param leaves Raw digests of the pieces, in piece order.
+        */
+        MerkleTree(const vector<string>& leaves);
+
+        /**
+        * @brief Constructs a tree from the nodes saved by nodeBytes().
+        * @param numLeaves The number of pieces of the file.
+        * @param root Raw digest of the root.
+        * @param nodes The saved nodes, unknown nodes are zero digests.
+        * @throw string If the nodes do not belong to a tree with this root.
+        */
+        MerkleTree(size_t numLeaves, const string& root, const string& nodes);
+
+        MerkleTree(const MerkleTree&) = delete;
+        MerkleTree& operator=(const MerkleTree&) = delete;
+
+        /**
+        * @brief Gives the raw digest of the root.
+        * @return The root digest.
+        */
+        string root() const;
+
+        /**
+        * @brief Gives the number of leaves, i.e. pieces of the file.
+        * @return The number of leaves before padding.
+        */
+        size_t numLeaves() const;
+
+        /**
+        * @brief Gives the length of the proof of every piece.
+        * @return Number of bytes of a proof, one digest per level below the root.
+        */
+        size_t proofLength() const;
+
+        /**
+        * @brief Gives the proof of a piece, the sibling digests on its path from leaf to root.
+        * @param leaf The piece number.
+        * @return The proof, proofLength() bytes.
+        * @throw string If the piece is out of range or its path is not known.
+        */
+        string giveProof(size_t leaf) const;
+
+        /**
+        * @brief Checks whether the digest of every piece is known.
+        * @return True if every piece can be proven, false otherwise.
+        */
+        bool isComplete() const;
+
+        /**
+        * @brief Checks a piece digest against the leaf digest of the tree, without any proof.
+        * @param leaf The piece number.
+        * @param leafDigest Raw digest of the piece data.
+        * @return True if the leaf is known and equal to the digest, false otherwise.
+        */
+        bool matchesLeaf(size_t leaf, const string& leafDigest) const;
+
+        /**
+        * @brief Gives the digests of all nodes, unknown nodes as zero digests.
+        * @return The nodes, node i at offset i * SHA256_DIGEST_LENGTH.
+        */
+        string nodeBytes() const;
+
+        /**
+        * @brief Verifies the digest of a piece against the root and learns its path if it matches.
+        * @param leaf The piece number.
+        * @param leafDigest Raw digest of the piece data.
+        * @param proof The proof sent along with the piece.
+        * @return True if the piece belongs to the file, false otherwise.
+        */
+        bool verifyPiece(size_t leaf, const string& leafDigest, const string& proof);
+};
+
+/**
+ * @struct FileInfo
+ * @brief What is needed to share or resume a file without asking the tracker.
+ */
+struct FileInfo {
+    string m_groupName; ///< Name of the group the file is shared in.
+    string m_fileName; ///< Name of the file in the group.
+    string m_filePath; ///< Path of the file on this client.
+    long long m_fileSize{0}; ///< Size of the file in bytes.
+    int m_pieceSize{0}; ///< The piece size the file is split into.
+    string m_fileSHA; ///< SHA of the entire file, in hexadecimal.
+};
+
+/**
+ * @class Journal
+ * @brief On-disk record of the pieces of a file this client holds, so sharing and downloads survive a restart.
+ * @details The journal is a text line with the FileInfo and the Merkle root, followed by the
+ *          packed bitfield of the pieces written and the nodes of the Merkle tree. Pieces are
+ *          marked in memory and written with one pwrite() and fdatasync() per JOURNAL_SYNC_PIECES
+ *          pieces or JOURNAL_SYNC_INTERVAL milliseconds, so a crash loses at most that many pieces,
+ *          which are then fetched again. Journals are kept per client and user, under
+ *          "./journals/IP:Port/userName". All methods are thread-safe.
+ */
+class Journal {
+    private:
+        string m_journalPath; ///< Path of the journal.
+        int m_fd{-1}; ///< File descriptor of the journal, opened for writing.
+        FileInfo m_info; ///< The file the journal is of.
+        shared_ptr<MerkleTree> m_merkleTree; ///< Merkle tree of the file, saved with the pieces.
+        Bitfield m_pieces; ///< Pieces written to the file.
+        size_t m_piecesOffset; ///< Offset of the bitfield in the journal.
+        size_t m_nodesOffset; ///< Offset of the Merkle tree nodes in the journal.
+
+        mutex m_journalMutex; ///< Mutex to protect the file descriptor and the sync state below.
+        int m_unsyncedPieces{0}; ///< Pieces marked since the last sync.
+        chrono::steady_clock::time_point m_lastSync; ///< Time of the last sync.
+
+        /**
+        * @brief Writes the bitfield and the tree to the journal and syncs it.
+        * @note Expects m_journalMutex to be held.
+        */
+        void syncLocked();
+
+    public:
+        /**
+        * @brief Writes a new journal, replacing any journal at the same path.
+        * @param journalPath Path of the journal.
+        * @param info The file the journal is of.
+        * @param merkleTree Merkle tree of the file.
+        * @param pieceBytes Packed bitfield of the pieces already written, empty if there are none.
+        * @throw string If the journal can not be written.
+        */
+        Journal(string journalPath, FileInfo info, shared_ptr<MerkleTree> merkleTree, const string& pieceBytes = "");
+
+        /**
+        * @brief Syncs pieces not synced yet and closes the journal.
+        */
+        ~Journal();
+
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+
+        /**
+        * @brief Reads a journal.
+        * @param journalPath Path of the journal.
+        * @return The journal, with the pieces and tree saved in it.
+        * @throw string If the journal can not be read or is damaged.
+        */
+        static shared_ptr<Journal> load(string journalPath);
+
+        /**
+        * @brief Gives the directory of the journals of a user, creating it if needed.
+        * @param seederIp The IP address of the seeder of this client.
+        * @param seederPort The port number of the seeder of this client.
+        * @param userName The name of the user.
+        * @return The directory path.
+        * @throw string If the directory can not be created.
+        */
+        static string giveJournalDir(string seederIp, int seederPort, string userName);
+
+        /**
+        * @brief Gives the path of the journal of a file in a group.
+        * @param journalDir The directory of the journals.
+        * @param groupName The name of the group.
+        * @param fileName The name of the file.
+        * @return The journal path.
+        */
+        static string giveJournalPath(string journalDir, string groupName, string fileName);
+
+        /**
+        * @brief Lists the journals in a directory.
+        * @param journalDir The directory of the journals.
+        * @return Paths of the journals.
+        */
+        static vector<string> listJournals(string journalDir);
+
+        /**
+        * @brief Marks a piece as written, syncing the journal once enough pieces or time piled up.
+        * @param pieceNumber The piece written.
+        */
+        void markPiece(int pieceNumber);
+
+        /**
+        * @brief Marks a piece as missing, e.g. when it did not match its leaf anymore.
+        * @param pieceNumber The piece missing.
+        */
+        void unmarkPiece(int pieceNumber);
+
+        /**
+        * @brief Marks all pieces as written and syncs the journal.
+        */
+        void markAllPieces();
+
+        /**
+        * @brief Syncs pieces not synced yet.
+        */
+        void sync();
+
+        /**
+        * @brief Deletes the journal, nothing is written to it afterwards.
+        */
+        void remove();
+
+        /**
+        * @brief Gives the pieces marked as written.
+        * @return The piece numbers in increasing order.
+        */
+        vector<int> giveJournaledPieces() const;
+
+        /**
+        * @brief Gives the packed bitfield of the pieces marked as written.
+        * @return The bitfield packed into bytes.
+        */
+        string givePieceBytes() const;
+
+        /**
+        * @brief Checks whether all pieces are marked as written.
+        * @return True if the file is complete, false otherwise.
+        */
+        bool isComplete() const;
+
+        /**
+        * @brief Gives the file the journal is of.
+        * @return The file info.
+        */
+        const FileInfo& info() const;
+
+        /**
+        * @brief Gives the Merkle tree saved in the journal.
+        * @return The Merkle tree.
+        */
+        shared_ptr<MerkleTree> merkleTree() const;
+};
+
+/**
+ * @struct FileHandle
+ * @brief A read-only file descriptor of a shared file, closed when the last user drops it.
+ */
+struct FileHandle {
+    int m_fd{-1}; ///< Read-only file descriptor of the file.
+    atomic<int> m_lastPiece{-1}; ///< Piece last asked for from the seeder.
+    atomic<int> m_readAheadEnd{0}; ///< Piece up to which reading ahead was asked for, exclusive.
+
+    FileHandle(int fd) : m_fd(fd) {}
+    ~FileHandle() { if(m_fd != -1) close(m_fd); }
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
 };
 
 /**
@@ -325,59 +1614,365 @@ class Utils {
  * @brief Manages file paths and available pieces for files in a shared context.
  * @details This class provides static methods to add and retrieve file paths and pieces,
  *          as well as check the availability of pieces. The class is designed to be used
- *          without instantiation.
+ *          without instantiation. The registry is split into REGISTRY_SHARDS shards by the
+ *          hash of the key, each guarded by a shared_mutex, so lookups of different files
+ *          never contend and lookups of the same file run concurrently. No lock is held
+ *          while touching the disk. Waits for contended locks are recorded in the Metrics.
  */
 class Files {
     private:
         friend class Leecher;
         friend class Seeder;
 
-        static mutex m_fileNameToFilePathMutex; ///< Mutex to protect access to fileNameToFilePath.
-        static mutex m_filePathToAvailablePiecesMutex; ///< Mutex to protect access to filePathToAvailablePieces.
+        /**
+        * @struct Shard
+        * @brief One part of the registry, holding the keys that hash to it.
+        */
+        struct Shard {
+            TimedMutex<shared_mutex> m_registryMutex{Metrics::getInstance().giveLockWaits("files_registry")}; ///< Shared for lookups, exclusive for changes of the maps below.
+            map<pair<string, string>, string> m_fileNameToFilePath; ///< Maps file name and group name to file path.
+            map<string, shared_ptr<Bitfield>> m_filePathToAvailablePieces; ///< Maps file path to the bitfield of its available pieces.
+            map<string, int> m_filePathToPieceSize; ///< Maps file path to the piece size of the file.
+            map<string, shared_ptr<MerkleTree>> m_filePathToMerkleTree; ///< Maps file path to the Merkle tree proving its pieces.
 
-        static map<pair<string, string>, string> m_fileNameToFilePath; ///< Maps file name and group name to file path.
-        static map<string, vector<int>> m_filePathToAvailablePieces; ///< Maps file path to a vector of available piece numbers.
+            TimedMutex<mutex> m_openFilesMutex{Metrics::getInstance().giveLockWaits("files_open")}; ///< Mutex to protect access to openFiles and openFilesLru.
+            list<string> m_openFilesLru; ///< File paths of open files, most recently used first.
+            unordered_map<string, pair<shared_ptr<FileHandle>, list<string>::iterator>> m_openFiles; ///< Maps file path to its open handle and its position in openFilesLru.
+        };
+
+        static Shard m_shards[REGISTRY_SHARDS]; ///< The shards of the registry.
+        static mutex m_namesMutex; ///< Serializes adding and removing file names, so a path is never dropped while a name of it is added.
+
+        /**
+        * @brief Gives the shard holding a file path.
+        * @param filePath The path to the file.
+        * @return The shard of the file path.
+        */
+        static Shard& giveShard(const string& filePath);
+
+        /**
+        * @brief Gives the shard holding a file name of a group.
+        * @param fileName The name of the file.
+        * @param groupName The name of the group.
+        * @return The shard of the file name.
+        */
+        static Shard& giveShard(const string& fileName, const string& groupName);
 
         /**
         * @brief Adds a file path to the map.
         * @param fileName The name of the file.
         * @param groupName The name of the group.
         * @param filePath The path to the file.
+        * @param pieceSize The piece size the file is split into.
+        * @param merkleTree The Merkle tree of the file, one leaf per piece.
+        */
+        static void addFilepath(string fileName, string groupName, string filePath, int pieceSize, shared_ptr<MerkleTree> merkleTree);
+
+        /**
+        * @brief Gives the bitfield of available pieces of a file path.
+        * @param filePath The path to the file.
+        * @return The bitfield, null if the file path is not added.
+        */
+        static shared_ptr<Bitfield> giveBitfield(string filePath);
+
+        /**
+        * @brief Gives the Merkle tree of a file path.
+        * @param filePath The path to the file.
+        * @return The Merkle tree, null if the file path is not added.
+        */
+        static shared_ptr<MerkleTree> giveMerkleTree(string filePath);
+
+        /**
+        * @brief Gives the piece size of a file path.
+        * @param filePath The path to the file.
+        * @return The piece size, -1 if the file path is not added.
         */
-        static void addFilepath(string fileName, string groupName, string filePath);
+        static int givePieceSize(string filePath);
 
         /**
-        * @brief Adds a piece number to the list of available pieces for a given file path.
+        * @brief Marks a piece as available for a given file path.
         * @param filePath The path to the file.
         * @param pieceNumber The piece number to add.
         */
-        static void addPieceToFilepath(string filePath, int pieceNumber);
+        static void addPieceToFilepath(string filePath, int pieceNumber);
+
+        /**
+        * @brief Retrieves the file path for a given file name and group name.
+        * @param fileName The name of the file.
+        * @param groupName The name of the group.
+        * @return The file path, or an empty string if not found.
+        */
+        static string giveFilePath(string fileName, string groupName);
+
+        /**
+        * @brief Retrieves the packed bitfield of available pieces for a given file path.
+        * @param filePath The path to the file.
+        * @return The bitfield packed into bytes, or an empty string if the file path is not added.
+        */
+        static string giveAvailablePieces(string filePath);
+
+        /**
+        * @brief Checks if a specific piece is available for a given file path.
+        * @param filePath The path to the file.
+        * @param pieceNumber The piece number to check.
+        * @return True if the piece is available, false otherwise.
+        */
+        static bool isPieceAvailable(string filePath, int pieceNumber);
+
+        /**
+        * @brief Removes a file name from the map, then forgets its file and closes it if no other name refers to it.
+        * @param fileName The name of the file.
+        * @param groupName The name of the group.
+        */
+        static void removeFilepath(string fileName, string groupName);
+
+        /**
+        * @brief Gives an open handle for a file path, opening it on a cache miss.
+        * @param filePath The path to the file.
+        * @return Shared handle of the file, it stays open while held even if evicted.
+        * @throw string If the file can not be opened.
+        */
+        static shared_ptr<FileHandle> giveFileHandle(string filePath);
+
+        /**
+        * @brief Drops the cached handle of a file path.
+        * @param filePath The path to the file.
+        */
+        static void closeFileHandle(string filePath);
+
+        /**
+        * @brief Drops all cached handles.
+        */
+        static void closeAllFileHandles();
+
+    public:
+        Files() = default;
+};
+
+/**
+ * @class DownloadScheduler
+ * @brief Shares the "give_piece" requests in flight between all downloads of the session.
+ * @details At most MAX_INFLIGHT_REQUESTS requests are in flight at once, and at most
+ *          MAX_INFLIGHT_PER_PEER to one seeder. Every active download gets a share of the
+ *          global limit matching its priority, so one huge download can not starve small
+ *          ones. A share left unused by one download goes to the others until it is asked
+ *          for again. All methods are thread-safe.
+ */
+class DownloadScheduler {
+    private:
+        /**
+        * @struct Download
+        * @brief Requests of one download.
+        */
+        struct Download {
+            int m_weight{DOWNLOAD_PRIORITY_NORMAL}; ///< Priority weight of the download.
+            int m_inFlight{0}; ///< Requests in flight.
+            int m_waiting{0}; ///< Workers waiting for a request slot.
+        };
+
+        mutex m_schedulerMutex; ///< Mutex to protect all members below.
+        condition_variable m_requestReleased; ///< Signalled when a request slot is given back or a download ends.
+        int m_nextDownloadId{0}; ///< Id given to the next download registered.
+        int m_inFlight{0}; ///< Requests in flight across all downloads.
+        map<int, Download> m_downloads; ///< Active downloads by id.
+        unordered_map<string, int> m_peerInFlight; ///< Requests in flight to every seeder by IP:Port.
+
+        /**
+        * @brief Gives the share of the global limit a download is entitled to.
+        * @param download The download.
+        * @param totalWeight Sum of the weights of all active downloads.
+        * @return At least one request.
+        * @note Expects m_schedulerMutex to be held.
+        */
+        int giveShareLocked(const Download& download, int totalWeight) const;
+
+        /**
+        * @brief Checks whether a download can send one more request to a seeder now.
+        * @param downloadId Id of the download.
+        * @param seederIpPort IP:Port of the seeder.
+        * @return True if a request slot can be granted, false otherwise.
+        * @note Expects m_schedulerMutex to be held.
+        */
+        bool canGrantLocked(int downloadId, const string& seederIpPort) const;
+
+    public:
+        DownloadScheduler() = default;
+        DownloadScheduler(const DownloadScheduler&) = delete;
+        DownloadScheduler& operator=(const DownloadScheduler&) = delete;
+
+        /**
+        * @brief Registers a new download.
+        * @param weight Priority weight of the download, one of the DOWNLOAD_PRIORITY_* values.
+        * @return Id of the download.
+        */
+        int addDownload(int weight);
+
+        /**
+        * @brief Forgets a download once all of its workers are done.
+        * @param downloadId Id of the download.
+        */
+        void removeDownload(int downloadId);
+
+        /**
+        * @brief Takes a slot for one request of a download to a seeder.
+        * @param downloadId Id of the download.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param shouldWait Whether to wait for a slot, only allowed without any slot held by the caller.
+        * @return True if a slot was taken, false if none is free and the caller should not wait.
+        */
+        bool acquireRequest(int downloadId, const string& seederIpPort, bool shouldWait);
+
+        /**
+        * @brief Gives back the slot of a request once its reply is received or the request is lost.
+        * @param downloadId Id of the download.
+        * @param seederIpPort IP:Port of the seeder.
+        */
+        void releaseRequest(int downloadId, const string& seederIpPort);
+};
+
+/**
+ * @class PieceScheduler
+ * @brief Decides which piece of a download should be requested from which seeder.
+ * @details Keeps a rarity index of all pieces, i.e. the number of seeders holding each
+ *          piece, and hands out the rarest pending piece a seeder holds, breaking ties
+ *          randomly. Once only the last few pieces are left it switches to endgame mode,
+ *          in which pieces already in flight are requested again from other seeders and
+ *          the first verified copy wins. All methods are thread-safe.
+ */
+class PieceScheduler {
+    private:
+        enum PieceState { PENDING, IN_FLIGHT, COMPLETED };
+
+        mutable mutex m_schedulerMutex; ///< Mutex to protect all members below.
+        mt19937 m_randomGenerator; ///< Random generator to break ties between equally rare pieces.
+
+        int m_numPieces; ///< Total number of pieces in the file.
+        int m_remainingPieces; ///< Number of pieces that are not completed yet.
+        int m_pendingPieces; ///< Number of pieces that are neither completed nor in flight.
+
+        vector<PieceState> m_pieceState; ///< State of every piece.
+        vector<int> m_availability; ///< Number of seeders holding every piece.
+        vector<int> m_failedAttempts; ///< Number of failed attempts of every piece.
+        vector<vector<string>> m_requestedFrom; ///< Seeders every in-flight piece is currently requested from.
+        set<int> m_inFlightPieces; ///< Pieces currently requested from at least one seeder.
+
+        vector<vector<int>> m_rarityBuckets; ///< Pending pieces bucketed by availability, in random order.
+        vector<int> m_bucketPosition; ///< Position of every pending piece in its bucket, -1 if not in any bucket.
+
+        unordered_map<string, vector<bool>> m_seederPieces; ///< Pieces held by every seeder.
+        unordered_set<string> m_chokedSeeders; ///< Seeders only given pieces no unchoked seeder holds.
+
+        /**
+        * @brief Checks whether a seeder other than the given one, which is not choked, holds a piece.
+        * @param pieceNumber The piece to check.
+        * @param seederIpPort IP:Port of the seeder asking.
+        * @return True if the piece can be left to an unchoked seeder, false otherwise.
+        * @note Expects m_schedulerMutex to be held.
+        */
+        bool isHeldByUnchokedLocked(int pieceNumber, const string& seederIpPort) const;
+
+        /**
+        * @brief Inserts a pending piece at a random position in the bucket of its availability.
+        * @param pieceNumber The piece to insert.
+        */
+        void insertIntoBucket(int pieceNumber);
+
+        /**
+        * @brief Removes a piece from its bucket, if it is in one.
+        * @param pieceNumber The piece to remove.
+        */
+        void removeFromBucket(int pieceNumber);
+
+        /**
+        * @brief Changes the availability of a piece and moves it to the matching bucket.
+        * @param pieceNumber The piece whose availability changes.
+        * @param delta The change in the number of seeders holding the piece.
+        */
+        void updateAvailability(int pieceNumber, int delta);
+
+        /**
+        * @brief Checks whether the download is in endgame mode.
+        * @return True if only the last few pieces are left, false otherwise.
+        * @note Expects m_schedulerMutex to be held.
+        */
+        bool isEndgameLocked() const;
+
+    public:
+        /**
+        * @brief Constructs a scheduler for a file with the given number of pieces.
+        * @param numPieces The number of pieces in the file.
+        */
+        PieceScheduler(int numPieces);
+
+        /**
+        * @brief Sets the pieces held by a seeder, e.g. from a "give_piece_info" reply.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param pieces Piece numbers the seeder holds. Replaces any earlier list.
+        * @return The number of pieces the seeder holds that are not completed yet.
+        */
+        int updateSeederPieces(string seederIpPort, const vector<int>& pieces);
+
+        /**
+        * @brief Forgets a seeder, e.g. once it is no longer reachable.
+        * @param seederIpPort IP:Port of the seeder.
+        */
+        void removeSeeder(string seederIpPort);
+
+        /**
+        * @brief Claims the next piece to request from a seeder.
+        * @param seederIpPort IP:Port of the seeder.
+        * @return The rarest pending piece held by the seeder, an in-flight piece in endgame
+        *         mode, or -1 if there is nothing to request from this seeder.
+        */
+        int claimPiece(string seederIpPort);
+
+        /**
+        * @brief Sets whether a seeder is choked, a choked seeder is only given pieces no unchoked seeder holds.
+        * @param seederIpPort IP:Port of the seeder.
+        * @param isChoked Whether the seeder is choked.
+        */
+        void setSeederChoked(string seederIpPort, bool isChoked);
+
+        /**
+        * @brief Checks whether a seeder holds a piece that is not completed yet.
+        * @param seederIpPort IP:Port of the seeder.
+        * @return True if the seeder may still be needed, false otherwise.
+        */
+        bool holdsRemainingPieces(string seederIpPort) const;
+
+        /**
+        * @brief Marks a claimed piece as downloaded and verified.
+        * @param pieceNumber The piece that was downloaded.
+        * @param seederIpPort IP:Port of the seeder it was downloaded from.
+        * @return True if this is the first copy of the piece, false if an endgame duplicate won already.
+        */
+        bool completePiece(int pieceNumber, string seederIpPort);
 
         /**
-        * @brief Retrieves the file path for a given file name and group name.
-        * @param fileName The name of the file.
-        * @param groupName The name of the group.
-        * @return The file path, or an empty string if not found.
+        * @brief Releases a claimed piece after a failed attempt so that it can be retried.
+        * @param pieceNumber The piece that failed.
+        * @param seederIpPort IP:Port of the seeder it was requested from.
         */
-        static string giveFilePath(string fileName, string groupName);
+        void releasePiece(int pieceNumber, string seederIpPort);
 
         /**
-        * @brief Retrieves a string of available pieces for a given file path.
-        * @param filePath The path to the file.
-        * @return A string of available piece numbers separated by spaces, or an empty string if none.
+        * @brief Checks whether a piece has been completed.
+        * @param pieceNumber The piece to check.
+        * @return True if the piece is completed, false otherwise.
         */
-        static string giveAvailablePieces(string filePath);
+        bool isPieceCompleted(int pieceNumber) const;
 
         /**
-        * @brief Checks if a specific piece is available for a given file path.
-        * @param filePath The path to the file.
-        * @param pieceNumber The piece number to check.
-        * @return True if the piece is available, false otherwise.
+        * @brief Checks whether all pieces have been completed.
+        * @return True if the download is complete, false otherwise.
         */
-        static bool isPieceAvailable(string filePath, int pieceNumber);
+        bool isComplete() const;
 
-    public:
-        Files() = default;
+        /**
+        * @brief Checks whether the download cannot complete anymore.
+        * @return True if a piece ran out of attempts or is not held by any seeder, false otherwise.
+        */
+        bool hasFailed() const;
 };
 
 /**
@@ -392,19 +1987,73 @@ class Files {
  */
 class Leecher {
     private:
+        /**
+        * @struct HaveBatch
+        * @brief Downloaded pieces of a file not announced to the tracker yet.
+        */
+        struct HaveBatch {
+            vector<int> m_pieces; ///< Pieces not announced yet.
+            bool m_isAnnounced{false}; ///< Whether the tracker lists this client as a sharer of the file already.
+            chrono::steady_clock::time_point m_lastSent; ///< Time pieces of the file were last announced.
+        };
+
+        /**
+        * @struct PendingUpload
+        * @brief A file hashed for upload, shared once the tracker accepted it.
+        */
+        struct PendingUpload {
+            FileInfo m_info; ///< The file.
+            shared_ptr<MerkleTree> m_merkleTree; ///< Merkle tree over the SHAs of its pieces.
+            string m_messageForTracker; ///< The "upload_file" command for the tracker.
+        };
+
+        /**
+        * @struct TrackerLink
+        * @brief Connection to one of the trackers, opened on first use.
+        */
+        struct TrackerLink {
+            string m_trackerIp; ///< IP address of the tracker.
+            int m_trackerPort; ///< Port number of the tracker.
+            mutex m_linkMutex; ///< Mutex to keep requests on the connection and their responses paired.
+            unique_ptr<ClientSocket> m_socket; ///< The connection, null while it is closed.
+            bool m_isDown{false}; ///< Whether the tracker could not be reached the last time it was tried.
+            chrono::steady_clock::time_point m_downSince; ///< Time the tracker could not be reached.
+        };
+
         mutex m_downloadFileMutex; ///< Mutex to synchronize access to download file operations.
+        mutex m_trackerMutex; ///< Mutex to protect the authentication token, read by download threads.
+        mutex m_haveMutex; ///< Mutex to protect pending announcements.
+        mutex m_subscribeMutex; ///< Mutex to keep subscription commands and their responses paired.
+        mutex m_notifyMutex; ///< Mutex to protect the notification connection and its responses.
+        condition_variable m_notifyReplied; ///< Signalled when a response arrives or the notification connection is lost.
 
         string m_authToken{"NULL"}; ///< Authentication token for the user.
         string m_seederIp; ///< IP address of the seeder.
         int m_seederPort; ///< Port number of the seeder.
-
-        ClientSocket m_clientSocket; ///< Client socket for network communication.
+        string m_requestPrefix; ///< Start of the request id of every write, unique to this client and its start time.
+        atomic<uint64_t> m_nextRequestNumber{0}; ///< Writes sent so far, numbers the request ids.
+
+        vector<unique_ptr<TrackerLink>> m_trackers; ///< Connections to all trackers, the tracker picked on the command line first.
+        atomic<size_t> m_homeTracker{0}; ///< Tracker changes and subscriptions are sent to first, the last one that took a change.
+        atomic<size_t> m_nextReadTracker{0}; ///< Tracker the next read is sent to first, reads go round all trackers.
+        shared_ptr<ClientSocket> m_notifySocket; ///< Second connection to a tracker carrying subscriptions and notifications, null until the first subscription.
+        deque<pair<FrameHeader, string>> m_notifyReplies; ///< Responses to subscription commands not taken yet.
+        vector<string> m_subscriptions; ///< Subscription commands of this session, sent again when the notification connection is lost.
+        PeerConnectionPool m_peerPool; ///< Connections to seeders, shared by all downloads.
+        PeerStats m_peerStats; ///< Measurements of seeders, shared by all downloads.
+        DownloadScheduler m_downloadScheduler; ///< Shares requests in flight between all downloads.
         Logger m_logger; ///< Logger for tracking events and errors.
 
         set<pair<string, string>> m_downloadingFiles; ///< Set of files currently being downloaded (groupId, fileName).
         set<pair<string, string>> m_downloadedFiles; ///< Set of files that have been downloaded (groupId, fileName).
         set<pair<string, string>> m_downloadFailFiles; ///< Set of files that failed to download (groupId, fileName).
 
+        string m_userName; ///< Name of the logged in user.
+        string m_journalDir{""}; ///< Directory of the journals of the logged in user.
+        map<pair<string, string>, shared_ptr<Journal>> m_journals; ///< Journals of files shared or downloaded in this session (groupId, fileName).
+        map<pair<string, string>, HaveBatch> m_pendingHaves; ///< Pieces of files being downloaded not announced yet (groupId, fileName).
+        map<pair<string, string>, set<string>> m_joinedSeeders; ///< Seeders of files being downloaded that started sharing since, learnt from notifications (groupId, fileName).
+
         /**
          * @brief Reads and processes commands from the user.
          */
@@ -424,11 +2073,38 @@ class Leecher {
         string sendTracker(string messageForTracker);
 
         /**
-         * @brief Checks for errors in the tracker response.
-         * @param response The response received from the tracker.
+         * @brief Gives a message with a request id in front if it changes the state of the trackers.
+         * @param messageForTracker The message.
+         * @return "request <id> <message>" for a write, the message as it is otherwise.
+         */
+        string giveRequest(string messageForTracker);
+
+        /**
+         * @brief Sends commands to the tracker in one frame and receives their responses.
+         * @param messagesForTracker The messages to be sent, at most MAX_BATCH_COMMANDS.
+         * @return Status and response of every message, in order.
+         * @throws string If the tracker refuses the whole batch or no tracker can be reached.
+         */
+        vector<pair<uint8_t, string>> sendTrackerBatch(vector<string> messagesForTracker);
+
+        /**
+         * @brief Sends a frame to a tracker, moving on to the next tracker if one can not be reached.
+         * @param payload The payload of the frame.
+         * @param opcode The kind of message, OPCODE_COMMAND or OPCODE_BATCH.
+         * @param isRead Whether the frame only reads, reads go round all trackers.
+         * @return The header and payload of the response.
+         * @throws string If no tracker can be reached.
+         */
+        pair<FrameHeader, string> exchangeTracker(string payload, uint8_t opcode, bool isRead);
+
+        /**
+         * @brief Checks for errors in a response.
+         * @param header The frame header of the response.
+         * @param response The response received from the tracker or a seeder.
+         * @param expectedOpcode The opcode a successful response must carry.
          * @throws string If the response contains an error.
          */
-        void checkForError(string response);
+        void checkForError(const FrameHeader& header, string response, uint8_t expectedOpcode = OPCODE_RESPONSE);
 
         /**
          * @brief Prints the response received from the tracker.
@@ -437,6 +2113,23 @@ class Leecher {
          */
         void printResponse(vector<string> tokens, string response);
 
+        /**
+         * @brief Sends a message to a seeder over an already connected socket and receives the response.
+         * @param seederSocket The socket connected to the seeder.
+         * @param messageForSeeder The message to be sent to the seeder.
+         * @return The response received from the seeder.
+         * @throws string If the seeder responds with an error or the connection fails.
+         */
+        string sendSeeder(ClientSocket& seederSocket, string messageForSeeder);
+
+        /**
+         * @brief Calls the function handling a user command.
+         * @param tokens Command tokens, not empty.
+         * @param inputFromClient The input command string from the user.
+         * @throws string If the command is unknown or fails.
+         */
+        void dispatchUserRequest(vector<string> tokens, string inputFromClient);
+
         // Command handling methods
         void quit(vector<string> tokens, string response);
         void createUser(vector<string> tokens, string inputFromClient);
@@ -453,6 +2146,116 @@ class Leecher {
         void showDownloads(vector<string> tokens, string inputFromClient);
         void logout(vector<string> tokens, string inputFromClient);
         void stopShare(vector<string> tokens, string inputFromClient);
+        void subscribe(vector<string> tokens, string inputFromClient);
+        void batch(vector<string> tokens, string inputFromClient);
+        void stats(vector<string> tokens, string inputFromClient);
+
+        /**
+         * @brief Hashes a file for upload and builds its command for the tracker.
+         * @param tokens Tokens of the "upload_file" command.
+         * @return The file, ready to be shared once the tracker accepts it.
+         * @throws string If the arguments are invalid or the file can not be read.
+         */
+        PendingUpload prepareUpload(vector<string> tokens);
+
+        /**
+         * @brief Shares a file accepted by the tracker and journals it.
+         * @param upload The file.
+         */
+        void finishUpload(const PendingUpload& upload);
+
+        /**
+         * @brief Stops serving a file locally and drops its journal.
+         * @param groupName The group of the file.
+         * @param fileName The name of the file.
+         */
+        void forgetShare(string groupName, string fileName);
+
+        /**
+         * @brief Sends a subscription command on the notification connection, opening it first if needed.
+         * @param messageForTracker The command to be sent to the tracker.
+         * @return The response of the tracker.
+         * @throws string If the tracker can not be reached or responds with an error.
+         */
+        string sendSubscription(string messageForTracker);
+
+        /**
+         * @brief Receives the frames of a notification connection until it is closed, run on its own thread.
+         * @param notifySocket The notification connection.
+         */
+        void listenNotifications(shared_ptr<ClientSocket> notifySocket);
+
+        /**
+         * @brief Sends the subscriptions of the session again on a new notification connection.
+         * @param subscriptions The subscription commands, in the order they were sent.
+         */
+        void resubscribe(vector<string> subscriptions);
+
+        /**
+         * @brief Opens a connection to a tracker.
+         * @param trackerIp IP address of the tracker.
+         * @param trackerPort Port number of the tracker.
+         * @return The connected socket.
+         * @throws string If the tracker can not be reached.
+         */
+        unique_ptr<ClientSocket> openTrackerSocket(string trackerIp, int trackerPort);
+
+        /**
+         * @brief Shows a notification and hands new seeders to the download of the file.
+         * @param notification "Event GroupName FileName [IP:Port]", the event being file_added, file_removed, peer_joined or peer_left.
+         */
+        void handleNotification(string notification);
+
+        /**
+         * @brief Closes the notification connection, the tracker drops its subscriptions with it.
+         */
+        void closeNotifications();
+
+        /**
+         * @brief Asks the tracker and the seeders for a file and starts downloading it in a separate thread.
+         * @param groupName The name of the group.
+         * @param fileName The name of the file to download.
+         * @param destinationPath The path to save the downloaded file.
+         * @param resumedJournal Journal of an earlier download of the file to resume, null to start afresh.
+         * @param priority Priority weight of the download, one of the DOWNLOAD_PRIORITY_* values.
+         * @throws string If the file can not be downloaded as of now.
+         */
+        void startDownload(string groupName, string fileName, string destinationPath, shared_ptr<Journal> resumedJournal, int priority);
+
+        /**
+         * @brief Shares the files and resumes the downloads recorded in the journals of the logged in user.
+         */
+        void resumeJournals();
+
+        /**
+         * @brief Checks the pieces recorded in a journal against the data on disk and makes the matching ones available.
+         * @param journal The journal of the file.
+         * @param scheduler Scheduler of the download the pieces are completed in, null if the file is not being downloaded.
+         */
+        void verifyJournaledPieces(shared_ptr<Journal> journal, PieceScheduler* scheduler);
+
+        /**
+         * @brief Collects downloaded pieces and announces them to the tracker with "have" once a batch is due.
+         * @param groupName The name of the group.
+         * @param fileName The name of the file.
+         * @param pieces The pieces verified and written.
+         */
+        void announcePieces(string groupName, string fileName, const vector<int>& pieces);
+
+        /**
+         * @brief Announces the pieces of a file still collected, e.g. once its download ends.
+         * @param groupName The name of the group.
+         * @param fileName The name of the file.
+         */
+        void flushAnnouncements(string groupName, string fileName);
+
+        /**
+         * @brief Sends one "have" message, keeping the pieces for the next one if it fails.
+         * @param groupName The name of the group.
+         * @param fileName The name of the file.
+         * @param pieces The pieces to announce.
+         */
+        void sendHave(string groupName, string fileName, vector<int> pieces);
 
         /**
          * @brief Downloads a file in a separate thread.
@@ -460,10 +2263,30 @@ class Leecher {
          * @param groupName The name of the group.
          * @param destinationPath The path to save the downloaded file.
          * @param fileSize The size of the file.
-         * @param SHAs The SHA hashes of the file pieces.
+         * @param pieceSize The piece size the file is split into.
+         * @param merkleTree Merkle tree of the file, knowing its root.
          * @param pieceToSeeders Mapping from piece index to seeders.
+         * @param fileSHA SHA of the entire file, in hexadecimal.
+         * @param journalPath Path of the journal of the download.
+         * @param resumedJournal Journal of an earlier download of the file to resume, null to start afresh.
+         * @param priority Priority weight of the download, one of the DOWNLOAD_PRIORITY_* values.
+         */
+        void downloadFileThread(string fileName, string groupName, string destinationPath, long long fileSize, int pieceSize, shared_ptr<MerkleTree> merkleTree, unordered_map<int, vector<string>> pieceToSeeders, string fileSHA, string journalPath, shared_ptr<Journal> resumedJournal, int priority);
+
+        /**
+         * @brief Downloads pieces from a single seeder until none of its pieces are pending.
+         * @param seederIpPort IP:Port of the seeder to download from.
+         * @param fileName The name of the file to download.
+         * @param groupName The name of the group.
+         * @param fileFd File descriptor of the destination file, opened for writing.
+         * @param destinationPath The path of the destination file.
+         * @param pieceSize The piece size the file is split into.
+         * @param merkleTree Merkle tree of the file, every piece is verified against it.
+         * @param scheduler Scheduler deciding which pieces to request, shared by all workers of this download.
+         * @param journal Journal every written piece is recorded in.
+         * @param downloadId Id of the download in the download scheduler.
          */
-        void downloadFileThread(string fileName, string groupName, string destinationPath, int fileSize, vector<string> SHAs, unordered_map<int, vector<string>> pieceToSeeders);
+        void downloadFromSeeder(string seederIpPort, string fileName, string groupName, int fileFd, string destinationPath, int pieceSize, MerkleTree& merkleTree, PieceScheduler& scheduler, Journal& journal, int downloadId);
 
         Leecher() = default; ///< Default constructor (private).
         ~Leecher() = default; ///< Default destructor (private).
@@ -478,21 +2301,17 @@ class Leecher {
         Leecher(string seederIp, int seederPort)
             : m_seederIp(seederIp)
             , m_seederPort(seederPort)
+            , m_requestPrefix("request " + seederIp + ":" + to_string(seederPort) + ":" + to_string(chrono::system_clock::now().time_since_epoch().count()) + ":")
             , m_logger(Logger(seederIp, seederPort, "leecher"))
         {}
 
     public:
         /**
-         * @brief Initializes the Leecher instance.
-         */
-        void init();
-
-        /**
-         * @brief Connects to the tracker server.
-         * @param trackerIp IP address of the tracker server.
-         * @param trackerPort Port number of the tracker server.
+         * @brief Connects to the first reachable tracker, the others are connected to when used.
+         * @param trackers IP address and port number of every tracker, the one to try first at the front.
+         * @throws string If no tracker can be reached.
          */
-        void connectTracker(string trackerIp, int trackerPort);
+        void connectTracker(vector<pair<string, int>> trackers);
 
         /**
          * @brief Starts the Leecher instance.
@@ -517,6 +2336,405 @@ class Leecher {
 };
 
 
+/**
+ * @struct PieceLocation
+ * @brief Where the data of a requested piece lives on disk.
+ */
+struct PieceLocation {
+    shared_ptr<FileHandle> m_file; ///< Open handle of the file holding the piece.
+    off_t m_offset{0}; ///< Offset of the piece in the file.
+    size_t m_length{0}; ///< Length of the piece, shorter than the piece size for the last piece.
+    string m_proof; ///< Merkle proof of the piece, sent ahead of its data.
+    shared_ptr<const string> m_data; ///< Data of the piece from the PieceCache, null if it is sent from the file.
+};
+
+/**
+ * @class UploadLimiter
+ * @brief Shapes the piece data a seeder uploads, keyed by the IP address of the leecher.
+ * @details Token buckets cap the bytes per second sent to all leechers together and to
+ *          each one of them. At most a number of leechers hold an upload slot at once, the
+ *          others are choked and wait for one in the order they asked. A slot is given to
+ *          the next waiting leecher once its holder is idle, or has held it for
+ *          UPLOAD_SLOT_ROTATION, so every leecher gets its turn. Limits are read from the
+ *          environment on construction. All methods are thread-safe.
+ */
+class UploadLimiter {
+    private:
+        /**
+        * @struct TokenBucket
+        * @brief Bytes that may be sent, refilled at a fixed rate up to a burst.
+        */
+        struct TokenBucket {
+            double m_rate{0}; ///< Bytes added per second, 0 for no limit.
+            double m_capacity{0}; ///< Most bytes the bucket holds.
+            double m_tokens{0}; ///< Bytes that may be sent now, negative after a send larger than the bucket.
+            chrono::steady_clock::time_point m_refilledAt; ///< Time the tokens were last refilled.
+
+            /**
+            * @brief Sets the rate and fills the bucket.
+            * @param rate Bytes per second, 0 for no limit.
+            */
+            void setRate(double rate);
+
+            /**
+            * @brief Cuts an allowance down to the bytes the bucket holds.
+            * @param now The current time.
+            * @param wanted Bytes waiting to be sent.
+            * @param allowed Bytes to be sent, lowered to what the bucket allows, 0 if it must be waited for.
+            * @param wait Raised to the time until the bucket allows a quantum, if it does not now.
+            */
+            void limit(chrono::steady_clock::time_point now, size_t wanted, size_t& allowed, chrono::steady_clock::duration& wait);
+        };
+
+        /**
+        * @struct Peer
+        * @brief Upload state of one leecher.
+        */
+        struct Peer {
+            TokenBucket m_bucket; ///< Bytes that may be sent to the leecher.
+            int m_connections{0}; ///< Open connections of the leecher.
+            bool m_isUnchoked{false}; ///< Whether the leecher holds an upload slot.
+            bool m_isWaiting{false}; ///< Whether the leecher is queued for an upload slot.
+            chrono::steady_clock::time_point m_unchokedSince; ///< Time the leecher got its slot.
+            chrono::steady_clock::time_point m_lastActiveAt; ///< Time the leecher was last sent piece data.
+        };
+
+        mutex m_limiterMutex; ///< Mutex to protect all of the state below.
+        TokenBucket m_bucket; ///< Bytes that may be sent to all leechers together.
+        double m_peerRate{0}; ///< Bytes per second of the bucket of every leecher, 0 for no limit.
+        size_t m_slots{0}; ///< Leechers holding a slot at once, 0 for no limit.
+        size_t m_unchokedPeers{0}; ///< Leechers holding a slot.
+        unordered_map<string, Peer> m_peers; ///< Leechers with an open connection by IP address.
+        deque<string> m_waitingPeers; ///< Choked leechers asking for a slot, the next one to get it at the front.
+
+        /**
+        * @brief Reads a limit from the environment.
+        * @param name Name of the environment variable.
+        * @param fallback The limit used if the variable is not set or not a number.
+        * @return The limit.
+        */
+        static long long giveSetting(const char* name, long long fallback);
+
+        /**
+        * @brief Takes slots from idle and long holders and gives free slots to waiting leechers.
+        * @param now The current time.
+        * @note Expects m_limiterMutex to be held.
+        */
+        void rotateLocked(chrono::steady_clock::time_point now);
+
+        /**
+        * @brief Takes the slot of a leecher.
+        * @param peer The leecher.
+        * @note Expects m_limiterMutex to be held.
+        */
+        void chokeLocked(Peer& peer);
+
+    public:
+        /**
+        * @brief Creates the limiter with the limits of the environment, see UPLOAD_RATE_LIMIT,
+        *        PEER_UPLOAD_RATE_LIMIT and UPLOAD_SLOTS.
+        */
+        UploadLimiter();
+
+        /**
+        * @brief Counts a new connection of a leecher.
+        * @param peerIp IP address of the leecher.
+        */
+        void addConnection(const string& peerIp);
+
+        /**
+        * @brief Forgets a closed connection of a leecher, freeing its slot with its last connection.
+        * @param peerIp IP address of the leecher.
+        */
+        void removeConnection(const string& peerIp);
+
+        /**
+        * @brief Checks whether a leecher holds an upload slot, queueing it for one if it does not.
+        * @param peerIp IP address of the leecher.
+        * @param resumeAt Set to the time to check again if the leecher is choked.
+        * @return True if a piece can be sent to the leecher.
+        */
+        bool admit(const string& peerIp, chrono::steady_clock::time_point& resumeAt);
+
+        /**
+        * @brief Gives the bytes of piece data that may be sent to a leecher now.
+        * @param peerIp IP address of the leecher.
+        * @param wanted Bytes waiting to be sent.
+        * @param resumeAt Set to the time more bytes may be sent if none may be sent now.
+        * @return Between 0 and wanted bytes, the bytes sent must be passed to consume().
+        */
+        size_t giveAllowance(const string& peerIp, size_t wanted, chrono::steady_clock::time_point& resumeAt);
+
+        /**
+        * @brief Takes the bytes sent to a leecher from the buckets.
+        * @param peerIp IP address of the leecher.
+        * @param bytes Bytes of piece data sent.
+        */
+        void consume(const string& peerIp, size_t bytes);
+};
+
+/**
+ * @class PieceCache
+ * @brief Pieces recently sent by the seeder kept in memory, keyed by file path and piece number.
+ * @details A piece is cached only when it is asked for again while it is still remembered
+ *          from its first request, so files read once by a single leecher keep being sent
+ *          from disk with sendfile() and do not evict popular pieces. Cached pieces are
+ *          evicted least recently used first to stay within PIECE_CACHE_BYTES. An entry is
+ *          only used while the path still names the file it was read from, unchanged in size
+ *          and modification time, pieces of a file being downloaded do not change once they
+ *          are available. The cache is split into PIECE_CACHE_SHARDS shards by the hash of
+ *          the piece, each with its own lock, so workers serving different pieces never
+ *          contend. All methods are thread-safe.
+ */
+class PieceCache {
+    private:
+        /**
+        * @struct Entry
+        * @brief A cached piece.
+        */
+        struct Entry {
+            shared_ptr<const string> m_data; ///< Data of the piece.
+            dev_t m_device{0}; ///< Device of the file the piece was read from.
+            ino_t m_inode{0}; ///< Inode of the file the piece was read from.
+            off_t m_fileSize{0}; ///< Size of the file when the piece was read.
+            struct timespec m_modifiedAt{}; ///< Modification time of the file when the piece was read.
+            list<pair<string, int>>::iterator m_lruPosition; ///< Position of the piece in lru.
+        };
+
+        /**
+        * @struct Shard
+        * @brief One part of the cache, holding the pieces that hash to it.
+        */
+        struct Shard {
+            TimedMutex<mutex> m_cacheMutex{Metrics::getInstance().giveLockWaits("piece_cache")}; ///< Mutex to protect all of the state below.
+            map<pair<string, int>, Entry> m_entries; ///< Cached pieces by file path and piece number.
+            list<pair<string, int>> m_lru; ///< Cached pieces, most recently used first.
+            size_t m_cachedBytes{0}; ///< Bytes of all cached pieces of the shard.
+            set<pair<string, int>> m_ghosts; ///< Pieces sent from disk lately, not cached.
+            deque<pair<string, int>> m_ghostOrder; ///< Pieces of ghosts, the oldest first.
+        };
+
+        Shard m_shards[PIECE_CACHE_SHARDS]; ///< The shards of the cache.
+
+        /**
+        * @brief Gives the shard holding a piece.
+        * @param key File path and piece number of the piece.
+        * @return The shard of the piece.
+        */
+        Shard& giveShard(const pair<string, int>& key);
+
+        /**
+        * @brief Checks whether an entry was read from the file as it is now.
+        * @param entry The cached piece.
+        * @param info Status of the file now.
+        * @return True if the entry can be used.
+        */
+        static bool isFresh(const Entry& entry, const struct stat& info);
+
+        /**
+        * @brief Drops a cached piece.
+        * @param shard The shard holding the piece.
+        * @param it The piece.
+        * @note Expects the mutex of the shard to be held.
+        */
+        static void eraseLocked(Shard& shard, map<pair<string, int>, Entry>::iterator it);
+
+    public:
+        /**
+        * @brief Gives the data of a piece if it is cached, reading it in if it was asked for lately.
+        * @param filePath The path to the file.
+        * @param pieceNumber The piece number.
+        * @param fd Open descriptor of the file.
+        * @param info Status of the file now.
+        * @param offset Offset of the piece in the file.
+        * @param length Length of the piece.
+        * @return The data of the piece, null if it is to be sent from disk.
+        */
+        shared_ptr<const string> givePiece(const string& filePath, int pieceNumber, int fd, const struct stat& info, off_t offset, size_t length);
+};
+
+/**
+ * @struct OutputChunk
+ * @brief A frame queued on a connection, either all in memory or a header followed by a file range or a shared buffer.
+ */
+struct OutputChunk {
+    string m_data; ///< Bytes of the frame kept in memory, only the header and prefix if m_file or m_buffer is set.
+    shared_ptr<FileHandle> m_file; ///< File the payload is sent from with sendfile(), null for in-memory frames.
+    shared_ptr<const string> m_buffer; ///< Shared buffer the payload is sent from, e.g. a cached piece, null for other frames.
+    off_t m_offset{0}; ///< Offset of the file or buffer data not sent yet.
+    size_t m_length{0}; ///< Length of the file or buffer data not sent yet.
+    bool m_isAdmitted{false}; ///< Set once the leecher got an upload slot for the frame, which is then sent whole.
+};
+
+/**
+ * @class Connection
+ * @brief State of one non-blocking connection served by the EventLoop.
+ * @details Only the worker the connection is handed to touches it, so it needs no locking.
+ */
+class Connection {
+    public:
+        int m_fd; ///< File descriptor of the connected socket.
+        string m_peerIp; ///< IP address of the peer.
+        atomic<uint64_t>* m_bytesServed{nullptr}; ///< Counter of the bytes sent to the peer in the Metrics, null if not counted.
+        string m_inBuffer; ///< Received bytes not yet handled as complete frames.
+        deque<OutputChunk> m_outQueue; ///< Frames waiting to be sent, in order.
+        size_t m_outSent{0}; ///< Bytes of m_data of the front chunk already sent.
+        bool m_peerClosed{false}; ///< Set once the peer closed its side of the connection.
+        chrono::steady_clock::time_point m_resumeAt; ///< Time the upload limiter lets queued output go on, set when it holds it back.
+
+        /**
+        * @brief Creates the state of an accepted connection.
+        * @param fd File descriptor of the connected socket.
+        * @param peerIp IP address of the peer.
+        */
+        Connection(int fd, string peerIp = "") : m_fd(fd), m_peerIp(peerIp) {}
+
+        /**
+        * @brief Queues a frame to be sent to the peer.
+        * @param payload The payload of the frame.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        * @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
+        */
+        void queueFrame(const string& payload, uint8_t opcode = OPCODE_RESPONSE, uint8_t status = STATUS_SUCCESS);
+
+        /**
+        * @brief Queues a frame whose payload is a prefix followed by a range of a file, sent later with sendfile().
+        * @param prefix Bytes of the payload sent before the file data.
+        * @param file Open handle of the file, kept open until the range is sent.
+        * @param offset The offset in the file to start sending from.
+        * @param length The number of bytes to send.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        */
+        void queueFile(const string& prefix, shared_ptr<FileHandle> file, off_t offset, size_t length, uint8_t opcode);
+
+        /**
+        * @brief Queues a frame whose payload is a prefix followed by a shared buffer, which is sent without being copied.
+        * @param prefix Bytes of the payload sent before the buffer.
+        * @param buffer The buffer, kept alive until it is sent.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        */
+        void queueBuffer(const string& prefix, shared_ptr<const string> buffer, uint8_t opcode);
+};
+
+/**
+ * @class EventLoop
+ * @brief An epoll reactor serving many non-blocking connections with a fixed set of worker threads.
+ * @details One reactor thread accepts connections and waits for readiness. Ready connections
+ *          are handed to the workers, which read, cut the input into frames, run the frame
+ *          handler for each and send the queued responses without blocking.
+ */
+class EventLoop {
+    private:
+        int m_epollFd{-1}; ///< The epoll instance watching all sockets.
+        int m_wakeFd{-1}; ///< Eventfd written to wake the reactor thread on stop.
+        int m_listenFd{-1}; ///< The listening socket.
+        ThreadPool m_workers; ///< Workers handling ready connections.
+        thread m_reactor; ///< Thread waiting for events.
+        atomic<bool> m_stop{false}; ///< Flag asking the reactor thread to return.
+        function<void(Connection&, const FrameHeader&, string&)> m_frameHandler; ///< Called for every complete frame.
+        UploadLimiter* m_uploadLimiter{nullptr}; ///< Limiter of the piece data sent, null for no limits.
+
+        mutex m_connectionsMutex; ///< Mutex to protect access to connections.
+        set<Connection*> m_connections; ///< All open connections, freed on stop.
+
+        mutex m_parkedMutex; ///< Mutex to protect access to parked.
+        multimap<chrono::steady_clock::time_point, Connection*> m_parked; ///< Connections held back by the upload limiter by the time they go on.
+
+        /**
+        * @brief Waits for readiness events and hands ready connections to the workers.
+        */
+        void run();
+
+        /**
+        * @brief Accepts all pending connections and registers them as non-blocking sockets.
+        */
+        void acceptConnections();
+
+        /**
+        * @brief Flushes pending output, reads and handles frames, then re-arms the connection.
+        * @param connection The ready connection.
+        * @param readyEvents The events reported by epoll.
+        */
+        void handleConnection(Connection* connection, uint32_t readyEvents);
+
+        /**
+        * @brief Reads everything the socket has buffered, up to MAX_READ_PER_EVENT bytes.
+        * @param connection The connection to read from.
+        * @throws string If receiving fails.
+        */
+        void readInput(Connection& connection);
+
+        /**
+        * @brief Sends as much of the queued output as the socket accepts.
+        * @param connection The connection to send on.
+        * @return True if the queue is empty, false if the socket is full.
+        * @throws string If sending fails.
+        */
+        bool flushOutput(Connection& connection);
+
+        /**
+        * @brief Hands a connection back to epoll, it will be reported once for the given events.
+        * @param connection The connection to re-arm.
+        * @param events The events to wait for.
+        * @throws string If the connection can not be re-armed.
+        */
+        void rearm(Connection* connection, uint32_t events);
+
+        /**
+        * @brief Waits until the output of a connection can go on, whether held back by the socket or by the upload limiter.
+        * @param connection The connection with output left.
+        * @throws string If the connection can not be re-armed.
+        */
+        void waitForOutput(Connection* connection);
+
+        /**
+        * @brief Gives the milliseconds until the first parked connection goes on.
+        * @return The timeout for epoll_wait(), -1 if no connection is parked.
+        */
+        int giveParkedTimeout();
+
+        /**
+        * @brief Hands the parked connections whose time came to the workers.
+        */
+        void resumeParked();
+
+        /**
+        * @brief Closes a connection and frees it.
+        * @param connection The connection to close.
+        */
+        void closeConnection(Connection* connection);
+
+    public:
+        /**
+        * @brief Creates the epoll instance and the worker threads.
+        * @param numWorkers Number of worker threads running the frame handler.
+        * @throws string If the epoll instance can not be created.
+        */
+        EventLoop(size_t numWorkers);
+
+        /**
+        * @brief Stops the loop and releases all connections.
+        */
+        ~EventLoop();
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        /**
+        * @brief Starts watching the listening socket on a reactor thread.
+        * @param listenFd The listening socket, switched to non-blocking mode.
+        * @param frameHandler Called on a worker thread for every complete frame received.
+        * @param uploadLimiter Limiter of the piece data sent, null for no limits.
+        * @throws string If the listening socket can not be watched.
+        */
+        void start(int listenFd, function<void(Connection&, const FrameHeader&, string&)> frameHandler, UploadLimiter* uploadLimiter = nullptr);
+
+        /**
+        * @brief Stops the reactor thread, waits for running handlers and closes all connections.
+        */
+        void stop();
+};
+
 /**
  * @class Seeder
  * @brief Handles seeding operations for file-sharing.
@@ -524,6 +2742,8 @@ class Leecher {
  * The Seeder class manages incoming connections from leechers, processes commands 
  * related to file pieces, and sends appropriate responses. It ensures thread-safe 
  * access to shared resources and logs operations for debugging and tracking.
+ * Connections are served by an EventLoop with a fixed number of workers, and the
+ * piece data they send is shaped by an UploadLimiter.
  */
 class Seeder {
     private:
@@ -531,17 +2751,17 @@ class Seeder {
         int m_seederPort; ///< Port number for the seeder
         ServerSocket m_seederSocket; ///< Socket used for communication
         Logger m_logger; ///< Logger for recording events
+        UploadLimiter m_uploadLimiter; ///< Rate limits and upload slots of all leecher connections
+        PieceCache m_pieceCache; ///< Pieces asked for again kept in memory
+        EventLoop m_eventLoop; ///< Reactor serving all leecher connections
 
         /**
-         * @brief Accepts incoming client connections and spawns handler threads.
-         */
-        void acceptConnections();
-
-        /**
-         * @brief Handles communication with a single leecher.
-         * @param leecherSocketFd File descriptor of the leecher socket.
+         * @brief Handles one frame received from a leecher and queues the reply.
+         * @param connection The connection of the leecher.
+         * @param header The header of the frame.
+         * @param receivedData The payload of the frame.
          */
-        void handleLeecher(int leecherSocketFd);
+        void handleLeecher(Connection& connection, const FrameHeader& header, string& receivedData);
 
         /**
          * @brief Executes a command received from a leecher.
@@ -552,6 +2772,23 @@ class Seeder {
          */
         string executeCommand(string command, int leecherSocketFd);
 
+        /**
+         * @brief Validates a "give_piece" command and locates the requested piece on disk.
+         * @param tokens Tokens of the "give_piece" command.
+         * @return Location of the piece, holding the file open until it is dropped.
+         * @throw string If the arguments are invalid or the piece is not available.
+         */
+        PieceLocation locatePiece(vector<string> tokens);
+
+        /**
+         * @brief Asks the kernel to read the next pieces of a file walked in order.
+         * @param file The open file.
+         * @param pieceNumber The piece asked for.
+         * @param pieceSize The piece size of the file.
+         * @param fileSize The size of the file.
+         */
+        void readAhead(FileHandle& file, int pieceNumber, int pieceSize, off_t fileSize);
+
         Seeder() = default; ///< Default constructor is private to prevent instantiation.
         ~Seeder() = default; ///< Default destructor.
         Seeder(const Seeder&) = delete; ///< Delete copy constructor to prevent copying.
@@ -567,6 +2804,7 @@ class Seeder {
             , m_seederPort(seederPort)
             , m_seederSocket(ServerSocket(seederIp, seederPort))
             , m_logger(Logger(seederIp, seederPort, "seeder"))
+            , m_eventLoop(EVENT_LOOP_WORKERS)
         {}
 
     public:
@@ -581,7 +2819,7 @@ class Seeder {
         void start();
 
         /**
-         * @brief Stops the seeder by closing the socket.
+         * @brief Stops the seeder by stopping the event loop and closing the socket.
          */
         void stop();
 
@@ -0,0 +1,563 @@
+#include "headers.h"
+#include <random>               // For the data of benchmark files
+#include <fstream>              // For writing benchmark files
+#include <filesystem>           // For the directory of a run
+#include <sys/wait.h>           // For waitpid() of peers
+#include <sys/resource.h>       // For getrusage()
+#include <signal.h>             // For kill() of peers
+
+Logger generalLogger;
+
+/**
+ * @struct BenchOptions
+ * @brief Settings of a benchmark run, see printUsage().
+ */
+struct BenchOptions {
+    string m_clientPath = "../client/client"; ///< Client binary run by every peer.
+    int m_port = 18000; ///< Port of the tracker, peers listen on the ports after it.
+    int m_connections = 8; ///< Connections sending tracker commands at once.
+    int m_opsPerConnection = 2000; ///< Tracker commands sent on every connection.
+    int m_seeders = 2; ///< Peers sharing the files.
+    int m_leechers = 4; ///< Peers downloading the files at once.
+    vector<long long> m_fileSizes = {16777216}; ///< Size of every file downloaded, one swarm round each.
+    int m_pieceSize = 0; ///< Piece size of the files, 0 for the size the client chooses.
+    bool m_isKept = false; ///< Whether the directory of the run is kept.
+};
+
+/**
+ * @class BenchPeer
+ * @brief A client process driven through its standard input and output.
+ */
+class BenchPeer {
+    public:
+        pid_t m_pid{-1}; ///< Process of the client.
+        int m_inputFd{-1}; ///< Standard input of the client.
+        string m_dir; ///< Working directory of the client.
+        mutex m_outputMutex; ///< Mutex to protect output.
+        condition_variable m_outputChanged; ///< Notified when output grows or ends.
+        string m_output; ///< Everything the client printed so far.
+        size_t m_consumed{0}; ///< Bytes of output already matched by waitFor().
+        bool m_isEnded{false}; ///< Set once the output of the client ended.
+        thread m_reader; ///< Thread collecting the output.
+
+        /**
+        * @brief Sends a command to the client.
+        * @param command The command, without the newline.
+        * @throws string If writing fails.
+        */
+        void send(const string& command){
+            string line = command + "\n";
+            if(write(m_inputFd, line.data(), line.size()) != (ssize_t)line.size()){
+                throw string("Sending \"" + command + "\" to peer in " + m_dir + "!!");
+            }
+        }
+
+        /**
+        * @brief Waits for the first of some texts in the output not matched yet.
+        * @param texts The texts.
+        * @param timeoutMs Milliseconds to wait at most.
+        * @return Index of the text found.
+        * @throws string If none is found in time.
+        */
+        size_t waitFor(const vector<string>& texts, int timeoutMs){
+            unique_lock<mutex> guard(m_outputMutex);
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+            while(true){
+                size_t bestPosition = string::npos, bestText = 0;
+                for(size_t i = 0; i < texts.size(); i++){
+                    size_t position = m_output.find(texts[i], m_consumed);
+                    if(position < bestPosition){
+                        bestPosition = position;
+                        bestText = i;
+                    }
+                }
+                if(bestPosition != string::npos){
+                    m_consumed = bestPosition + texts[bestText].size();
+                    return bestText;
+                }
+                if(m_isEnded || m_outputChanged.wait_until(guard, deadline) == cv_status::timeout){
+                    throw string("Peer in " + m_dir + " did not print \"" + texts[0] + "\"!!");
+                }
+            }
+        }
+
+        /**
+        * @brief Sends a command and waits for its result line.
+        * @param command The command.
+        * @throws string If the client reports an error or does not answer.
+        */
+        void run(const string& command){
+            send(command);
+            if(waitFor({"Success:", "Error:"}, 30000) != 0){
+                throw string("Peer in " + m_dir + " failed \"" + command + "\"!!");
+            }
+        }
+};
+
+/**
+* @brief Prints how the benchmark is run.
+*/
+void printUsage(){
+    cout << "Usage: ./bench [--client <path>] [--port <port>] [--connections <n>] [--ops <n>]\n"
+            "               [--seeders <n>] [--leechers <n>] [--sizes <bytes,...>] [--piece-size <bytes>] [--keep] [--help]\n"
+            "  --client      Client binary run by every peer (default ../client/client)\n"
+            "  --port        Port of the in-process tracker, peers use the ports after it (default 18000)\n"
+            "  --connections Connections sending tracker commands at once (default 8)\n"
+            "  --ops         Tracker commands sent on every connection, one in four a write (default 2000)\n"
+            "  --seeders     Peers sharing every file (default 2)\n"
+            "  --leechers    Peers downloading every file at once (default 4)\n"
+            "  --sizes       Size of every file, one swarm round each (default 16777216)\n"
+            "  --piece-size  Piece size, a power of two the tracker accepts (default chosen by the client)\n"
+            "  --keep        Keep the directory of the run with the logs of all processes\n" << flush;
+}
+
+/**
+* @brief Reads the options of a run.
+* @param argc Number of arguments.
+* @param argv The arguments.
+* @return The options.
+* @throws string If an option is unknown or its value is invalid.
+*/
+BenchOptions processArgs(int argc, char* argv[]){
+    BenchOptions options;
+    auto giveNumber = [](const string& value, long long least) {
+        if(value.empty() || value.find_first_not_of("0123456789") != string::npos || stoll(value) < least){
+            throw string("Invalid value " + value + "!!");
+        }
+        return stoll(value);
+    };
+
+    for(int i = 1; i < argc; i++){
+        string option = argv[i];
+        if(option == "--help"){
+            printUsage();
+            exit(0);
+        }
+        if(option == "--keep"){
+            options.m_isKept = true;
+            continue;
+        }
+        if(i + 1 >= argc) throw string("Missing value of " + option + "!!");
+        string value = argv[++i];
+
+        if(option == "--client") options.m_clientPath = value;
+        else if(option == "--port") options.m_port = giveNumber(value, 1);
+        else if(option == "--connections") options.m_connections = giveNumber(value, 1);
+        else if(option == "--ops") options.m_opsPerConnection = giveNumber(value, 1);
+        else if(option == "--seeders") options.m_seeders = giveNumber(value, 1);
+        else if(option == "--leechers") options.m_leechers = giveNumber(value, 0);
+        else if(option == "--piece-size") options.m_pieceSize = giveNumber(value, MIN_PIECE_SIZE);
+        else if(option == "--sizes"){
+            options.m_fileSizes.clear();
+            for(auto& it : Utils::tokenize(value, ',')) options.m_fileSizes.push_back(giveNumber(it, 1));
+        }
+        else throw string("Unknown option " + option + "!!");
+    }
+
+    if(options.m_pieceSize && (options.m_pieceSize > MAX_PIECE_SIZE || (options.m_pieceSize & (options.m_pieceSize - 1)))){
+        throw string("Piece size must be a power of two between " + to_string(MIN_PIECE_SIZE) + " and " + to_string(MAX_PIECE_SIZE) + "!!");
+    }
+    if(options.m_port + options.m_seeders + options.m_leechers > 65535) throw string("Ports of peers are out of range!!");
+    return options;
+}
+
+/**
+* @brief Gives the value at a quantile of sorted samples.
+* @param samples The samples, sorted.
+* @param quantile Between 0 and 1.
+* @return The sample, 0 if there are none.
+*/
+double givePercentile(const vector<double>& samples, double quantile){
+    if(samples.empty()) return 0;
+    return samples[min(samples.size() - 1, (size_t)(quantile * samples.size()))];
+}
+
+/**
+* @brief Gives the CPU time used by this process.
+* @return Seconds of user and system time.
+*/
+double giveOwnCpuSeconds(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+* @brief Gives the CPU time used by a process still running.
+* @param pid The process.
+* @return Seconds of user and system time, 0 if it can not be read.
+*/
+double giveCpuSeconds(pid_t pid){
+    ifstream stat("/proc/" + to_string(pid) + "/stat");
+    string line;
+    if(!getline(stat, line)) return 0;
+
+    //: Name of the process may hold spaces, the fields are counted after it
+    size_t nameEnd = line.rfind(')');
+    if(nameEnd == string::npos) return 0;
+    vector<string> fields = Utils::tokenize(line.substr(nameEnd + 2), ' ');
+    if(fields.size() < 13) return 0;
+    return (stod(fields[11]) + stod(fields[12])) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+* @brief Connects to the tracker with a blocking socket.
+* @param port Port of the tracker.
+* @return The connected socket.
+* @throws string If the tracker can not be reached.
+*/
+int connectTracker(int port){
+    struct sockaddr_in trackerAddr;
+    memset(&trackerAddr, 0, sizeof(trackerAddr));
+    trackerAddr.sin_family = AF_INET;
+    trackerAddr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &trackerAddr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&trackerAddr, sizeof(trackerAddr)) < 0){
+        string error = strerror(errno);
+        if(fd >= 0) close(fd);
+        throw string("Connecting to tracker!!\nError: " + error);
+    }
+    return fd;
+}
+
+/**
+* @brief Sends a command to the tracker and receives its response.
+* @param fd The connected socket.
+* @param command The command.
+* @param status Set to the status of the response.
+* @return The response.
+* @throws string If sending or receiving fails.
+*/
+string exchangeCommand(int fd, const string& command, uint8_t& status){
+    string frame = Connection::makeFrame(command, OPCODE_COMMAND, STATUS_SUCCESS);
+    if(send(fd, frame.data(), frame.size(), MSG_NOSIGNAL) != (ssize_t)frame.size()){
+        throw string("Sending to tracker!!\nError: " + string(strerror(errno)));
+    }
+
+    auto recvAll = [fd](char* buffer, size_t length){
+        size_t bytesReceived = 0;
+        while(bytesReceived < length){
+            ssize_t bytesRead = recv(fd, buffer + bytesReceived, length - bytesReceived, 0);
+            if(bytesRead < 0 && errno == EINTR) continue;
+            if(bytesRead <= 0) throw string("Receiving from tracker!!");
+            bytesReceived += bytesRead;
+        }
+    };
+
+    FrameHeader header;
+    recvAll((char*)&header, sizeof(header));
+    header.m_length = ntohl(header.m_length);
+    if(header.m_length > MAX_FRAME_LENGTH) throw string("Frame from tracker is too large!!");
+    string payload(header.m_length, '\0');
+    recvAll(&payload[0], header.m_length);
+    status = header.m_status;
+    return payload;
+}
+
+/**
+* @brief Sends the tracker commands of one connection, three reads for every write.
+* @param connectionNumber Number of the connection, naming its user and groups.
+* @param options The options of the run.
+* @param readLatencies Filled with the seconds every read took.
+* @param writeLatencies Filled with the seconds every write took.
+* @param errors Counts the commands answered with an error.
+*/
+void runCommands(int connectionNumber, const BenchOptions& options, vector<double>& readLatencies, vector<double>& writeLatencies, atomic<int>& errors){
+    int fd = -1;
+    try{
+        fd = connectTracker(options.m_port);
+        string userName = "bench" + to_string(connectionNumber);
+        string groupName = "benchgroup" + to_string(connectionNumber);
+        string nextGroupName = "benchgroup" + to_string((connectionNumber + 1) % options.m_connections);
+
+        uint8_t status;
+        exchangeCommand(fd, "create_user " + userName + " p", status);
+        string response = exchangeCommand(fd, "login " + userName + " p 127.0.0.1:1", status);
+        if(status != STATUS_SUCCESS) throw string("Login of " + userName + " failed!! Error: " + response);
+        string authToken = Utils::tokenize(response, ' ')[0];
+        exchangeCommand(fd, "create_group " + groupName + " " + authToken, status);
+
+        for(int i = 0; i < options.m_opsPerConnection; i++){
+            string command;
+            bool isWrite = i % 4 == 0;
+            if(isWrite) command = (i % 8 == 0 ? "create_group " + groupName + "_" + to_string(i) : "join_group " + nextGroupName);
+            else if(i % 4 == 1) command = "list_files " + groupName;
+            else if(i % 4 == 2) command = "list_requests " + groupName;
+            else command = "list_groups";
+
+            auto start = chrono::steady_clock::now();
+            exchangeCommand(fd, command + " " + authToken, status);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            (isWrite ? writeLatencies : readLatencies).push_back(seconds);
+            if(status != STATUS_SUCCESS && command.rfind("join_group", 0) != 0) errors++;
+        }
+    }
+    catch(const string& e){
+        cout << string(RED) + "Error: Connection " + to_string(connectionNumber) + ": " + e + "\n" + string(RESET) << flush;
+        errors++;
+    }
+    if(fd >= 0) close(fd);
+}
+
+/**
+* @brief Measures the tracker alone: commands per second and the latency of reads and writes.
+* @param options The options of the run.
+*/
+void benchTracker(const BenchOptions& options){
+    vector<vector<double>> readLatencies(options.m_connections), writeLatencies(options.m_connections);
+    atomic<int> errors{0};
+
+    auto start = chrono::steady_clock::now();
+    double cpuStart = giveOwnCpuSeconds();
+    vector<thread> connections;
+    for(int i = 0; i < options.m_connections; i++){
+        connections.emplace_back(runCommands, i, cref(options), ref(readLatencies[i]), ref(writeLatencies[i]), ref(errors));
+    }
+    for(auto& it : connections) it.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double cpuSeconds = giveOwnCpuSeconds() - cpuStart;
+
+    vector<double> reads, writes;
+    for(auto& it : readLatencies) reads.insert(reads.end(), it.begin(), it.end());
+    for(auto& it : writeLatencies) writes.insert(writes.end(), it.begin(), it.end());
+    sort(reads.begin(), reads.end());
+    sort(writes.begin(), writes.end());
+
+    size_t commands = reads.size() + writes.size();
+    printf("== Tracker: %d connections, %zu commands in %.2f s, %.0f ops/s, %.1f us CPU per command\n",
+        options.m_connections, commands, seconds, commands / seconds, commands ? cpuSeconds * 1e6 / commands : 0);
+    printf("   reads  %7zu  p50 %7.3f ms  p99 %7.3f ms\n", reads.size(), givePercentile(reads, 0.5) * 1e3, givePercentile(reads, 0.99) * 1e3);
+    printf("   writes %7zu  p50 %7.3f ms  p99 %7.3f ms\n", writes.size(), givePercentile(writes, 0.5) * 1e3, givePercentile(writes, 0.99) * 1e3);
+    printf("   errors %7d\n", errors.load());
+    fflush(stdout);
+}
+
+/**
+* @brief Starts a client process listening on a port.
+* @param clientPath Absolute path of the client binary.
+* @param trackerInfoPath Absolute path of trackerinfo.txt.
+* @param dir Working directory of the client, created if missing.
+* @param port Port of the seeder of the client.
+* @return The started peer.
+* @throws string If the process can not be started.
+*/
+unique_ptr<BenchPeer> startPeer(const string& clientPath, const string& trackerInfoPath, const string& dir, int port){
+    filesystem::create_directories(dir);
+    int inputPipe[2], outputPipe[2];
+    if(pipe2(inputPipe, O_CLOEXEC) == -1 || pipe2(outputPipe, O_CLOEXEC) == -1){
+        throw string("Creating pipes!!\nError: " + string(strerror(errno)));
+    }
+
+    //: Everything the child needs is built before fork(), the tracker threads may hold locks
+    string address = "127.0.0.1:" + to_string(port);
+    const char* arguments[] = {clientPath.c_str(), address.c_str(), trackerInfoPath.c_str(), "1", nullptr};
+
+    pid_t pid = fork();
+    if(pid == -1) throw string("Starting peer!!\nError: " + string(strerror(errno)));
+    if(pid == 0){
+        dup2(inputPipe[0], STDIN_FILENO);
+        dup2(outputPipe[1], STDOUT_FILENO);
+        dup2(outputPipe[1], STDERR_FILENO);
+        if(chdir(dir.c_str()) == 0) execv(arguments[0], (char* const*)arguments);
+        _exit(127);
+    }
+    close(inputPipe[0]);
+    close(outputPipe[1]);
+
+    unique_ptr<BenchPeer> peer = make_unique<BenchPeer>();
+    peer->m_pid = pid;
+    peer->m_inputFd = inputPipe[1];
+    peer->m_dir = dir;
+    BenchPeer* rawPeer = peer.get();
+    int outputFd = outputPipe[0];
+    peer->m_reader = thread([rawPeer, outputFd] {
+        char buffer[4096];
+        ssize_t bytesRead;
+        while((bytesRead = read(outputFd, buffer, sizeof(buffer))) > 0 || (bytesRead < 0 && errno == EINTR)){
+            if(bytesRead <= 0) continue;
+            lock_guard<mutex> guard(rawPeer->m_outputMutex);
+            rawPeer->m_output.append(buffer, bytesRead);
+            rawPeer->m_outputChanged.notify_all();
+        }
+        close(outputFd);
+        lock_guard<mutex> guard(rawPeer->m_outputMutex);
+        rawPeer->m_isEnded = true;
+        rawPeer->m_outputChanged.notify_all();
+    });
+    return peer;
+}
+
+/**
+* @brief Stops a client process and waits for its output to end.
+* @param peer The peer.
+*/
+void stopPeer(BenchPeer& peer){
+    if(peer.m_pid > 0){
+        kill(peer.m_pid, SIGKILL);
+        waitpid(peer.m_pid, nullptr, 0);
+    }
+    if(peer.m_inputFd >= 0) close(peer.m_inputFd);
+    if(peer.m_reader.joinable()) peer.m_reader.join();
+}
+
+/**
+* @brief Writes a file of random bytes.
+* @param path Path of the file.
+* @param size Size of the file in bytes.
+* @throws string If the file can not be written.
+*/
+void writeRandomFile(const string& path, long long size){
+    ofstream file(path, ios::binary);
+    mt19937_64 random(size);
+    vector<uint64_t> block(8192);
+    for(long long written = 0; written < size; written += block.size() * sizeof(uint64_t)){
+        for(auto& it : block) it = random();
+        file.write((const char*)block.data(), min((long long)(block.size() * sizeof(uint64_t)), size - written));
+    }
+    if(!file) throw string("Writing " + path + "!!");
+}
+
+/**
+* @brief Checks whether two files hold the same bytes.
+* @param firstPath Path of one file.
+* @param secondPath Path of the other file.
+* @return True if they are equal.
+*/
+bool isSameFile(const string& firstPath, const string& secondPath){
+    ifstream first(firstPath, ios::binary), second(secondPath, ios::binary);
+    if(!first || !second) return false;
+    vector<char> firstBlock(1 << 20), secondBlock(1 << 20);
+    while(first && second){
+        first.read(firstBlock.data(), firstBlock.size());
+        second.read(secondBlock.data(), secondBlock.size());
+        if(first.gcount() != second.gcount() || memcmp(firstBlock.data(), secondBlock.data(), first.gcount()) != 0) return false;
+    }
+    return first.eof() && second.eof();
+}
+
+/**
+* @brief Measures the swarm: seeders share every file, all leechers download it at once.
+* @param options The options of the run, with the absolute path of the client binary.
+* @param runDir Absolute path of the directory of the run.
+*/
+void benchSwarm(const BenchOptions& options, const string& runDir){
+    if(options.m_leechers == 0) return;
+
+    const string& clientPath = options.m_clientPath;
+    if(access(clientPath.c_str(), X_OK) != 0) throw string("Client binary " + clientPath + " can not be run, build it first!!");
+    if(options.m_pieceSize) setenv("P2P_PIECE_SIZE", to_string(options.m_pieceSize).c_str(), 1);
+
+    vector<unique_ptr<BenchPeer>> peers;
+    try{
+        int numPeers = options.m_seeders + options.m_leechers;
+        for(int i = 0; i < numPeers; i++){
+            peers.push_back(startPeer(clientPath, runDir + "/trackerinfo.txt", runDir + "/peer" + to_string(i), options.m_port + 1 + i));
+        }
+
+        //: First seeder owns the group, every other peer joins it
+        for(int i = 0; i < numPeers; i++){
+            peers[i]->run("create_user peer" + to_string(i) + " p");
+            peers[i]->run("login peer" + to_string(i) + " p");
+        }
+        peers[0]->run("create_group swarm");
+        for(int i = 1; i < numPeers; i++){
+            peers[i]->run("join_group swarm");
+            peers[0]->run("accept_request swarm peer" + to_string(i));
+        }
+
+        printf("== Swarm: %d seeders, %d leechers\n", options.m_seeders, options.m_leechers);
+        fflush(stdout);
+        for(long long fileSize : options.m_fileSizes){
+            string fileName = "file" + to_string(fileSize) + ".bin";
+            string filePath = runDir + "/" + fileName;
+            writeRandomFile(filePath, fileSize);
+            for(int i = 0; i < options.m_seeders; i++){
+                peers[i]->send("upload_file " + filePath + " swarm");
+                if(peers[i]->waitFor({"Success:", "Error:"}, 600000) != 0) throw string("Upload of " + fileName + " failed!!");
+            }
+
+            vector<double> cpuStart(numPeers);
+            for(int i = 0; i < numPeers; i++) cpuStart[i] = giveCpuSeconds(peers[i]->m_pid);
+            double ownCpuStart = giveOwnCpuSeconds();
+            auto start = chrono::steady_clock::now();
+
+            for(int i = options.m_seeders; i < numPeers; i++){
+                peers[i]->send("download_file swarm " + fileName + " " + peers[i]->m_dir);
+            }
+            int failures = 0;
+            for(int i = options.m_seeders; i < numPeers; i++){
+                try{
+                    size_t result = peers[i]->waitFor({"Download of " + fileName + " completed!!", "Download of " + fileName + " failed!!"}, 600000);
+                    if(result != 0 || !isSameFile(filePath, peers[i]->m_dir + "/" + fileName)) failures++;
+                }
+                catch(const string& e){
+                    cout << string(RED) + "Error: " + e + "\n" + string(RESET) << flush;
+                    failures++;
+                }
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            //: CPU of the tracker and of every peer counts, the bytes are those downloaded
+            double cpuSeconds = giveOwnCpuSeconds() - ownCpuStart;
+            for(int i = 0; i < numPeers; i++) cpuSeconds += giveCpuSeconds(peers[i]->m_pid) - cpuStart[i];
+            double bytes = (double)fileSize * options.m_leechers;
+
+            printf("   %12lld bytes, piece size %s: %d downloads in %.2f s, %.1f MB/s, %.2f ns CPU per byte, %d failed\n",
+                fileSize, options.m_pieceSize ? to_string(options.m_pieceSize).c_str() : "default", options.m_leechers,
+                seconds, bytes / seconds / 1e6, cpuSeconds * 1e9 / bytes, failures);
+            fflush(stdout);
+        }
+    }
+    catch(const string& e){
+        for(auto& it : peers) stopPeer(*it);
+        throw;
+    }
+    for(auto& it : peers) stopPeer(*it);
+}
+
+int main(int argc, char* argv[]){
+    BenchOptions options;
+    try{
+        options = processArgs(argc, argv);
+    }
+    catch(const string& e){
+        cout << string(RED) + "Error: " + e + "\n" + string(RESET) << flush;
+        printUsage();
+        return 1;
+    }
+
+    //: Every run starts from an empty state, logs and files of all processes go to its directory
+    char dirTemplate[] = "/tmp/p2p_bench_XXXXXX";
+    if(!mkdtemp(dirTemplate)){
+        cout << string(RED) + "Error: Creating directory of the run!!\n" + string(RESET) << flush;
+        return 1;
+    }
+    string runDir = dirTemplate;
+    options.m_clientPath = filesystem::absolute(options.m_clientPath).string();
+
+    int exitCode = 0;
+    try{
+        if(chdir(runDir.c_str()) != 0) throw string("Entering " + runDir + "!!");
+        ofstream(runDir + "/trackerinfo.txt") << "127.0.0.1:" << options.m_port << "\n";
+
+        vector<pair<string, int>> trackers = {{"127.0.0.1", options.m_port}};
+        generalLogger = Logger("127.0.0.1", options.m_port, "general");
+        Tracker& tracker = Tracker::getInstance(trackers, 1);
+        tracker.init();
+        tracker.start();
+
+        benchTracker(options);
+        benchSwarm(options, runDir);
+        tracker.stop();
+    }
+    catch(const string& e){
+        cout << string(RED) + "Error: " + e + "\n" + string(RESET) << flush;
+        exitCode = 1;
+    }
+
+    if(options.m_isKept) cout << "Run kept in " + runDir + "\n" << flush;
+    else filesystem::remove_all(runDir);
+    return exitCode;
+}
@@ -0,0 +1,424 @@
+#include "../headers.h"
+
+/**
+* @brief Builds a frame.
+* @param payload The payload of the frame.
+* @param opcode The kind of message, one of the OPCODE_* values.
+* @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
+* @return The header followed by the payload.
+*/
+string Connection::makeFrame(const string& payload, uint8_t opcode, uint8_t status){
+    FrameHeader header;
+    header.m_length = htonl(payload.size());
+    header.m_opcode = opcode;
+    header.m_status = status;
+    header.m_reserved = 0;
+
+    string frame;
+    frame.reserve(sizeof(header) + payload.size());
+    frame.append((char*)&header, sizeof(header));
+    frame.append(payload);
+    return frame;
+}
+
+/**
+* @brief Queues a frame to be sent to the peer.
+* @param payload The payload of the frame.
+* @param opcode The kind of message, one of the OPCODE_* values.
+* @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
+*/
+void Connection::queueFrame(const string& payload, uint8_t opcode, uint8_t status){
+    m_outQueue.push_back(makeFrame(payload, opcode, status));
+}
+
+/**
+* @brief Creates the epoll instance and the worker threads.
+* @param numWorkers Number of worker threads running the frame handler.
+* @throws string If the epoll instance can not be created.
+*/
+EventLoop::EventLoop(size_t numWorkers)
+: m_workers(numWorkers, "event_loop")
+{
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(m_epollFd == -1){
+        throw string("Creating epoll instance!!\nError: " + string(strerror(errno)));
+    }
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_wakeFd == -1){
+        close(m_epollFd);
+        throw string("Creating eventfd!!\nError: " + string(strerror(errno)));
+    }
+}
+
+/**
+* @brief Stops the loop and releases all connections.
+*/
+EventLoop::~EventLoop(){
+    stop();
+    close(m_wakeFd);
+    close(m_epollFd);
+}
+
+/**
+* @brief Starts watching the listening socket on a reactor thread.
+* @param listenFd The listening socket, switched to non-blocking mode.
+* @param frameHandler Called on a worker thread for every complete frame received.
+* @throws string If the listening socket can not be watched.
+*/
+void EventLoop::start(int listenFd, function<void(Connection&, const FrameHeader&, string&)> frameHandler){
+    m_listenFd = listenFd;
+    m_frameHandler = move(frameHandler);
+
+    int flags = fcntl(m_listenFd, F_GETFL, 0);
+    if(flags == -1 || fcntl(m_listenFd, F_SETFL, flags | O_NONBLOCK) == -1){
+        throw string("Setting listening socket non-blocking!!\nError: " + string(strerror(errno)));
+    }
+
+    //: Listening socket and eventfd are told apart from connections by pointers to their members
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &m_listenFd;
+    if(epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &event) == -1){
+        throw string("Watching listening socket!!\nError: " + string(strerror(errno)));
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &m_wakeFd;
+    if(epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &event) == -1){
+        throw string("Watching eventfd!!\nError: " + string(strerror(errno)));
+    }
+
+    m_stop = false;
+    m_reactor = thread(&EventLoop::run, this);
+}
+
+/**
+* @brief Stops the reactor thread, waits for running handlers and closes all connections.
+*/
+void EventLoop::stop(){
+    if(!m_reactor.joinable()) return;
+
+    m_stop = true;
+    uint64_t one = 1;
+    if(write(m_wakeFd, &one, sizeof(one)) == -1){
+        generalLogger.log("ERROR", "Waking event loop!! Error: " + string(strerror(errno)));
+    }
+    m_reactor.join();
+    m_workers.wait();
+
+    lock_guard<mutex> guard(m_connectionsMutex);
+    for(auto& it : m_connections){
+        Metrics::getInstance().removeConnection();
+        close(it.second->m_fd);
+        delete it.second;
+    }
+    m_connections.clear();
+}
+
+/**
+* @brief Waits for readiness events and hands ready connections to the workers.
+* @details Connections are registered with EPOLLONESHOT, so a connection is reported
+*          again only after the worker handling it re-arms it. This way frames of one
+*          connection are always handled in order by a single worker at a time.
+*/
+void EventLoop::run(){
+    vector<struct epoll_event> events(MAX_EPOLL_EVENTS);
+    while(!m_stop){
+        int numEvents = epoll_wait(m_epollFd, events.data(), events.size(), -1);
+        if(numEvents == -1){
+            if(errno == EINTR) continue;
+            generalLogger.log("ERROR", "Waiting for events!! Error: " + string(strerror(errno)));
+            break;
+        }
+
+        bool isWoken = false;
+        for(int i = 0; i < numEvents; i++){
+            if(events[i].data.ptr == &m_wakeFd){
+                uint64_t count;
+                if(read(m_wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN){
+                    generalLogger.log("ERROR", "Reading eventfd!! Error: " + string(strerror(errno)));
+                }
+                isWoken = true;
+                continue;
+            }
+            if(events[i].data.ptr == &m_listenFd){
+                acceptConnections();
+                continue;
+            }
+
+            //: Reported connections are disabled by EPOLLONESHOT until their worker re-arms them
+            Connection* connection = (Connection*)events[i].data.ptr;
+            {
+                lock_guard<mutex> guard(connection->m_pushMutex);
+                connection->m_isArmed = false;
+            }
+            uint32_t readyEvents = events[i].events;
+            m_workers.enqueueTask([this, connection, readyEvents] {
+                handleConnection(connection, readyEvents);
+            });
+        }
+
+        //: Woken connections are checked after the whole batch, a connection reported in it is not armed anymore
+        if(isWoken) wakePushed();
+    }
+}
+
+/**
+* @brief Accepts all pending connections and registers them as non-blocking sockets.
+*/
+void EventLoop::acceptConnections(){
+    while(true){
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrSize = sizeof(clientAddr);
+        int clientFd = accept4(m_listenFd, (struct sockaddr*)&clientAddr, &clientAddrSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(clientFd == -1){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                generalLogger.log("ERROR", "Accepting connection!! Error: " + string(strerror(errno)));
+            }
+            return;
+        }
+
+        Connection* connection = new Connection(clientFd, m_nextConnectionId++);
+        connection->m_isArmed = true;
+        Metrics::getInstance().addConnection();
+        {
+            lock_guard<mutex> guard(m_connectionsMutex);
+            m_connections[connection->m_id] = connection;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = connection;
+        if(epoll_ctl(m_epollFd, EPOLL_CTL_ADD, clientFd, &event) == -1){
+            generalLogger.log("ERROR", "Watching connection!! Error: " + string(strerror(errno)));
+            closeConnection(connection);
+        }
+    }
+}
+
+/**
+* @brief Runs on a worker: flushes pending output, reads and handles frames, then re-arms the connection.
+* @param connection The ready connection, owned by this worker until it is re-armed.
+* @param readyEvents The events reported by epoll.
+*/
+void EventLoop::handleConnection(Connection* connection, uint32_t readyEvents){
+    try{
+        if(readyEvents & EPOLLERR){
+            throw string("Socket error!!");
+        }
+
+        //: Frames pushed meanwhile are sent along with the responses
+        {
+            lock_guard<mutex> guard(connection->m_pushMutex);
+            while(!connection->m_pushQueue.empty()){
+                connection->m_outQueue.push_back(move(connection->m_pushQueue.front()));
+                connection->m_pushQueue.pop_front();
+            }
+        }
+
+        //: Nothing new is read while earlier responses are still queued, the peer is slowed down instead
+        if(!flushOutput(*connection)){
+            rearm(connection, EPOLLOUT);
+            return;
+        }
+
+        readInput(*connection);
+
+        //: Every complete frame in the buffer is handled, a partial one waits for more bytes
+        size_t consumed = 0;
+        while(connection->m_inBuffer.size() - consumed >= sizeof(FrameHeader)){
+            FrameHeader header;
+            memcpy(&header, connection->m_inBuffer.data() + consumed, sizeof(header));
+            header.m_length = ntohl(header.m_length);
+            header.m_reserved = ntohs(header.m_reserved);
+            if(header.m_length > MAX_FRAME_LENGTH){
+                throw string("Frame of " + to_string(header.m_length) + " bytes is too large!!");
+            }
+            if(connection->m_inBuffer.size() - consumed - sizeof(header) < header.m_length) break;
+
+            string payload = connection->m_inBuffer.substr(consumed + sizeof(header), header.m_length);
+            consumed += sizeof(header) + header.m_length;
+            m_frameHandler(*connection, header, payload);
+        }
+        connection->m_inBuffer.erase(0, consumed);
+
+        if(!flushOutput(*connection)){
+            rearm(connection, EPOLLOUT);
+            return;
+        }
+        if(connection->m_peerClosed){
+            closeConnection(connection);
+            return;
+        }
+        rearm(connection, EPOLLIN | EPOLLRDHUP);
+    }
+    catch(const string& e){
+        //: Stream can not be resynchronized after a broken frame, so drop the connection
+        generalLogger.log("ERROR", "Connection at fd " + to_string(connection->m_fd) + " dropped!! Error: " + e);
+        closeConnection(connection);
+    }
+    catch(const exception& e){
+        //: e.g. stoi() on a malformed argument, the connection must not be left un-armed
+        generalLogger.log("ERROR", "Connection at fd " + to_string(connection->m_fd) + " dropped!! Error: " + string(e.what()));
+        closeConnection(connection);
+    }
+}
+
+/**
+* @brief Reads everything the socket has buffered, up to MAX_READ_PER_EVENT bytes.
+* @param connection The connection to read from.
+* @throws string If receiving fails.
+*/
+void EventLoop::readInput(Connection& connection){
+    char buffer[READ_CHUNK_SIZE];
+    size_t totalRead = 0;
+    while(totalRead < MAX_READ_PER_EVENT){
+        ssize_t bytesRead = recv(connection.m_fd, buffer, sizeof(buffer), 0);
+        if(bytesRead == 0){
+            connection.m_peerClosed = true;
+            return;
+        }
+        if(bytesRead < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            throw string("Receiving from socket!!\nError: " + string(strerror(errno)));
+        }
+        connection.m_inBuffer.append(buffer, bytesRead);
+        totalRead += bytesRead;
+        Metrics::getInstance().addBytesReceived(bytesRead);
+    }
+}
+
+/**
+* @brief Sends as much of the queued output as the socket accepts.
+* @param connection The connection to send on.
+* @return True if the queue is empty, false if the socket is full.
+* @throws string If sending fails.
+*/
+bool EventLoop::flushOutput(Connection& connection){
+    while(!connection.m_outQueue.empty()){
+        string& frame = connection.m_outQueue.front();
+        if(connection.m_outSent < frame.size()){
+            ssize_t bytesSent = send(connection.m_fd, frame.data() + connection.m_outSent, frame.size() - connection.m_outSent, MSG_NOSIGNAL);
+            if(bytesSent < 0){
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                throw string("Sending to socket!!\nError: " + string(strerror(errno)));
+            }
+            connection.m_outSent += bytesSent;
+            Metrics::getInstance().addBytesSent(bytesSent);
+            continue;
+        }
+
+        connection.m_outQueue.pop_front();
+        connection.m_outSent = 0;
+    }
+    return true;
+}
+
+/**
+* @brief Hands a connection back to epoll, it will be reported once for the given events.
+* @param connection The connection to re-arm.
+* @param events The events to wait for.
+* @throws string If the connection can not be re-armed.
+*/
+void EventLoop::rearm(Connection* connection, uint32_t events){
+    //: A frame pushed while this worker owned the connection makes it reported again at once, the socket is writable
+    lock_guard<mutex> guard(connection->m_pushMutex);
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT | (connection->m_pushQueue.empty() ? 0 : EPOLLOUT);
+    event.data.ptr = connection;
+    if(epoll_ctl(m_epollFd, EPOLL_CTL_MOD, connection->m_fd, &event) == -1){
+        throw string("Re-arming connection!!\nError: " + string(strerror(errno)));
+    }
+    connection->m_isArmed = true;
+}
+
+/**
+* @brief Queues a frame for a connection from any thread, e.g. a notification.
+* @param connectionId Id of the connection.
+* @param payload The payload of the frame.
+* @param opcode The kind of message, one of the OPCODE_* values.
+* @return True if the frame was queued, false if the connection is closed or was shut down for falling behind.
+*/
+bool EventLoop::push(uint64_t connectionId, const string& payload, uint8_t opcode){
+    {
+        //: Connections are freed under this lock, so the connection stays valid while it is held
+        lock_guard<mutex> guard(m_connectionsMutex);
+        auto it = m_connections.find(connectionId);
+        if(it == m_connections.end()) return false;
+
+        Connection* connection = it->second;
+        lock_guard<mutex> pushGuard(connection->m_pushMutex);
+
+        //: A peer not reading its socket must not make the tracker buffer without limit, nor miss frames unnoticed
+        if(connection->m_isOverflowed) return false;
+        if(connection->m_pushQueue.size() >= MAX_PUSHED_FRAMES){
+            //: Shut down rather than closed, the thread owning the connection sees the hang up and frees it
+            connection->m_isOverflowed = true;
+            shutdown(connection->m_fd, SHUT_RDWR);
+            generalLogger.log("ERROR", "Connection " + to_string(connectionId) + " fell " + to_string(MAX_PUSHED_FRAMES) + " frames behind, it is closed!!");
+            return false;
+        }
+        connection->m_pushQueue.push_back(Connection::makeFrame(payload, opcode, STATUS_SUCCESS));
+        if(connection->m_isWakePending) return true;
+        connection->m_isWakePending = true;
+    }
+
+    //: Only the reactor knows whether the connection sits in epoll or is owned by a worker
+    {
+        lock_guard<mutex> guard(m_wakeMutex);
+        m_wakeList.push_back(connectionId);
+    }
+    uint64_t one = 1;
+    if(write(m_wakeFd, &one, sizeof(one)) == -1){
+        generalLogger.log("ERROR", "Waking event loop!! Error: " + string(strerror(errno)));
+    }
+    return true;
+}
+
+/**
+* @brief Runs on the reactor: re-arms idle connections of the wake list so their pushed frames are sent.
+*/
+void EventLoop::wakePushed(){
+    vector<uint64_t> wakeList;
+    {
+        lock_guard<mutex> guard(m_wakeMutex);
+        wakeList.swap(m_wakeList);
+    }
+
+    lock_guard<mutex> guard(m_connectionsMutex);
+    for(uint64_t connectionId : wakeList){
+        auto it = m_connections.find(connectionId);
+        if(it == m_connections.end()) continue;
+
+        Connection* connection = it->second;
+        lock_guard<mutex> pushGuard(connection->m_pushMutex);
+        connection->m_isWakePending = false;
+
+        //: A connection owned by a worker sends its pushed frames before the worker re-arms it
+        if(!connection->m_isArmed || connection->m_pushQueue.empty()) continue;
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = connection;
+        if(epoll_ctl(m_epollFd, EPOLL_CTL_MOD, connection->m_fd, &event) == -1){
+            generalLogger.log("ERROR", "Waking connection at fd " + to_string(connection->m_fd) + "!! Error: " + string(strerror(errno)));
+        }
+    }
+}
+
+/**
+* @brief Closes a connection and frees it.
+* @param connection The connection to close, not watched by epoll anymore after this call.
+*/
+void EventLoop::closeConnection(Connection* connection){
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, connection->m_fd, nullptr);
+    {
+        //: Left before the socket is closed, so push() never shuts down a descriptor reused meanwhile
+        lock_guard<mutex> guard(m_connectionsMutex);
+        m_connections.erase(connection->m_id);
+    }
+    close(connection->m_fd);
+    Metrics::getInstance().removeConnection();
+    delete connection;
+}
@@ -10,9 +10,15 @@
 //         Groups& operator=(const Groups&) = delete;
 
 //         static Groups* instance;
-//         mutex m_groupsMutex;
+//         shared_mutex m_groupsMutex;
 
-//         unordered_map<string, Group> m_groups;
+//         unordered_map<string, shared_ptr<Group>> m_groups;
+
+//         function<bool(uint64_t, const string&)> m_pusher;
+
+//         shared_ptr<Group> giveGroup(const string& groupName);
+//         static string giveIpPort(const string& userName);
+//         void notifyLocked(Group& group, const string& event, const string& fileName, const string& ipPort);
 
 //     public:
 //         static Groups& getInstance() {
@@ -26,25 +32,71 @@
 //         string listGroups(string authToken);
 //         string acceptRequest(string groupName, string pendingUserName, string authToken);
 //         string listFiles(string groupName, string authToken);
-//         string uploadFile(string fileName, string groupName, string fileSize, string SHAs, string authToken);
+//         string uploadFile(string fileName, string groupName, string fileSize, string pieceSize, string SHAs, string authToken);
 //         string downloadFile(string fileName, string groupName, string authToken);
 //         string stopShare(string groupName, string fileName, string authToken);
+//         string havePieces(string groupName, string fileName, string pieces, string authToken);
 //         string leaveGroup(string groupName, string authToken);
+//         string subscribe(string groupName, string fileName, string authToken, uint64_t connectionId);
+//         string unsubscribe(string groupName, string fileName, string authToken, uint64_t connectionId);
+//         void notifySession(string userName, string seederIpPort, bool isActive);
+//         void setPusher(function<bool(uint64_t, const string&)> pusher);
 // };
 
+shared_ptr<Group> Groups::giveGroup(const string& groupName){
+    //: Map lock is held only for the lookup, the group is locked by the caller
+    shared_lock <TimedMutex<shared_mutex>> guard(m_groupsMutex);
+
+    //: Ensure that group exist
+    auto it = m_groups.find(groupName);
+    if(it == m_groups.end()) {
+        throw string("Group not exist!!");
+    }
+    return it->second;
+}
+
+string Groups::giveIpPort(const string& userName){
+    //: Empty if the user has no active session, it is then no peer for anybody
+    shared_lock <shared_mutex> guard(Users::m_userToIpMutex);
+    auto it = Users::m_userToIp.find(userName);
+    return (it != Users::m_userToIp.end()) ? it->second : "";
+}
+
+void Groups::notifyLocked(Group& group, const string& event, const string& fileName, const string& ipPort){
+    //: Expects the group to be locked exclusively
+    //: Notification is "Event <space> GroupName <space> FileName [<space> IP:Port]"
+    if(!m_pusher || group.m_subscribers.empty()) return;
+    string notification = event + " " + group.m_groupName + " " + fileName + (ipPort.empty() ? "" : " " + ipPort);
+
+    for(auto it = group.m_subscribers.begin(); it != group.m_subscribers.end();){
+        Subscriber& subscriber = it->second;
+        if(!subscriber.m_isAllFiles && !subscriber.m_fileNames.count(fileName)){
+            it++;
+            continue;
+        }
+
+        //: Subscriptions of closed connections are dropped on the first change they miss
+        if(m_pusher(it->first, notification)) it++;
+        else it = group.m_subscribers.erase(it);
+    }
+}
+
+void Groups::setPusher(function<bool(uint64_t, const string&)> pusher){
+    m_pusher = move(pusher);
+}
+
 string Groups::addGroup(string groupName, string authToken){
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
     {
         //: Ensure that group with same name not exist
-        lock_guard <mutex> guard(m_groupsMutex);
+        unique_lock <TimedMutex<shared_mutex>> guard(m_groupsMutex);
         if(m_groups.count(groupName)) {
             throw string("Group already exist!!");
         }
 
         //: Create new "Group" and add it to Groups.m_groups[] map
-        Group group(groupName, {userName});
-        m_groups[groupName] = group;
+        m_groups[groupName] = shared_ptr<Group>(new Group(groupName, {userName}));
         return "Group created successfully!!";
     }
 }
@@ -53,17 +105,17 @@ string Groups::joinGroup(string groupName, string authToken){
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
     {
-        lock_guard <mutex> guard(m_groupsMutex);
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
 
-        //: Ensure that group exist
-        if(!m_groups.count(groupName)) {
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
             throw string("Group not exist!!");
         }
 
-        Group& group = m_groups[groupName];
-
         //: Ensure that user is not a member of this group 
-        if(count(group.m_participants.begin(), group.m_participants.end(), userName)){
+        if(group.m_members.count(userName)){
             throw string("You are already a member of this group!!");
         }
 
@@ -83,14 +135,14 @@ string Groups::listRequests(string groupName, string authToken){
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
     {
-        lock_guard <mutex> guard(m_groupsMutex);
-        
-        //: Ensure that group exist
-        if(!m_groups.count(groupName)) {
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        shared_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
+
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
             throw string("Group not exist!!");
         }
-
-        Group& group = m_groups[groupName];
         
         //: Ensure that user is a admin of this group
         if(group.m_participants[0] != userName){
@@ -108,11 +160,11 @@ string Groups::listGroups(string authToken){
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
     {
-        lock_guard <mutex> guard(m_groupsMutex);
+        shared_lock <TimedMutex<shared_mutex>> guard(m_groupsMutex);
 
         //: Building '\n' separated response
         string temp = "";
-        for(auto it: m_groups) temp.append("\n" + it.first);
+        for(auto& it: m_groups) temp.append("\n" + it.first);
         return temp;
     }
 
@@ -122,14 +174,14 @@ string Groups::acceptRequest(string groupName, string pendingUserName, string au
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
     {
-        lock_guard <mutex> guard(m_groupsMutex);
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
 
-        //: Ensure that group exist
-        if(!m_groups.count(groupName)) {
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
             throw string("Group not exist!!");
         }
-        
-        Group& group = m_groups[groupName];
 
         //: Ensure that user is a admin of this group
         if(group.m_participants[0] != userName){
@@ -145,6 +197,7 @@ string Groups::acceptRequest(string groupName, string pendingUserName, string au
         group.m_pendingJoins.erase(pendingUserName);
         //: Add pending user to participants vector
         group.m_participants.push_back(pendingUserName);
+        group.m_members.insert(pendingUserName);
 
         return "Member added to the group!!";
     }
@@ -154,22 +207,25 @@ string Groups::listFiles(string groupName, string authToken){
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
     {
-        lock_guard <mutex> guard(m_groupsMutex);
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        shared_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
 
-        //: Ensure that group exist
-        if(!m_groups.count(groupName)) {
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
             throw string("Group not exist!!");
         }
-
-        Group& group = m_groups[groupName];
         
         //: Ensure that user is a member of this group
-        if(!count(group.m_participants.begin(), group.m_participants.end(), userName)){
+        if(!group.m_members.count(userName)){
             throw string("You are not a member of this group!!");
         }
 
         //: Building '\n' separated response
         string temp = "";
+
+        //: Sessions are checked under one lock, a user logging out meanwhile is seen consistently for all files
+        shared_lock <shared_mutex> sessionGuard(Users::m_userToIpMutex);
         
         //: Iterate through all files exist in group
         for(auto& it: group.m_files){
@@ -195,50 +251,65 @@ string Groups::listFiles(string groupName, string authToken){
     }
 }
 
-string Groups::uploadFile(string fileName, string groupName, string fileSize, string SHAs, string authToken){
+string Groups::uploadFile(string fileName, string groupName, string fileSize, string pieceSize, string SHAs, string authToken){
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
+
+    //: SHAs are decoded before taking the lock, it does not depend on the group
+    long long size = stoll(fileSize);
+    int pieceLength = stoi(pieceSize);
+
+    if(size < 0) throw string("Invalid file size!!");
+
+    //: Ensure that piece size is a power of two within the supported range
+    if(pieceLength < MIN_PIECE_SIZE || pieceLength > MAX_PIECE_SIZE || (pieceLength & (pieceLength - 1))) {
+        throw string("Invalid piece size!!");
+    }
+
+    //: SHAs are "FileSHA:MerkleRoot" kept as raw digests, piece SHAs are proven by seeders against the root
+    string digests;
+    for(auto& it : Utils::tokenize(SHAs, ':')) {
+        if(it.size() != 2 * SHA256_DIGEST_LENGTH) throw string("Invalid (More/Less) number of SHAs!!");
+        digests += Utils::fromHex(it);
+    }
+    //: Ensure that both the SHA of the file and the Merkle root are given
+    if(digests.size() != 2 * SHA256_DIGEST_LENGTH) {
+        throw string("Invalid (More/Less) number of SHAs!!");
+    }
+
     {
-        lock_guard <mutex> guard(m_groupsMutex);
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
 
-        //: Ensure that group exist
-        if(!m_groups.count(groupName)) {
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
             throw string("Group not exist!!");
         }
-
-        Group& group = m_groups[groupName];
         
         //: Ensure that user is a member of this group
-        if(!count(group.m_participants.begin(), group.m_participants.end(), userName)){
+        if(!group.m_members.count(userName)){
             throw string("You are not a member of this group!!");
         }
 
-        vector <string> SHAVector = Utils::tokenize(SHAs, ':');
-
-        //: Finding expected size of SHA vector
-        int sizeOfSHAVector = (stoi(fileSize) / PIECE_SIZE) + 1; //: +1 for entire file's SHA at beggining of the vector
-        if(stoi(fileSize) % PIECE_SIZE) sizeOfSHAVector++;
-
-        //: Ensure that actual SHA vector size and expected SHA vector size are equal
-        if((int)SHAVector.size() != sizeOfSHAVector) {
-            throw string("Invalid (More/Less) number of SHAs!!");
-        }
-
         //: If file already exist in group Check SHA
         if(group.m_files.count(fileName)){
             //: Ensure that SHA is matching
-            if(group.m_files[fileName].m_SHA[0] != SHAVector[0]){
+            if(*group.m_files[fileName].m_digests != digests || group.m_files[fileName].m_pieceSize != pieceLength){
                 throw string("File with same name but different content exist, change name of the file!!");
             }
 
-            //: Insert userName into set
-            group.m_files[fileName].m_userNames.insert(userName);
+            //: Insert userName into set, a user that was still downloading the file now has all of it
+            bool isNewSharer = group.m_files[fileName].m_userNames.insert(userName).second;
+            group.m_files[fileName].m_partialPieces.erase(userName);
+            if(isNewSharer) notifyLocked(group, "peer_joined", fileName, giveIpPort(userName));
             return "File uploaded successfully!!";
         }
 
         //: If file not exist in group, Create new "File" and add it to the "Group.m_file[]" map
-        File newFile(fileName, SHAVector, stoi(fileSize), {userName});
+        File newFile(fileName, make_shared<const string>(move(digests)), size, pieceLength, {userName});
         group.m_files[fileName] = newFile;
+        notifyLocked(group, "file_added", fileName, giveIpPort(userName));
         
         return "File uploaded successfully!!";
     }
@@ -247,18 +318,23 @@ string Groups::uploadFile(string fileName, string groupName, string fileSize, st
 string Groups::downloadFile(string fileName, string groupName, string authToken) {
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
+
+    long long fileSize;
+    int pieceSize;
+    shared_ptr<const string> digests;
+    vector<pair<int, string>> userNames;
     {
-        lock_guard <mutex> guard(m_groupsMutex);
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        shared_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
 
-        //: Ensure that group exist
-        if(!m_groups.count(groupName)) {
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
             throw string("Group not exist!!");
         }
-
-        Group& group = m_groups[groupName];
         
         //: Ensure that user is a member of this group
-        if(!count(group.m_participants.begin(), group.m_participants.end(), userName)){
+        if(!group.m_members.count(userName)){
             throw string("You are not a member of this group!!");
         }
        
@@ -267,56 +343,70 @@ string Groups::downloadFile(string fileName, string groupName, string authToken)
             throw string("File not found!!");
         }
 
-        File& file = group.m_files[fileName];
-        
-        //: Building a response in a formate of 
-        //: "FileSize <space> FileSHA:Piece1SHA:Piece2SHA:...:PieceNSHA <space> IP:Port_1,IP:Port_2,...,IP:Port_N"
-        string temp = "";
+        //: Only what the reply needs is copied, the digests are shared and never change
+        File& file = group.m_files.at(fileName);
+        fileSize = file.m_size;
+        pieceSize = file.m_pieceSize;
+        digests = file.m_digests;
+
+        //: Users holding the entire file come first, then users still downloading it by the pieces they hold
+        int numPieces = (int)((file.m_size + file.m_pieceSize - 1) / file.m_pieceSize);
+        for(auto& it : file.m_userNames) {
+            auto partial = file.m_partialPieces.find(it);
+            int heldPieces = (partial == file.m_partialPieces.end()) ? numPieces : partial->second.m_heldPieces;
+            userNames.push_back({-heldPieces, it});
+        }
+        sort(userNames.begin(), userNames.end());
+    }
 
-        //: Adding fileSize to response
-        temp.append(to_string(file.m_size) + " ");
+    //: Building a response in a formate of 
+    //: "FileSize <space> PieceSize <space> FileSHA <space> MerkleRoot <space> IP:Port_1,IP:Port_2,...,IP:Port_N"
+    string temp = "";
 
-        //: Adding SHAs to response
-        for(auto it : file.m_SHA) {
-            temp.append(it + ":");
-        }
-        temp.push_back(' ');
+    //: Adding fileSize and pieceSize to response
+    temp.append(to_string(fileSize) + " ");
+    temp.append(to_string(pieceSize) + " ");
 
-        //: Adding IP:Ports to response
-        {
-            lock_guard <mutex> guard(Users::m_userToIpMutex);
+    //: Adding SHA of the entire file to response
+    temp.append(Utils::toHex(digests->data(), SHA256_DIGEST_LENGTH) + " ");
 
-            //: Building a string of IP:Port of active users that are currently sharing this file
-            string activeUsers = "";
-            for(auto it : file.m_userNames) {
-                //: Append IP:Port of user if it has active session
-                if(Users::m_userToIp.count(it)) {
-                    activeUsers.append(Users::m_userToIp[it] + ",");
-                }
+    //: Adding Merkle root of the pieces to response
+    temp.append(Utils::toHex(digests->data() + SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH) + " ");
+
+    //: Adding IP:Ports to response
+    {
+        shared_lock <shared_mutex> guard(Users::m_userToIpMutex);
+
+        //: Building a string of IP:Port of active users that are currently sharing this file
+        string activeUsers = "";
+        for(auto& it : userNames) {
+            //: Append IP:Port of user if it has active session
+            if(Users::m_userToIp.count(it.second)) {
+                activeUsers.append(Users::m_userToIp.at(it.second) + ",");
             }
-            //: Ensure that there is atleast one active user sharing this file
-            if(activeUsers == "") throw string("There is no active user sharing this file as of now!!");
-            temp += activeUsers;
         }
-        return temp;
+        //: Ensure that there is atleast one active user sharing this file
+        if(activeUsers == "") throw string("There is no active user sharing this file as of now!!");
+        temp += activeUsers;
     }
+    return temp;
 }
 
 string Groups::stopShare(string groupName, string fileName, string authToken) {
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
     {
-        lock_guard <mutex> guard(m_groupsMutex);
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
 
-        //: Ensure that group exist
-        if(!m_groups.count(groupName)) {
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
             throw string("Group not exist!!");
         }
 
-        Group& group = m_groups[groupName];
-
         //: Ensure that user is a member of this group
-        if(!count(group.m_participants.begin(), group.m_participants.end(), userName)){
+        if(!group.m_members.count(userName)){
             throw string("You are not a member of this group!!");
         }
 
@@ -334,53 +424,227 @@ string Groups::stopShare(string groupName, string fileName, string authToken) {
 
         //: Remove userName from set
         file.m_userNames.erase(userName);
+        file.m_partialPieces.erase(userName);
+        notifyLocked(group, "peer_left", fileName, giveIpPort(userName));
 
         //: Remove file from group if it does not have any user sharing
         if(file.m_userNames.empty()) {
             group.m_files.erase(fileName);
+            notifyLocked(group, "file_removed", fileName, "");
         }
 
         return "File Sharing is stopped!!";
     }
 }
 
-string Groups::leaveGroup(string groupName, string authToken) {
+string Groups::havePieces(string groupName, string fileName, string pieces, string authToken) {
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
+
+    //: Pieces are "PieceNumber_1,PieceNumber_2,...", parsed before taking the lock
+    vector<int> pieceNumbers;
+    for(auto& it : Utils::tokenize(pieces, ',')) {
+        if(it.empty() || it.size() > 9 || it.find_first_not_of("0123456789") != string::npos) {
+            throw string("Invalid piece number!!");
+        }
+        pieceNumbers.push_back(stoi(it));
+    }
+
     {
-        lock_guard <mutex> guard(m_groupsMutex);
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
 
-        //: Ensure that group exist
-        if(!m_groups.count(groupName)) {
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
             throw string("Group not exist!!");
         }
 
-        Group& group = m_groups[groupName];
+        //: Ensure that user is a member of this group
+        if(!group.m_members.count(userName)){
+            throw string("You are not a member of this group!!");
+        }
+
+        //: Ensure that file exist in a group
+        if(!group.m_files.count(fileName)){
+            throw string("File not found!!");
+        }
+
+        File& file = group.m_files[fileName];
+        int numPieces = (int)((file.m_size + file.m_pieceSize - 1) / file.m_pieceSize);
+        for(int pieceNumber : pieceNumbers) {
+            if(pieceNumber >= numPieces) throw string("Invalid piece number!!");
+        }
+
+        //: A user sharing the entire file already has every piece
+        if(file.m_userNames.count(userName) && !file.m_partialPieces.count(userName)) {
+            return "Pieces announced successfully!!";
+        }
+
+        //: Even a single piece makes the user a sharer of the file, other leechers ask it which pieces it holds
+        File::PartialPieces& partial = file.m_partialPieces[userName];
+        partial.m_pieces.resize(numPieces, false);
+        for(int pieceNumber : pieceNumbers) {
+            if(!partial.m_pieces[pieceNumber]) {
+                partial.m_pieces[pieceNumber] = true;
+                partial.m_heldPieces++;
+            }
+        }
+        if(file.m_userNames.insert(userName).second) notifyLocked(group, "peer_joined", fileName, giveIpPort(userName));
+
+        if(partial.m_heldPieces == numPieces) {
+            file.m_partialPieces.erase(userName);
+        }
+        return "Pieces announced successfully!!";
+    }
+}
+
+string Groups::leaveGroup(string groupName, string authToken) {
+    //: Validate that user is logged in
+    string userName = Utils::validateToken(authToken);
+    {
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
+
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
+            throw string("Group not exist!!");
+        }
         
         //: Ensure that user is a member of this group
-        if(!count(group.m_participants.begin(), group.m_participants.end(), userName)){
+        if(!group.m_members.count(userName)){
             throw string("You are not a member of this group!!");
         }
 
-        //: Remove username from participants vector
+        //: Remove username from participants vector, the next one in joining order becomes the admin
         auto it = find(group.m_participants.begin(), group.m_participants.end(), userName);
         group.m_participants.erase(it);
+        group.m_members.erase(userName);
 
         //: If Only 1 participant is there, delete this group from system
-        if(m_groups[groupName].m_participants.size() == 0) {
+        if(group.m_participants.size() == 0) {
+            //: No thread waits for a group lock while holding the map lock, so taking it here cannot deadlock
+            group.m_isRemoved = true;
+            unique_lock <TimedMutex<shared_mutex>> mapGuard(m_groupsMutex);
             m_groups.erase(groupName);
             return "You left the group successfully!!";
         }
 
+        //: A user out of the group gets no more notifications of it
+        for(auto it = group.m_subscribers.begin(); it != group.m_subscribers.end();) {
+            if(it->second.m_userName == userName) it = group.m_subscribers.erase(it);
+            else it++;
+        }
+
         //: Remove user from all files he is sharing
-        for(auto &it : m_groups[groupName].m_files) {
-            it.second.m_userNames.erase(userName);
+        string ipPort = giveIpPort(userName);
+        for(auto it = group.m_files.begin(); it != group.m_files.end();) {
+            string fileName = it->first;
+            if(it->second.m_userNames.erase(userName)) notifyLocked(group, "peer_left", fileName, ipPort);
+            it->second.m_partialPieces.erase(userName);
 
             //: Remove file from group if it does not have any user sharing
-            if(it.second.m_userNames.empty()) {
-                m_groups[groupName].m_files.erase(it.first);
+            if(it->second.m_userNames.empty()) {
+                it = group.m_files.erase(it);
+                notifyLocked(group, "file_removed", fileName, "");
             }
+            else it++;
         }
         return "You left the group successfully!!";
     }
-}
\ No newline at end of file
+}
+
+string Groups::subscribe(string groupName, string fileName, string authToken, uint64_t connectionId) {
+    //: Validate that user is logged in
+    string userName = Utils::validateToken(authToken);
+    {
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
+
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
+            throw string("Group not exist!!");
+        }
+
+        //: Ensure that user is a member of this group
+        if(!group.m_members.count(userName)){
+            throw string("You are not a member of this group!!");
+        }
+
+        //: A file that is not shared yet can be subscribed to, its "file_added" is then the first notification
+        Subscriber& subscriber = group.m_subscribers[connectionId];
+        subscriber.m_userName = userName;
+        if(fileName == "") {
+            subscriber.m_isAllFiles = true;
+            return "Subscribed to group " + groupName + "!!";
+        }
+        subscriber.m_fileNames.insert(fileName);
+        return "Subscribed to " + fileName + " of group " + groupName + "!!";
+    }
+}
+
+string Groups::unsubscribe(string groupName, string fileName, string authToken, uint64_t connectionId) {
+    //: Validate that user is logged in
+    string userName = Utils::validateToken(authToken);
+    {
+        shared_ptr<Group> groupPtr = giveGroup(groupName);
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
+
+        //: Ensure that group was not removed while waiting for its lock
+        if(group.m_isRemoved) {
+            throw string("Group not exist!!");
+        }
+
+        //: Ensure that this connection is subscribed to the group
+        auto it = group.m_subscribers.find(connectionId);
+        if(it == group.m_subscribers.end()){
+            throw string("You are not subscribed to this group!!");
+        }
+
+        //: Without a file name the whole subscription to the group is dropped
+        Subscriber& subscriber = it->second;
+        if(fileName == "") {
+            subscriber.m_isAllFiles = false;
+            subscriber.m_fileNames.clear();
+        }
+        else if(!subscriber.m_fileNames.erase(fileName)) {
+            throw string("You are not subscribed to this file!!");
+        }
+
+        if(!subscriber.m_isAllFiles && subscriber.m_fileNames.empty()) group.m_subscribers.erase(it);
+        return "Unsubscribed successfully!!";
+    }
+}
+
+void Groups::notifySession(string userName, string seederIpPort, bool isActive) {
+    //: Groups are locked one at a time outside the map lock, see leaveGroup
+    vector<shared_ptr<Group>> groups;
+    {
+        shared_lock <TimedMutex<shared_mutex>> guard(m_groupsMutex);
+        for(auto& it : m_groups) groups.push_back(it.second);
+    }
+
+    for(auto& groupPtr : groups) {
+        unique_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
+        if(group.m_isRemoved || !group.m_members.count(userName)) continue;
+
+        //: Subscriptions belong to the session, a logged out user is not notified anymore
+        if(!isActive) {
+            for(auto it = group.m_subscribers.begin(); it != group.m_subscribers.end();) {
+                if(it->second.m_userName == userName) it = group.m_subscribers.erase(it);
+                else it++;
+            }
+        }
+
+        //: Files stay listed with the user as sharer, only its IP:Port comes or goes
+        for(auto& it : group.m_files) {
+            if(it.second.m_userNames.count(userName)) {
+                notifyLocked(group, isActive ? "peer_joined" : "peer_left", it.first, seederIpPort);
+            }
+        }
+    }
+}
@@ -0,0 +1,219 @@
+#include "../headers.h"
+
+/**
+* @brief Holds the ring of a thread and marks it as orphan when the thread exits.
+*/
+struct RingOwner {
+    shared_ptr<LogRing> m_ring;
+
+    ~RingOwner() {
+        if (m_ring) m_ring->m_isOrphan = true;
+    }
+};
+
+/**
+* @brief Queues a record, called by the owning thread only.
+* @param record The record.
+* @return True if it was queued, false if the ring is full.
+*/
+bool LogRing::push(LogRecord&& record) {
+    size_t tail = m_tail.load(memory_order_relaxed);
+    if (tail - m_head.load(memory_order_acquire) >= m_records.size()) return false;
+    m_records[tail % m_records.size()] = move(record);
+    m_tail.store(tail + 1, memory_order_release);
+    return true;
+}
+
+/**
+* @brief Takes all queued records, called by the writer only.
+* @param records Vector the records are appended to.
+*/
+void LogRing::drain(vector<LogRecord>& records) {
+    size_t head = m_head.load(memory_order_relaxed);
+    size_t tail = m_tail.load(memory_order_acquire);
+    for (; head != tail; head++) records.push_back(move(m_records[head % m_records.size()]));
+    m_head.store(head, memory_order_release);
+}
+
+/**
+* @brief Checks whether no record is queued.
+* @return True if the ring is empty.
+*/
+bool LogRing::isEmpty() const {
+    return m_head.load(memory_order_acquire) == m_tail.load(memory_order_acquire);
+}
+
+/**
+* @brief Starts the writer thread.
+*/
+LogWriter::LogWriter() {
+    m_writer = thread(&LogWriter::run, this);
+    atexit(&LogWriter::flushAtExit);
+}
+
+/**
+* @brief Gives the writer, starting it on first use.
+* @return The writer.
+*/
+LogWriter& LogWriter::getInstance() {
+    //: Never destroyed, detached threads may still log while static objects are destroyed
+    static LogWriter* writer = new LogWriter();
+    return *writer;
+}
+
+/**
+* @brief Writes all queued lines and stops the writer, called when the process exits.
+*/
+void LogWriter::flushAtExit() {
+    LogWriter& writer = getInstance();
+    {
+        lock_guard<mutex> guard(writer.m_writerMutex);
+        writer.m_stop = true;
+    }
+    writer.m_wakeUp.notify_one();
+    if (writer.m_writer.joinable()) writer.m_writer.join();
+}
+
+/**
+* @brief Gives the ring of the calling thread, registering it on first use.
+* @return The ring.
+*/
+LogRing& LogWriter::giveRing() {
+    thread_local RingOwner owner;
+    if (!owner.m_ring) {
+        owner.m_ring = make_shared<LogRing>();
+        lock_guard<mutex> guard(m_writerMutex);
+        m_rings.push_back(owner.m_ring);
+    }
+    return *owner.m_ring;
+}
+
+/**
+* @brief Registers a file so that its dropped lines are reported.
+* @param file The file.
+*/
+void LogWriter::addFile(const shared_ptr<LogFile>& file) {
+    lock_guard<mutex> guard(m_writerMutex);
+    m_files.push_back(file);
+}
+
+/**
+* @brief Asks the writer to write before the next interval, e.g. for an error.
+*/
+void LogWriter::wakeUp() {
+    {
+        lock_guard<mutex> guard(m_writerMutex);
+        m_isUrgent = true;
+    }
+    m_wakeUp.notify_one();
+}
+
+/**
+* @brief Writes the queued lines until the process exits.
+*/
+void LogWriter::run() {
+    unique_lock<mutex> guard(m_writerMutex);
+    while (true) {
+        m_wakeUp.wait_for(guard, chrono::milliseconds(LOG_FLUSH_INTERVAL), [this]() { return m_isUrgent || m_stop; });
+        m_isUrgent = false;
+        bool isStopping = m_stop;
+
+        //: An orphan ring gets no more records, once it is empty it is only kept alive by the writer
+        m_rings.erase(remove_if(m_rings.begin(), m_rings.end(), [](const shared_ptr<LogRing>& ring) {
+            return ring->m_isOrphan && ring->isEmpty();
+        }), m_rings.end());
+
+        vector<shared_ptr<LogFile>> files;
+        for (auto it = m_files.begin(); it != m_files.end();) {
+            if (shared_ptr<LogFile> file = it->lock()) {
+                files.push_back(file);
+                it++;
+            } else {
+                it = m_files.erase(it);
+            }
+        }
+        vector<shared_ptr<LogRing>> rings = m_rings;
+
+        //: Loggers keep queueing while the lines are written
+        guard.unlock();
+        writeQueued(rings, files);
+        guard.lock();
+
+        if (isStopping) break;
+    }
+}
+
+/**
+* @brief Writes a batch of buffers completely.
+* @param fd The file descriptor.
+* @param buffers The buffers, advanced past what is written.
+* @param count The number of buffers.
+* @return True if everything was written, false on an error.
+*/
+static bool writeAll(int fd, struct iovec* buffers, int count) {
+    while (count > 0) {
+        ssize_t bytesWritten = writev(fd, buffers, count);
+        if (bytesWritten < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (count > 0 && (size_t)bytesWritten >= buffers->iov_len) {
+            bytesWritten -= buffers->iov_len;
+            buffers++;
+            count--;
+        }
+        if (count > 0) {
+            buffers->iov_base = (char*)buffers->iov_base + bytesWritten;
+            buffers->iov_len -= bytesWritten;
+        }
+    }
+    return true;
+}
+
+/**
+* @brief Takes the lines of all rings and writes them.
+* @param rings The rings.
+* @param files The files to report dropped lines of.
+*/
+void LogWriter::writeQueued(const vector<shared_ptr<LogRing>>& rings, const vector<shared_ptr<LogFile>>& files) {
+    vector<LogRecord> records;
+    for (const shared_ptr<LogRing>& ring : rings) ring->drain(records);
+
+    //: Lines of different threads are merged in time order, lines of one thread keep their order
+    stable_sort(records.begin(), records.end(), [](const LogRecord& a, const LogRecord& b) { return a.m_time < b.m_time; });
+
+    //: Timestamps only change once a second, most lines of a batch share the formatted one
+    time_t formattedTime = -1;
+    string timestamp;
+    auto giveTimestamp = [&](time_t lineTime) -> const string& {
+        if (lineTime != formattedTime) {
+            struct tm localTime;
+            char buffer[100];
+            localtime_r(&lineTime, &localTime);
+            strftime(buffer, sizeof(buffer), "%d/%m/%Y %H:%M:%S", &localTime);
+            timestamp = buffer;
+            formattedTime = lineTime;
+        }
+        return timestamp;
+    };
+
+    unordered_map<LogFile*, vector<string>> linesOfFile;
+    for (LogRecord& record : records) {
+        linesOfFile[record.m_file.get()].push_back("\n[" + giveTimestamp(record.m_time) + "][" + record.m_type + "] " + record.m_content);
+    }
+    for (const shared_ptr<LogFile>& file : files) {
+        uint64_t droppedLines = file->m_droppedLines.exchange(0);
+        if (droppedLines > 0) {
+            linesOfFile[file.get()].push_back("\n[" + giveTimestamp(time(nullptr)) + "][ERROR] Dropped " + to_string(droppedLines) + " log lines!!");
+        }
+    }
+
+    //: Files are still open here, held by the records or by the caller
+    for (auto& it : linesOfFile) {
+        vector<struct iovec> buffers;
+        for (const string& line : it.second) buffers.push_back({(void*)line.data(), line.size()});
+        for (size_t i = 0; i < buffers.size(); i += IOV_MAX) {
+            if (!writeAll(it.first->m_fd, buffers.data() + i, (int)min(buffers.size() - i, (size_t)IOV_MAX))) break;
+        }
+    }
+}
@@ -1,5 +1,7 @@
 #include "../headers.h"
 
+atomic<int> Logger::m_runtimeLevel{-1};
+
 Logger::Logger(string seederIp, int seederPort, string name)
 : m_seederIp(seederIp)
 , m_seederPort(to_string(seederPort))
@@ -7,56 +9,58 @@ Logger::Logger(string seederIp, int seederPort, string name)
 , m_logFilePath(m_logDirPath + "/" + name + ".txt")
 {
     //: Creating directory named logs_seederIp_seederPort
-    struct stat info;
-
-    if (stat("./logs", &info) != 0 || !(info.st_mode & S_IFDIR)) {
-        if (mkdir("./logs", 0755) != 0) {
-            throw string("Making base directory for log!!");
-        }
+    if (mkdir("./logs", 0755) != 0 && errno != EEXIST) {
+        throw string("Making base directory for log!!");
     }
-
-    if (stat(m_logDirPath.c_str(), &info) != 0 || !(info.st_mode & S_IFDIR)) {
-        if (mkdir(m_logDirPath.c_str(), 0755) != 0) {
-            throw string("Making new directory for log!!");
-        }
+    if (mkdir(m_logDirPath.c_str(), 0755) != 0 && errno != EEXIST) {
+        throw string("Making new directory for log!!");
     }
 
-    //: Creating leecher log file
-    int fd = open(m_logFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if(fd <= 0){
+    //: Creating log file, kept open for the log writer
+    int fd = open(m_logFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(fd < 0){
         throw string("Opening log file!!");
     }
+    m_logFile = make_shared<LogFile>(fd);
+    LogWriter::getInstance().addFile(m_logFile);
+}
+
+int Logger::giveLevel(const string& type){
+    if (strcasecmp(type.c_str(), "COMMAND") == 0) return LOG_LEVEL_COMMAND;
+    if (strcasecmp(type.c_str(), "SUCCESS") == 0) return LOG_LEVEL_SUCCESS;
+    if (strcasecmp(type.c_str(), "ERROR") == 0) return LOG_LEVEL_ERROR;
+    return LOG_LEVEL_INFO;
+}
 
-    close(fd);
+void Logger::setLevel(int level){
+    m_runtimeLevel = level;
+}
+
+bool Logger::isEnabled(const string& type){
+    int level = giveLevel(type);
+    if (level < MIN_LOG_LEVEL) return false;
+
+    //: P2P_LOG_LEVEL is read on first use, static loggers may log before main()
+    int runtimeLevel = m_runtimeLevel.load(memory_order_relaxed);
+    if (runtimeLevel < 0) {
+        const char* levelName = getenv("P2P_LOG_LEVEL");
+        runtimeLevel = levelName ? giveLevel(levelName) : LOG_LEVEL_COMMAND;
+        m_runtimeLevel = runtimeLevel;
+    }
+    return level >= runtimeLevel;
 }
 
 void Logger::log(string type, string content){
+    if (!m_logFile || !isEnabled(type)) return;
+
+    if (!content.empty() && content.back() == '\n') content.pop_back();
+    if (content.size() > LOG_MAX_LINE_LENGTH) content.resize(LOG_MAX_LINE_LENGTH);
 
-    {
-        if(content[content.size() - 1] == '\n') content.pop_back();
-
-        time_t current_time = time(nullptr);
-        struct tm* local_time = localtime(&current_time);
-        char buffer[100];
-        strftime(buffer, sizeof(buffer), "%d/%m/%Y %H:%M:%S", local_time);
-        string time = buffer;
-
-        lock_guard <mutex> guard(m_logMutex);
-        
-        int fd = open(m_logFilePath.c_str(), O_WRONLY | O_APPEND, 0644);
-        if (fd == -1) {
-            return;
-        }
-
-        string temp = "\n["+time+"]["+type+"] "+content;
-        
-        int bytesWritten = write(fd, temp.c_str(), temp.size());
-        if (bytesWritten == -1) {
-            close(fd);
-            return;
-        }
-        
-        close(fd);
+    //: Queued for the log writer, a full ring drops the line instead of blocking
+    bool isError = giveLevel(type) == LOG_LEVEL_ERROR;
+    LogWriter& writer = LogWriter::getInstance();
+    if (!writer.giveRing().push({m_logFile, time(nullptr), move(type), move(content)})) {
+        m_logFile->m_droppedLines++;
     }
-    
-}
\ No newline at end of file
+    if (isError) writer.wakeUp();
+}
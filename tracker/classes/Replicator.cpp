@@ -0,0 +1,940 @@
+#include "../headers.h"
+
+/**
+* @brief Stops the replication thread.
+*/
+Replicator::~Replicator(){
+    stop();
+}
+
+/**
+* @brief Loads the saved state, then starts electing the primary.
+* @param applier Applies a command to the state of this tracker and gives its response.
+* @param pusher Sends a frame to a connection from any thread, e.g. an entry of the log to a follower.
+* @throws string If the saved state can not be loaded.
+*/
+void Replicator::start(function<string(const string&)> applier, function<bool(uint64_t, const string&, uint8_t)> pusher){
+    m_applier = move(applier);
+    m_pusher = move(pusher);
+    m_stop = false;
+
+    {
+        //: Entries of the write-ahead log were validated when they were first applied
+        lock_guard<mutex> guard(m_logMutex);
+        Utils::m_isReplaying = true;
+        m_log.clear();
+        m_logBase = m_store.load([this](uint64_t seq, const string& command){
+            applyEntryLocked(seq, command);
+            m_log.push_back(command);
+        });
+        Utils::m_isReplaying = false;
+    }
+    m_thread = thread(&Replicator::run, this);
+}
+
+/**
+* @brief Stops following or leading, a stopped tracker is taken as lost by the others.
+*/
+void Replicator::stop(){
+    if(!m_thread.joinable()) return;
+    {
+        lock_guard<mutex> guard(m_logMutex);
+        m_stop = true;
+    }
+    m_logChanged.notify_all();
+
+    //: A follower blocked receiving the log returns at once
+    int primaryFd = m_primaryFd;
+    if(primaryFd != -1) shutdown(primaryFd, SHUT_RDWR);
+    m_thread.join();
+    closeForwards();
+
+    //: The next start loads the snapshot only
+    unique_lock<shared_mutex> applyGuard(m_applyMutex);
+    lock_guard<mutex> guard(m_logMutex);
+    try{
+        if(!m_log.empty()){
+            m_store.saveSnapshot(giveLastSeqLocked());
+            m_logBase = giveLastSeqLocked();
+            m_log.clear();
+        }
+    }
+    catch(const string& e){
+        generalLogger.log("ERROR", "Saving the state!! Error: " + e);
+    }
+    m_store.sync();
+}
+
+/**
+* @brief Checks whether a command changes the state shared by the trackers.
+* @param commandName First word of the command.
+* @return True if the command goes through the primary.
+*/
+bool Replicator::isWrite(const string& commandName){
+    //: Subscriptions belong to a connection of one tracker, they are not shared
+    static const unordered_set<string> writes = {
+        "create_user", "login", "logout", "create_group", "join_group", "accept_request",
+        "upload_file", "stop_share", "have", "leave_group"
+    };
+    return writes.count(commandName);
+}
+
+/**
+* @brief Gives the name of a command, the request id a client sent with a write is skipped.
+* @param command The command.
+* @return The first word of the command itself.
+*/
+string Replicator::giveCommandName(const string& command){
+    string plainCommand = command;
+    takeRequestId(plainCommand);
+    return plainCommand.substr(0, plainCommand.find(' '));
+}
+
+/**
+* @brief Splits the request id off a command.
+* @param command The command, "request <id> <command>" or the command alone, left as the command alone.
+* @return The request id, empty if the command has none.
+*/
+string Replicator::takeRequestId(string& command){
+    if(command.compare(0, 8, "request ") != 0) return "";
+    size_t idEnd = command.find(' ', 8);
+    if(idEnd == string::npos) return "";
+    string requestId = command.substr(8, idEnd - 8);
+    command.erase(0, idEnd + 1);
+    return requestId;
+}
+
+/**
+* @brief Applies a write on the primary, or forwards it to the primary.
+* @param command The command.
+* @param connectionId Connection the command came from.
+* @return The response, or nothing if it is sent to the connection once the followers applied the write.
+* @throws string The error of the command, or if no primary is reachable.
+*/
+optional<string> Replicator::write(const string& command, uint64_t connectionId){
+    uint64_t seq = 0;
+    vector<pair<uint8_t, string>> replies = writeMany({command}, seq);
+    if(replies[0].first == STATUS_ERROR) throw replies[0].second;
+    return answerAfter(seq, connectionId, replies[0].second, OPCODE_RESPONSE);
+}
+
+/**
+* @brief Replaces the password of a "create_user" or "login" command with its hash.
+* @details Only the primary calls this, a follower forwards the command as the client sent it.
+* @param command The command.
+* @return The command as it is applied, logged and saved.
+*/
+string Replicator::hidePassword(const string& command){
+    vector <string> tokens = Utils::tokenize(command, ' ');
+    bool hasPassword = (tokens.size() == 3 && tokens[0] == "create_user") || (tokens.size() == 4 && tokens[0] == "login");
+    if(!hasPassword) return command;
+
+    //: Followers, the write-ahead log and snapshots only ever see the hash
+    tokens[2] = Utils::hashPassword(tokens[1], tokens[2]);
+    string hiddenCommand = tokens[0];
+    for(size_t i = 1; i < tokens.size(); i++) hiddenCommand += " " + tokens[i];
+    return hiddenCommand;
+}
+
+/**
+* @brief Applies writes one after the other on the primary, or forwards them to the primary.
+* @details Writes of other connections are applied meanwhile, a follower forwards them in one frame.
+* @param commands The commands.
+* @param seq Set to the sequence number of the last entry appended by this tracker, or of the latest entry for a write sent again, left as is otherwise.
+* @return Status and response of every command, in order.
+*/
+vector<pair<uint8_t, string>> Replicator::writeMany(const vector<string>& commands, uint64_t& seq){
+    int primaryNumber = m_primaryNumber;
+    if(primaryNumber == 0){
+        //: Writes during an election wait for its end instead of failing at once
+        unique_lock<mutex> guard(m_logMutex);
+        m_logChanged.wait_for(guard, chrono::milliseconds(REPLICATION_TIMEOUT), [this] { return m_primaryNumber != 0 || m_stop; });
+        primaryNumber = m_primaryNumber;
+        if(primaryNumber == 0) return vector<pair<uint8_t, string>>(commands.size(), {STATUS_ERROR, "No primary tracker is elected yet!! Try again!!"});
+    }
+    if(primaryNumber != m_trackerNumber) return forward(commands, primaryNumber);
+
+    //: Passwords are hashed before any lock is taken, a hash takes milliseconds
+    vector <pair<string, string>> hiddenCommands;
+    for(string command : commands){
+        string requestId = takeRequestId(command);
+        hiddenCommands.push_back({requestId, hidePassword(command)});
+    }
+
+    vector<pair<uint8_t, string>> replies;
+    for(const auto& hiddenCommand : hiddenCommands){
+        const string& requestId = hiddenCommand.first;
+        const string& plainCommand = hiddenCommand.second;
+
+        //: Writes on the same user or group are applied and logged one at a time, so the log holds them in the order they were applied in
+        shared_lock<shared_mutex> applyGuard(m_applyMutex);
+        vector<unique_lock<mutex>> orderGuards;
+        for(size_t stripe : giveOrderStripes(plainCommand)) orderGuards.emplace_back(m_orderMutexes[stripe]);
+
+        //: A client that lost the response sends the write again, possibly to another tracker, it is answered as the first time
+        if(!requestId.empty()){
+            lock_guard<mutex> guard(m_logMutex);
+            auto it = m_requestResponses.find(requestId);
+            if(it != m_requestResponses.end()){
+                //: The write may not have reached the followers yet, the response waits for the latest entry
+                seq = max(seq, giveLastSeqLocked());
+                replies.push_back({STATUS_SUCCESS, it->second});
+                continue;
+            }
+        }
+
+        string response;
+        try{
+            response = m_applier(plainCommand);
+        }
+        catch(const string& e){
+            //: A failed write changed nothing, it is not logged
+            replies.push_back({STATUS_ERROR, e});
+            continue;
+        }
+
+        //: The log lock is held to number and log the entry only, followers remember the request id from it too
+        string command = requestId.empty() ? plainCommand : "request " + requestId + " " + plainCommand;
+        lock_guard<mutex> guard(m_logMutex);
+        seq = appendLocked(command);
+        rememberLocked(requestId, response);
+
+        //: Built from the command, the entry may have left the log for a snapshot already
+        string entry = "entry " + to_string(seq) + " " + command;
+        for(auto it = m_followers.begin(); it != m_followers.end();){
+            if(m_pusher(it->first, entry, OPCODE_REPLICATE)) it++;
+            else it = m_followers.erase(it);
+        }
+        replies.push_back({STATUS_SUCCESS, response});
+    }
+    return replies;
+}
+
+/**
+* @brief Answers a connection once every follower keeping up applied the log up to an entry.
+* @param seq Sequence number of the entry, 0 if nothing was appended.
+* @param connectionId Connection the response is sent to.
+* @param response The response.
+* @param opcode Kind of frame the response is sent in, OPCODE_RESPONSE or OPCODE_BATCH.
+* @return The response if it can be sent at once, nothing if the replicator sends it later.
+*/
+optional<string> Replicator::answerAfter(uint64_t seq, uint64_t connectionId, string response, uint8_t opcode){
+    if(seq == 0) return response;
+
+    //: Answered once every follower keeping up applied the write, a read on any tracker sees it then
+    lock_guard<mutex> guard(m_logMutex);
+    bool isWaited = false;
+    for(auto& it : m_followers){
+        if(!it.second.m_isLagging && it.second.m_ackedSeq < seq) isWaited = true;
+    }
+    if(!isWaited) return response;
+
+    //: Kept in log order, writers reach this point in any order once the log lock was released
+    PendingReply reply = {seq, connectionId, move(response), opcode, chrono::steady_clock::now() + chrono::milliseconds(REPLICATION_ACK_TIMEOUT)};
+    auto position = upper_bound(m_pendingReplies.begin(), m_pendingReplies.end(), seq, [](uint64_t value, const PendingReply& it) { return value < it.m_seq; });
+    m_pendingReplies.insert(position, move(reply));
+    return nullopt;
+}
+
+/**
+* @brief Sends the pending responses of writes applied by every follower keeping up.
+* @details A follower that did not apply a write by its deadline lags behind from then on.
+* @note Expects m_logMutex to be held.
+*/
+void Replicator::answerAppliedLocked(){
+    auto now = chrono::steady_clock::now();
+    while(!m_pendingReplies.empty()){
+        PendingReply& reply = m_pendingReplies.front();
+        bool isApplied = true;
+        for(auto& it : m_followers){
+            if(!it.second.m_isLagging && it.second.m_ackedSeq < reply.m_seq) isApplied = false;
+        }
+        if(!isApplied){
+            if(now < reply.m_deadline) return;
+            for(auto& it : m_followers){
+                if(it.second.m_isLagging || it.second.m_ackedSeq >= reply.m_seq) continue;
+                it.second.m_isLagging = true;
+                generalLogger.log("ERROR", "Tracker " + to_string(it.second.m_trackerNumber) + " lags behind the log, writes do not wait for it!!");
+            }
+        }
+
+        //: A client gone meanwhile is not answered, its write stays applied
+        m_pusher(reply.m_connectionId, reply.m_response, reply.m_opcode);
+        m_pendingReplies.pop_front();
+    }
+}
+
+/**
+* @brief Handles a frame of another tracker, runs on the worker owning the connection.
+* @param connection The connection of the other tracker.
+* @param message The payload of the frame.
+*/
+void Replicator::handlePeer(Connection& connection, const string& message){
+    vector<string> tokens = Utils::tokenize(message, ' ');
+    if(tokens.empty()) return;
+
+    //: "whois" is answered with "PrimaryNumber <space> LogLength", PrimaryNumber is 0 while electing
+    if(tokens[0] == "whois"){
+        lock_guard<mutex> guard(m_logMutex);
+        connection.queueFrame(to_string(m_primaryNumber) + " " + to_string(giveLastSeqLocked()), OPCODE_REPLICATE);
+        return;
+    }
+
+    //: "sync <tracker_number> <last_seq> <last_checksum> <signature>" makes the connection a follower streamed the log after last_seq
+    if(tokens[0] == "sync" && tokens.size() == 5){
+        if(Utils::signToken("sync:" + tokens[1] + ":" + tokens[2] + ":" + tokens[3]) != tokens[4]){
+            connection.queueFrame("error Invalid signature!!", OPCODE_REPLICATE);
+            return;
+        }
+        int trackerNumber = stoi(tokens[1]);
+        uint64_t lastSeq = stoull(tokens[2]);
+
+        //: No write is applied while the state may be copied to a snapshot for the follower
+        unique_lock<shared_mutex> applyGuard(m_applyMutex);
+        lock_guard<mutex> guard(m_logMutex);
+        if(m_primaryNumber != m_trackerNumber){
+            connection.queueFrame("error Tracker " + to_string(m_trackerNumber) + " is not the primary!!", OPCODE_REPLICATE);
+            return;
+        }
+        uint64_t primarySeq = giveLastSeqLocked();
+        if(lastSeq > primarySeq){
+            generalLogger.log("ERROR", "Log of tracker " + to_string(trackerNumber) + " is ahead of the primary, its entries after " + to_string(primarySeq) + " are dropped!!");
+        }
+
+        //: A follower restarted with entries a lost primary never passed on has a log of its own, only its last entry tells
+        bool isMatching = (lastSeq == 0 && m_logBase == 0);
+        if(lastSeq > m_logBase && lastSeq <= primarySeq){
+            const string& entry = m_log[lastSeq - m_logBase - 1];
+            isMatching = (tokens[3] == to_string(Store::giveChecksum(entry.data(), entry.size())));
+        }
+
+        //: Entries saved to the snapshot left the log, the follower is sent the state they led to instead
+        string snapshot;
+        if(!isMatching){
+            snapshot = "snapshot " + Store::giveSnapshot(primarySeq);
+            if(snapshot.size() > MAX_FRAME_LENGTH){
+                generalLogger.log("ERROR", "Snapshot of " + to_string(snapshot.size()) + " bytes is too large to be sent to tracker " + to_string(trackerNumber) + "!!");
+                connection.queueFrame("error Snapshot is too large!!", OPCODE_REPLICATE);
+                return;
+            }
+        }
+
+        //: Entries missed are queued on the connection itself, later ones are pushed behind them
+        connection.queueFrame("synced " + to_string(primarySeq), OPCODE_REPLICATE);
+        if(!isMatching) connection.queueFrame(snapshot, OPCODE_REPLICATE);
+        for(uint64_t seq = (isMatching ? lastSeq : primarySeq) + 1; seq <= primarySeq; seq++){
+            connection.queueFrame(giveEntryLocked(seq), OPCODE_REPLICATE);
+        }
+
+        Follower follower;
+        follower.m_trackerNumber = trackerNumber;
+        follower.m_ackedSeq = isMatching ? lastSeq : 0;
+        follower.m_isLagging = follower.m_ackedSeq < primarySeq;
+        m_followers[connection.m_id] = follower;
+        generalLogger.log("INFO", "Tracker " + to_string(trackerNumber) + " follows from " + (isMatching ? "entry " + to_string(lastSeq) : "the snapshot of entry " + to_string(primarySeq)) + "!!");
+        return;
+    }
+
+    //: "ack <seq>" tells that a follower applied the log up to seq
+    if(tokens[0] == "ack" && tokens.size() == 2){
+        lock_guard<mutex> guard(m_logMutex);
+        auto it = m_followers.find(connection.m_id);
+        if(it == m_followers.end()) return;
+
+        Follower& follower = it->second;
+        follower.m_ackedSeq = max(follower.m_ackedSeq, (uint64_t)stoull(tokens[1]));
+        if(follower.m_isLagging && follower.m_ackedSeq >= giveLastSeqLocked()){
+            follower.m_isLagging = false;
+            generalLogger.log("INFO", "Tracker " + to_string(follower.m_trackerNumber) + " caught up with the log!!");
+        }
+        answerAppliedLocked();
+    }
+}
+
+/**
+* @brief Elects the primary, then follows it or sends heartbeats until the tracker stops.
+*/
+void Replicator::run(){
+    while(!m_stop){
+        if(m_primaryNumber == m_trackerNumber){
+            //: Heartbeats tell the followers that the primary is alive, pending responses are timed out meanwhile
+            unique_lock<mutex> guard(m_logMutex);
+            auto heartbeat = chrono::steady_clock::now() + chrono::milliseconds(REPLICATION_HEARTBEAT);
+            while(!m_stop && chrono::steady_clock::now() < heartbeat){
+                auto wakeUp = m_pendingReplies.empty() ? heartbeat : min(heartbeat, m_pendingReplies.front().m_deadline);
+                m_logChanged.wait_until(guard, wakeUp);
+                answerAppliedLocked();
+
+                //: Saved by this thread without the log lock, writes go on meanwhile
+                if(m_store.isSnapshotDue()){
+                    guard.unlock();
+                    saveDueSnapshot();
+                    guard.lock();
+                }
+            }
+
+            //: Entries appended since the last heartbeat reach the disk, a crash of the machine loses at most these
+            m_store.sync();
+            string beat = "beat " + to_string(giveLastSeqLocked());
+            for(auto it = m_followers.begin(); it != m_followers.end();){
+                if(m_pusher(it->first, beat, OPCODE_REPLICATE)) it++;
+                else it = m_followers.erase(it);
+            }
+            answerAppliedLocked();
+            guard.unlock();
+
+            //: Asked without the log lock, writes go on while the other trackers answer
+            if(m_stop || confirmPrimary()) continue;
+            guard.lock();
+            m_primaryNumber = 0;
+            m_followers.clear();
+
+            //: Writes waiting for the followers are answered as on a timeout, no follower is waited for any more
+            answerAppliedLocked();
+            continue;
+        }
+
+        int primaryNumber = elect();
+        if(primaryNumber == m_trackerNumber){
+            {
+                lock_guard<mutex> guard(m_logMutex);
+                m_primaryNumber = m_trackerNumber;
+            }
+            m_logChanged.notify_all();
+            generalLogger.log("SUCCESS", "Tracker " + to_string(m_trackerNumber) + " is the primary!!");
+            continue;
+        }
+        if(primaryNumber != 0) follow(primaryNumber);
+
+        unique_lock<mutex> guard(m_logMutex);
+        m_logChanged.wait_for(guard, chrono::milliseconds(ELECTION_RETRY_INTERVAL), [this] { return m_stop.load(); });
+    }
+}
+
+/**
+* @brief Asks the other trackers about the primary and the length of their logs.
+* @details This tracker only wins with the answers of a majority of the trackers.
+* @return Number of the tracker to follow or of this tracker if it won, 0 if the winner is not primary yet.
+*/
+int Replicator::elect(){
+    //: Longest log wins, so no write answered to a client is lost, the lowest number breaks ties
+    uint64_t bestSeq;
+    {
+        lock_guard<mutex> guard(m_logMutex);
+        bestSeq = giveLastSeqLocked();
+    }
+    int bestNumber = m_trackerNumber;
+    size_t answers = 1;
+
+    for(int trackerNumber = 1; trackerNumber <= (int)m_trackers.size(); trackerNumber++){
+        if(trackerNumber == m_trackerNumber) continue;
+
+        //: A tracker that is down takes no part in the election
+        int primaryNumber;
+        uint64_t seq;
+        if(!askTracker(trackerNumber, primaryNumber, seq)) continue;
+        answers++;
+
+        if(primaryNumber != 0 && primaryNumber != m_trackerNumber) return primaryNumber;
+        if(seq > bestSeq || (seq == bestSeq && trackerNumber < bestNumber)){
+            bestSeq = seq;
+            bestNumber = trackerNumber;
+        }
+    }
+
+    //: A tracker cut off from the others must not become a second primary, the others may still have one
+    if(answers * 2 <= m_trackers.size()) return 0;
+    return (bestNumber == m_trackerNumber) ? m_trackerNumber : 0;
+}
+
+/**
+* @brief Asks the other trackers whether this primary should stay the primary, once every heartbeat.
+* @return False if no majority of the trackers answers or another primary has the longer log, or the lower number with an equal log.
+*/
+bool Replicator::confirmPrimary(){
+    uint64_t ownSeq;
+    {
+        lock_guard<mutex> guard(m_logMutex);
+        ownSeq = giveLastSeqLocked();
+    }
+    size_t answers = 1;
+
+    for(int trackerNumber = 1; trackerNumber <= (int)m_trackers.size(); trackerNumber++){
+        if(trackerNumber == m_trackerNumber) continue;
+
+        int primaryNumber;
+        uint64_t seq;
+        if(!askTracker(trackerNumber, primaryNumber, seq)) continue;
+        answers++;
+
+        //: Two primaries left by a partition, the one with the better claim stays, the other follows it
+        if(primaryNumber == trackerNumber && (seq > ownSeq || (seq == ownSeq && trackerNumber < m_trackerNumber))){
+            generalLogger.log("ERROR", "Tracker " + to_string(trackerNumber) + " is primary too and has the better log, tracker " + to_string(m_trackerNumber) + " steps down!!");
+            return false;
+        }
+    }
+    if(answers * 2 <= m_trackers.size()){
+        generalLogger.log("ERROR", "Primary " + to_string(m_trackerNumber) + " reaches no majority of the trackers, it steps down!!");
+        return false;
+    }
+    return true;
+}
+
+/**
+* @brief Asks another tracker about the primary and the length of its log.
+* @param trackerNumber Number of the tracker.
+* @param primaryNumber Set to the primary the tracker knows, 0 while it is electing.
+* @param seq Set to the sequence number of the last entry the tracker applied.
+* @return False if the tracker did not answer within PEER_CONNECT_TIMEOUT.
+*/
+bool Replicator::askTracker(int trackerNumber, int& primaryNumber, uint64_t& seq){
+    int fd = -1;
+    try{
+        fd = connectTracker(trackerNumber);
+
+        //: Asked every heartbeat by the primary, a tracker that hangs must not hold up the heartbeats
+        struct timeval timeout;
+        timeout.tv_sec = PEER_CONNECT_TIMEOUT / 1000;
+        timeout.tv_usec = (PEER_CONNECT_TIMEOUT % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        sendFrame(fd, "whois", OPCODE_REPLICATE);
+        FrameHeader header;
+        vector<string> reply = Utils::tokenize(recvFrame(fd, header), ' ');
+        close(fd);
+        fd = -1;
+        if(reply.size() != 2) return false;
+        primaryNumber = stoi(reply[0]);
+        seq = stoull(reply[1]);
+        return true;
+    }
+    catch(const string& e){
+        if(fd != -1) close(fd);
+    }
+    catch(const exception& e){
+        if(fd != -1) close(fd);
+    }
+    return false;
+}
+
+/**
+* @brief Receives and applies the log of the primary until the connection is lost.
+* @param primaryNumber Number of the primary.
+*/
+void Replicator::follow(int primaryNumber){
+    int fd;
+    try{
+        fd = connectTracker(primaryNumber);
+    }
+    catch(const string& e){
+        return;
+    }
+    m_primaryFd = fd;
+
+    //: Commands of the log were validated by the primary, this thread applies nothing else
+    Utils::m_isReplaying = true;
+
+    try{
+        uint64_t lastSeq;
+        string lastChecksum = "-";
+        {
+            lock_guard<mutex> guard(m_logMutex);
+            lastSeq = giveLastSeqLocked();
+            if(!m_log.empty()) lastChecksum = to_string(Store::giveChecksum(m_log.back().data(), m_log.back().size()));
+        }
+        string numbers = to_string(m_trackerNumber) + ":" + to_string(lastSeq) + ":" + lastChecksum;
+        sendFrame(fd, "sync " + to_string(m_trackerNumber) + " " + to_string(lastSeq) + " " + lastChecksum + " " + Utils::signToken("sync:" + numbers), OPCODE_REPLICATE);
+
+        FrameHeader header;
+        string reply = recvFrame(fd, header);
+        if(reply.compare(0, 7, "synced ") != 0){
+            throw string("Tracker " + to_string(primaryNumber) + " refused to be followed!! " + reply);
+        }
+        {
+            lock_guard<mutex> guard(m_logMutex);
+            m_primaryNumber = primaryNumber;
+        }
+        m_logChanged.notify_all();
+        generalLogger.log("SUCCESS", "Tracker " + to_string(m_trackerNumber) + " follows primary " + to_string(primaryNumber) + " from entry " + to_string(lastSeq) + "!!");
+
+        while(!m_stop){
+            //: Heartbeats arrive every REPLICATION_HEARTBEAT, a receive timing out means the primary is lost
+            string frame = recvFrame(fd, header);
+            if(frame.compare(0, 5, "beat ") == 0){
+                lock_guard<mutex> guard(m_logMutex);
+                m_store.sync();
+                continue;
+            }
+            if(frame.compare(0, 9, "snapshot ") == 0){
+                //: State of the primary when the log of this tracker could not be continued, replaces all saved so far
+                lock_guard<mutex> guard(m_logMutex);
+                lastSeq = Store::installSnapshot(frame.data() + 9, frame.size() - 9);
+                m_log.clear();
+                m_logBase = lastSeq;
+                try{
+                    m_store.saveSnapshot(lastSeq);
+                }
+                catch(const string& e){
+                    generalLogger.log("ERROR", "Saving the snapshot of primary " + to_string(primaryNumber) + "!! Error: " + e);
+                }
+                generalLogger.log("INFO", "Installed the snapshot of primary " + to_string(primaryNumber) + " up to entry " + to_string(lastSeq) + "!!");
+            }
+            else if(frame.compare(0, 6, "entry ") == 0){
+                //: Entry is "entry <seq> <command>"
+                size_t seqEnd = frame.find(' ', 6);
+                if(seqEnd == string::npos) throw string("Invalid entry of the log!!");
+                uint64_t seq = stoull(frame.substr(6, seqEnd - 6));
+                string command = frame.substr(seqEnd + 1);
+
+                lock_guard<mutex> guard(m_logMutex);
+
+                //: An entry dropped on the way can not be made up for, the log is synced again from where it stopped
+                if(seq != giveLastSeqLocked() + 1) throw string("Entry " + to_string(seq) + " of the log is out of order!!");
+                applyEntryLocked(seq, command);
+                lastSeq = appendLocked(command);
+            }
+            else continue;
+
+            //: Entries received together are acknowledged together
+            char byte;
+            if(recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) <= 0){
+                sendFrame(fd, "ack " + to_string(lastSeq), OPCODE_REPLICATE);
+                saveDueSnapshot();
+            }
+        }
+    }
+    catch(const string& e){
+        generalLogger.log("ERROR", "Following primary tracker " + to_string(primaryNumber) + "!! Error: " + e);
+    }
+    catch(const exception& e){
+        generalLogger.log("ERROR", "Following primary tracker " + to_string(primaryNumber) + "!! Error: " + string(e.what()));
+    }
+
+    {
+        lock_guard<mutex> guard(m_logMutex);
+        if(m_primaryNumber == primaryNumber) m_primaryNumber = 0;
+    }
+    m_primaryFd = -1;
+    close(fd);
+    closeForwards();
+}
+
+/**
+* @brief Passes writes of a client on to the primary, all in one batch frame.
+* @param commands The commands.
+* @param primaryNumber Number of the primary.
+* @return Status and response of every command, in order.
+*/
+vector<pair<uint8_t, string>> Replicator::forward(const vector<string>& commands, int primaryNumber){
+    string batch;
+    for(const string& command : commands) batch += command + "\n";
+
+    int fd = -1;
+    {
+        lock_guard<mutex> guard(m_forwardMutex);
+        if(m_forwardNumber != primaryNumber){
+            for(int idleFd : m_forwardFds) close(idleFd);
+            m_forwardFds.clear();
+            m_forwardNumber = primaryNumber;
+        }
+
+        //: A connection the primary closed reads as end of file, it is not used for the write
+        while(fd == -1 && !m_forwardFds.empty()){
+            fd = m_forwardFds.back();
+            m_forwardFds.pop_back();
+            char byte;
+            if(recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    FrameHeader header;
+    string response;
+    try{
+        if(fd == -1) fd = connectTracker(primaryNumber);
+        sendFrame(fd, batch, OPCODE_BATCH);
+        response = recvFrame(fd, header);
+    }
+    catch(const string& e){
+        if(fd != -1) close(fd);
+        generalLogger.log("ERROR", "Forwarding to primary tracker " + to_string(primaryNumber) + "!! Error: " + e);
+        return vector<pair<uint8_t, string>>(commands.size(), {STATUS_ERROR, "Primary tracker is not reachable!! Try again!!"});
+    }
+
+    {
+        lock_guard<mutex> guard(m_forwardMutex);
+        if(m_forwardNumber == primaryNumber) m_forwardFds.push_back(fd);
+        else close(fd);
+    }
+    //: An error of the whole batch is the error of every command in it
+    vector<pair<uint8_t, string>> replies;
+    if(header.m_status == STATUS_ERROR) replies.assign(commands.size(), {STATUS_ERROR, response});
+    else{
+        try{
+            replies = Utils::unpackReplies(response);
+        }
+        catch(const string& e){
+            replies.clear();
+        }
+        if(replies.size() != commands.size()) replies.assign(commands.size(), {STATUS_ERROR, "Invalid replies of primary tracker!!"});
+    }
+    return replies;
+}
+
+/**
+* @brief Closes the forward connections.
+*/
+void Replicator::closeForwards(){
+    lock_guard<mutex> guard(m_forwardMutex);
+    for(int fd : m_forwardFds) close(fd);
+    m_forwardFds.clear();
+    m_forwardNumber = 0;
+}
+
+/**
+* @brief Gives the sequence number of the last entry applied.
+* @return The sequence number, 0 if no entry was applied.
+* @note Expects m_logMutex to be held.
+*/
+uint64_t Replicator::giveLastSeqLocked() const {
+    return m_logBase + m_log.size();
+}
+
+/**
+* @brief Appends an applied command to the log and the write-ahead log.
+* @details The replication thread is woken once a snapshot is due, see saveDueSnapshot().
+* @param command The command.
+* @return Sequence number of the entry.
+* @note Expects m_logMutex to be held.
+*/
+uint64_t Replicator::appendLocked(const string& command){
+    m_log.push_back(command);
+    uint64_t seq = giveLastSeqLocked();
+
+    //: The entry is applied already, a failing disk costs the restart, not the write
+    try{
+        m_store.append(seq, command);
+    }
+    catch(const string& e){
+        generalLogger.log("ERROR", "Saving entry " + to_string(seq) + " of the log!! Error: " + e);
+    }
+    if(m_store.isSnapshotDue()) m_logChanged.notify_all();
+    return seq;
+}
+
+/**
+* @brief Remembers the response of a write sent with a request id.
+* @param requestId The request id, nothing is remembered if it is empty.
+* @param response The response.
+* @note Expects m_logMutex to be held.
+*/
+void Replicator::rememberLocked(const string& requestId, const string& response){
+    if(requestId.empty() || !m_requestResponses.emplace(requestId, response).second) return;
+    m_requestOrder.push_back(requestId);
+    if(m_requestOrder.size() > MAX_REMEMBERED_REQUESTS){
+        m_requestResponses.erase(m_requestOrder.front());
+        m_requestOrder.pop_front();
+    }
+}
+
+/**
+* @brief Applies an entry of the log, remembering its response if it carries a request id.
+* @param seq Sequence number of the entry.
+* @param command The command of the entry, "request <id> <command>" or the command alone.
+* @note Expects m_logMutex to be held.
+*/
+void Replicator::applyEntryLocked(uint64_t seq, const string& command){
+    string plainCommand = command;
+    string requestId = takeRequestId(plainCommand);
+    try{
+        rememberLocked(requestId, m_applier(plainCommand));
+    }
+    catch(const string& e){
+        generalLogger.log("ERROR", "Applying entry " + to_string(seq) + " of the log!! Error: " + e);
+    }
+}
+
+/**
+* @brief Saves the state to a new snapshot if enough entries piled up in the write-ahead log.
+* @details Writes wait only while the state is copied, not while the copy is written.
+* @note Expects m_logMutex not to be held, called by the replication thread only.
+*/
+void Replicator::saveDueSnapshot(){
+    {
+        lock_guard<mutex> guard(m_logMutex);
+        if(!m_store.isSnapshotDue()) return;
+    }
+
+    string content;
+    uint64_t seq;
+    {
+        unique_lock<shared_mutex> applyGuard(m_applyMutex);
+        lock_guard<mutex> guard(m_logMutex);
+        seq = giveLastSeqLocked();
+        content = Store::giveSnapshot(seq);
+    }
+
+    try{
+        m_store.writeSnapshot(content, seq);
+
+        //: Entries appended while the snapshot was written stay in the log and start the new write-ahead log
+        lock_guard<mutex> guard(m_logMutex);
+        m_log.erase(m_log.begin(), m_log.begin() + (seq - m_logBase));
+        m_logBase = seq;
+        m_store.restartWal(seq, m_log);
+    }
+    catch(const string& e){
+        generalLogger.log("ERROR", "Saving the snapshot of entry " + to_string(seq) + "!! Error: " + e);
+    }
+}
+
+/**
+* @brief Gives the locks a write takes to be applied and logged in order with the writes it does not commute with.
+* @param command The command.
+* @return Indices into m_orderMutexes, ascending and without duplicates.
+*/
+vector<size_t> Replicator::giveOrderStripes(const string& command){
+    vector <string> tokens = Utils::tokenize(command, ' ');
+    if(tokens.empty()) return {0};
+
+    //: A write touches the user named in it or owning its token, and the group it names
+    vector <string> keys;
+    if(tokens[0] == "create_user" || tokens[0] == "login"){
+        if(tokens.size() > 1) keys.push_back("user " + tokens[1]);
+    }
+    else{
+        //: Token is "payload:expiry_time:signature", the payload is the user name
+        const string& token = tokens.back();
+        size_t signatureStart = token.rfind(':');
+        size_t expiryStart = (signatureStart == string::npos || signatureStart == 0) ? string::npos : token.rfind(':', signatureStart - 1);
+        keys.push_back("user " + token.substr(0, expiryStart));
+
+        if(tokens[0] == "upload_file"){
+            if(tokens.size() > 2) keys.push_back("group " + tokens[2]);
+        }
+        else if(tokens[0] != "logout" && tokens.size() > 1) keys.push_back("group " + tokens[1]);
+        if(tokens[0] == "accept_request" && tokens.size() > 2) keys.push_back("user " + tokens[2]);
+    }
+
+    //: Taken in ascending order, so two writes never wait for each other
+    vector<size_t> stripes;
+    for(const string& key : keys) stripes.push_back(hash<string>{}(key) % WRITE_ORDER_STRIPES);
+    sort(stripes.begin(), stripes.end());
+    stripes.erase(unique(stripes.begin(), stripes.end()), stripes.end());
+    return stripes;
+}
+
+/**
+* @brief Gives the frame carrying an entry of the log.
+* @param seq Sequence number of the entry.
+* @return The payload "entry <seq> <command>".
+* @note Expects m_logMutex to be held.
+*/
+string Replicator::giveEntryLocked(uint64_t seq) const {
+    return "entry " + to_string(seq) + " " + m_log[seq - m_logBase - 1];
+}
+
+/**
+* @brief Connects to another tracker.
+* @param trackerNumber Number of the tracker.
+* @return The connected socket, with REPLICATION_TIMEOUT as timeout of every receive.
+* @throws string If the tracker can not be reached within PEER_CONNECT_TIMEOUT.
+*/
+int Replicator::connectTracker(int trackerNumber){
+    const pair<string, int>& tracker = m_trackers[trackerNumber - 1];
+    string address = tracker.first + ":" + to_string(tracker.second);
+
+    struct sockaddr_in trackerAddr;
+    memset(&trackerAddr, 0, sizeof(trackerAddr));
+    trackerAddr.sin_family = AF_INET;
+    trackerAddr.sin_port = htons(tracker.second);
+    if(inet_pton(AF_INET, tracker.first.c_str(), &trackerAddr.sin_addr) <= 0){
+        throw string("Converting IP address " + tracker.first + "!!");
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        throw string("Creating a socket!!\nError: " + string(strerror(errno)));
+    }
+
+    //: Connecting is bounded, a tracker that is down must not hold up the election
+    if(connect(fd, (struct sockaddr*)&trackerAddr, sizeof(trackerAddr)) < 0 && errno != EINPROGRESS){
+        string error = strerror(errno);
+        close(fd);
+        throw string("Connecting to tracker " + address + "!!\nError: " + error);
+    }
+    struct pollfd pollFd = {fd, POLLOUT, 0};
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    if(poll(&pollFd, 1, PEER_CONNECT_TIMEOUT) <= 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0 || error != 0){
+        close(fd);
+        throw string("Connecting to tracker " + address + "!!" + (error ? "\nError: " + string(strerror(error)) : ""));
+    }
+
+    //: Blocking again, every receive is bounded instead
+    struct timeval timeout;
+    timeout.tv_sec = REPLICATION_TIMEOUT / 1000;
+    timeout.tv_usec = (REPLICATION_TIMEOUT % 1000) * 1000;
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK) == -1 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1){
+        string error = strerror(errno);
+        close(fd);
+        throw string("Setting options of connection to tracker " + address + "!!\nError: " + error);
+    }
+    return fd;
+}
+
+/**
+* @brief Sends a frame on a blocking socket.
+* @param fd The socket.
+* @param payload The payload.
+* @param opcode The kind of message, one of the OPCODE_* values.
+* @throws string If sending fails.
+*/
+void Replicator::sendFrame(int fd, const string& payload, uint8_t opcode){
+    string frame = Connection::makeFrame(payload, opcode, STATUS_SUCCESS);
+    size_t bytesSent = 0;
+    while(bytesSent < frame.size()){
+        ssize_t sent = send(fd, frame.data() + bytesSent, frame.size() - bytesSent, MSG_NOSIGNAL);
+        if(sent < 0){
+            if(errno == EINTR) continue;
+            throw string("Sending to tracker!!\nError: " + string(strerror(errno)));
+        }
+        bytesSent += sent;
+    }
+}
+
+/**
+* @brief Receives a frame on a blocking socket.
+* @param fd The socket.
+* @param header Set to the header in host byte order.
+* @return The payload.
+* @throws string If receiving fails, times out or the connection is closed.
+*/
+string Replicator::recvFrame(int fd, FrameHeader& header){
+    auto recvAll = [fd](char* buffer, size_t length){
+        size_t bytesReceived = 0;
+        while(bytesReceived < length){
+            ssize_t bytesRead = recv(fd, buffer + bytesReceived, length - bytesReceived, 0);
+            if(bytesRead == 0) throw string("Tracker closed the connection!!");
+            if(bytesRead < 0){
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) throw string("Tracker did not answer in time!!");
+                throw string("Receiving from tracker!!\nError: " + string(strerror(errno)));
+            }
+            bytesReceived += bytesRead;
+        }
+    };
+
+    recvAll((char*)&header, sizeof(header));
+    header.m_length = ntohl(header.m_length);
+    header.m_reserved = ntohs(header.m_reserved);
+    if(header.m_length > MAX_FRAME_LENGTH){
+        throw string("Frame of " + to_string(header.m_length) + " bytes from tracker is too large!!");
+    }
+
+    string payload(header.m_length, '\0');
+    recvAll(&payload[0], header.m_length);
+    return payload;
+}
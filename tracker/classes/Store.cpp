@@ -0,0 +1,528 @@
+#include "../headers.h"
+
+/**
+* @brief Reads a number.
+* @return The number.
+* @throws string If the snapshot ends before it.
+*/
+uint64_t Store::Reader::takeNumber(){
+    if(m_end - m_next < 8) throw string("Snapshot is damaged!!");
+    uint64_t value = 0;
+    for(int i = 7; i >= 0; i--) value = (value << 8) | (unsigned char)m_next[i];
+    m_next += 8;
+    return value;
+}
+
+/**
+* @brief Reads a string.
+* @return The string.
+* @throws string If the snapshot ends before it.
+*/
+string Store::Reader::takeString(){
+    uint64_t length = takeNumber();
+    if((uint64_t)(m_end - m_next) < length) throw string("Snapshot is damaged!!");
+    string value(m_next, length);
+    m_next += length;
+    return value;
+}
+
+/**
+* @brief Constructs the store of a tracker, nothing is read or written yet.
+* @param trackerIp IP address of the tracker.
+* @param trackerPort Port number of the tracker.
+*/
+Store::Store(string trackerIp, int trackerPort)
+: m_dirPath("./state/" + trackerIp + ":" + to_string(trackerPort))
+, m_snapshotPath(m_dirPath + "/snapshot.bin")
+, m_walPath(m_dirPath + "/wal.bin")
+{}
+
+/**
+* @brief Syncs and closes the write-ahead log.
+*/
+Store::~Store(){
+    if(m_walFd == -1) return;
+    sync();
+    close(m_walFd);
+}
+
+/**
+* @brief Appends a number, 8 bytes in little endian order.
+* @param out The bytes appended to.
+* @param value The number.
+*/
+void Store::putNumber(string& out, uint64_t value){
+    //: Byte order is fixed, snapshots are sent to trackers on other machines
+    for(int i = 0; i < 8; i++) out.push_back((char)((value >> (8 * i)) & 0xFF));
+}
+
+/**
+* @brief Appends a string, its length first.
+* @param out The bytes appended to.
+* @param value The string.
+*/
+void Store::putString(string& out, const string& value){
+    putNumber(out, value.size());
+    out += value;
+}
+
+/**
+* @brief Gives the checksum of some bytes, e.g. of a record of the write-ahead log.
+* @param data The bytes.
+* @param length Number of bytes.
+* @return The 32 bit FNV-1a hash of the bytes.
+*/
+uint32_t Store::giveChecksum(const char* data, size_t length){
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+* @brief Opens the write-ahead log for appending, creating it if needed.
+* @param isTruncated Whether the entries in it are dropped.
+* @throws string If the log can not be opened.
+*/
+void Store::openWal(bool isTruncated){
+    if(m_walFd != -1) close(m_walFd);
+    m_walFd = open(m_walPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (isTruncated ? O_TRUNC : 0), 0600);
+    if(m_walFd < 0){
+        throw string("Opening write-ahead log " + m_walPath + "!!\nError: " + string(strerror(errno)));
+    }
+
+    //: A log created readable by others before is closed to them too
+    fchmod(m_walFd, 0600);
+    if(isTruncated) m_walEntries = 0;
+    m_isUnsynced = false;
+}
+
+/**
+* @brief Loads the snapshot, then gives the entries of the write-ahead log to be applied again.
+* @param replayer Applies an entry, called in log order with its sequence number.
+* @return Sequence number of the last entry in the snapshot, 0 if there is no snapshot.
+* @throws string If the snapshot is damaged or the files can not be opened.
+*/
+uint64_t Store::load(function<void(uint64_t, const string&)> replayer){
+    for(string dirPath : {string("./state"), m_dirPath}){
+        //: State holds the users and their password hashes, only the tracker's own user may look into it
+        if(mkdir(dirPath.c_str(), 0700) != 0 && errno != EEXIST){
+            throw string("Making directory " + dirPath + " for the state!!");
+        }
+        chmod(dirPath.c_str(), 0700);
+    }
+
+    //: Mapped instead of read, the pages of a large snapshot are parsed straight from the page cache
+    uint64_t snapshotSeq = 0;
+    int fd = open(m_snapshotPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd >= 0){
+        struct stat fileStat;
+        if(fstat(fd, &fileStat) < 0){
+            close(fd);
+            throw string("Reading snapshot " + m_snapshotPath + "!!\nError: " + string(strerror(errno)));
+        }
+        void* data = (fileStat.st_size > 0) ? mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if(data == MAP_FAILED){
+            throw string("Mapping snapshot " + m_snapshotPath + "!!");
+        }
+        madvise(data, fileStat.st_size, MADV_SEQUENTIAL);
+        try{
+            snapshotSeq = installSnapshot((const char*)data, fileStat.st_size);
+        }
+        catch(const string& e){
+            munmap(data, fileStat.st_size);
+            throw string("Loading snapshot " + m_snapshotPath + "!! " + e);
+        }
+        munmap(data, fileStat.st_size);
+    }
+    else if(errno != ENOENT){
+        throw string("Opening snapshot " + m_snapshotPath + "!!\nError: " + string(strerror(errno)));
+    }
+
+    string content;
+    fd = open(m_walPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd >= 0){
+        char buffer[65536];
+        ssize_t bytesRead;
+        while((bytesRead = read(fd, buffer, sizeof(buffer))) > 0) content.append(buffer, bytesRead);
+        close(fd);
+        if(bytesRead < 0){
+            throw string("Reading write-ahead log " + m_walPath + "!!\nError: " + string(strerror(errno)));
+        }
+    }
+
+    //: Record is "Length <8 bytes> Seq <8 bytes> Command <Length bytes> Checksum <4 bytes>"
+    size_t offset = 0;
+    uint64_t lastSeq = snapshotSeq;
+    m_walEntries = 0;
+    while(content.size() - offset >= 20){
+        Reader reader = {content.data() + offset, content.data() + content.size()};
+        uint64_t length = reader.takeNumber();
+        if(length > content.size() - offset - 20) break;
+        uint64_t seq = reader.takeNumber();
+        string command(reader.m_next, length);
+
+        uint32_t checksum = 0;
+        memcpy(&checksum, reader.m_next + length, 4);
+        if(ntohl(checksum) != giveChecksum(content.data() + offset, 16 + length)) break;
+
+        //: Entries already in the snapshot are left from a crash before the log was emptied
+        if(seq > lastSeq){
+            if(seq != lastSeq + 1) break;
+            replayer(seq, command);
+            lastSeq = seq;
+        }
+        offset += 20 + length;
+        m_walEntries++;
+    }
+
+    //: A record cut short by a crash is dropped, the entries after it are appended in its place
+    if(offset < content.size()){
+        generalLogger.log("ERROR", "Dropping " + to_string(content.size() - offset) + " damaged bytes at the end of write-ahead log " + m_walPath + "!!");
+        if(truncate(m_walPath.c_str(), offset) < 0){
+            throw string("Truncating write-ahead log " + m_walPath + "!!\nError: " + string(strerror(errno)));
+        }
+    }
+    openWal(false);
+    generalLogger.log("INFO", "Loaded the state up to entry " + to_string(lastSeq) + ", " + to_string(lastSeq - snapshotSeq) + " of them from the write-ahead log!!");
+    return snapshotSeq;
+}
+
+/**
+* @brief Appends an entry of the replication log to the write-ahead log.
+* @param seq Sequence number of the entry.
+* @param command The command of the entry.
+* @throws string If the entry can not be written.
+*/
+void Store::append(uint64_t seq, const string& command){
+    string record = giveRecord(seq, command);
+
+    //: Written at once, a tracker exiting keeps every entry, syncing is left to the heartbeats
+    if(write(m_walFd, record.data(), record.size()) != (ssize_t)record.size()){
+        throw string("Writing write-ahead log " + m_walPath + "!!\nError: " + string(strerror(errno)));
+    }
+    m_walEntries++;
+    m_isUnsynced = true;
+}
+
+/**
+* @brief Syncs the entries appended since the last sync to the disk.
+*/
+void Store::sync(){
+    if(!m_isUnsynced || m_walFd == -1) return;
+    if(fdatasync(m_walFd) < 0){
+        generalLogger.log("ERROR", "Syncing write-ahead log " + m_walPath + "!! Error: " + string(strerror(errno)));
+        return;
+    }
+    m_isUnsynced = false;
+}
+
+/**
+* @brief Checks whether enough entries piled up in the write-ahead log for a new snapshot.
+* @return True if the state should be saved.
+*/
+bool Store::isSnapshotDue() const {
+    return m_walEntries >= SNAPSHOT_WAL_ENTRIES;
+}
+
+/**
+* @brief Gives the record of an entry in the write-ahead log.
+* @param seq Sequence number of the entry.
+* @param command The command of the entry.
+* @return The bytes "Length Seq Command Checksum".
+*/
+string Store::giveRecord(uint64_t seq, const string& command){
+    string record;
+    record.reserve(20 + command.size());
+    putNumber(record, command.size());
+    putNumber(record, seq);
+    record += command;
+    uint32_t checksum = htonl(giveChecksum(record.data(), record.size()));
+    record.append((const char*)&checksum, 4);
+    return record;
+}
+
+/**
+* @brief Replaces a file by new content, synced to the disk before it takes the place of the old one.
+* @param path Path of the file.
+* @param content The content.
+* @throws string If the file can not be written.
+*/
+void Store::replaceFile(const string& path, const string& content){
+    //: Written aside and renamed over the old file, so a crash leaves either the old or the new one
+    string tempPath = path + ".tmp";
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0){
+        throw string("Creating " + path + "!!\nError: " + string(strerror(errno)));
+    }
+    fchmod(fd, 0600);
+    size_t bytesWritten = 0;
+    while(bytesWritten < content.size()){
+        ssize_t written = write(fd, content.data() + bytesWritten, content.size() - bytesWritten);
+        if(written < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        bytesWritten += written;
+    }
+    if(bytesWritten != content.size() || fdatasync(fd) < 0){
+        string error = strerror(errno);
+        close(fd);
+        unlink(tempPath.c_str());
+        throw string("Writing " + path + "!!\nError: " + error);
+    }
+    close(fd);
+    if(rename(tempPath.c_str(), path.c_str()) < 0){
+        throw string("Creating " + path + "!!\nError: " + string(strerror(errno)));
+    }
+}
+
+/**
+* @brief Saves the state to a new snapshot and empties the write-ahead log.
+* @param seq Sequence number of the last entry applied to the state.
+* @throws string If the snapshot can not be written.
+* @note Expects no command to change the state meanwhile.
+*/
+void Store::saveSnapshot(uint64_t seq){
+    writeSnapshot(giveSnapshot(seq), seq);
+
+    //: Entries left by a crash before this point are skipped on load, they are in the snapshot
+    openWal(true);
+}
+
+/**
+* @brief Writes a snapshot taken before, the write-ahead log is left as it is.
+* @details Touches the snapshot file only, so entries can be appended meanwhile.
+* @param content The bytes of the snapshot, see giveSnapshot().
+* @param seq Sequence number of the last entry in the snapshot.
+* @throws string If the snapshot can not be written.
+*/
+void Store::writeSnapshot(const string& content, uint64_t seq){
+    replaceFile(m_snapshotPath, content);
+    generalLogger.log("INFO", "Saved the state up to entry " + to_string(seq) + " to a snapshot of " + to_string(content.size()) + " bytes!!");
+}
+
+/**
+* @brief Replaces the write-ahead log by the entries that follow the snapshot.
+* @param seq Sequence number of the last entry in the snapshot.
+* @param commands Commands of the entries after seq, in log order.
+* @throws string If the log can not be written.
+*/
+void Store::restartWal(uint64_t seq, const vector<string>& commands){
+    //: Until the rename the old log is loaded, its entries up to seq are skipped as they are in the snapshot
+    string records;
+    for(size_t i = 0; i < commands.size(); i++) records += giveRecord(seq + i + 1, commands[i]);
+    replaceFile(m_walPath, records);
+    openWal(false);
+    m_walEntries = commands.size();
+}
+
+/**
+* @brief Gives the snapshot of the state, e.g. for a follower too far behind the log.
+* @param seq Sequence number of the last entry applied to the state.
+* @return The bytes of the snapshot.
+* @note Expects no command to change the state meanwhile.
+*/
+string Store::giveSnapshot(uint64_t seq){
+    Users& users = Users::getInstance();
+    Groups& groups = Groups::getInstance();
+
+    //: Snapshot is "P2P_SNAPSHOT" Seq Users Sessions RevokedTokens Groups SHA-256, numbers and strings as by putNumber() and putString()
+    string out = "P2P_SNAPSHOT";
+    putNumber(out, seq);
+    {
+        lock_guard <mutex> guard(users.m_usersMutex);
+        putNumber(out, users.m_users.size());
+        for(auto& it : users.m_users){
+            putString(out, it.second.m_userName);
+            putString(out, it.second.m_password);
+        }
+    }
+    {
+        shared_lock <shared_mutex> guard(Users::m_userToIpMutex);
+        putNumber(out, Users::m_userToIp.size());
+        for(auto& it : Users::m_userToIp){
+            putString(out, it.first);
+            putString(out, it.second);
+        }
+    }
+    {
+        //: Logged out tokens stay refused after a restart, the cache of validated ones is rebuilt on use
+        shared_lock <shared_mutex> guard(Utils::m_sessionsMutex);
+        putNumber(out, Utils::m_revokedTokens.size());
+        for(auto& it : Utils::m_revokedTokens){
+            putString(out, it.first);
+            putNumber(out, it.second);
+        }
+    }
+
+    //: Groups are locked one at a time outside the map lock, see Groups::leaveGroup
+    vector<shared_ptr<Group>> groupPtrs;
+    {
+        shared_lock <TimedMutex<shared_mutex>> guard(groups.m_groupsMutex);
+        for(auto& it : groups.m_groups) groupPtrs.push_back(it.second);
+    }
+    putNumber(out, groupPtrs.size());
+    for(auto& groupPtr : groupPtrs){
+        shared_lock <TimedMutex<shared_mutex>> guard(groupPtr->m_groupMutex);
+        Group& group = *groupPtr;
+        putString(out, group.m_groupName);
+        putNumber(out, group.m_participants.size());
+        for(auto& it : group.m_participants) putString(out, it);
+        putNumber(out, group.m_pendingJoins.size());
+        for(auto& it : group.m_pendingJoins) putString(out, it);
+
+        putNumber(out, group.m_files.size());
+        for(auto& it : group.m_files){
+            File& file = it.second;
+            putString(out, file.m_fileName);
+            putString(out, *file.m_digests);
+            putNumber(out, file.m_size);
+            putNumber(out, file.m_pieceSize);
+            putNumber(out, file.m_userNames.size());
+            for(auto& userName : file.m_userNames) putString(out, userName);
+
+            //: Pieces held by users still downloading are packed 8 to a byte
+            putNumber(out, file.m_partialPieces.size());
+            for(auto& partial : file.m_partialPieces){
+                putString(out, partial.first);
+                const vector<bool>& heldPieces = partial.second.m_pieces;
+                putNumber(out, heldPieces.size());
+                string pieceBytes((heldPieces.size() + 7) / 8, '\0');
+                for(size_t i = 0; i < heldPieces.size(); i++){
+                    if(heldPieces[i]) pieceBytes[i / 8] |= (char)(0x80 >> (i % 8));
+                }
+                out += pieceBytes;
+            }
+        }
+    }
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)out.data(), out.size(), digest);
+    out.append((const char*)digest, SHA256_DIGEST_LENGTH);
+    return out;
+}
+
+/**
+* @brief Replaces the state by a snapshot, the subscriptions of the groups are kept.
+* @param data The bytes of the snapshot.
+* @param length Number of bytes.
+* @return Sequence number of the last entry in the snapshot.
+* @throws string If the snapshot is damaged, the state is then left as it was.
+*/
+uint64_t Store::installSnapshot(const char* data, size_t length){
+    const string magic = "P2P_SNAPSHOT";
+    if(length < magic.size() + SHA256_DIGEST_LENGTH || string(data, magic.size()) != magic){
+        throw string("Snapshot is damaged!!");
+    }
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)data, length - SHA256_DIGEST_LENGTH, digest);
+    if(memcmp(digest, data + length - SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH) != 0){
+        throw string("Snapshot is damaged!!");
+    }
+
+    //: Everything is parsed before the state is touched, a damaged snapshot changes nothing
+    Reader reader = {data + magic.size(), data + length - SHA256_DIGEST_LENGTH};
+    uint64_t seq = reader.takeNumber();
+
+    unordered_map<string, User> userMap;
+    for(uint64_t i = reader.takeNumber(); i > 0; i--){
+        string userName = reader.takeString();
+        string password = reader.takeString();
+        userMap[userName] = User(userName, password);
+    }
+    unordered_map<string, string> userToIp;
+    for(uint64_t i = reader.takeNumber(); i > 0; i--){
+        string userName = reader.takeString();
+        userToIp[userName] = reader.takeString();
+    }
+    unordered_map<string, time_t> revokedTokens;
+    for(uint64_t i = reader.takeNumber(); i > 0; i--){
+        string token = reader.takeString();
+        revokedTokens[token] = (time_t)reader.takeNumber();
+    }
+
+    unordered_map<string, shared_ptr<Group>> groupMap;
+    for(uint64_t i = reader.takeNumber(); i > 0; i--){
+        string groupName = reader.takeString();
+        vector<string> participants;
+        for(uint64_t j = reader.takeNumber(); j > 0; j--) participants.push_back(reader.takeString());
+        if(participants.empty()) throw string("Snapshot is damaged!!");
+
+        shared_ptr<Group> groupPtr(new Group(groupName, participants));
+        for(uint64_t j = reader.takeNumber(); j > 0; j--) groupPtr->m_pendingJoins.insert(reader.takeString());
+
+        for(uint64_t j = reader.takeNumber(); j > 0; j--){
+            string fileName = reader.takeString();
+            string digests = reader.takeString();
+            long long size = (long long)reader.takeNumber();
+            int pieceSize = (int)reader.takeNumber();
+            if(digests.size() != 2 * SHA256_DIGEST_LENGTH || size < 0 || pieceSize < MIN_PIECE_SIZE || pieceSize > MAX_PIECE_SIZE){
+                throw string("Snapshot is damaged!!");
+            }
+            unordered_set<string> userNames;
+            for(uint64_t k = reader.takeNumber(); k > 0; k--) userNames.insert(reader.takeString());
+
+            File file(fileName, make_shared<const string>(move(digests)), size, pieceSize, move(userNames));
+            for(uint64_t k = reader.takeNumber(); k > 0; k--){
+                string userName = reader.takeString();
+                uint64_t numPieces = reader.takeNumber();
+                if(numPieces > (uint64_t)(reader.m_end - reader.m_next) * 8) throw string("Snapshot is damaged!!");
+                File::PartialPieces& partial = file.m_partialPieces[userName];
+                partial.m_pieces.resize(numPieces, false);
+                for(uint64_t piece = 0; piece < numPieces; piece++){
+                    partial.m_pieces[piece] = ((unsigned char)reader.m_next[piece / 8] >> (7 - piece % 8)) & 1;
+                    partial.m_heldPieces += partial.m_pieces[piece];
+                }
+                reader.m_next += (numPieces + 7) / 8;
+            }
+            groupPtr->m_files[fileName] = move(file);
+        }
+        groupMap[groupName] = groupPtr;
+    }
+    if(reader.m_next != reader.m_end) throw string("Snapshot is damaged!!");
+
+    Users& users = Users::getInstance();
+    Groups& groups = Groups::getInstance();
+    {
+        lock_guard <mutex> guard(users.m_usersMutex);
+        users.m_users.swap(userMap);
+    }
+    {
+        unique_lock <shared_mutex> guard(Users::m_userToIpMutex);
+        Users::m_userToIp.swap(userToIp);
+    }
+    {
+        unique_lock <shared_mutex> guard(Utils::m_sessionsMutex);
+        Utils::m_revokedTokens.swap(revokedTokens);
+        Utils::m_sessions.clear();
+    }
+    {
+        unique_lock <TimedMutex<shared_mutex>> guard(groups.m_groupsMutex);
+        groups.m_groups.swap(groupMap);
+    }
+
+    //: Commands still holding a replaced group fail as if it was removed, its subscribers move to the new one
+    for(auto& it : groupMap){
+        unique_lock <TimedMutex<shared_mutex>> oldGuard(it.second->m_groupMutex);
+        it.second->m_isRemoved = true;
+
+        shared_ptr<Group> newGroupPtr;
+        {
+            shared_lock <TimedMutex<shared_mutex>> guard(groups.m_groupsMutex);
+            auto newGroup = groups.m_groups.find(it.first);
+            if(newGroup != groups.m_groups.end()) newGroupPtr = newGroup->second;
+        }
+        if(!newGroupPtr) continue;
+
+        //: No other thread holds two group locks, so taking the second one cannot deadlock
+        unique_lock <TimedMutex<shared_mutex>> newGuard(newGroupPtr->m_groupMutex);
+        for(auto& subscriber : it.second->m_subscribers){
+            if(newGroupPtr->m_members.count(subscriber.second.m_userName)) newGroupPtr->m_subscribers[subscriber.first] = subscriber.second;
+        }
+    }
+    return seq;
+}
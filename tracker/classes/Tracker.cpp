@@ -10,63 +10,109 @@ void Tracker::init(){
 }
 
 void Tracker::start(){
-    thread t(&Tracker::acceptConnections, this);
-    t.detach();
+    //: Changes of groups reach the connections subscribed to them without a command
+    m_groups.setPusher([this](uint64_t connectionId, const string& notification) {
+        return m_eventLoop.push(connectionId, notification);
+    });
+
+    //: Commands of the log carry no connection, subscriptions are never replicated
+    //: The saved state is loaded before the first command of a client is read
+    m_replicator.start([this](const string& command) {
+        return applyCommand(command, 0);
+    }, [this](uint64_t connectionId, const string& payload, uint8_t opcode) {
+        return m_eventLoop.push(connectionId, payload, opcode);
+    });
+
+    m_eventLoop.start(m_trackerSocket.giveSocketFd(), [this](Connection& connection, const FrameHeader& header, string& receivedData) {
+        handleLeecher(connection, header, receivedData);
+    });
 }
 
 void Tracker::stop(){
+    m_replicator.stop();
+    m_eventLoop.stop();
     m_trackerSocket.closeSocket();
 }
 
-void Tracker::acceptConnections(){
-    while(true){
-        try{
-            int leecherSocketFd = m_trackerSocket.acceptSocket();
-            cout << "Connection established with FD of " + to_string(leecherSocketFd) + "\n" << flush;
-            m_logger.log("INFO", "Connection established with FD of " + to_string(leecherSocketFd));
-            
-            thread t1(&Tracker::handleLeecher, this, leecherSocketFd);
-            t1.detach();
-        }
-        catch(const string& e){
-            m_logger.log("ERROR", e);
-        }
+void Tracker::handleLeecher(Connection& connection, const FrameHeader& header, string& receivedData){
+    //: Other trackers electing the primary or following this one
+    if(header.m_opcode == OPCODE_REPLICATE){
+        m_replicator.handlePeer(connection, receivedData);
+        return;
     }
+
+    if (Logger::isEnabled("COMMAND")) {
+        m_logger.log("COMMAND", "LeecherSocket = " + to_string(connection.m_fd) + " | Recieved from leecher : " + receivedData);
+    }
+    
+    optional<string> response;
+    uint8_t status = STATUS_SUCCESS;
+    bool isBatch = (header.m_opcode == OPCODE_BATCH);
+    auto startTime = chrono::steady_clock::now();
+
+    try{
+        response = isBatch ? executeBatch(receivedData, connection.m_id) : executeCommand(receivedData, connection.m_id);
+    }
+    catch(const string& e){
+        response = e;
+        status = STATUS_ERROR;
+    }
+    Metrics::getInstance().recordCommand(isBatch ? "batch" : receivedData.substr(0, receivedData.find(' ')), chrono::steady_clock::now() - startTime);
+    
+    //: A write waiting for the other trackers is answered by the replicator once they applied it
+    if(response) connection.queueFrame(*response, isBatch ? OPCODE_BATCH : OPCODE_RESPONSE, status);
 }
 
-void Tracker::handleLeecher(int leecherSocketFd){
-    while (true) {
+optional<string> Tracker::executeCommand(string command, uint64_t connectionId){
+    vector <string> tokens = Utils::tokenize(command, ' ');
+    if(tokens.size() < 1) throw string("Invalid command!!");
+
+    //: Changes of users, groups and files are applied by the primary, which passes them on to the other trackers
+    if(Replicator::isWrite(Replicator::giveCommandName(command))) return m_replicator.write(command, connectionId);
+    return applyCommand(command, connectionId);
+}
+
+optional<string> Tracker::executeBatch(string batch, uint64_t connectionId){
+    //: Commands are "Command_1 \n Command_2 \n ... Command_N", each gets its own status in the reply
+    vector <string> commands = Utils::tokenize(batch, '\n');
+    if(commands.empty() || commands.size() > MAX_BATCH_COMMANDS) {
+        throw string("Batch must hold 1 to " + to_string(MAX_BATCH_COMMANDS) + " commands!!");
+    }
+
+    vector <pair<uint8_t, string>> replies;
+    uint64_t lastSeq = 0;
+    for(size_t i = 0; i < commands.size();){
+        //: Consecutive writes take the log lock once, a follower forwards them to the primary in one frame
+        vector <string> writes;
+        while(i < commands.size() && Replicator::isWrite(Replicator::giveCommandName(commands[i]))) writes.push_back(commands[i++]);
+        if(!writes.empty()){
+            for(auto& it : m_replicator.writeMany(writes, lastSeq)) replies.push_back(move(it));
+            continue;
+        }
+
+        //: Reads see the writes before them, a forwarded write is answered once every tracker keeping up applied it
         try{
-            string receivedData = m_trackerSocket.recvSocket(leecherSocketFd);
-
-            if(receivedData == "") {
-                m_logger.log("INFO", "LeecherSocket = " + to_string(leecherSocketFd) + " | Leecher closed the connection!!");
-                break;
-            }
-            m_logger.log("COMMAND", "LeecherSocket = " + to_string(leecherSocketFd) + " | Recieved from leecher : " + receivedData);
-            
-            string response = "";
-            try{
-                response = "Success: " + executeCommand(receivedData);
-            }
-            catch(const string& e){
-                response = "Error: " + e;
-            }
-            
-            m_trackerSocket.sendSocket(leecherSocketFd, response);
+            replies.push_back({STATUS_SUCCESS, applyCommand(commands[i], connectionId)});
         }
         catch(const string& e){
-            m_logger.log("ERROR", "LeecherSocket = " + to_string(leecherSocketFd) + " | While handling leecher!! Error: " + e);
+            replies.push_back({STATUS_ERROR, e});
         }
+        i++;
     }
+    return m_replicator.answerAfter(lastSeq, connectionId, Utils::packReplies(replies), OPCODE_BATCH);
 }
 
-string Tracker::executeCommand(string command){
+string Tracker::applyCommand(string command, uint64_t connectionId){
     if(command == "") throw string("Invalid command!!");
     vector <string> tokens = Utils::tokenize(command, ' ');
     
     if(tokens.size() < 1) throw string("Invalid command!!");
 
+    if(tokens[0] == "stats"){
+        if(tokens.size() != 1) throw string("Invalid arguments to stats command!!");
+        return "tracker " + m_trackerIp + ":" + to_string(m_trackerPort) + "\n" + Metrics::getInstance().describe();
+    }
+
     if(tokens[0] == "create_user"){
         if(tokens.size() != 3) throw string("Invalid arguments to create_user command!!");
         
@@ -129,13 +175,14 @@ string Tracker::executeCommand(string command){
     }
 
     if(tokens[0] == "upload_file"){
-        if(tokens.size() != 6) throw string("Invalid arguments to upload_file command!!");
+        if(tokens.size() != 7) throw string("Invalid arguments to upload_file command!!");
         string fileName = tokens[1];
         string groupName = tokens[2];
         string fileSize = tokens[3];
-        string SHAs = tokens[4];
-        string authToken = tokens[5];
-        return m_groups.uploadFile(fileName, groupName, fileSize, SHAs, authToken);
+        string pieceSize = tokens[4];
+        string SHAs = tokens[5];
+        string authToken = tokens[6];
+        return m_groups.uploadFile(fileName, groupName, fileSize, pieceSize, SHAs, authToken);
     }
 
     if(tokens[0] == "download_file"){
@@ -154,6 +201,15 @@ string Tracker::executeCommand(string command){
         return m_groups.stopShare(groupName, fileName, authToken);
     }
     
+    if(tokens[0] == "have"){
+        if(tokens.size() != 5) throw string("Invalid arguments to have command!!");
+        string groupName = tokens[1];
+        string fileName = tokens[2];
+        string pieces = tokens[3];
+        string authToken = tokens[4];
+        return m_groups.havePieces(groupName, fileName, pieces, authToken);
+    }
+    
     if(tokens[0] == "leave_group"){
         if(tokens.size() != 3) throw string("Invalid arguments to leave_group command!!");
         string groupName = tokens[1];
@@ -161,6 +217,16 @@ string Tracker::executeCommand(string command){
         return m_groups.leaveGroup(groupName, authToken);
     }
 
+    if(tokens[0] == "subscribe" || tokens[0] == "unsubscribe"){
+        //: File name is optional, without it every file of the group is subscribed
+        if(tokens.size() != 3 && tokens.size() != 4) throw string("Invalid arguments to " + tokens[0] + " command!!");
+        string groupName = tokens[1];
+        string fileName = (tokens.size() == 4) ? tokens[2] : "";
+        string authToken = tokens.back();
+        if(tokens[0] == "subscribe") return m_groups.subscribe(groupName, fileName, authToken, connectionId);
+        return m_groups.unsubscribe(groupName, fileName, authToken, connectionId);
+    }
+
     if(tokens[0] == "logout"){
         if(tokens.size() != 2) throw string("Invalid arguments to logout command!!");
         string authToken = tokens[1];
@@ -14,10 +14,10 @@
 //         static Users* instance;
 
 //         mutex m_usersMutex;
-//         mutex m_userToIpMutex;
+//         static shared_mutex m_userToIpMutex;
 
 //         unordered_map<string, User> m_users;
-//         unordered_map<string, string> m_userToIp;
+//         static unordered_map<string, string> m_userToIp;
 
 //     public:
 //         static Users& getInstance() {
@@ -30,7 +30,7 @@
 //         string logoutUser(string authToken);
 // };
 
-mutex Users::m_userToIpMutex;
+shared_mutex Users::m_userToIpMutex;
 unordered_map<string, string> Users::m_userToIp;
 
 string Users::addUser(string userName, string password){
@@ -60,17 +60,23 @@ string Users::loginUser(string userName, string password, string seederIpPort){
     }
 
     //: Saving IP & Port of loggedin User
+    bool isNewSession;
     {
-        lock_guard <mutex> guard(m_userToIpMutex);
+        unique_lock <shared_mutex> guard(m_userToIpMutex);
         
         //: Ensure that user not already logged in from other place
-        if(m_userToIp.count(userName)) {
+        //: A client restarted after a crash comes back at the same IP:Port and takes over its old session
+        if(m_userToIp.count(userName) && m_userToIp[userName] != seederIpPort) {
             throw string("Session already exist!! Logout from current session first!!");
         }
 
         //: Add IP:Port in Users.m_userToIp[] map
+        isNewSession = !m_userToIp.count(userName);
         m_userToIp[userName] = seederIpPort;
     }
+
+    //: Files shared by the user have a sharer again, sent after the session lock is released since groups are locked first
+    if(isNewSession) Groups::getInstance().notifySession(userName, seederIpPort, true);
     //: Generate authToken
     string payload = userName;
     string authToken = Utils::generateToken(payload);
@@ -82,9 +88,20 @@ string Users::logoutUser(string authToken){
     //: Validate that user is logged in
     string userName = Utils::validateToken(authToken);
 
+    //: Token can not be used by any later command
+    Utils::revokeToken(authToken);
+
     //: Remove entry of {userName, IP:Port} form "Users.m_userToIp"
-    lock_guard <mutex> guard(m_userToIpMutex);
-    m_userToIp.erase(userName);
+    string seederIpPort;
+    {
+        unique_lock <shared_mutex> guard(m_userToIpMutex);
+        auto it = m_userToIp.find(userName);
+        if(it == m_userToIp.end()) return string("User logged out successfully!!");
+        seederIpPort = it->second;
+        m_userToIp.erase(it);
+    }
+
+    Groups::getInstance().notifySession(userName, seederIpPort, false);
 
     return string("User logged out successfully!!");
 }
\ No newline at end of file
@@ -4,17 +4,33 @@
 // class Utils {
 //     friend class Users;   
 //     friend class Groups;  
+//     friend class Replicator;
 
 //     private:
+//         static shared_mutex m_sessionsMutex;
+//         static unordered_map<string, pair<string, time_t>> m_sessions;
+//         static unordered_map<string, time_t> m_revokedTokens;
+//         static thread_local bool m_isReplaying;
+
+//         string signToken(const string& message);
+//         void pruneSessionsLocked();
 //         string generateToken(string payload);
 //         string validateToken(string token);
+//         void revokeToken(string token);
 
 //     public:
-//         pair<string, int> processArgs(int argc, char* argv[]);
+//         int processArgs(int argc, char* argv[], vector<pair<string, int>>& trackers);
 //         vector<string> tokenize(string buffer, char separator);
+//         string packReplies(const vector<pair<uint8_t, string>>& replies);
+//         vector<pair<uint8_t, string>> unpackReplies(const string& payload);
 // };
 
-pair <string, int> Utils::processArgs(int argc, char *argv[]){
+shared_mutex Utils::m_sessionsMutex;
+unordered_map<string, pair<string, time_t>> Utils::m_sessions;
+unordered_map<string, time_t> Utils::m_revokedTokens;
+thread_local bool Utils::m_isReplaying = false;
+
+int Utils::processArgs(int argc, char *argv[], vector<pair<string, int>>& trackers){
     if(argc != 3){
         throw string("Invalid arguments!!");
     }
@@ -33,26 +49,26 @@ pair <string, int> Utils::processArgs(int argc, char *argv[]){
 
     char buffer[524288];
     int bytesRead = read(fd, buffer, sizeof(buffer));
+    close(fd);
     if(bytesRead <= 0){
         string s = trackerInfoFileName;
         throw string("Reading " + s + " file!!");
     }
 
-    vector <string> ipAndPorts = tokenize(buffer, '\n');
+    //: Every tracker of the file is replicated to, not only this one
+    vector <string> ipAndPorts = tokenize(string(buffer, bytesRead), '\n');
     if((int)ipAndPorts.size() < trackerNumber) {
         throw string("IP and port of tracker number " + to_string(trackerNumber) + " is not defined in file!!");
     }
 
-    string ipAndPort = ipAndPorts[trackerNumber-1];
-
-    vector <string> temp = tokenize(ipAndPort, ':');
-    if((int)temp.size() != 2){
-        throw string("Invalid format of ip:port of tracker number " + to_string(trackerNumber) + "!!");
+    for(size_t i = 0; i < ipAndPorts.size(); i++){
+        vector <string> temp = tokenize(ipAndPorts[i], ':');
+        if((int)temp.size() != 2){
+            throw string("Invalid format of ip:port of tracker number " + to_string(i + 1) + "!!");
+        }
+        trackers.push_back({temp[0], stoi(temp[1])});
     }
-
-    string trackerIp = temp[0];
-    int trackerPort = stoi(temp[1]);
-    return {trackerIp, trackerPort};
+    return trackerNumber;
 }
 
 vector <string> Utils::tokenize(string buffer, char separator){
@@ -69,30 +85,95 @@ vector <string> Utils::tokenize(string buffer, char separator){
     return ans;
 }
 
-string Utils::generateToken(string payload) {
+string Utils::packReplies(const vector<pair<uint8_t, string>>& replies){
+    //: Reply is "Status <space> Length \n Response", responses may hold '\n' themselves
+    string payload;
+    for(auto& it : replies){
+        payload += to_string(it.first) + " " + to_string(it.second.size()) + "\n";
+        payload += it.second;
+    }
+    return payload;
+}
+
+vector <pair<uint8_t, string>> Utils::unpackReplies(const string& payload){
+    vector <pair<uint8_t, string>> replies;
+    size_t offset = 0;
+    while(offset < payload.size()){
+        size_t lineEnd = payload.find('\n', offset);
+        if(lineEnd == string::npos) throw string("Invalid replies of batch!!");
+        vector <string> tokens = tokenize(payload.substr(offset, lineEnd - offset), ' ');
+        if(tokens.size() != 2 || (tokens[0] != to_string(STATUS_SUCCESS) && tokens[0] != to_string(STATUS_ERROR)) || tokens[1].find_first_not_of("0123456789") != string::npos) throw string("Invalid replies of batch!!");
+
+        size_t length = stoull(tokens[1]);
+        if(length > payload.size() - lineEnd - 1) throw string("Invalid replies of batch!!");
+        replies.push_back({(uint8_t)stoi(tokens[0]), payload.substr(lineEnd + 1, length)});
+        offset = lineEnd + 1 + length;
+    }
+    return replies;
+}
+
+string Utils::signToken(const string& message) {
     string secret_key = SECRET_KEY;
+
+    // Generate HMAC-SHA256 signature
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+    HMAC(EVP_sha256(), secret_key.c_str(), secret_key.length(),
+         (unsigned char*)message.c_str(), message.length(), digest, &digestLength);
+
+    // Convert to hexadecimal string
+    return toHex((const char*)digest, digestLength);
+}
+
+void Utils::pruneSessionsLocked() {
+    //: Expects m_sessionsMutex to be held exclusively
+    time_t currentTime = time(nullptr);
+    for(auto it = m_sessions.begin(); it != m_sessions.end();) {
+        if(currentTime > it->second.second) it = m_sessions.erase(it);
+        else it++;
+    }
+    for(auto it = m_revokedTokens.begin(); it != m_revokedTokens.end();) {
+        if(currentTime > it->second) it = m_revokedTokens.erase(it);
+        else it++;
+    }
+}
+
+string Utils::generateToken(string payload) {
     // Get current time and calculate expiry time
     time_t currentTime = time(nullptr);
     time_t expiryTime = currentTime + TOKEN_EXPIRY_DURATION;
     
     string message = payload + ":" + to_string(expiryTime);
 
-    // Generate HMAC-SHA256 signature
-    unsigned char* digest;
-    digest = HMAC(EVP_sha256(), secret_key.c_str(), secret_key.length(),
-                  (unsigned char*)message.c_str(), message.length(), nullptr, nullptr);
-
-    // Convert to hexadecimal string
-    char mdString[SHA256_DIGEST_LENGTH*2+1];
-    for(int i = 0; i < SHA256_DIGEST_LENGTH; i++)
-        sprintf(&mdString[i*2], "%02x", (unsigned int)digest[i]);
-
     // Return the token: payload:expiry_time:signature
-    return message + ":" + string(mdString);
+    string token = message + ":" + signToken(message);
+
+    //: Commands of this session are validated without the HMAC
+    unique_lock <shared_mutex> guard(m_sessionsMutex);
+    if(m_sessions.size() >= MAX_CACHED_SESSIONS) pruneSessionsLocked();
+    if(m_sessions.size() < MAX_CACHED_SESSIONS) m_sessions[token] = {payload, expiryTime};
+    return token;
 }
 
 string Utils::validateToken(string token) {
-    string secret_key = SECRET_KEY;
+    //: Commands of the log were validated by the primary, their tokens may have expired or been revoked since
+    if(m_isReplaying) {
+        vector <string> tokens = tokenize(token, ':');
+        if(tokens.size() != 3) throw string("Authentication failed!! Invalid token!!");
+        return tokens[0];
+    }
+
+    //: Every command carries the token, a token seen before only needs a lookup
+    {
+        shared_lock <shared_mutex> guard(m_sessionsMutex);
+        auto it = m_sessions.find(token);
+        if(it != m_sessions.end()) {
+            if(time(nullptr) > it->second.second) throw string("Authentication failed!! Token expired!!");
+            return it->second.first;
+        }
+        if(m_revokedTokens.count(token)) throw string("Authentication failed!! Session logged out!!");
+    }
+
     vector <string> tokens = tokenize(token, ':');
     if(tokens.size() != 3) throw string("Authentication failed!! Invalid token!!");
     
@@ -101,22 +182,66 @@ string Utils::validateToken(string token) {
     string signature = tokens[2];
     string payloadExpiry = payload + ":" + to_string(expiryTime);
 
-    // Regenerate the HMAC-SHA256 signature
-    unsigned char* digest;
-    digest = HMAC(EVP_sha256(), secret_key.c_str(), secret_key.length(),
-                  (unsigned char*)payloadExpiry.c_str(), payloadExpiry.length(), nullptr, nullptr);
-
-    // Convert to hexadecimal string
-    char mdString[SHA256_DIGEST_LENGTH*2+1];
-    for(int i = 0; i < SHA256_DIGEST_LENGTH; i++)
-        sprintf(&mdString[i*2], "%02x", (unsigned int)digest[i]);
-
     // Validate the signature
-    if(signature != string(mdString)) throw string("Authentication failed!! Invalid signature!!");
+    if(signature != signToken(payloadExpiry)) throw string("Authentication failed!! Invalid signature!!");
 
     // Check if the token is expired
     time_t currentTime = time(nullptr);
     if (currentTime > expiryTime) throw string("Authentication failed!! Token expired!!");
 
+    //: Only tokens with a valid signature are remembered, so the cache can not be filled with forged ones
+    unique_lock <shared_mutex> guard(m_sessionsMutex);
+    if(m_revokedTokens.count(token)) throw string("Authentication failed!! Session logged out!!");
+    if(m_sessions.size() >= MAX_CACHED_SESSIONS) pruneSessionsLocked();
+    if(m_sessions.size() < MAX_CACHED_SESSIONS) m_sessions[token] = {payload, expiryTime};
     return payload;
-}
\ No newline at end of file
+}
+
+void Utils::revokeToken(string token) {
+    //: Token is kept as revoked until it expires, its signature stays valid until then
+    unique_lock <shared_mutex> guard(m_sessionsMutex);
+    vector <string> tokens = tokenize(token, ':');
+    time_t expiryTime = (tokens.size() == 3) ? stol(tokens[1]) : time(nullptr) + TOKEN_EXPIRY_DURATION;
+    m_sessions.erase(token);
+    if(m_revokedTokens.size() >= MAX_CACHED_SESSIONS) pruneSessionsLocked();
+    m_revokedTokens[token] = expiryTime;
+}
+
+string Utils::hashPassword(const string& userName, const string& password){
+    //: Salted with the user name, equal passwords of two users give different hashes
+    string salt = "p2p:" + userName;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    if(!PKCS5_PBKDF2_HMAC(password.c_str(), password.size(), (const unsigned char*)salt.c_str(), salt.size(), PASSWORD_HASH_ITERATIONS, EVP_sha256(), sizeof(hash), hash)){
+        throw string("Hashing password!!");
+    }
+    return toHex((const char*)hash, sizeof(hash));
+}
+
+string Utils::fromHex(string hex){
+    if(hex.size() % 2) throw string("Invalid hex string!!");
+
+    string bytes(hex.size() / 2, '\0');
+    for(size_t i = 0; i < bytes.size(); i++){
+        int value = 0;
+        for(int j = 0; j < 2; j++){
+            char c = hex[2 * i + j];
+            value <<= 4;
+            if(c >= '0' && c <= '9') value |= c - '0';
+            else if(c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+            else if(c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+            else throw string("Invalid hex string!!");
+        }
+        bytes[i] = (char)value;
+    }
+    return bytes;
+}
+
+string Utils::toHex(const char* bytes, size_t length){
+    static const char hexDigits[] = "0123456789abcdef";
+    string hex(2 * length, '0');
+    for(size_t i = 0; i < length; i++){
+        hex[2 * i] = hexDigits[(unsigned char)bytes[i] >> 4];
+        hex[2 * i + 1] = hexDigits[(unsigned char)bytes[i] & 0x0F];
+    }
+    return hex;
+}
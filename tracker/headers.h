@@ -6,19 +6,80 @@
 #include <unordered_map>        // For unordered_map
 #include <unordered_set>        // For unordered_set
 #include <mutex>                // For mutex
+#include <shared_mutex>         // For shared_mutex of groups and sessions
+#include <memory>               // For shared_ptr
+#include <optional>             // For responses of writes sent later
+#include <set>                  // For set
+#include <map>                  // For map of metrics
+#include <cmath>                // For ceil() of percentiles
+#include <deque>                // For deque of queued output
+#include <queue>                // For queue
+#include <atomic>               // For atomic
+#include <condition_variable>   // For condition_variable
+#include <functional>           // For function <void()>
+#include <type_traits>          // For the callables stored in pool tasks
+#include <new>                  // For placement new of pool tasks
+#include <cstddef>              // For max_align_t
+#include <ctime>                // For timestamps of log lines
+#include <climits>              // For IOV_MAX
+#include <chrono>               // For the flush interval of logs
+#include <cstdint>              // For fixed width integers of frame header
 #include <arpa/inet.h>          // For socket programming
+#include <sys/uio.h>            // For iovec
 #include <fcntl.h>              // For open()
 #include <unistd.h>             // For read(), write(), close()
 #include <sys/stat.h>           // For stat()
+#include <sys/mman.h>           // For mmap() of snapshots
+#include <sys/epoll.h>          // For epoll
+#include <sys/eventfd.h>        // For eventfd to wake the event loop
+#include <poll.h>               // For poll() of connections to other trackers
 #include <errno.h>              // For errno error checking
 #include <cstring>              // For strerror
+#include <strings.h>            // For strcasecmp() of log types
 #include <openssl/hmac.h>       // For HMAC operations
 #include <openssl/sha.h>        // For SHA hashing
+#include <openssl/evp.h>        // For PBKDF2 hashes of passwords
 
 
 #define TOKEN_EXPIRY_DURATION 36000         /// Token expiry duration in seconds (10 hour)
 #define SECRET_KEY "chin_tapak_dum_dum"     /// Secret key for HMAC operations
-#define PIECE_SIZE 1024                     /// Piece size for file chunking (in bytes)
+#define PASSWORD_HASH_ITERATIONS 4096       /// PBKDF2 rounds of the hash a password is replaced with before it is applied, logged and saved
+#define MAX_CACHED_SESSIONS 65536           /// Validated tokens remembered, commands with a remembered token skip the HMAC
+#define MIN_PIECE_SIZE 262144               /// Smallest piece size a file can be split into (256 KiB)
+#define MAX_PIECE_SIZE 4194304              /// Largest piece size a file can be split into (4 MiB)
+
+#define OPCODE_COMMAND 1                    /// Frame carries a text command
+#define OPCODE_RESPONSE 2                   /// Frame carries the response to a command
+#define OPCODE_NOTIFY 4                     /// Frame carries a change of a subscribed group, sent without a command
+#define OPCODE_REPLICATE 5                  /// Frame exchanged between trackers to elect the primary and stream the replication log
+#define OPCODE_BATCH 6                      /// Frame carries commands separated by '\n', answered by one frame of their responses in order
+#define STATUS_SUCCESS 0                    /// Command executed successfully
+#define STATUS_ERROR 1                      /// Command failed, payload is the error message
+#define MAX_FRAME_LENGTH 67108864           /// Largest payload accepted in a single frame (64 MiB)
+#define MAX_BATCH_COMMANDS 1024             /// Commands accepted in a single batch frame
+#define EVENT_LOOP_WORKERS 8                /// Worker threads handling the frames of all connections
+#define MAX_EPOLL_EVENTS 256                /// Events fetched by one epoll_wait() call
+#define READ_CHUNK_SIZE 65536               /// Bytes read from a connection by one recv() call
+#define MAX_READ_PER_EVENT 1048576          /// Bytes read from a connection before its frames are handled
+#define MAX_PUSHED_FRAMES 4096              /// Frames pushed to a connection and not sent yet, a connection falling further behind is closed
+#define LOG_LEVEL_COMMAND 0                 /// Level of "COMMAND" lines, every message sent and received
+#define LOG_LEVEL_INFO 1                    /// Level of "INFO" lines and of lines of unknown type
+#define LOG_LEVEL_SUCCESS 2                 /// Level of "SUCCESS" lines
+#define LOG_LEVEL_ERROR 3                   /// Level of "ERROR" lines, written without waiting for the next flush
+#define MIN_LOG_LEVEL LOG_LEVEL_COMMAND     /// Lines below this level are dropped before anything is formatted, P2P_LOG_LEVEL raises it at runtime
+#define LOG_RING_CAPACITY 1024              /// Lines a thread can queue for the log writer before further lines are dropped
+#define LOG_FLUSH_INTERVAL 50               /// Milliseconds between two writes of queued log lines
+#define LOG_MAX_LINE_LENGTH 4096            /// Bytes of a log line kept, longer lines are cut
+#define TASK_INLINE_SIZE 64                 /// Bytes of a callable stored inside a pool task, larger ones are heap allocated
+#define PEER_CONNECT_TIMEOUT 500            /// Milliseconds a tracker waits to connect to another tracker
+#define REPLICATION_TIMEOUT 3000            /// Milliseconds without a frame from the primary after which it is taken as lost
+#define REPLICATION_HEARTBEAT 1000          /// Milliseconds between two heartbeats of the primary to its followers
+#define REPLICATION_ACK_TIMEOUT 2000        /// Milliseconds a write waits for the followers, slower ones lag behind and are not waited for
+#define ELECTION_RETRY_INTERVAL 500         /// Milliseconds between two election rounds while no primary is known
+#define SNAPSHOT_WAL_ENTRIES 100000         /// Entries appended to the write-ahead log before the state is saved to a new snapshot
+#define MAX_REMEMBERED_REQUESTS 65536       /// Responses of writes remembered by request id, a write sent again under its id is answered without being applied twice
+#define WRITE_ORDER_STRIPES 64              /// Locks ordering the writes of the primary, writes on the same user or group take the same one
+#define METRICS_BUCKETS 32                  /// Buckets of a latency histogram, bucket i counts durations below 2^i microseconds
 
 #define RED "\033[31m"
 #define GREEN "\033[32m"
@@ -30,54 +91,598 @@ using namespace std;
 class Utils {
     friend class Users;
     friend class Groups;
+    friend class Replicator;
+    friend class Store;
 
     private:
         Utils() = delete;
 
+        static shared_mutex m_sessionsMutex;
+        static unordered_map<string, pair<string, time_t>> m_sessions;     //: Validated token, {userName, expiryTime}
+        static unordered_map<string, time_t> m_revokedTokens;              //: Logged out token, expiryTime
+        static thread_local bool m_isReplaying;                             //: Set on the thread applying the log of the primary, which validated the tokens already
+
+        static string signToken(const string& message);
+        static void pruneSessionsLocked();
         static string generateToken(string payload);
         static string validateToken(string token);
+        static void revokeToken(string token);
+        static string fromHex(string hex);
+        static string toHex(const char* bytes, size_t length);
 
     public:
-        static pair<string, int> processArgs(int argc, char* argv[]);
+        static int processArgs(int argc, char* argv[], vector<pair<string, int>>& trackers);
         static vector<string> tokenize(string buffer, char separator);
+        static string packReplies(const vector<pair<uint8_t, string>>& replies);
+        static vector<pair<uint8_t, string>> unpackReplies(const string& payload);
+        static string hashPassword(const string& userName, const string& password);
+};
+
+/**
+ * @struct LogFile
+ * @brief An open log file, closed once no logger and no queued line refers to it.
+ */
+struct LogFile {
+    int m_fd{-1}; ///< Descriptor of the file, opened for appending.
+    atomic<uint64_t> m_droppedLines{0}; ///< Lines dropped since the writer last reported it.
+
+    LogFile(int fd) : m_fd(fd) {}
+    ~LogFile() { if (m_fd != -1) close(m_fd); }
+    LogFile(const LogFile&) = delete;
+    LogFile& operator=(const LogFile&) = delete;
+};
+
+/**
+ * @struct LogRecord
+ * @brief A log line queued for the writer, formatted only once it is written.
+ */
+struct LogRecord {
+    shared_ptr<LogFile> m_file; ///< File the line goes to.
+    time_t m_time{0}; ///< Time the line was logged.
+    string m_type; ///< Type of the line, e.g. "ERROR".
+    string m_content; ///< Content of the line.
+};
+
+/**
+ * @class LogRing
+ * @brief Lines queued by one thread, a lock-free ring with the thread as the only producer and the writer as the only consumer.
+ */
+class LogRing {
+    private:
+        vector<LogRecord> m_records; ///< Slots of the ring.
+        atomic<size_t> m_head{0}; ///< Records taken by the writer, only advanced by the writer.
+        atomic<size_t> m_tail{0}; ///< Records queued, only advanced by the owning thread.
+
+    public:
+        atomic<bool> m_isOrphan{false}; ///< Whether the owning thread has exited.
+
+        LogRing() : m_records(LOG_RING_CAPACITY) {}
+        LogRing(const LogRing&) = delete;
+        LogRing& operator=(const LogRing&) = delete;
+
+        /**
+        * @brief Queues a record, called by the owning thread only.
+        * @param record The record.
+        * @return True if it was queued, false if the ring is full.
+        */
+        bool push(LogRecord&& record);
+
+        /**
+        * @brief Takes all queued records, called by the writer only.
+        * @param records Vector the records are appended to.
+        */
+        void drain(vector<LogRecord>& records);
+
+        /**
+        * @brief Checks whether no record is queued.
+        * @return True if the ring is empty.
+        */
+        bool isEmpty() const;
+};
+
+/**
+ * @class LogWriter
+ * @brief Background thread writing the lines of all loggers.
+ * @details Every thread queues its lines in its own LogRing without locking. The writer
+ *          drains all rings every LOG_FLUSH_INTERVAL, or at once for an error, formats the
+ *          lines and writes them with one writev() per file. Lines of a full ring are
+ *          dropped and counted, the count is written to the file instead. The writer lives
+ *          as long as the process and writes what is left when it exits.
+ */
+class LogWriter {
+    private:
+        mutex m_writerMutex; ///< Mutex to protect rings and files, and the writer sleeps on.
+        condition_variable m_wakeUp; ///< Signalled to write before the next interval.
+        bool m_isUrgent{false}; ///< Whether the writer was asked to write at once.
+        bool m_stop{false}; ///< Whether the process is exiting.
+        vector<shared_ptr<LogRing>> m_rings; ///< Rings of all threads that logged.
+        vector<weak_ptr<LogFile>> m_files; ///< Files of all loggers, to report dropped lines.
+        thread m_writer; ///< The writer thread.
+
+        LogWriter();
+
+        /**
+        * @brief Writes the queued lines until the process exits.
+        */
+        void run();
+
+        /**
+        * @brief Takes the lines of all rings and writes them.
+        * @param rings The rings.
+        * @param files The files to report dropped lines of.
+        */
+        void writeQueued(const vector<shared_ptr<LogRing>>& rings, const vector<shared_ptr<LogFile>>& files);
+
+        /**
+        * @brief Writes all queued lines and stops the writer, called when the process exits.
+        */
+        static void flushAtExit();
+
+    public:
+        LogWriter(const LogWriter&) = delete;
+        LogWriter& operator=(const LogWriter&) = delete;
+
+        /**
+        * @brief Gives the writer, starting it on first use.
+        * @return The writer.
+        */
+        static LogWriter& getInstance();
+
+        /**
+        * @brief Gives the ring of the calling thread, registering it on first use.
+        * @return The ring.
+        */
+        LogRing& giveRing();
+
+        /**
+        * @brief Registers a file so that its dropped lines are reported.
+        * @param file The file.
+        */
+        void addFile(const shared_ptr<LogFile>& file);
+
+        /**
+        * @brief Asks the writer to write before the next interval, e.g. for an error.
+        */
+        void wakeUp();
 };
 
 class Logger{
     private: 
-        mutex m_logMutex;
+        static atomic<int> m_runtimeLevel;
 
         string m_seederIp;
         string m_seederPort;
         string m_logDirPath;
         string m_logFilePath;
+        shared_ptr<LogFile> m_logFile;
 
     public:
         Logger() = default;
         
         Logger(string seederIp, int seederPort, string name);
 
-        //: Move constructor (can't move mutex, so leave it default in the moved-from object)
-        Logger(Logger&& other) noexcept {
-            m_seederIp = move(other.m_seederIp);
-            m_seederPort = move(other.m_seederPort);
-            m_logDirPath = move(other.m_logDirPath);
-            m_logFilePath = move(other.m_logFilePath);
+        Logger(Logger&& other) noexcept = default;
+        Logger& operator=(Logger&& other) noexcept = default;
+
+        static int giveLevel(const string& type);
+        static void setLevel(int level);
+        static bool isEnabled(const string& type);
+
+        void log(string type, string content);
+};
+
+/**
+ * @class Histogram
+ * @brief Counts durations in buckets of powers of two microseconds, recorded from any thread without locking.
+ * @details Bucket 0 counts durations below 1 microsecond, bucket i the ones of at least
+ *          2^(i-1) and below 2^i microseconds, the last bucket everything longer.
+ *          Percentiles are given as the upper bound of the bucket they fall into.
+ */
+class Histogram {
+    private:
+        atomic<uint64_t> m_buckets[METRICS_BUCKETS]{}; ///< Durations counted in every bucket.
+        atomic<uint64_t> m_totalMicros{0}; ///< Sum of all durations in microseconds.
+        atomic<uint64_t> m_maxMicros{0}; ///< Longest duration in microseconds.
+
+    public:
+        /**
+        * @brief Records a duration.
+        * @param duration The duration.
+        */
+        void record(chrono::steady_clock::duration duration);
+
+        /**
+        * @brief Describes the durations recorded so far.
+        * @return "count=N mean_us=N p50_us=N p90_us=N p99_us=N max_us=N", only "count=0" if none was recorded.
+        */
+        string describe() const;
+};
+
+/**
+ * @class TimedMutex
+ * @brief A mutex or shared_mutex recording in a histogram how long a lock waited while another thread held it.
+ * @details A lock taken at the first try records nothing, so an uncontended lock costs
+ *          what the plain mutex costs. Works with lock_guard and unique_lock, and with
+ *          shared_lock when the mutex is a shared_mutex.
+ */
+template <typename Mutex>
+class TimedMutex {
+    private:
+        Mutex m_mutex; ///< The mutex.
+        Histogram& m_waits; ///< Histogram of the waits of contended locks.
+
+    public:
+        /**
+        * @brief Creates an unlocked mutex.
+        * @param waits Histogram the waits are recorded in.
+        */
+        explicit TimedMutex(Histogram& waits) : m_waits(waits) {}
+
+        TimedMutex(const TimedMutex&) = delete;
+        TimedMutex& operator=(const TimedMutex&) = delete;
+
+        void lock() {
+            if (m_mutex.try_lock()) return;
+            auto waitStart = chrono::steady_clock::now();
+            m_mutex.lock();
+            m_waits.record(chrono::steady_clock::now() - waitStart);
+        }
+        bool try_lock() { return m_mutex.try_lock(); }
+        void unlock() { m_mutex.unlock(); }
+
+        void lock_shared() {
+            if (m_mutex.try_lock_shared()) return;
+            auto waitStart = chrono::steady_clock::now();
+            m_mutex.lock_shared();
+            m_waits.record(chrono::steady_clock::now() - waitStart);
+        }
+        bool try_lock_shared() { return m_mutex.try_lock_shared(); }
+        void unlock_shared() { m_mutex.unlock_shared(); }
+};
+
+class ThreadPool;
+
+/**
+ * @class Metrics
+ * @brief Counters and histograms of the hot paths of the tracker, given by the "stats" command.
+ * @details Counters are atomics and the histograms of commands and locks are created up
+ *          front, so recording takes no lock. Thread pools add themselves while they exist.
+ */
+class Metrics {
+    private:
+        chrono::steady_clock::time_point m_startTime; ///< Time the metrics were created.
+        map<string, Histogram> m_commandLatencies; ///< Time executeCommand() took by command name, unknown ones under "other".
+        map<string, Histogram> m_lockWaits; ///< Waits of contended locks by lock name.
+        atomic<uint64_t> m_acceptedConnections{0}; ///< Connections accepted.
+        atomic<int64_t> m_openConnections{0}; ///< Connections open now.
+        atomic<uint64_t> m_bytesReceived{0}; ///< Bytes received on all connections.
+        atomic<uint64_t> m_bytesSent{0}; ///< Bytes sent on all connections.
+
+        mutex m_poolsMutex; ///< Mutex to protect pools.
+        vector<const ThreadPool*> m_pools; ///< Thread pools alive now.
+
+        /**
+        * @brief Creates the histograms of all known commands and locks.
+        */
+        Metrics();
+
+        Metrics(const Metrics&) = delete;
+        Metrics& operator=(const Metrics&) = delete;
+
+    public:
+        /**
+        * @brief Gives the metrics of the process.
+        */
+        static Metrics& getInstance() {
+            static Metrics m_instance;
+            return m_instance;
+        }
+
+        /**
+        * @brief Records the time a command took.
+        * @param commandName Name of the command, first word of it.
+        * @param duration The time it took.
+        */
+        void recordCommand(const string& commandName, chrono::steady_clock::duration duration);
+
+        /**
+        * @brief Gives the histogram the waits of a lock are recorded in, see TimedMutex.
+        * @param lockName Name of the lock, one created by the constructor.
+        * @throws out_of_range If the lock is unknown.
+        */
+        Histogram& giveLockWaits(const string& lockName);
+
+        /**
+        * @brief Counts bytes received on a connection.
+        * @param bytes The number of bytes.
+        */
+        void addBytesReceived(size_t bytes);
+
+        /**
+        * @brief Counts bytes sent on a connection.
+        * @param bytes The number of bytes.
+        */
+        void addBytesSent(size_t bytes);
+
+        /**
+        * @brief Counts an accepted connection.
+        */
+        void addConnection();
+
+        /**
+        * @brief Counts a connection that was closed.
+        */
+        void removeConnection();
+
+        /**
+        * @brief Adds a thread pool to the ones described, called by its constructor.
+        * @param pool The pool.
+        */
+        void addPool(const ThreadPool* pool);
+
+        /**
+        * @brief Removes a thread pool, called by its destructor.
+        * @param pool The pool.
+        */
+        void removePool(const ThreadPool* pool);
+
+        /**
+        * @brief Describes everything counted so far.
+        * @return One line per value, "name value" or "name key field=value ...".
+        */
+        string describe();
+};
+
+/**
+ * @class Task
+ * @brief A callable taking no arguments, stored inline when small enough.
+ * @details Callables of up to TASK_INLINE_SIZE bytes, like lambdas capturing a few
+ *          pointers, are kept in the task itself, so queueing them allocates nothing.
+ *          Larger ones are moved to the heap. A task can be moved but not copied.
+ */
+class Task {
+    private:
+        /**
+        * @struct Operations
+        * @brief How to run, move and destroy the stored callable.
+        */
+        struct Operations {
+            void (*m_invoke)(void* storage); ///< Runs the callable.
+            void (*m_move)(void* from, void* to); ///< Moves the callable to empty storage.
+            void (*m_destroy)(void* storage); ///< Destroys the callable.
+        };
+
+        template <typename F>
+        static constexpr bool isInline = sizeof(F) <= TASK_INLINE_SIZE && alignof(F) <= alignof(max_align_t) && is_nothrow_move_constructible<F>::value;
+
+        template <typename F>
+        static constexpr Operations m_inlineOperations = {
+            [](void* storage) { (*(F*)storage)(); },
+            [](void* from, void* to) { new (to) F(move(*(F*)from)); ((F*)from)->~F(); },
+            [](void* storage) { ((F*)storage)->~F(); }
+        };
+
+        template <typename F>
+        static constexpr Operations m_heapOperations = {
+            [](void* storage) { (**(F**)storage)(); },
+            [](void* from, void* to) { *(F**)to = *(F**)from; },
+            [](void* storage) { delete *(F**)storage; }
+        };
+
+        alignas(max_align_t) unsigned char m_storage[TASK_INLINE_SIZE]; ///< The callable, or a pointer to it if it is too large.
+        const Operations* m_operations{nullptr}; ///< Operations of the stored callable, null if the task is empty.
+
+    public:
+        Task() = default;
+
+        /**
+        * @brief Constructs a task from a callable.
+        * @param callable The callable, e.g. a lambda.
+        */
+        template <typename F, typename = enable_if_t<!is_same<decay_t<F>, Task>::value>>
+        Task(F&& callable) {
+            using Callable = decay_t<F>;
+            if constexpr (isInline<Callable>) {
+                new (m_storage) Callable(forward<F>(callable));
+                m_operations = &m_inlineOperations<Callable>;
+            } else {
+                *(Callable**)m_storage = new Callable(forward<F>(callable));
+                m_operations = &m_heapOperations<Callable>;
+            }
+        }
+
+        Task(Task&& other) noexcept : m_operations(other.m_operations) {
+            if (m_operations) m_operations->m_move(other.m_storage, m_storage);
+            other.m_operations = nullptr;
         }
 
-        //: Move assignment operator (same as move constructor)
-        Logger& operator=(Logger&& other) noexcept {
+        Task& operator=(Task&& other) noexcept {
             if (this != &other) {
-                m_seederIp = move(other.m_seederIp);
-                m_seederPort = move(other.m_seederPort);
-                m_logDirPath = move(other.m_logDirPath);
-                m_logFilePath = move(other.m_logFilePath);
+                if (m_operations) m_operations->m_destroy(m_storage);
+                m_operations = other.m_operations;
+                if (m_operations) m_operations->m_move(other.m_storage, m_storage);
+                other.m_operations = nullptr;
             }
             return *this;
         }
 
-        void log(string type, string content);
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        ~Task() {
+            if (m_operations) m_operations->m_destroy(m_storage);
+        }
+
+        /**
+        * @brief Runs the callable.
+        */
+        void operator()() {
+            m_operations->m_invoke(m_storage);
+        }
 };
 
+/**
+ * @class TaskGroup
+ * @brief Tasks waited for together, e.g. the pieces of one file.
+ * @details A group can be given to ThreadPool::enqueueTask() and waited for with
+ *          ThreadPool::wait(), which only covers the tasks of that group. The waiter is
+ *          woken once, when the last task of the group is done.
+ */
+class TaskGroup {
+    private:
+        friend class ThreadPool;
+
+        atomic<int> m_pendingTasks{0}; ///< Tasks of the group not done yet.
+        mutex m_groupMutex; ///< Mutex the waiter sleeps on.
+        condition_variable m_groupDone; ///< Signalled when the last task of the group is done.
+
+    public:
+        TaskGroup() = default;
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+};
+
+/**
+ * @class ThreadPool
+ * @brief A work-stealing pool of worker threads.
+ * @details Every worker has its own task queue behind its own mutex, so workers and
+ *          producers do not contend on a single lock. A task enqueued by a worker goes
+ *          to that worker's queue, other tasks are spread over the queues in turn. A
+ *          worker runs the oldest task of its own queue, and when that is empty steals
+ *          the newest task of another queue. Idle workers sleep until a task is queued.
+ */
+class ThreadPool {
+    private:
+        /**
+        * @struct QueuedTask
+        * @brief A task waiting in a queue, along with the group it belongs to.
+        */
+        struct QueuedTask {
+            Task m_task; ///< The task.
+            TaskGroup* m_group{nullptr}; ///< Group of the task, null if it has none.
+        };
+
+        /**
+        * @struct WorkerQueue
+        * @brief Task queue of one worker.
+        */
+        struct WorkerQueue {
+            mutex m_queueMutex; ///< Mutex to protect the tasks.
+            deque<QueuedTask> m_tasks; ///< Tasks, oldest first.
+        };
+
+        static thread_local ThreadPool* m_currentPool; ///< Pool the calling thread is a worker of, null for other threads.
+        static thread_local size_t m_currentWorker; ///< Index of the calling thread in its pool.
+
+        string m_name; ///< Name of the pool in the metrics.
+        vector<thread> m_workers; ///< Vector of worker threads in the pool.
+        vector<unique_ptr<WorkerQueue>> m_queues; ///< Task queue of every worker.
+        atomic<size_t> m_nextQueue{0}; ///< Queue given the next task enqueued from outside the pool.
+
+        atomic<bool> m_stop{false}; ///< Flag indicating whether the thread pool should stop processing tasks.
+        atomic<int> m_queuedTasks{0}; ///< Tasks in the queues, not taken by a worker yet.
+        atomic<int> m_unfinishedTasks{0}; ///< Tasks enqueued and not done yet.
+        atomic<int> m_sleepingWorkers{0}; ///< Workers sleeping until a task is queued.
+
+        mutex m_sleepMutex; ///< Mutex idle workers sleep on.
+        condition_variable m_condition; ///< Condition variable to notify worker threads about new tasks or stop signal.
+        mutex m_waitMutex; ///< Mutex wait() sleeps on.
+        condition_variable m_waitCondition; ///< Condition variable signalled when the last unfinished task is done.
+
+        /**
+        * @brief The worker thread function that runs and steals tasks until the pool is stopped.
+        * @param index Index of the worker.
+        */
+        void workerThread(size_t index);
+
+        /**
+        * @brief Takes a task for a worker, from its own queue or else from another one.
+        * @param index Index of the worker.
+        * @param task The task taken.
+        * @return True if a task was taken, false if all queues are empty.
+        */
+        bool takeTask(size_t index, QueuedTask& task);
+
+        /**
+        * @brief Queues a task.
+        * @param task The task.
+        * @param group Group of the task, null if it has none.
+        * @throws runtime_error If the thread pool has been stopped and no more tasks can be enqueued.
+        */
+        void pushTask(Task task, TaskGroup* group);
+
+    public:
+        /**
+        * @brief Constructs a ThreadPool with a specified number of worker threads.
+        * @param numThreads The number of worker threads to create.
+        * @param name Name of the pool in the metrics.
+        */
+        ThreadPool(size_t numThreads, string name = "pool");
+
+        /**
+        * @brief Destroys the ThreadPool, running the tasks still queued, and joins all worker threads.
+        */
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /**
+        * @brief Enqueues a task for execution by the thread pool.
+        * @param task The task to be executed. It is a callable object (function, lambda, etc.).
+        * @param group Group the task belongs to, null if it has none.
+        * @throws runtime_error If the thread pool has been stopped and no more tasks can be enqueued.
+        */
+        template <typename F>
+        void enqueueTask(F&& task, TaskGroup* group = nullptr) {
+            pushTask(Task(forward<F>(task)), group);
+        }
+
+        /**
+        * @brief Blocks until all enqueued tasks have been completed.
+        */
+        void wait();
+
+        /**
+        * @brief Gives the name of the pool in the metrics.
+        */
+        const string& giveName() const;
+
+        /**
+        * @brief Gives the number of worker threads.
+        */
+        size_t giveWorkers() const;
+
+        /**
+        * @brief Gives the number of tasks waiting in the queues, not taken by a worker yet.
+        */
+        int giveQueuedTasks() const;
+
+        /**
+        * @brief Gives the number of tasks being run by workers now.
+        */
+        int giveActiveTasks() const;
+
+        /**
+        * @brief Blocks until all tasks of a group have been completed.
+        * @param group The group to wait for.
+        * @note Must not be called from a task of the same pool, the task would hold a worker the group may need.
+        */
+        void wait(TaskGroup& group);
+};
+
+/**
+ * @struct FrameHeader
+ * @brief Fixed-size header sent in front of every message on the wire.
+ * @details A frame is this header followed by m_length bytes of payload. All fields
+ *          are in network byte order on the wire and in host byte order once received.
+ */
+struct FrameHeader {
+    uint32_t m_length; ///< Length of the payload following the header, in bytes.
+    uint8_t m_opcode; ///< Kind of message, one of the OPCODE_* values.
+    uint8_t m_status; ///< Result of a response, STATUS_SUCCESS or STATUS_ERROR.
+    uint16_t m_reserved; ///< Unused, always zero.
+} __attribute__((packed));
 
 /**
  * @class ServerSocket
@@ -135,21 +740,47 @@ class ServerSocket {
         int acceptSocket();
 
         /**
-        * @brief Sends a response message to a client socket.
+        * @brief Sends a response message to a client socket as a single frame.
         * @param clientSocketFd The file descriptor of the client socket.
         * @param response The response message to be sent.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        * @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
         * @throws string If sending message fails.
         */
-        void sendSocket(int clientSocketFd, string response);
+        void sendSocket(int clientSocketFd, string response, uint8_t opcode = OPCODE_RESPONSE, uint8_t status = STATUS_SUCCESS);
 
         /**
-        * @brief Receives a message from a client socket.
+        * @brief Receives the header of the next frame from a client socket.
         * @param clientSocketFd The file descriptor of the client socket.
-        * @return The received message as a string.
+        * @param header Set to the frame header in host byte order.
+        * @return False if the client closed the connection before sending a header, true otherwise.
+        * @throws string If receiving fails or the header is invalid.
+        */
+        bool recvHeader(int clientSocketFd, FrameHeader& header);
+
+        /**
+        * @brief Receives the payload of a frame directly into a caller-supplied buffer.
+        * @param clientSocketFd The file descriptor of the client socket.
+        * @param buffer The buffer to receive into, at least length bytes long.
+        * @param length The payload length from the frame header.
+        * @throws string If receiving fails or the connection is closed.
+        */
+        void recvPayload(int clientSocketFd, char* buffer, size_t length);
+
+        /**
+        * @brief Receives a whole frame from a client socket.
+        * @param clientSocketFd The file descriptor of the client socket.
+        * @return The payload of the frame as a string, or an empty string if the client closed the connection.
         * @throws string If receiving message fails.
         */
         string recvSocket(int clientSocketFd);
 
+        /**
+        * @brief Gives the file descriptor of the listening socket.
+        * @return The file descriptor, -1 if the socket is not created.
+        */
+        int giveSocketFd();
+
         /**
         * @brief Closes the server socket and resets internal state.
         * @throws string If socket is not created before attempting to close.
@@ -157,23 +788,659 @@ class ServerSocket {
         void closeSocket();
 };
 
+/**
+ * @class Connection
+ * @brief State of one non-blocking connection served by the EventLoop.
+ * @details Only the worker the connection is handed to touches it, so it needs no locking.
+ *          Frames pushed by other threads are the exception, they wait in m_pushQueue.
+ */
+class Connection {
+    public:
+        int m_fd; ///< File descriptor of the connected socket.
+        uint64_t m_id; ///< Id of the connection, never reused while the loop runs.
+        string m_inBuffer; ///< Received bytes not yet handled as complete frames.
+        deque<string> m_outQueue; ///< Frames waiting to be sent, in order.
+        size_t m_outSent{0}; ///< Bytes of the front frame already sent.
+        bool m_peerClosed{false}; ///< Set once the peer closed its side of the connection.
+
+        mutex m_pushMutex; ///< Mutex to protect the members below.
+        deque<string> m_pushQueue; ///< Frames pushed by other threads, moved to m_outQueue by the worker.
+        bool m_isArmed{false}; ///< Whether epoll watches the connection, i.e. no worker owns it.
+        bool m_isWakePending{false}; ///< Whether the connection waits in the wake list of the reactor.
+        bool m_isOverflowed{false}; ///< Set once a pushed frame found the queue full, the connection is shut down then.
+
+        /**
+        * @brief Creates the state of an accepted connection.
+        * @param fd File descriptor of the connected socket.
+        * @param id Id of the connection.
+        */
+        Connection(int fd, uint64_t id) : m_fd(fd), m_id(id) {}
+
+        /**
+        * @brief Builds a frame.
+        * @param payload The payload of the frame.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        * @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
+        * @return The header followed by the payload.
+        */
+        static string makeFrame(const string& payload, uint8_t opcode, uint8_t status);
+
+        /**
+        * @brief Queues a frame to be sent to the peer.
+        * @param payload The payload of the frame.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        * @param status The result of the command, STATUS_SUCCESS or STATUS_ERROR.
+        */
+        void queueFrame(const string& payload, uint8_t opcode = OPCODE_RESPONSE, uint8_t status = STATUS_SUCCESS);
+};
+
+/**
+ * @class EventLoop
+ * @brief An epoll reactor serving many non-blocking connections with a fixed set of worker threads.
+ * @details One reactor thread accepts connections and waits for readiness. Ready connections
+ *          are handed to the workers, which read, cut the input into frames, run the frame
+ *          handler for each and send the queued responses without blocking.
+ */
+class EventLoop {
+    private:
+        int m_epollFd{-1}; ///< The epoll instance watching all sockets.
+        int m_wakeFd{-1}; ///< Eventfd written to wake the reactor thread on stop.
+        int m_listenFd{-1}; ///< The listening socket.
+        ThreadPool m_workers; ///< Workers handling ready connections.
+        thread m_reactor; ///< Thread waiting for events.
+        atomic<bool> m_stop{false}; ///< Flag asking the reactor thread to return.
+        function<void(Connection&, const FrameHeader&, string&)> m_frameHandler; ///< Called for every complete frame.
+
+        mutex m_connectionsMutex; ///< Mutex to protect access to connections.
+        unordered_map<uint64_t, Connection*> m_connections; ///< All open connections by id, freed on stop.
+        uint64_t m_nextConnectionId{1}; ///< Id of the next accepted connection, only used by the reactor.
+
+        mutex m_wakeMutex; ///< Mutex to protect the wake list.
+        vector<uint64_t> m_wakeList; ///< Connections with pushed frames the reactor has to check.
+
+        /**
+        * @brief Runs on the reactor: re-arms idle connections of the wake list so their pushed frames are sent.
+        */
+        void wakePushed();
+
+        /**
+        * @brief Waits for readiness events and hands ready connections to the workers.
+        */
+        void run();
+
+        /**
+        * @brief Accepts all pending connections and registers them as non-blocking sockets.
+        */
+        void acceptConnections();
+
+        /**
+        * @brief Flushes pending output, reads and handles frames, then re-arms the connection.
+        * @param connection The ready connection.
+        * @param readyEvents The events reported by epoll.
+        */
+        void handleConnection(Connection* connection, uint32_t readyEvents);
+
+        /**
+        * @brief Reads everything the socket has buffered, up to MAX_READ_PER_EVENT bytes.
+        * @param connection The connection to read from.
+        * @throws string If receiving fails.
+        */
+        void readInput(Connection& connection);
+
+        /**
+        * @brief Sends as much of the queued output as the socket accepts.
+        * @param connection The connection to send on.
+        * @return True if the queue is empty, false if the socket is full.
+        * @throws string If sending fails.
+        */
+        bool flushOutput(Connection& connection);
+
+        /**
+        * @brief Hands a connection back to epoll, it will be reported once for the given events.
+        * @param connection The connection to re-arm.
+        * @param events The events to wait for.
+        * @throws string If the connection can not be re-armed.
+        */
+        void rearm(Connection* connection, uint32_t events);
+
+        /**
+        * @brief Closes a connection and frees it.
+        * @param connection The connection to close.
+        */
+        void closeConnection(Connection* connection);
+
+    public:
+        /**
+        * @brief Creates the epoll instance and the worker threads.
+        * @param numWorkers Number of worker threads running the frame handler.
+        * @throws string If the epoll instance can not be created.
+        */
+        EventLoop(size_t numWorkers);
+
+        /**
+        * @brief Stops the loop and releases all connections.
+        */
+        ~EventLoop();
+
+        EventLoop(const EventLoop&) = delete;
+        EventLoop& operator=(const EventLoop&) = delete;
+
+        /**
+        * @brief Starts watching the listening socket on a reactor thread.
+        * @param listenFd The listening socket, switched to non-blocking mode.
+        * @param frameHandler Called on a worker thread for every complete frame received.
+        * @throws string If the listening socket can not be watched.
+        */
+        void start(int listenFd, function<void(Connection&, const FrameHeader&, string&)> frameHandler);
+
+        /**
+        * @brief Queues a frame for a connection from any thread, e.g. a notification.
+        * @param connectionId Id of the connection.
+        * @param payload The payload of the frame.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        * @return True if the frame was queued, false if the connection is closed or was shut down for falling behind.
+        */
+        bool push(uint64_t connectionId, const string& payload, uint8_t opcode = OPCODE_NOTIFY);
+
+        /**
+        * @brief Stops the reactor thread, waits for running handlers and closes all connections.
+        */
+        void stop();
+};
+
+/**
+ * @class Store
+ * @brief Saves the users, groups and files of a tracker, so a restarted tracker comes back with them.
+ * @details The state is kept as a binary snapshot plus a write-ahead log of the entries of the
+ *          replication log applied since. At startup the snapshot is mapped and loaded, then the
+ *          entries of the write-ahead log are applied again. Once SNAPSHOT_WAL_ENTRIES entries
+ *          piled up the state is saved to a new snapshot and the write-ahead log starts empty.
+ *          Subscriptions belong to connections and are never saved. Calls are serialized by the
+ *          replicator, which holds its log lock around every one of them but writeSnapshot().
+ */
+class Store {
+    private:
+        /**
+        * @struct Reader
+        * @brief Reads the fields of a snapshot in order.
+        */
+        struct Reader {
+            const char* m_next; ///< First byte not read yet.
+            const char* m_end; ///< End of the snapshot.
+
+            /**
+            * @brief Reads a number.
+            * @return The number.
+            * @throws string If the snapshot ends before it.
+            */
+            uint64_t takeNumber();
+
+            /**
+            * @brief Reads a string.
+            * @return The string.
+            * @throws string If the snapshot ends before it.
+            */
+            string takeString();
+        };
+
+        string m_dirPath; ///< Directory of the snapshot and the write-ahead log.
+        string m_snapshotPath; ///< Path of the snapshot.
+        string m_walPath; ///< Path of the write-ahead log.
+        int m_walFd{-1}; ///< Write-ahead log, open for appending.
+        uint64_t m_walEntries{0}; ///< Entries in the write-ahead log.
+        bool m_isUnsynced{false}; ///< Whether entries were appended since the last sync.
+
+        /**
+        * @brief Appends a number, 8 bytes in little endian order.
+        * @param out The bytes appended to.
+        * @param value The number.
+        */
+        static void putNumber(string& out, uint64_t value);
+
+        /**
+        * @brief Appends a string, its length first.
+        * @param out The bytes appended to.
+        * @param value The string.
+        */
+        static void putString(string& out, const string& value);
+
+        /**
+        * @brief Gives the record of an entry in the write-ahead log.
+        * @param seq Sequence number of the entry.
+        * @param command The command of the entry.
+        * @return The bytes "Length Seq Command Checksum".
+        */
+        static string giveRecord(uint64_t seq, const string& command);
+
+        /**
+        * @brief Replaces a file by new content, synced to the disk before it takes the place of the old one.
+        * @param path Path of the file.
+        * @param content The content.
+        * @throws string If the file can not be written.
+        */
+        static void replaceFile(const string& path, const string& content);
+
+        /**
+        * @brief Opens the write-ahead log for appending, creating it if needed.
+        * @param isTruncated Whether the entries in it are dropped.
+        * @throws string If the log can not be opened.
+        */
+        void openWal(bool isTruncated);
+
+    public:
+        /**
+        * @brief Constructs the store of a tracker, nothing is read or written yet.
+        * @param trackerIp IP address of the tracker.
+        * @param trackerPort Port number of the tracker.
+        */
+        Store(string trackerIp, int trackerPort);
+
+        /**
+        * @brief Syncs and closes the write-ahead log.
+        */
+        ~Store();
+
+        Store(const Store&) = delete;
+        Store& operator=(const Store&) = delete;
+
+        /**
+        * @brief Gives the checksum of some bytes, e.g. of a record of the write-ahead log.
+        * @param data The bytes.
+        * @param length Number of bytes.
+        * @return The 32 bit FNV-1a hash of the bytes.
+        */
+        static uint32_t giveChecksum(const char* data, size_t length);
+
+        /**
+        * @brief Loads the snapshot, then gives the entries of the write-ahead log to be applied again.
+        * @param replayer Applies an entry, called in log order with its sequence number.
+        * @return Sequence number of the last entry in the snapshot, 0 if there is no snapshot.
+        * @throws string If the snapshot is damaged or the files can not be opened.
+        */
+        uint64_t load(function<void(uint64_t, const string&)> replayer);
+
+        /**
+        * @brief Appends an entry of the replication log to the write-ahead log.
+        * @param seq Sequence number of the entry.
+        * @param command The command of the entry.
+        * @throws string If the entry can not be written.
+        */
+        void append(uint64_t seq, const string& command);
+
+        /**
+        * @brief Syncs the entries appended since the last sync to the disk.
+        */
+        void sync();
+
+        /**
+        * @brief Checks whether enough entries piled up in the write-ahead log for a new snapshot.
+        * @return True if the state should be saved.
+        */
+        bool isSnapshotDue() const;
+
+        /**
+        * @brief Saves the state to a new snapshot and empties the write-ahead log.
+        * @param seq Sequence number of the last entry applied to the state.
+        * @throws string If the snapshot can not be written.
+        * @note Expects no command to change the state meanwhile.
+        */
+        void saveSnapshot(uint64_t seq);
+
+        /**
+        * @brief Writes a snapshot taken before, the write-ahead log is left as it is.
+        * @details Touches the snapshot file only, so entries can be appended meanwhile.
+        * @param content The bytes of the snapshot, see giveSnapshot().
+        * @param seq Sequence number of the last entry in the snapshot.
+        * @throws string If the snapshot can not be written.
+        */
+        void writeSnapshot(const string& content, uint64_t seq);
+
+        /**
+        * @brief Replaces the write-ahead log by the entries that follow the snapshot.
+        * @param seq Sequence number of the last entry in the snapshot.
+        * @param commands Commands of the entries after seq, in log order.
+        * @throws string If the log can not be written.
+        */
+        void restartWal(uint64_t seq, const vector<string>& commands);
+
+        /**
+        * @brief Gives the snapshot of the state, e.g. for a follower too far behind the log.
+        * @param seq Sequence number of the last entry applied to the state.
+        * @return The bytes of the snapshot.
+        * @note Expects no command to change the state meanwhile.
+        */
+        static string giveSnapshot(uint64_t seq);
+
+        /**
+        * @brief Replaces the state by a snapshot, the subscriptions of the groups are kept.
+        * @param data The bytes of the snapshot.
+        * @param length Number of bytes.
+        * @return Sequence number of the last entry in the snapshot.
+        * @throws string If the snapshot is damaged, the state is then left as it was.
+        */
+        static uint64_t installSnapshot(const char* data, size_t length);
+};
+
+/**
+ * @class Replicator
+ * @brief Keeps the users, groups and files of all trackers of trackerinfo.txt the same.
+ * @details One tracker is the primary, every other one follows it. Commands changing the
+ *          state are applied by the primary and appended to the replication log, which is
+ *          streamed to the followers as they apply it. Writes on the same user or group are
+ *          applied one at a time, others at once, and are logged in the order they were
+ *          applied in. A write is answered
+ *          once every follower keeping up has applied it, so any tracker can serve the
+ *          reads that follow. Followers pass the writes of their clients on to the primary.
+ *          A follower losing the primary elects a new one: the tracker with the longest
+ *          log, the lowest number among those, becomes the primary, once a majority of the
+ *          trackers answered. A primary asks the others every heartbeat and steps down when
+ *          it can not reach a majority or finds a primary with a better claim. Every tracker saves the
+ *          log it applied through its store, entries saved to a snapshot leave the log and
+ *          followers behind them are sent the snapshot instead.
+ */
+class Replicator {
+    private:
+        /**
+        * @struct Follower
+        * @brief A tracker streamed the log by this primary.
+        */
+        struct Follower {
+            int m_trackerNumber; ///< Number of the tracker in trackerinfo.txt.
+            uint64_t m_ackedSeq{0}; ///< Entries of the log the follower has applied.
+            bool m_isLagging{false}; ///< Whether the follower is behind, writes do not wait for it then.
+        };
+
+        /**
+        * @struct PendingReply
+        * @brief Response to a write, sent once the followers applied the write.
+        */
+        struct PendingReply {
+            uint64_t m_seq; ///< Sequence number of the write in the log.
+            uint64_t m_connectionId; ///< Connection the write came from.
+            string m_response; ///< The response.
+            uint8_t m_opcode; ///< Kind of frame the response is sent in, OPCODE_RESPONSE or OPCODE_BATCH.
+            chrono::steady_clock::time_point m_deadline; ///< Time after which followers that did not apply the write lag behind.
+        };
+
+        vector<pair<string, int>> m_trackers; ///< IP and port of all trackers, in trackerinfo.txt order.
+        int m_trackerNumber; ///< Number of this tracker, counted from 1.
+        atomic<int> m_primaryNumber{0}; ///< Number of the primary, 0 while none is known.
+        atomic<bool> m_stop{false}; ///< Flag asking the replication thread to return.
+        atomic<int> m_primaryFd{-1}; ///< Connection the log of the primary is received on, -1 if there is none.
+        thread m_thread; ///< Thread electing the primary, then following it or sending heartbeats.
+
+        mutex m_logMutex; ///< Mutex to protect the log and the followers, held while a write is appended, not while it is applied.
+        shared_mutex m_applyMutex; ///< Taken shared by a write being applied, unique while the state is copied to a snapshot.
+        mutex m_orderMutexes[WRITE_ORDER_STRIPES]; ///< Held by a write from its apply to its append, see giveOrderStripes().
+        condition_variable m_logChanged; ///< Signalled when a follower acknowledges entries or a primary is elected.
+        vector<string> m_log; ///< Commands applied since the last snapshot, entry i has sequence number m_logBase + i + 1.
+        uint64_t m_logBase{0}; ///< Sequence number of the last entry saved to the snapshot.
+        Store m_store; ///< Snapshot and write-ahead log of the state of this tracker.
+        unordered_map<uint64_t, Follower> m_followers; ///< Followers of this primary, by connection id.
+        unordered_map<string, string> m_requestResponses; ///< Responses of the latest writes by request id, entries saved to a snapshot are forgotten on a restart.
+        deque<string> m_requestOrder; ///< Request ids of m_requestResponses, the oldest first.
+        deque<PendingReply> m_pendingReplies; ///< Responses waiting for the followers, in log order.
+
+        mutex m_forwardMutex; ///< Mutex to protect the forward connections.
+        vector<int> m_forwardFds; ///< Idle connections to the primary, writes of clients are forwarded on them.
+        int m_forwardNumber{0}; ///< Primary the forward connections lead to.
+
+        function<string(const string&)> m_applier; ///< Applies a command to the state, throws its error.
+        function<bool(uint64_t, const string&, uint8_t)> m_pusher; ///< Sends a frame to a connection, false once it is closed.
+
+        /**
+        * @brief Elects the primary, then follows it or sends heartbeats until the tracker stops.
+        */
+        void run();
+
+        /**
+        * @brief Asks the other trackers about the primary and the length of their logs.
+        * @details This tracker only wins with the answers of a majority of the trackers.
+        * @return Number of the tracker to follow or of this tracker if it won, 0 if the winner is not primary yet.
+        */
+        int elect();
+
+        /**
+        * @brief Asks the other trackers whether this primary should stay the primary, once every heartbeat.
+        * @return False if no majority of the trackers answers or another primary has the longer log, or the lower number with an equal log.
+        */
+        bool confirmPrimary();
+
+        /**
+        * @brief Asks another tracker about the primary and the length of its log.
+        * @param trackerNumber Number of the tracker.
+        * @param primaryNumber Set to the primary the tracker knows, 0 while it is electing.
+        * @param seq Set to the sequence number of the last entry the tracker applied.
+        * @return False if the tracker did not answer within PEER_CONNECT_TIMEOUT.
+        */
+        bool askTracker(int trackerNumber, int& primaryNumber, uint64_t& seq);
+
+        /**
+        * @brief Receives and applies the log of the primary until the connection is lost.
+        * @param primaryNumber Number of the primary.
+        */
+        void follow(int primaryNumber);
+
+        /**
+        * @brief Passes writes of a client on to the primary, all in one batch frame.
+        * @param commands The commands.
+        * @param primaryNumber Number of the primary.
+        * @return Status and response of every command, in order.
+        */
+        vector<pair<uint8_t, string>> forward(const vector<string>& commands, int primaryNumber);
+
+        /**
+        * @brief Closes the forward connections.
+        */
+        void closeForwards();
+
+        /**
+        * @brief Sends the pending responses of writes applied by every follower keeping up.
+        * @details A follower that did not apply a write by its deadline lags behind from then on.
+        * @note Expects m_logMutex to be held.
+        */
+        void answerAppliedLocked();
+
+        /**
+        * @brief Gives the sequence number of the last entry applied.
+        * @return The sequence number, 0 if no entry was applied.
+        * @note Expects m_logMutex to be held.
+        */
+        uint64_t giveLastSeqLocked() const;
+
+        /**
+        * @brief Appends an applied command to the log and the write-ahead log.
+        * @details The replication thread is woken once a snapshot is due, see saveDueSnapshot().
+        * @param command The command.
+        * @return Sequence number of the entry.
+        * @note Expects m_logMutex to be held.
+        */
+        uint64_t appendLocked(const string& command);
+
+        /**
+        * @brief Remembers the response of a write sent with a request id.
+        * @param requestId The request id, nothing is remembered if it is empty.
+        * @param response The response.
+        * @note Expects m_logMutex to be held.
+        */
+        void rememberLocked(const string& requestId, const string& response);
+
+        /**
+        * @brief Applies an entry of the log, remembering its response if it carries a request id.
+        * @param seq Sequence number of the entry.
+        * @param command The command of the entry, "request <id> <command>" or the command alone.
+        * @note Expects m_logMutex to be held.
+        */
+        void applyEntryLocked(uint64_t seq, const string& command);
+
+        /**
+        * @brief Splits the request id off a command.
+        * @param command The command, "request <id> <command>" or the command alone, left as the command alone.
+        * @return The request id, empty if the command has none.
+        */
+        static string takeRequestId(string& command);
+
+        /**
+        * @brief Saves the state to a new snapshot if enough entries piled up in the write-ahead log.
+        * @details Writes wait only while the state is copied, not while the copy is written.
+        * @note Expects m_logMutex not to be held, called by the replication thread only.
+        */
+        void saveDueSnapshot();
+
+        /**
+        * @brief Gives the locks a write takes to be applied and logged in order with the writes it does not commute with.
+        * @param command The command.
+        * @return Indices into m_orderMutexes, ascending and without duplicates.
+        */
+        static vector<size_t> giveOrderStripes(const string& command);
+
+        /**
+        * @brief Replaces the password of a "create_user" or "login" command with its hash.
+        * @param command The command.
+        * @return The command as it is applied, logged and saved.
+        */
+        static string hidePassword(const string& command);
+
+        /**
+        * @brief Gives the frame carrying an entry of the log.
+        * @param seq Sequence number of the entry.
+        * @return The payload "entry <seq> <command>".
+        * @note Expects m_logMutex to be held.
+        */
+        string giveEntryLocked(uint64_t seq) const;
+
+        /**
+        * @brief Connects to another tracker.
+        * @param trackerNumber Number of the tracker.
+        * @return The connected socket, with REPLICATION_TIMEOUT as timeout of every receive.
+        * @throws string If the tracker can not be reached within PEER_CONNECT_TIMEOUT.
+        */
+        int connectTracker(int trackerNumber);
+
+        /**
+        * @brief Sends a frame on a blocking socket.
+        * @param fd The socket.
+        * @param payload The payload.
+        * @param opcode The kind of message, one of the OPCODE_* values.
+        * @throws string If sending fails.
+        */
+        static void sendFrame(int fd, const string& payload, uint8_t opcode);
+
+        /**
+        * @brief Receives a frame on a blocking socket.
+        * @param fd The socket.
+        * @param header Set to the header in host byte order.
+        * @return The payload.
+        * @throws string If receiving fails, times out or the connection is closed.
+        */
+        static string recvFrame(int fd, FrameHeader& header);
+
+    public:
+        /**
+        * @brief Constructs the replicator of one of the trackers.
+        * @param trackers IP and port of all trackers, in trackerinfo.txt order.
+        * @param trackerNumber Number of this tracker, counted from 1.
+        */
+        Replicator(vector<pair<string, int>> trackers, int trackerNumber)
+            : m_trackers(trackers)
+            , m_trackerNumber(trackerNumber)
+            , m_store(trackers[trackerNumber-1].first, trackers[trackerNumber-1].second)
+        {}
+
+        ~Replicator();
+
+        Replicator(const Replicator&) = delete;
+        Replicator& operator=(const Replicator&) = delete;
+
+        /**
+        * @brief Loads the saved state, then starts electing the primary.
+        * @param applier Applies a command to the state of this tracker and gives its response.
+        * @param pusher Sends a frame to a connection from any thread, e.g. an entry of the log to a follower.
+        */
+        void start(function<string(const string&)> applier, function<bool(uint64_t, const string&, uint8_t)> pusher);
+
+        /**
+        * @brief Stops following or leading and saves the state, a stopped tracker is taken as lost by the others.
+        */
+        void stop();
+
+        /**
+        * @brief Checks whether a command changes the state shared by the trackers.
+        * @param commandName First word of the command.
+        * @return True if the command goes through the primary.
+        */
+        static bool isWrite(const string& commandName);
+
+        /**
+        * @brief Gives the name of a command, the request id a client sent with a write is skipped.
+        * @param command The command.
+        * @return The first word of the command itself.
+        */
+        static string giveCommandName(const string& command);
+
+        /**
+        * @brief Applies a write on the primary, or forwards it to the primary.
+        * @param command The command.
+        * @param connectionId Connection the command came from.
+        * @return The response, or nothing if it is sent to the connection once the followers applied the write.
+        * @throws string The error of the command, or if no primary is reachable.
+        */
+        optional<string> write(const string& command, uint64_t connectionId);
+
+        /**
+        * @brief Applies writes one after the other on the primary, or forwards them to the primary.
+        * @details The log lock is taken once for all of them, a follower forwards them in one frame.
+        * @param commands The commands.
+        * @param seq Set to the sequence number of the last entry appended by this tracker, or of the latest entry for a write sent again, left as is otherwise.
+        * @return Status and response of every command, in order.
+        */
+        vector<pair<uint8_t, string>> writeMany(const vector<string>& commands, uint64_t& seq);
+
+        /**
+        * @brief Answers a connection once every follower keeping up applied the log up to an entry.
+        * @param seq Sequence number of the entry, 0 if nothing was appended.
+        * @param connectionId Connection the response is sent to.
+        * @param response The response.
+        * @param opcode Kind of frame the response is sent in, OPCODE_RESPONSE or OPCODE_BATCH.
+        * @return The response if it can be sent at once, nothing if the replicator sends it later.
+        */
+        optional<string> answerAfter(uint64_t seq, uint64_t connectionId, string response, uint8_t opcode);
+
+        /**
+        * @brief Handles a frame of another tracker, runs on the worker owning the connection.
+        * @param connection The connection of the other tracker.
+        * @param message The payload of the frame.
+        */
+        void handlePeer(Connection& connection, const string& message);
+};
+
 class File {
     friend class Group;
     friend class Users;
     friend class Groups;
+    friend class Store;
 
     private:
-        File(string fileName, vector<string> SHA, int size, unordered_set<string> userName)
+        //: Pieces a user still downloading the file announced with "have"
+        struct PartialPieces {
+            vector<bool> m_pieces;
+            int m_heldPieces = 0;     //: Pieces set in m_pieces, counted as they are set so no message scans them
+        };
+
+        File(string fileName, shared_ptr<const string> digests, long long size, int pieceSize, unordered_set<string> userName)
             : m_fileName(fileName)
-            , m_SHA(SHA)
+            , m_digests(digests)
             , m_size(size)
+            , m_pieceSize(pieceSize)
             , m_userNames(userName)
         {}
 
         string m_fileName;
-        vector<string> m_SHA;
-        int m_size;
+        shared_ptr<const string> m_digests;     //: Raw SHA-256 digests, entire file first, then Merkle root of the pieces, never changed once uploaded
+        long long m_size;
+        int m_pieceSize;
         unordered_set<string> m_userNames;
+        unordered_map<string, PartialPieces> m_partialPieces;   //: Pieces announced with "have" by users in m_userNames still downloading the file
     
     public:
         File() = default;  
@@ -182,6 +1449,7 @@ class File {
 class User {
     friend class Users;
     friend class Groups;
+    friend class Store;
 
     private:
         User(string userName, string password)
@@ -190,27 +1458,43 @@ class User {
         {}
 
         string m_userName;
-        string m_password;
+        string m_password;                      //: Hash of the password, see Utils::hashPassword()
         unordered_set<string> m_groups;
     
     public:
         User() = default;  
 };
 
+class Subscriber {
+    friend class Groups;
+    friend class Store;
+
+    private:
+        string m_userName;
+        bool m_isAllFiles = false;              //: Subscribed to the whole group, m_fileNames is then unused
+        unordered_set<string> m_fileNames;
+};
+
 class Group {
     friend class Users;
     friend class Groups;
+    friend class Store;
 
     private:
         Group(string groupName, vector<string> participants)
             : m_groupName(groupName)
             , m_participants(participants)
+            , m_members(participants.begin(), participants.end())
         {}
 
+        TimedMutex<shared_mutex> m_groupMutex{Metrics::getInstance().giveLockWaits("group")};     //: Taken shared by commands only reading the group
         string m_groupName;
-        vector<string> m_participants;
+        vector<string> m_participants;          //: In joining order, the first one is the admin
+        unordered_set<string> m_members;        //: Same users as m_participants, for membership checks
         unordered_set<string> m_pendingJoins;
         unordered_map<string, File> m_files;
+        unordered_map<uint64_t, Subscriber> m_subscribers;     //: Connections notified of changes, by connection id
+        bool m_isRemoved = false;               //: Set when the last member left, commands still holding the group fail
     
     public:
         Group() = default; 
@@ -218,10 +1502,11 @@ class Group {
 
 class Users {
     friend class Groups;
+    friend class Store;
 
     private:
         mutex m_usersMutex;
-        static mutex m_userToIpMutex;
+        static shared_mutex m_userToIpMutex;
 
         unordered_map <string, User> m_users;
         static unordered_map< string, string> m_userToIp; // userName, IP, authToken
@@ -243,9 +1528,17 @@ class Users {
 };
 
 class Groups {
+    friend class Store;
+
     private:
-        mutex m_groupsMutex;
-        unordered_map<string, Group> m_groups;
+        TimedMutex<shared_mutex> m_groupsMutex{Metrics::getInstance().giveLockWaits("groups")};    //: Guards the map only, every group has its own lock
+        unordered_map<string, shared_ptr<Group>> m_groups;
+
+        function<bool(uint64_t, const string&)> m_pusher;  //: Sends a notification to a connection, false once it is closed
+
+        shared_ptr<Group> giveGroup(const string& groupName);
+        static string giveIpPort(const string& userName);
+        void notifyLocked(Group& group, const string& event, const string& fileName, const string& ipPort);
 
         Groups() = default;
         ~Groups() = default;
@@ -259,10 +1552,15 @@ class Groups {
         string listGroups(string authToken);
         string acceptRequest(string groupName, string pendingUserName, string authToken);
         string listFiles(string groupName, string authToken);
-        string uploadFile(string fileName, string groupName, string fileSize, string SHAs, string authToken);
+        string uploadFile(string fileName, string groupName, string fileSize, string pieceSize, string SHAs, string authToken);
         string downloadFile(string fileName, string groupName, string authToken);
         string stopShare(string groupName, string fileName, string authToken);
+        string havePieces(string groupName, string fileName, string pieces, string authToken);
         string leaveGroup(string groupName, string authToken);
+        string subscribe(string groupName, string fileName, string authToken, uint64_t connectionId);
+        string unsubscribe(string groupName, string fileName, string authToken, uint64_t connectionId);
+        void notifySession(string userName, string seederIpPort, bool isActive);
+        void setPusher(function<bool(uint64_t, const string&)> pusher);
         
         static Groups& getInstance() {
             static Groups m_instance;
@@ -278,23 +1576,28 @@ class Tracker {
         Users& m_users;
         Groups& m_groups;
         Logger m_logger;
+        EventLoop m_eventLoop;
+        Replicator m_replicator;
 
-        void acceptConnections();
-        void handleLeecher(int leecherSocketFd);
-        string executeCommand(string command);
+        void handleLeecher(Connection& connection, const FrameHeader& header, string& receivedData);
+        optional<string> executeCommand(string command, uint64_t connectionId);
+        optional<string> executeBatch(string batch, uint64_t connectionId);
+        string applyCommand(string command, uint64_t connectionId);
 
         Tracker() = default;
         ~Tracker() = default;
         Tracker(const Tracker&) = delete;
         Tracker& operator=(const Tracker&) = delete;
         
-        Tracker(string trackerIp, int trackerPort)
-            : m_trackerIp(trackerIp)
-            , m_trackerPort(trackerPort)
-            , m_trackerSocket(ServerSocket(trackerIp, trackerPort))
+        Tracker(vector<pair<string, int>> trackers, int trackerNumber)
+            : m_trackerIp(trackers[trackerNumber-1].first)
+            , m_trackerPort(trackers[trackerNumber-1].second)
+            , m_trackerSocket(ServerSocket(m_trackerIp, m_trackerPort))
             , m_users(Users::getInstance())  
             , m_groups(Groups::getInstance())
-            , m_logger(Logger(trackerIp, trackerPort, "tracker"))
+            , m_logger(Logger(m_trackerIp, m_trackerPort, "tracker"))
+            , m_eventLoop(EVENT_LOOP_WORKERS)
+            , m_replicator(trackers, trackerNumber)
         {}
 
     public:
@@ -302,8 +1605,8 @@ class Tracker {
         void start();
         void stop();
 
-        static Tracker& getInstance(string trackerIp, int trackerPort) {
-            static Tracker m_instance(trackerIp, trackerPort);
+        static Tracker& getInstance(vector<pair<string, int>> trackers, int trackerNumber) {
+            static Tracker m_instance(trackers, trackerNumber);
             return m_instance;
         }
 };
@@ -6,17 +6,18 @@ void handleQuitOfTracker(Tracker &tracker);
 
 int main(int argc, char* argv[]){
     try{
-        pair <string, int> trackerIpPort = Utils::processArgs(argc, argv);
+        vector <pair<string, int>> trackers;
+        int trackerNumber = Utils::processArgs(argc, argv, trackers);
         
-        string trackerIp = trackerIpPort.first;
-        int trackerPort = trackerIpPort.second;
+        string trackerIp = trackers[trackerNumber-1].first;
+        int trackerPort = trackers[trackerNumber-1].second;
 
         generalLogger = Logger(trackerIp, trackerPort, "general");
 
         generalLogger.log("INFO", "Creating tracker!!");
         
-        // Tracker tracker(trackerIp, trackerPort);
-        Tracker& tracker = Tracker::getInstance(trackerIp, trackerPort);
+        // Tracker tracker(trackers, trackerNumber);
+        Tracker& tracker = Tracker::getInstance(trackers, trackerNumber);
         generalLogger.log("INFO", "Tracker created successfully!!");   
 
         tracker.init();